@@ -1,15 +1,36 @@
 /* -------------------------------- Includes -------------------------------- */
+/* Feature test macros: expose madvise() flags, readahead() and clock_gettime() with -std=c99. */
+#define _DEFAULT_SOURCE
+#define _BSD_SOURCE
+#define _GNU_SOURCE
+
 #include <ctype.h> /* iscntrl() */
+#include <dirent.h> /* DT_DIR, DT_LNK */
 #include <errno.h> /* errno */
-#include <stdio.h> /* perror(), sscanf(), snprintf() */
-#include <stdlib.h> /* atexit(), exit(), realloc(), free() */
-#include <string.h> /* memcpy(), strlen() */
+#include <fcntl.h> /* open(), readahead(), vmsplice() */
+#include <poll.h> /* poll() */
+#include <pthread.h> /* pthread_create(), pthread_mutex_lock(), pthread_cond_wait() */
+#include <setjmp.h> /* sigsetjmp(), siglongjmp() */
+#include <signal.h> /* sigaction(), raise() */
+#include <stdarg.h> /* va_list, va_start(), va_end() */
+#include <stddef.h> /* offsetof() */
+#include <stdint.h> /* uint8_t, uint16_t */
+#include <stdio.h> /* perror(), sscanf(), snprintf(), fopen(), rename() */
+#include <stdlib.h> /* atexit(), exit(), realloc(), free(), realpath() */
+#include <string.h> /* memcpy(), memchr(), strlen(), strerror() */
 #include <sys/ioctl.h> /* ioctl() */
+#include <sys/mman.h> /* mmap(), munmap(), mremap(), madvise() */
+#include <sys/stat.h> /* fstat(), fchmod(), fstatat() */
+#include <sys/syscall.h> /* SYS_getdents64 */
+#include <sys/uio.h> /* struct iovec */
+#include <sys/wait.h> /* waitpid() */
 #include <termios.h> /* tcgetattr(), tcsetattr() */
-#include <unistd.h> /* read(), write() */
+#include <time.h> /* clock_gettime(), time(), strftime(), gmtime() */
+#include <unistd.h> /* read(), write(), close(), lseek(), sysconf(), fsync(), unlink(), pipe(), syscall(), execl(), fork() */
 
 /* --------------------------------- Defines -------------------------------- */
 #define KILO_VERSION "0.01"
+#define KILO_TAB_STOP 8
 #define CTRL_KEY(k) ((k) & 0x1F) /* For mapping CTRL key combinations */
 
 /* Escape sequences */
@@ -20,6 +41,151 @@
 #define CURSOR_HIDE "\x1b[?25l"
 #define CURSOR_SHOW "\x1b[?25h"
 #define CURSOR_BOTTOM_RIGHT "\x1b[999C\x1b[999B"
+#define MOUSE_ENABLE "\x1b[?1002h\x1b[?1006h" /* Button and drag reporting, SGR extended coordinates. */
+#define MOUSE_DISABLE "\x1b[?1006l\x1b[?1002l"
+#define INVERT_COLORS "\x1b[7m"
+#define RESET_COLORS "\x1b[m"
+
+#define INPUT_ESCAPE_TIMEOUT 50 /* ms to wait for the rest of an escape sequence before it counts as esc. */
+#define INPUT_MAX_EVENTS 512 /* Events handled per frame before we redraw anyway. */
+#define MOUSE_WHEEL_LINES 3 /* Lines scrolled per wheel tick. */
+
+/* Key bindings */
+#define KEYMAP_SLOTS (256 + (KEY_MAX - ARROW_LEFT)) /* Bytes, then the special keys of enum editor_key. */
+#define KEYMAP_TIMEOUT 1000 /* ms a bound prefix waits for the next key of a longer binding. */
+#define KEYMAP_MAX_KEYS 8 /* Longest key sequence a binding can have. */
+#define KILO_CONFIG ".kilorc" /* In $HOME. */
+#define SESSION_MAGIC "KILOREC"
+#define SESSION_VERSION 1
+#define SESSION_SAMPLE (1 << 20) /* Bytes at each end of the file that identify it in a recording. */
+#define SESSION_SLOW_MS 16 /* Input that takes longer than a frame at 60Hz to reach the screen counts as slow. */
+#define CONFIG_CACHE_FILE "config" /* In ~/.cache/kilo: the compiled KILO_CONFIG. */
+#define CONFIG_CACHE_MAGIC "KILOCFG"
+#define CONFIG_CACHE_VERSION 1 /* Bump when the image's layout changes in a way the build hash can't see. */
+
+#define TIMER_MAX 16
+#define WATCH_MAX 16 /* Descriptors the event loop can wait on besides the terminal. */
+#define BUF_OBSERVERS_MAX 4 /* Subsystems told about buffer changes as they happen. */
+
+/* Directory browser */
+#define DIR_BATCH_SIZE (64 * 1024) /* Bytes of records asked of each getdents64 call. */
+#define DIR_GUTTER_WIDTH 36 /* "drwxr-xr-x    4.0K 2026-01-31 12:00 " */
+
+/*
+Read-ahead tuning for mmapped documents. The prefetch window grows with scroll speed so that a fast page-through asks
+the kernel for data before the viewport reaches it, and everything further than RA_KEEP_AROUND bytes away from the
+viewport is handed back.
+*/
+#define RA_MIN_WINDOW (1UL << 20) /* Always prefetch at least 1 MiB past the viewport. */
+#define RA_MAX_WINDOW (64UL << 20) /* Never ask for more than 64 MiB at once. */
+#define RA_HORIZON_MS 500 /* Prefetch as far as the current scroll speed will carry us in this time. */
+#define RA_KEEP_AROUND (128UL << 20) /* Bytes either side of the viewport that are never released. */
+#define RA_SEQUENTIAL_RUNS 4 /* Consecutive short forward moves before switching to MADV_SEQUENTIAL. */
+
+/* Regions at least this large are backed by huge pages when the system allows it. */
+#define HP_HUGE_PAGE_SIZE (2UL << 20)
+
+/*
+Content-defined chunking for files that can't be mmapped. Cut points depend only on the bytes around them, so a
+repeated run of text produces the same chunks wherever it appears and only one copy of each is kept.
+*/
+#define CHUNK_MIN_SIZE (2UL * 1024)
+#define CHUNK_MAX_SIZE (64UL * 1024)
+#define CHUNK_CUT_MASK 0x0000d93003530000ULL /* 13 bits spread over the hash (as in FastCDC): ~8 KiB chunks. */
+#define CHUNK_READ_SIZE (CHUNK_MAX_SIZE * 2)
+
+/*
+When a mapped file shrinks under us, a remainder up to this size is re-read into a private copy; anything larger keeps
+using the surviving part of the mapping.
+*/
+#define DOC_SNAPSHOT_LIMIT (64UL << 20)
+
+#define STATUS_MESSAGE_TIMEOUT 5 /* Seconds a status message stays on screen. */
+#define PROMPT_MAX 256
+
+/* Tags */
+#define TAGS_FILE "tags"
+#define TAGS_MAX_CANDIDATES 8 /* Completions listed in the prompt. */
+#define TAGS_FUZZY_BUDGET (4UL << 20) /* Bytes of the tags file one fuzzy completion may scan. */
+#define TAGS_REGENERATE "ctags -R -f tags.kilo-tmp . && mv -f tags.kilo-tmp tags"
+
+/* Build and run jobs */
+#define JOB_READ_SIZE (64 * 1024)
+#define JOB_READ_BUDGET (1UL << 20) /* Bytes of output read per wakeup before keys get a turn. */
+#define JOB_POLL_INTERVAL 20 /* ms to leave a drained pipe alone, so a job trickling output can't force every frame. */
+#define JOB_PIPE_SIZE (1 << 20) /* Asked of F_SETPIPE_SZ so the job can run ahead while we aren't polling. */
+#define JOB_LINE_MAX 1024 /* Bytes of each output line kept for parsing; diagnostics start at the front. */
+#define JOB_TAIL_SIZE (16 * 1024) /* Output kept in memory for the panel; the rest is only in the log. */
+#define JOB_DIAGNOSTICS_MAX 100000
+#define JOB_PANEL_ROWS 8 /* Header plus output lines, when the terminal has room. */
+#define JOB_HANDOFF "KILO_JOB" /* Environment variable passing a job on to the kilo we exec(). */
+
+/* Language servers */
+#define LSP_SERVERS_MAX 16 /* `lsp` lines in ~/.kilorc. */
+#define LSP_DOCUMENT_MAX (16UL << 20) /* Larger files aren't given to a server: didOpen has to send all of it. */
+#define LSP_MESSAGE_MAX (64UL << 20)
+#define LSP_READ_SIZE (64 * 1024)
+#define LSP_READ_BUDGET (1UL << 20) /* Bytes read per wakeup before keys get a turn. */
+#define LSP_SYNC_DELAY 50 /* ms without edits before the pending change is sent. */
+#define LSP_COMPLETE_DELAY 150 /* ms without edits before the open popup asks again. */
+#define LSP_MERGE_GAP 32 /* Edits at most this many lines apart are sent as one change. */
+#define LSP_COMPLETIONS_MAX 100
+#define LSP_POPUP_ROWS 8
+#define LSP_DIAGNOSTICS_MAX 1000
+#define JSON_MAX_DEPTH 64
+
+/* Scripts */
+#define SCRIPT_WINDOW (1UL << 20) /* --batch input is read through a window this big... */
+#define SCRIPT_WRITE_SIZE (64 * 1024) /* ...and output written in pieces about this big. */
+
+/* Filters */
+#define FILTER_IO_SIZE (1UL << 20) /* Bytes copied per write, and read per read. */
+#define FILTER_PIPE_SIZE (1 << 20) /* Asked of F_SETPIPE_SZ for both pipes. */
+#define FORMATTERS_MAX 16 /* `format` lines in ~/.kilorc. */
+
+/* Reflow */
+#define REFLOW_WIDTH 79 /* Default fill column; `fill-column N` in ~/.kilorc sets another. */
+#define REFLOW_THREADS_MAX 8
+#define REFLOW_SLICE_LINES 16384 /* Lines per unit of work handed to a thread. */
+
+/* Project replace */
+#define REPLACE_THREADS_MAX 8
+#define REPLACE_BLOCK_SIZE (1 << 20) /* Files are streamed in blocks of whole lines at least this big. */
+#define REPLACE_PREVIEW_MAX 160 /* Bytes of a matching line shown in the preview. */
+#define REPLACE_JOURNAL ".kilo-journal" /* In the project directory: the originals the last replace overwrote. */
+
+/* Git gutter */
+#define GIT_BLOB_MAX (64UL << 20) /* Larger files get no gutter: HEAD's copy is read whole. */
+#define GIT_READ_SIZE (64 * 1024)
+#define GIT_READ_BUDGET (1UL << 20) /* Bytes read per wakeup before keys get a turn. */
+#define GIT_DIFF_DELAY 200 /* ms without edits before the gutter is recomputed. */
+#define GIT_DIFF_MAX_EDITS 1000 /* Past this the diff gives up and marks everything between the unchanged ends. */
+#define GIT_UNHASHED UINT64_MAX /* A line changed since it was last hashed; real hashes are below 2^61 - 1. */
+
+/*
+Read-only pager mode (-R, or when run as `view`) only records the start of every DOC_SPARSE_STRIDE-th line and finds
+the lines in between by scanning forward from the nearest sample, cutting the index to 1/64th.
+*/
+#define DOC_SPARSE_STRIDE 64
+#define LINE_INDEX_BLOCK 64 /* Offsets per compressed block of the line index. */
+
+/* Seeking past the line index */
+#define SEEK_SYNC_BYTES (4UL << 20) /* Jumps this close past the index just index up to the target first. */
+#define SEEK_INDEX_LINES 4096 /* Lines indexed between clock checks. */
+#define SEEK_INDEX_SLICE_MS 50 /* Indexing per wakeup while a detached view waits for it; keys get a turn between. */
+
+/* Log timestamps */
+#define LOG_DETECT_LINES 32 /* Lines at the top of the file tried against each timestamp format. */
+#define LOG_STAMP_SEARCH 64 /* How far into a line a bracketed timestamp is looked for. */
+#define LOG_SAMPLE_BYTES (1UL << 20) /* The time index keeps the first stamped line of every stretch this long. */
+#define LOG_SCAN_SLICE_MS 20 /* Background scanning per wakeup; keys get a turn between slices. */
+#define LOG_PROBE_LINES 64 /* Lines a bisection step looks through for a timestamp. */
+#define LOG_BISECT_BYTES (64 * 1024) /* Below this, finding a time scans lines instead of bisecting. */
+#define LOG_MINUTES_MAX (1 << 20) /* Timeline length cap (about two years), against stray timestamps. */
+
+/* Rendering ahead */
+#define RENDER_AHEAD_DELAY 30 /* ms of quiet after a frame before the pages around it are rendered. */
+#define RENDER_AHEAD_CHECK 8 /* Rows rendered between checks for input. */
 
 enum editor_key {
     ARROW_LEFT = 1000,
@@ -30,23 +196,933 @@ enum editor_key {
     PAGE_DOWN, /* <esc>[6~ */
     HOME, /* <esc>[1~, <esc>[7~, <esc>[H, or <esc>OH */
     END, /* <esc>[4~, <esc>[8~, <esc>[F, or <esc>OF */
-    DELETE /* <esc[3~ */
+    DELETE, /* <esc[3~ */
+    KEY_MAX /* Not a key: one past the last special key. */
+};
+
+enum keymap_mode {
+    KEYMAP_NORMAL,
+    KEYMAP_PAGER, /* Everything bound in normal mode, plus less-style keys. */
+    KEYMAP_DIRECTORY, /* The pager keys, plus the directory browser's own. */
+    KEYMAP_MODES
+};
+
+/* Where the lines of a piece of the buffer come from. */
+enum piece_source {
+    PIECE_DOCUMENT, /* Unedited lines of the open file. */
+    PIECE_ADDED /* Lines written to the add buffer by an edit. */
+};
+
+enum json_type {
+    JSON_OBJECT,
+    JSON_ARRAY,
+    JSON_STRING,
+    JSON_PRIMITIVE /* Number, true, false or null. */
+};
+
+enum lsp_state {
+    LSP_OFF,
+    LSP_STARTING, /* initialize sent, waiting for the reply. */
+    LSP_READY
+};
+
+enum script_op {
+    SCRIPT_REPLACE,
+    SCRIPT_DELETE,
+    SCRIPT_UPCASE,
+    SCRIPT_DOWNCASE,
+    SCRIPT_TRIM
+};
+
+enum git_mark {
+    GIT_UNCHANGED,
+    GIT_ADDED,
+    GIT_MODIFIED,
+    GIT_DELETED /* Lines HEAD has are missing below this one (or above, on the first line). */
+};
+
+enum session_record_type {
+    SESSION_INPUT, /* Bytes read from the terminal. */
+    SESSION_RESIZE /* The window's new rows and columns, as two uint16_t. */
+};
+
+enum input_event_type {
+    EVENT_NONE, /* Consumed, but nothing to act on (an unknown escape sequence). */
+    EVENT_KEY,
+    EVENT_MOUSE
 };
 
 /* ------------------------------- Declarations ------------------------------ */
 void restore_term(void);
-void editor_process_keypress(void);
+ssize_t session_read(char *buf, size_t size);
+int session_timeout(int timeout_ms);
+int session_due(void);
+void doc_start_copy_in(void);
+void doc_hash_line(size_t line);
+void editor_set_status_message(const char *fmt, ...);
+void editor_refresh_screen(void);
+void editor_process_keypress(int c);
+void editor_move_page(int key);
+size_t editor_rx_to_cx(size_t line, size_t rx);
+int editor_gutter_width(void);
+int editor_text_visible(void);
+int buf_line_exists(size_t line);
+size_t buf_line_length(size_t line);
+size_t buf_num_lines(void);
+void render_cache_clear(void);
+
+size_t editor_cx_to_rx(size_t line, size_t cx);
+void job_handoff(int handing_off);
+void lsp_stop(const char *reason);
 
 /* ---------------------------------- Data ---------------------------------- */
+struct abuf {
+    char *str;
+    uint length;
+    uint capacity;
+};
+
+/* A deadline on the event loop. Armed timers fire from the main loop once their time has passed. */
+struct timer {
+    long long deadline; /* Monotonic ms. */
+    int armed;
+    void (*fn)(void);
+};
+
+/* The start of a recorded session, followed by the path of the file that was open and then the records. */
+struct session_header {
+    char magic[8];
+    uint32_t version;
+    int32_t read_only;
+    int64_t size; /* Of the file, 0 if there was none... */
+    uint64_t sample_hash; /* ...and session_sample_hash() of it. */
+    uint32_t path_length;
+};
+
+struct session_record {
+    uint32_t ms; /* Since the recording started. */
+    uint16_t type; /* enum session_record_type */
+    uint16_t length; /* Of the data that follows. */
+};
+
+/* Recording or replaying a session. */
+struct session {
+    int record_fd; /* The log being written, or -1. */
+    long long start; /* now_ms() when the session started; --fast moves it back over idle time. */
+    int replaying;
+    int fast;
+    char *log; /* The whole log being replayed... */
+    size_t length;
+    size_t pos; /* ...the next record in it... */
+    size_t offset; /* ...and how much of that record's input has been taken. */
+    double replay_started;
+    double input_at; /* session_clock() when input was replayed that hasn't reached the screen yet, or 0. */
+    size_t inputs;
+    size_t frames;
+    size_t slow;
+    double last_ms;
+    double total_ms;
+    double max_ms;
+};
+
+/* A descriptor the event loop waits on, calling `fn` from the main loop when it is readable (or writable). */
+struct watch {
+    int fd;
+    short events; /* POLLIN or POLLOUT. */
+    void (*fn)(void);
+};
+
+/* Something a key can be bound to. */
+struct command {
+    const char *name;
+    void (*fn)(void);
+};
+
+/*
+Key bindings compiled into a trie with a flat table of children per node, so each key costs one array lookup whether
+it is a plain key or the middle of a chord. Node 0 is the root.
+*/
+struct keymap_node {
+    int command; /* Index into commands[] plus one, or 0 if the keys so far aren't bound on their own. */
+    int children;
+    int next[KEYMAP_SLOTS]; /* Child node per key slot, 0 for none. */
+};
+
+struct keymap {
+    struct keymap_node *nodes;
+    int count;
+    int capacity;
+};
+
+/* Bytes read from the terminal but not yet decoded. */
+struct input_buffer {
+    char data[4096];
+    size_t start;
+    size_t length;
+};
+
+struct input_event {
+    int type; /* enum input_event_type */
+    int key; /* EVENT_KEY: a byte or an enum editor_key */
+    /* EVENT_MOUSE, in 1-based screen coordinates */
+    int button; /* 0 left, 1 middle, 2 right */
+    int x;
+    int y;
+    int release;
+    int motion; /* Drag: moved with a button held. */
+    int wheel; /* -1 up, 1 down */
+};
+
+/*
+A growable anonymous mapping for the editor's large arrays. Once a region reaches HP_HUGE_PAGE_SIZE it is backed by
+hugetlbfs pages if a pool is reserved, or by transparent huge pages otherwise, so random access over gigabytes of index
+doesn't spend its time in TLB misses.
+*/
+struct hp_region {
+    char *base;
+    size_t size; /* Bytes mapped. */
+    size_t page_size; /* Effective page size backing the region. */
+    int hugetlb; /* Mapped with MAP_HUGETLB (cannot be mremap()ed). */
+};
+
+/* A run of copied-in text. With deduplication on, identical chunks are shared between all their occurrences. */
+struct chunk {
+    uint64_t hash;
+    size_t length;
+    size_t refs;
+    char data[];
+};
+
+/* Where a chunk sits in the document. */
+struct chunk_ref {
+    size_t start;
+    struct chunk *chunk;
+};
+
+/* Open-addressed table of every distinct chunk, keyed by content hash. */
+struct chunk_store {
+    int dedup; /* Deduplicate chunks (--dedup). */
+    struct chunk **slots;
+    size_t capacity;
+    size_t count;
+    size_t stored_bytes; /* Bytes actually held in chunk data. */
+    uint64_t gear[256]; /* Rolling hash table for cut-point detection. */
+};
+
+/* Memory stats for the status line. */
+struct mem_stats {
+    size_t region_bytes; /* Bytes mapped by all hp_regions. */
+    size_t huge_bytes; /* Of which backed by huge pages. */
+    int thp; /* Transparent huge pages are enabled system-wide or on madvise. */
+    int hugetlb_failed; /* MAP_HUGETLB failed once (no reserved pool); don't keep asking. */
+};
+
+/* A compressed block of the line index: its first offset in full, and where the rest is in the bit stream. */
+struct line_index_block {
+    uint64_t base;
+    uint64_t position; /* Bit offset into the stream shifted left by 6, over the width of the low halves. */
+};
+
+/*
+Line start offsets in a few bits each. Every LINE_INDEX_BLOCK offsets are Elias-Fano coded relative to the block's
+first one: the low bits of each as a packed array, then the high parts in unary as a bitvector in which offset i's bit
+is at (high + i). A lookup is a shift and mask for the low half and a select over at most three words for the high
+half, so an index of 80-byte lines costs about 10 bits a line instead of 64. The block being filled is kept plain.
+*/
+struct line_index {
+    struct hp_region block_region; /* Backing store for blocks. */
+    struct line_index_block *blocks;
+    size_t num_blocks;
+    struct hp_region bit_region; /* Backing store for bits. */
+    uint64_t *bits;
+    size_t bit_length; /* Bits of the stream in use. */
+    size_t tail[LINE_INDEX_BLOCK]; /* Offsets after the last full block. */
+    size_t tail_count;
+};
+
+/* The line starts between two samples of a sparse line index. */
+struct line_block {
+    size_t block; /* Sample number, or SIZE_MAX if unused. */
+    size_t count; /* Line starts filled in. */
+    size_t offsets[DOC_SPARSE_STRIDE];
+};
+
+/*
+An open file. Regular files are mmapped read-only and never copied. Anything else (pipes, devices, process
+substitution) is copied in lazily as chunks. Lines are found by a lazy index that only scans as far as the viewport has
+needed so far, so opening a huge file costs nothing up front.
+*/
+struct document {
+    char *filename;
+    int fd;
+    char *map; /* NULL for empty files and copy-in documents. */
+    size_t map_length; /* Length of the mapping, which outlives `size` if the file is truncated. */
+    size_t size; /* For copy-in documents, bytes read so far. */
+    int truncated; /* The file shrank on disk while we had it open. */
+    size_t fault; /* Offset into the mapping of the last fault on it. */
+    size_t remapped_fault; /* fault + 1 when that fault led to a fresh mapping; 0 otherwise. */
+
+    /* Copy-in storage */
+    int copy_in;
+    int eof; /* Copy-in source exhausted. */
+    struct hp_region chunk_region; /* Backing store for chunks. */
+    struct chunk_ref *chunks;
+    size_t num_chunks;
+    size_t chunk_capacity;
+    size_t last_chunk; /* Lookup cache: accesses are mostly sequential. */
+    char *pending; /* Bytes read but not yet cut into a chunk. */
+    size_t pending_length;
+
+    size_t record_length; /* --fixed: lines are records of this many bytes, with no terminators; 0 for text. */
+    struct line_index lines; /* Start offset of every index_stride-th indexed line. */
+    size_t index_stride; /* 1 for a full index, DOC_SPARSE_STRIDE in pager mode. */
+    size_t num_lines; /* Lines indexed so far. */
+    struct line_block blocks[2]; /* Sparse index: recently expanded samples, enough to cover a screen. */
+    int next_block;
+    size_t index_pos; /* Offset where the next unindexed line starts. */
+    int fully_indexed;
+
+    /* Full index only: what the buffer is checked against to tell whether it has been modified. */
+    struct hp_region hash_region; /* Backing store for prefix_hashes. */
+    uint64_t *prefix_hashes; /* Identity hash of lines 0..i, for every indexed line i. */
+    int crlf; /* The first line ends in \r\n, so lines are written back that way. */
+    int unnamed; /* Read from stdin: there is no file to save to. */
+};
+
+/* A node of the buffer's piece tree: `count` consecutive lines from one source, plus totals for its subtree. */
+struct piece {
+    int source; /* enum piece_source */
+    size_t first; /* Document line, or index into the added line table. */
+    size_t count;
+    uint64_t own_hash; /* Identity hash of this piece's lines alone. */
+    uint32_t priority; /* Treap heap order. */
+    size_t left; /* Children; node 0 is the null node. */
+    size_t right;
+    size_t lines; /* Lines in the subtree. */
+    uint64_t hash; /* Identity hash of the subtree's text. */
+};
+
+/* A line written to the add buffer. Lines are stored back to back, each starting where the previous one ends. */
+struct added_line {
+    size_t offset;
+    size_t length;
+    uint64_t prefix; /* Identity hash of added lines 0..this one, so any run of them hashes in O(1). */
+};
+
+/*
+One replacement of a run of lines. Undo and redo are the same operation: swap the `lines` lines at `at` with the
+pieces held here.
+*/
+struct undo_record {
+    size_t at;
+    size_t lines; /* Lines at `at` that stand in for `held`. */
+    size_t held; /* Piece subtree with the other version of the text, 0 if that was no lines at all. */
+    unsigned group; /* Records made by one command (or one run of typing) are undone together. */
+    size_t cx; /* Cursor before the change... */
+    size_t cy;
+    size_t cx_after; /* ...and after it. */
+    size_t cy_after;
+};
+
+/* The identity of the buffer's text: hash and size of the piece tree, followed by the document from line `tail`. */
+struct buffer_state {
+    uint64_t hash;
+    size_t lines;
+    size_t tail;
+};
+
+/*
+The text being edited, as a sequence of lines. Edited lines are written whole to an append-only add buffer; which lines
+come from the document and which from the add buffer is kept in a piece tree (a treap keyed implicitly by line count).
+Below the last edit the document continues unchanged from line `tail`, so an unedited buffer allocates nothing and
+the part of a huge file past the last edit never has to be indexed.
+*/
+struct buffer {
+    struct hp_region node_region; /* Backing store for nodes. */
+    struct piece *nodes;
+    size_t num_nodes;
+    size_t node_capacity;
+    size_t root;
+    size_t tail; /* Document line the unedited remainder starts at, after the tree's lines. */
+    uint32_t seed; /* For treap priorities. */
+
+    struct hp_region add_region; /* The add buffer: text of every line an edit has written. */
+    size_t add_length;
+    struct hp_region added_region; /* Backing store for added. */
+    struct added_line *added;
+    size_t num_added;
+    size_t added_capacity;
+
+    struct undo_record *undo;
+    size_t num_undo;
+    size_t undo_pos; /* Records from here on have been undone and can be redone. */
+    size_t undo_capacity;
+    unsigned group;
+    int typing; /* The last command inserted a character: the next one joins its undo group. */
+
+    struct buffer_state saved; /* What the file on disk holds. */
+
+    /* Told about each replace, undo and redo before it happens: `removed` lines at `at` become `inserted` lines. */
+    void (*observers[BUF_OBSERVERS_MAX])(size_t at, size_t removed, size_t inserted);
+    int num_observers;
+};
+
+/* What the browser knows about one entry. Row `i` of the listing is entry `i`. */
+struct dir_info {
+    unsigned char type; /* d_type from getdents64 (DT_UNKNOWN on some filesystems). */
+    unsigned char statted; /* 0 not yet, 1 done, 2 stat() failed. */
+    mode_t mode;
+    off_t size;
+    time_t mtime;
+};
+
+/* A stat() done by the worker for the browser. */
+struct dir_stat {
+    size_t index;
+    int ok;
+    mode_t mode;
+    off_t size;
+    time_t mtime;
+};
+
+/*
+State shared between the directory browser and its worker thread, under `lock`. It is reference counted and freed by
+whichever side lets go last, so leaving a directory never waits for a getdents64 or stat() stuck on a slow server.
+*/
+struct dir_listing {
+    pthread_mutex_t lock;
+    pthread_cond_t wake; /* Signalled when the browser wants something stat()ed, or wants the worker to quit. */
+    int refs;
+    int quit; /* The browser has moved on: the worker stops at its next check. */
+    int done; /* All entries have been read. */
+    int error; /* errno from getdents64, or 0. */
+    int fd; /* The directory; only the worker reads it. */
+    int notify; /* Write end of the wakeup pipe. */
+
+    /* Entries not yet taken by the browser: for each, a d_type byte and the NUL-terminated name. */
+    char *names;
+    size_t names_length;
+    size_t names_capacity;
+    struct dir_stat *stats; /* Results not yet taken by the browser. */
+    size_t num_stats;
+    size_t stats_capacity;
+    size_t want_lo; /* Rows on screen, which the worker stat()s before reading further. */
+    size_t want_hi;
+};
+
+/* The directory browser. Entries are appended to the buffer as lines as they stream in. */
+struct directory {
+    int active;
+    int read_only; /* Started with -R: files are opened in pager mode too. */
+    char *path;
+    struct dir_listing *listing;
+    int wakeup; /* Read end of the wakeup pipe, watched by the event loop. */
+    int done;
+    struct hp_region info_region; /* Backing store for info. */
+    struct dir_info *info;
+    size_t count;
+    size_t capacity;
+    size_t want_lo; /* Rows last asked for. */
+    size_t want_hi;
+};
+
+/* A one-line prompt on the status row. The event loop keeps running while it is open. */
+struct prompt {
+    int active;
+    const char *label;
+    char text[PROMPT_MAX];
+    size_t length;
+    char hint[160]; /* Shown after the text: completions, or why there are none. */
+    void (*done)(const char *text); /* Enter. Esc just closes the prompt. */
+    void (*complete)(int apply); /* After every change to refresh the hint, and on Tab with `apply` set. */
+};
+
+/*
+A ctags file, mmapped and searched in place. Tag files are sorted by name, so lookups are a binary search over byte
+offsets that backs up to the start of whatever line it lands in; nothing is parsed up front.
+*/
+struct tags {
+    char *path;
+    char *dir; /* File names in the tags file are relative to this. */
+    char *map;
+    size_t size;
+    ino_t ino; /* Identity of the mapped file, to notice when it has been regenerated. */
+    time_t mtime;
+    int sorted; /* !_TAG_FILE_SORTED: 0 unsorted (linear scan), 1 sorted, 2 sorted ignoring case. */
+    pid_t regenerate_pid; /* ctags running in the background, or 0. */
+    int regenerate_fd;
+    int regenerate_again; /* Sources were saved while ctags was running. */
+};
+
+/* Scroll tracking for the mmap read-ahead predictor. */
+struct readahead {
+    size_t top; /* Viewport byte range at the previous update. */
+    size_t bottom;
+    struct timespec stamp;
+    double velocity; /* Smoothed scroll speed in bytes/second, negative when scrolling up. */
+    int sequential_runs;
+    int sequential; /* MADV_SEQUENTIAL currently applied to the mapping. */
+    size_t ahead_lo; /* Range most recently passed to MADV_WILLNEED. */
+    size_t ahead_hi;
+};
+
+/*
+Rendered text of the rows on screen and of the pages above and below it, which idle time fills in ahead of paging.
+Row `line` lives in slot line % slots, so any three pages in a row fit without evicting each other.
+*/
+struct render_cache {
+    char *rows; /* slots rows of `width` bytes. */
+    int *lengths;
+    size_t *lines; /* Line each slot holds, or SIZE_MAX. */
+    int slots;
+    int width; /* Text columns the rows were rendered for. */
+    size_t coloff; /* Horizontal scroll they were rendered at. */
+    struct timer timer;
+};
+
+/*
+A view detached from the line index, after a jump by byte offset to a part of the document that hasn't been indexed
+yet. Its line numbers are estimates until the index catches up.
+*/
+struct seek {
+    int active;
+    size_t offset; /* Start of the top line of the view. */
+    size_t estimate; /* Buffer line number guessed for it. */
+    int dragging; /* The scrollbar is being dragged. */
+    struct timer timer; /* Indexes in slices between keys until the view can attach. */
+};
+
+/* Timestamp layouts recognised at the start of log lines. */
+enum log_format {
+    LOG_NONE = 0,
+    LOG_ISO, /* 2026-10-18 14:32:07 or 2026-10-18T14:32:07, optionally in [] */
+    LOG_CLF, /* [18/Oct/2026:14:32:07 +0000] somewhere near the start, as web servers write */
+    LOG_SYSLOG, /* Oct 18 14:32:07 */
+    LOG_CLOCK /* 14:32:07, optionally in [] */
+};
+
+/* A point of the time index: the first stamped line at or after a LOG_SAMPLE_BYTES boundary. */
+struct log_sample {
+    int64_t time; /* Seconds since 1970 as written, ignoring time zones. */
+    size_t offset;
+};
+
+/*
+Timestamps of a log file. The format is detected from the first lines when the file is opened; a scan in the
+background then records a sparse time-to-offset index and counts lines per minute for the timeline.
+*/
+struct log_index {
+    int format; /* enum log_format */
+    int64_t first_time; /* Of the first stamped line. */
+    size_t scan_pos; /* Start of the next line to scan. */
+    struct log_sample *samples;
+    size_t num_samples;
+    size_t sample_capacity;
+    uint32_t *minutes; /* Lines per minute, from the minute of first_time on. */
+    size_t num_minutes;
+    size_t minute_capacity;
+    int timeline; /* The timeline takes the place of the status line. */
+    struct timer timer;
+};
+
+/* A `file:line[:col]` found in job output. Its text stays in the log; only where to find it is kept. */
+struct diagnostic {
+    off_t offset; /* Start of the output line in the log. */
+    unsigned path_length; /* The path is the first bytes of that line. */
+    unsigned line; /* 1-based, as printed. */
+    unsigned col; /* 1-based; 0 if there was none. */
+};
+
+/*
+The last `make` or `run`. Output arrives on a pipe, is appended to a log file, and is parsed a line at a time as it
+comes. Memory holds the unfinished last line, the tail shown in the output panel and the diagnostics, so it stays
+bounded however much the job prints.
+*/
+struct job {
+    pid_t pid; /* Running job, or 0. */
+    int fd; /* Read end of its output pipe, or -1. */
+    int log; /* All output so far, in an unlinked temporary file; or -1. */
+    char *dir; /* Where it runs; relative paths in its output are relative to this. */
+    char command[PROMPT_MAX];
+    char make_command[PROMPT_MAX]; /* Offered again by the prompts. */
+    char run_command[PROMPT_MAX];
+    off_t log_size;
+    off_t reload_offset; /* Reading the log back in after an exec(); -1 when done. */
+    char partial[JOB_LINE_MAX];
+    size_t partial_length;
+    off_t partial_offset;
+    char tail[JOB_TAIL_SIZE];
+    size_t tail_length;
+    struct diagnostic *diagnostics;
+    size_t count;
+    size_t capacity;
+    size_t dropped; /* Diagnostics past JOB_DIAGNOSTICS_MAX. */
+    size_t current; /* Where next-error is; SIZE_MAX before the first. */
+    int status; /* From waitpid(), once it has finished. */
+    time_t started;
+    int show_panel;
+    struct timer poll_timer;
+};
+
+/*
+A JSON value found in a message, which stays where it is: strings are [start, end) between the quotes, other values
+span their text. Members of objects are a key token followed by a value token. `next` is the index of the first token
+after this value and everything in it, so siblings are one step apart.
+*/
+struct json_token {
+    int type;
+    size_t start;
+    size_t end;
+    size_t size; /* Members or elements. */
+    long next;
+};
+
+struct json {
+    const char *text;
+    size_t length;
+    size_t pos;
+    struct json_token *tokens; /* Reused from message to message. */
+    long count;
+    long capacity;
+};
+
+/* A configured server: `lsp .ext command` in ~/.kilorc. */
+struct lsp_server {
+    char extension[16];
+    char command[200];
+};
+
+struct lsp_diagnostic {
+    size_t line;
+    size_t start; /* Bytes into the line. */
+    size_t end;
+    int severity; /* 1 error, 2 warning, 3 information, 4 hint. */
+    char message[160];
+};
+
+struct lsp_completion {
+    char label[64];
+    char insert[64];
+    char filter[64];
+};
+
+/*
+The language server client. The server sees the document once, in didOpen; after that every edit reaches it as a line
+range and its new text. Edits are gathered into one window of changed lines and sent after LSP_SYNC_DELAY ms of quiet
+(or before a request that needs them), so typing a word on one line costs one small message.
+*/
+struct lsp {
+    struct lsp_server servers[LSP_SERVERS_MAX];
+    int num_servers;
+    int state;
+    pid_t pid;
+    int in; /* We write requests here... */
+    int out; /* ...and read replies from here. */
+    int writable_watch; /* Waiting for `in` to drain. */
+    int utf8; /* The server took UTF-8 positions; otherwise columns are UTF-16 code units. */
+    char *uri;
+    long next_id;
+    long initialize_id;
+    long version;
+    struct abuf message; /* The message being built. */
+    struct abuf output; /* Framed messages not yet written. */
+    size_t sent;
+    char *input;
+    size_t input_length;
+    size_t input_capacity;
+    struct json json;
+    char *line; /* Scratch copy of a buffer line. */
+    size_t line_capacity;
+
+    /* Edits not yet sent: lines [from, old_end) of the server's text are now [from, new_end). */
+    int dirty;
+    size_t from;
+    size_t old_end;
+    size_t new_end;
+    struct timer sync_timer;
+
+    struct lsp_diagnostic *diagnostics; /* Sorted by line. */
+    size_t num_diagnostics;
+
+    long completion_id; /* Request in flight, or 0. */
+    long completion_version;
+    int popup;
+    size_t popup_line;
+    size_t popup_start; /* Where the word being completed starts. */
+    struct lsp_completion *items;
+    int num_items;
+    int selected;
+    struct timer complete_timer;
+};
+
+struct script_address {
+    size_t line; /* 1-based, or 0 for a text address. */
+    char *text;
+    size_t length;
+};
+
+struct script_command {
+    int addresses; /* 0, 1, or 2 for a range. */
+    struct script_address from;
+    struct script_address to;
+    int invert;
+    int in_range; /* Past the first line of a range and not yet at its last. */
+    int op; /* enum script_op */
+    char *old;
+    size_t old_length;
+    char *new;
+    size_t new_length;
+};
+
+struct script {
+    struct script_command *commands;
+    int count;
+    int capacity;
+    struct abuf text[2]; /* The line being edited goes back and forth between these as commands change it. */
+};
+
+/* A region on its way through a filter command. */
+struct filter {
+    int in; /* The command's stdin... */
+    int out; /* ...and stdout. */
+    size_t line; /* Next line of the region to send... */
+    size_t to; /* ...up to here. */
+    size_t offset; /* Bytes of a run of document lines still to send. */
+    size_t end;
+    int newline; /* The run ended the file without a newline: send one. */
+    const char *pending; /* Bytes being sent. */
+    size_t pending_length;
+    int splice; /* `pending` is in the document mapping, so its pages can be passed on. */
+    struct abuf staging; /* Edited lines with newlines added. */
+    char *output; /* Output not yet taken; it starts with an unfinished line `partial` bytes long. */
+    size_t partial;
+    size_t output_capacity;
+    size_t first; /* The output's first added line... */
+    size_t lines; /* ...and how many there are. */
+    size_t sent;
+};
+
+/* A configured formatter: `format .ext command`, or `format-on-save .ext command`, in ~/.kilorc. */
+struct formatter {
+    char extension[16];
+    char command[200];
+    int on_save;
+};
+
+/*
+The header of the compiled config image, followed by each keymap's nodes. Everything before fill_column identifies
+the build and the ~/.kilorc it was made by; the rest is what they made.
+*/
+struct config_image {
+    char magic[8];
+    uint32_t version;
+    uint64_t build;
+    uint64_t rc_dev; /* All zero if there was no ~/.kilorc. */
+    uint64_t rc_ino;
+    int64_t rc_size;
+    int64_t rc_mtime;
+    int64_t rc_mtime_nsec;
+    int32_t fill_column;
+    int32_t keymap_count[KEYMAP_MODES];
+    int32_t num_servers;
+    int32_t num_formatters;
+    struct lsp_server servers[LSP_SERVERS_MAX];
+    struct formatter formatters[FORMATTERS_MAX];
+    char status[80]; /* What parsing said about the config, shown again on every start. */
+};
+
+/* A line to reflow, wherever it already is in memory. */
+struct reflow_line {
+    const char *s;
+    size_t length;
+};
+
+/* One thread's share of a reflow: whole paragraphs in; their lines, and the hash of each, out. */
+struct reflow_slice {
+    const struct reflow_line *lines;
+    size_t count;
+    int width;
+    struct abuf text; /* Output lines back to back. */
+    size_t *lengths;
+    uint64_t *hashes;
+    size_t num_out;
+    size_t out_capacity;
+};
+
+/* The slices one reflow thread works through. */
+struct reflow_job {
+    struct reflow_slice *slices;
+    size_t count;
+};
+
+/* Something for the project replace's workers to look into. */
+struct replace_item {
+    unsigned char type; /* DT_DIR or DT_REG. */
+    char *path; /* Relative to the project directory. */
+};
+
+/* A file with matches. */
+struct replace_file {
+    char *path;
+    off_t size;
+    size_t matches;
+    char *preview; /* Its lines of the preview. */
+    size_t preview_length;
+    char *temp; /* The rewritten copy, until it is renamed into place. */
+    int error; /* errno if it couldn't be rewritten. */
+};
+
+/* One worker's buffers. */
+struct replace_stream {
+    char *block;
+    size_t capacity;
+    struct abuf out; /* Rewritten text not yet written. */
+    struct abuf preview; /* The file's preview lines so far. */
+};
+
+/*
+A project-wide replace, from the scan through the answer to its prompt. The workers share everything from `lock`
+down.
+*/
+struct replace {
+    char *root;
+    char *old;
+    size_t old_length;
+    char *new;
+    size_t new_length;
+    int open_known; /* The open file is changed in the buffer, so the walk skips it. */
+    dev_t open_dev;
+    ino_t open_ino;
+    size_t buffer_matches;
+    char question[120];
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake; /* Work was pushed, or the last busy worker found none left. */
+    struct replace_item *stack; /* Scanning: what is still to be looked into. */
+    size_t stack_length;
+    size_t stack_capacity;
+    int busy; /* Workers looking into something, which may push more. */
+    int running;
+    int applying; /* Rewriting the files, not scanning. */
+    size_t next; /* The next file to rewrite. */
+    int cancelled; /* C-g, or a file couldn't be rewritten. */
+    size_t scanned; /* Progress: files done... */
+    size_t bytes; /* ...and their size. */
+    struct replace_file *files;
+    size_t num_files;
+    size_t files_capacity;
+    size_t matches; /* In the files, not counting the buffer's. */
+};
+
+/* One diff for the worker thread: a snapshot of the buffer's line hashes, to be compared with HEAD's. */
+struct git_diff {
+    uint64_t *lines;
+    size_t num_lines;
+    const uint64_t *head; /* E.git.head, which doesn't change once loaded. */
+    size_t num_head;
+    unsigned char *marks; /* The result: an enum git_mark for each line. */
+    unsigned long generation; /* Of the buffer the snapshot was taken from. */
+    int cancelled; /* Under E.git.lock. */
+};
+
+/*
+Gutter marks for lines changed since the last commit. HEAD's copy of the file is read once through `git show` and kept
+only as a hash per line. The buffer's line hashes are kept in step with its edits, shifting along as lines come and go,
+and lines an edit touched are rehashed just before the next diff. Diffs run in a worker thread GIT_DIFF_DELAY ms after
+the last edit; an edit cancels one still running, whose result would be out of date anyway.
+*/
+struct git {
+    int loading; /* `git show` is running. */
+    int ready; /* HEAD is known: the gutter is shown. */
+    pid_t pid;
+    int fd;
+    char *blob; /* HEAD's copy, until it has been hashed. */
+    size_t blob_length;
+    size_t blob_capacity;
+    uint64_t *head; /* Hash of each line of HEAD's copy. */
+    size_t num_head;
+
+    uint64_t *lines; /* Hash of each buffer line, or GIT_UNHASHED. */
+    unsigned char *marks; /* The gutter: an enum git_mark for each buffer line. */
+    size_t num_lines;
+    size_t capacity;
+    size_t unhashed_from; /* Every GIT_UNHASHED slot is in [unhashed_from, unhashed_to). */
+    size_t unhashed_to;
+    unsigned long generation; /* Counts edits, so a diff of an older buffer can be told apart. */
+    struct timer diff_timer;
+
+    pthread_mutex_t lock;
+    struct git_diff *running;
+    int rerun; /* A diff is due once the running one has come back. */
+    int wakeup[2]; /* Finished diffs are written here by the worker. */
+};
+
 /* Editor state is global. */
 struct editor_config {
     /* Cursor coordinates */
-    int cx; /* col coordinate */
-    int cy; /* row coordinate */
+    size_t cx; /* col coordinate (byte offset into the line) */
+    size_t cy; /* row coordinate (document line) */
+    size_t rx; /* render col coordinate (tabs expanded) */
+
+    /* Scroll offsets */
+    size_t rowoff;
+    size_t coloff;
 
     /* Window measurements */
     int rows;
     int cols;
+    int screen_rows; /* Rows available for text; the last one is the status line. */
+
+    int read_only; /* Pager mode: no edit structures, less-style keys. */
+
+    /* Selection from the anchor to the cursor, made by dragging the mouse. */
+    int sel_active;
+    size_t sel_line;
+    size_t sel_cx;
+
+    struct input_buffer input;
+
+    struct timer *timers[TIMER_MAX];
+    int num_timers;
+    struct watch watches[WATCH_MAX];
+    int num_watches;
+
+    struct keymap keymaps[KEYMAP_MODES];
+    int key_node; /* Position in the active keymap while a chord is being typed; 0 when idle. */
+    struct timer key_timer;
+    struct abuf frame; /* Output buffer, reused from frame to frame. */
+    char *render; /* Scratch row for editor_render_line(). */
+    int render_capacity;
+    struct render_cache cache;
+
+    size_t page_size;
+    struct mem_stats mem;
+    struct chunk_store store;
+    struct document doc;
+    struct buffer buf;
+    struct directory dir;
+    struct prompt prompt;
+    struct tags tags;
+    struct job job;
+    struct lsp lsp;
+    struct git git;
+    struct formatter formatters[FORMATTERS_MAX];
+    int num_formatters;
+    int fill_column; /* Reflow wraps lines to this width. */
+    struct replace replace;
+    struct session session;
+    volatile sig_atomic_t resized; /* SIGWINCH came. */
+    struct readahead ra;
+    struct seek seek;
+    struct log_index log;
+
+    /* SIGBUS recovery: a fault on the document mapping while the main thread is reading it unwinds to *bus_jump. */
+    pthread_t main_thread;
+    sigjmp_buf *bus_jump; /* The main loop's, or that of an operation holding files or processes. */
+    volatile sig_atomic_t bus_armed; /* Depth of doc_read_begin() calls. */
+
+    char statusmsg[80];
+    time_t statusmsg_time;
 
     struct termios orig_term;
 };
@@ -71,7 +1147,7 @@ void init_term(void) {
         error_handler("tcgetattr");
     }
 
-    atexit(restore_term); 
+    atexit(restore_term);
 
     /*
     Enable raw mode on new terminal. Disable echoing (can't see what we type as we type) and canonical mode (read input
@@ -82,7 +1158,7 @@ void init_term(void) {
     /*
     OUTPUT FLAGS
         OPOST: output processing features
-    */ 
+    */
    raw_term.c_oflag &= ~(OPOST); // Now need to use \r\n when printing
     /*
     INPUT FLAGS
@@ -91,7 +1167,7 @@ void init_term(void) {
         ISTRIP: strips 8th bit of each input byte
         IXON: Ctrl-S and Ctrl-Q
         ICRNL: translate carriage returns into newlines
-    */ 
+    */
     raw_term.c_iflag &= ~(BRKINT | INPCK | ISTRIP | IXON | ICRNL);
     /*
     LOCAL FLAGS
@@ -100,7 +1176,7 @@ void init_term(void) {
         ISIG: Ctrl-C and Ctrl-Z
         IEXTEN: Ctrl-V and Ctrl-O (Macs)
     */
-    raw_term.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN); 
+    raw_term.c_lflag &= ~(ECHO | ICANON | ISIG | IEXTEN);
     /*
     CONTROL FLAGS & CONTROL CHARACTERS
         CS8: sets character size to 8 bits per byte
@@ -113,96 +1189,220 @@ void init_term(void) {
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw_term) == -1) { // try TCSANOW. TCSAFLUSH discards unread input
         error_handler("tcsetattr");
     }
+
+    write(STDOUT_FILENO, MOUSE_ENABLE, strlen(MOUSE_ENABLE));
+}
+
+/* When the document comes from stdin, take keyboard input from the controlling terminal instead. */
+void reopen_tty(void) {
+    int fd = open("/dev/tty", O_RDONLY);
+
+    if (fd == -1 || dup2(fd, STDIN_FILENO) == -1) {
+        perror("/dev/tty");
+        exit(1);
+    }
+    close(fd);
 }
 
 void restore_term(void) {
+    write(STDOUT_FILENO, MOUSE_DISABLE, strlen(MOUSE_DISABLE));
     printf("Restoring original terminal.\r\n");
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_term) == -1) {
         error_handler("tcsetattr");
     }
 }
 
-int editor_read_key(void) {
-    int ret;
-    char c;
-    char escape_sequence[3] = "";
+/*
+Fill the input buffer with whatever the terminal has sent, waiting up to `timeout_ms` for the first byte (-1 waits
+forever, 0 only takes what is already there). Returns the number of bytes read.
+*/
+int input_fill(int timeout_ms) {
+    struct input_buffer *in = &E.input;
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+    ssize_t n;
 
-    while((ret = read(STDIN_FILENO, &c, 1)) != 1) {
-        if (ret == -1 && errno != EAGAIN) {
-            error_handler("read");
+    if (in->start > 0) {
+        memmove(in->data, in->data + in->start, in->length);
+        in->start = 0;
+    }
+    if (in->length == sizeof(in->data)) {
+        return 0;
+    }
+
+    /* A replay takes its input from the log, when it is due; the terminal is left for loop_wait() to watch. */
+    if (E.session.replaying) {
+        pfd.fd = -1;
+        timeout_ms = session_timeout(timeout_ms);
+    }
+    while (poll(&pfd, 1, timeout_ms) == -1) {
+        if (errno != EINTR) {
+            error_handler("poll");
         }
+    }
+    if (!E.session.replaying && !(pfd.revents & (POLLIN | POLLHUP))) {
+        return 0;
+    }
+    n = session_read(in->data + in->length, sizeof(in->data) - in->length);
+    if (n == -1 && errno != EAGAIN && errno != EINTR) {
+        error_handler("read");
+    }
+    if (n <= 0) {
+        return 0;
+    }
+    in->length += n;
+
+    return (int)n;
+}
 
+/* Is input waiting to be handled? Background work checks this to get out of the way of keys. */
+int input_pending(void) {
+    struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+
+    if (E.input.length > 0) {
+        return 1;
+    }
+    if (E.session.replaying) {
+        return session_due();
     }
-    /* 
-    Check if c is an escape sequence. If so, read 2 more bytes. Check to see if we received an arrow key escape sequence.
 
-    escape_sequence[0]: '['
-    escape_sequence[1]: 'A' (or 'B', 'C', 'D')
-    escape_sequence[2]: '\0'
-    */
-    if (c == '\x1b') {
-        /* If reads time out, assume user pressed esc button. */
-        if (read(STDIN_FILENO, &escape_sequence[0], 1) != 1) {
-            return '\x1b';
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/* Key for the final byte of <esc>[...X or <esc>OX, or 0 if we don't know it. */
+int input_csi_key(char final, int param) {
+    switch (final) {
+        case ('A'): return ARROW_UP;
+        case ('B'): return ARROW_DOWN;
+        case ('C'): return ARROW_RIGHT;
+        case ('D'): return ARROW_LEFT;
+        case ('H'): return HOME;
+        case ('F'): return END;
+        case ('~'):
+            switch (param) {
+                case (1): return HOME;
+                case (3): return DELETE;
+                case (4): return END;
+                case (5): return PAGE_UP;
+                case (6): return PAGE_DOWN;
+                case (7): return HOME;
+                case (8): return END;
+            }
+    }
+
+    return 0;
+}
+
+/*
+Decode one event from the front of `s`. Returns the number of bytes it used, or 0 if `s` ends in the middle of an
+escape sequence. With `final` set no more bytes are coming, so a lone or cut-off escape is taken as the esc key.
+Sequences we don't understand are consumed whole and produce EVENT_NONE rather than a stray esc.
+
+    <esc>[<b;x;yM     SGR mouse press/motion (m: release)
+    <esc>[Pn;...X     CSI keys, X in @..~
+    <esc>OX           SS3 keys
+*/
+size_t input_parse(const char *s, size_t length, int final, struct input_event *ev) {
+    size_t i;
+    int params[3] = {0, 0, 0};
+    int count = 0;
+
+    memset(ev, 0, sizeof(*ev));
+    if (s[0] != '\x1b') {
+        ev->type = EVENT_KEY;
+        ev->key = (unsigned char)s[0];
+        return 1;
+    }
+    if (length < 2 || (s[1] == 'O' && length < 3)) {
+        goto incomplete;
+    }
+
+    if (s[1] == 'O') {
+        ev->key = input_csi_key(s[2], 0);
+        ev->type = ev->key ? EVENT_KEY : EVENT_NONE;
+        return 3;
+    }
+    if (s[1] != '[') {
+        /* Alt+key: report the esc now, the key follows as its own event. */
+        ev->type = EVENT_KEY;
+        ev->key = '\x1b';
+        return 1;
+    }
+
+    /* Parameter bytes (digits, ';' and private markers like '<') run up to a final byte in @..~. */
+    for (i = 2; i < length && !(s[i] >= '@' && s[i] <= '~'); i++) {
+        if (s[i] >= '0' && s[i] <= '9' && count < 3) {
+            params[count] = params[count] * 10 + (s[i] - '0');
+        } else if (s[i] == ';') {
+            count++;
         }
-        if (read(STDIN_FILENO, &escape_sequence[1], 1) != 1) {
-            return '\x1b';
+    }
+    if (i == length) {
+        goto incomplete;
+    }
+
+    if (s[2] == '<' && (s[i] == 'M' || s[i] == 'm') && count == 2) {
+        ev->type = EVENT_MOUSE;
+        ev->button = params[0] & 3;
+        ev->motion = (params[0] & 32) != 0;
+        ev->release = s[i] == 'm';
+        if (params[0] & 64) {
+            ev->wheel = ev->button == 0 ? -1 : 1;
         }
+        ev->x = params[1];
+        ev->y = params[2];
+    } else {
+        ev->key = input_csi_key(s[i], params[0]);
+        ev->type = ev->key ? EVENT_KEY : EVENT_NONE;
+    }
 
-        if (escape_sequence[0] == '[') {
-            /* Esc seqs with <esc>[1...9~ */
-            if (escape_sequence[1] >= '0' && escape_sequence[1] <= '9') {
-                if (read(STDIN_FILENO, &escape_sequence[2], 1) != 1) {
-                    return '\x1b';
-                }
-                if (escape_sequence[2] == '~') {
-                    switch(escape_sequence[2]) {
-                        case ('1'): return HOME;
-                        case ('3'): return DELETE;
-                        case ('4'): return END;
-                        case ('5'): return PAGE_UP;
-                        case ('6'): return PAGE_DOWN;
-                        case ('7'): return HOME;
-                        case ('8'): return END;
-                    }
-                }
-            }
-            /* Esc seqs with <esc>[A...F*/
-            else { 
-                switch(escape_sequence[1]) {
-                case ('A'): return ARROW_UP;
-                case ('B'): return ARROW_DOWN;
-                case ('C'): return ARROW_RIGHT;
-                case ('D'): return ARROW_LEFT;
-                case ('H'): return HOME;
-                case ('F'): return END;
-                }
-            }
-        /* Esc seqs with <esc>OH;F*/
-        } else if (escape_sequence[0] == 'O') {
-            switch (escape_sequence[1]) {
-                case ('H'): return HOME;
-                case ('F'): return END;
+    return i + 1;
+
+incomplete:
+    if (!final) {
+        return 0;
+    }
+    ev->type = EVENT_KEY;
+    ev->key = '\x1b';
+    return 1;
+}
+
+/*
+Take the next event out of the input buffer. Returns 0 when the buffer holds no complete event; a partial escape
+sequence gets INPUT_ESCAPE_TIMEOUT ms to complete before it is read as the esc key.
+*/
+int input_next_event(struct input_event *ev) {
+    struct input_buffer *in = &E.input;
+    size_t used;
+
+    while (in->length > 0) {
+        used = input_parse(in->data + in->start, in->length, 0, ev);
+        if (used == 0) {
+            if (input_fill(INPUT_ESCAPE_TIMEOUT) > 0) {
+                continue;
             }
+            used = input_parse(in->data + in->start, in->length, 1, ev);
+        }
+        in->start += used;
+        in->length -= used;
+        if (ev->type != EVENT_NONE) {
+            return 1;
         }
-        return '\x1b'; /* If not an arrow key escape sequence, return esc for now. */
-    } else {
-        return c; /* Normal character condition. */
     }
+
+    return 0;
 }
 
 int get_cursor_position(int *rows, int *cols) {
-    char buffer[32]; 
-    uint8_t i = 0;
-    
+    char buffer[32];
+    size_t i = 0;
+
     /* Request cursor position. */
     if (write(STDOUT_FILENO, CURSOR_POSITION_REQUEST, 4) != 4) {
         return -1;
     }
     /* Read response into buffer: ESC [ Pn ; Pn R */
     while (i < sizeof(buffer) - 1) {
-        buffer[i] = editor_read_key();
-        if (buffer[i] == 'R') {
+        if (read(STDIN_FILENO, &buffer[i], 1) != 1 || buffer[i] == 'R') {
             break;
         }
         i++;
@@ -229,137 +1429,9994 @@ int get_window_size(int *rows, int *cols) {
         }
         /* Get window size the hard way if ioctl() fails. */
         return get_cursor_position(rows, cols);
-    } 
+    }
     *rows = ws.ws_row;
     *cols = ws.ws_col;
 
     return 0;
 }
 
-/* ------------------------------ Append Buffer ----------------------------- */
-struct abuf {
-    char *str;
-    uint length;
-};
+/* ------------------------------- Event Loop ------------------------------- */
+long long now_ms(void) {
+    struct timespec ts;
 
-#define ABUF_INIT {NULL, 0} // constructor for append buffer
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-void ab_append(struct abuf *ab, const char *s, int length) {
-    /* Allocate memory: size of existing buff plus size of string to be appended. */
-    char *new_buff = realloc(ab->str, ab->length + length);
+/* (Re)arm `t` to call `fn` from the main loop `ms` from now. */
+void timer_start(struct timer *t, int ms, void (*fn)(void)) {
+    int registered = 0;
 
-    if (new_buff == NULL) {
-        return;
+    for (int i = 0; i < E.num_timers; i++) {
+        registered |= E.timers[i] == t;
+    }
+    if (!registered) {
+        if (E.num_timers == TIMER_MAX) {
+            error_handler("timer_start");
+        }
+        E.timers[E.num_timers++] = t;
+    }
+    t->deadline = now_ms() + ms;
+    t->fn = fn;
+    t->armed = 1;
+}
+
+void timer_stop(struct timer *t) {
+    t->armed = 0;
+}
+
+/* How long the main loop may sleep waiting for input: until the next deadline, or forever (-1). */
+int timers_next_timeout(void) {
+    long long now = now_ms();
+    long long timeout = -1;
+
+    for (int i = 0; i < E.num_timers; i++) {
+        if (E.timers[i]->armed) {
+            long long left = E.timers[i]->deadline > now ? E.timers[i]->deadline - now : 0;
+
+            if (timeout == -1 || left < timeout) {
+                timeout = left;
+            }
+        }
+    }
+
+    return (int)timeout;
+}
+
+/* Call `fn` from the main loop whenever `fd` is readable or has hung up. */
+void watch_add(int fd, void (*fn)(void)) {
+    if (E.num_watches == WATCH_MAX) {
+        error_handler("watch_add");
+    }
+    E.watches[E.num_watches].fd = fd;
+    E.watches[E.num_watches].events = POLLIN;
+    E.watches[E.num_watches].fn = fn;
+    E.num_watches++;
+}
+
+/* Call `fn` once `fd` can take more output. */
+void watch_add_writable(int fd, void (*fn)(void)) {
+    watch_add(fd, fn);
+    E.watches[E.num_watches - 1].events = POLLOUT;
+}
+
+void watch_remove(int fd) {
+    for (int i = 0; i < E.num_watches; i++) {
+        if (E.watches[i].fd == fd) {
+            E.watches[i] = E.watches[--E.num_watches];
+            return;
+        }
+    }
+}
+
+/*
+Sleep until the terminal has input, a watched descriptor is ready, or `timeout_ms` passes (-1: no limit). Watch
+callbacks run from here; terminal input is left for input_fill(). Returns 1 if the terminal is readable.
+*/
+int loop_wait(int timeout_ms) {
+    struct pollfd pfds[WATCH_MAX + 1];
+    int count = E.num_watches;
+
+    pfds[0].fd = STDIN_FILENO;
+    pfds[0].events = POLLIN;
+    for (int i = 0; i < count; i++) {
+        pfds[i + 1].fd = E.watches[i].fd;
+        pfds[i + 1].events = E.watches[i].events;
+    }
+    if (E.session.replaying) {
+        timeout_ms = session_timeout(timeout_ms);
+    }
+    while (poll(pfds, count + 1, timeout_ms) == -1) {
+        if (errno != EINTR) {
+            error_handler("poll");
+        }
+        if (E.resized) {
+            return 0; /* Redraw at the new size first. */
+        }
+    }
+    if (E.session.replaying && pfds[0].revents != 0) {
+        exit(0); /* A key typed during a replay stops it. */
+    }
+
+    /* A callback may remove watches (its own included), so look each one up again before calling it. */
+    for (int i = 0; i < count; i++) {
+        if (pfds[i + 1].revents != 0) {
+            for (int j = 0; j < E.num_watches; j++) {
+                if (E.watches[j].fd == pfds[i + 1].fd) {
+                    E.watches[j].fn();
+                    break;
+                }
+            }
+        }
+    }
+
+    return E.session.replaying ? session_due() : (pfds[0].revents & (POLLIN | POLLHUP)) != 0;
+}
+
+/* Fire every timer whose deadline has passed. Timers are one-shot: a callback re-arms if it wants to run again. */
+void timers_run(void) {
+    long long now = now_ms();
+
+    for (int i = 0; i < E.num_timers; i++) {
+        struct timer *t = E.timers[i];
+
+        if (t->armed && t->deadline <= now) {
+            t->armed = 0;
+            t->fn();
+        }
+    }
+}
+
+/* -------------------------------- Processes ------------------------------- */
+/*
+Run `command` with /bin/sh in `dir` (NULL: here), stdin from /dev/null and stdout and stderr into a pipe, so it can't
+touch the terminal. Returns the pid and sets `*output` to the non-blocking read end of the pipe, or returns -1. With
+`input`, stdin is a pipe too (`*input` is its non-blocking write end) and stderr is discarded: stdout then carries a
+protocol. The child leads its own process group so it can be signalled together with anything it starts.
+*/
+pid_t spawn_shell(const char *dir, const char *command, int *input, int *output) {
+    int fds[2];
+    int in[2] = {-1, -1};
+    pid_t pid;
+
+    if (pipe(fds) == -1) {
+        return -1;
+    }
+    if (input != NULL && pipe(in) == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        return -1;
+    }
+    if ((pid = fork()) == -1) {
+        close(fds[0]);
+        close(fds[1]);
+        if (input != NULL) {
+            close(in[0]);
+            close(in[1]);
+        }
+        return -1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_RDWR);
+
+        setpgid(0, 0);
+        signal(SIGPIPE, SIG_DFL); /* Ignored dispositions survive exec. */
+        dup2(input != NULL ? in[0] : null, STDIN_FILENO);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(input != NULL ? null : fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        if (input != NULL) {
+            close(in[0]);
+            close(in[1]);
+        }
+        if (dir != NULL && chdir(dir) == -1) {
+            _exit(127);
+        }
+        execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+        _exit(127);
+    }
+
+    close(fds[1]);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    *output = fds[0];
+    if (input != NULL) {
+        close(in[0]);
+        fcntl(in[1], F_SETFL, O_NONBLOCK);
+        fcntl(in[1], F_SETFD, FD_CLOEXEC);
+        *input = in[1];
+    }
+    return pid;
+}
+
+/* `s` in single quotes for the shell, allocated. */
+char *shell_quote(const char *s) {
+    char *quoted = malloc(strlen(s) * 4 + 3);
+    char *p = quoted;
+
+    if (quoted == NULL) {
+        error_handler("malloc");
+    }
+    *p++ = '\'';
+    for (; *s != '\0'; s++) {
+        if (*s == '\'') {
+            memcpy(p, "'\\''", 4);
+            p += 4;
+        } else {
+            *p++ = *s;
+        }
+    }
+    *p++ = '\'';
+    *p = '\0';
+    return quoted;
+}
+
+/* ---------------------------- Huge Page Regions --------------------------- */
+/* Check whether the kernel will honour MADV_HUGEPAGE at all. */
+void hp_init(void) {
+    char mode[64] = "";
+    FILE *fp = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+
+    E.mem.thp = 0;
+    if (fp != NULL) {
+        if (fgets(mode, sizeof(mode), fp) != NULL && strstr(mode, "[never]") == NULL) {
+            E.mem.thp = 1;
+        }
+        fclose(fp);
+    }
+}
+
+/* Round `size` up to the page size the region will use. */
+size_t hp_round(size_t size) {
+    size_t page = size >= HP_HUGE_PAGE_SIZE ? HP_HUGE_PAGE_SIZE : E.page_size;
+
+    return (size + page - 1) / page * page;
+}
+
+/*
+Map `size` bytes of anonymous memory. Large mappings try MAP_HUGETLB first, then fall back to ordinary pages aligned
+to a huge page boundary and marked MADV_HUGEPAGE so khugepaged and the fault handler can use THP.
+*/
+char *hp_map(size_t size, size_t *page_size, int *hugetlb) {
+    char *p;
+    char *aligned;
+    size_t head;
+
+    *page_size = E.page_size;
+    *hugetlb = 0;
+    if (size < HP_HUGE_PAGE_SIZE) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        return p == MAP_FAILED ? NULL : p;
+    }
+
+#ifdef MAP_HUGETLB
+    if (!E.mem.hugetlb_failed) {
+        p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (p != MAP_FAILED) {
+            *page_size = HP_HUGE_PAGE_SIZE;
+            *hugetlb = 1;
+            return p;
+        }
+        E.mem.hugetlb_failed = 1;
+    }
+#endif
+
+    /* Over-map by one huge page and trim, so the region starts on a huge page boundary. */
+    p = mmap(NULL, size + HP_HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        return NULL;
+    }
+    aligned = (char *)(((uintptr_t)p + HP_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HP_HUGE_PAGE_SIZE - 1));
+    head = (size_t)(aligned - p);
+    if (head > 0) {
+        munmap(p, head);
+    }
+    munmap(aligned + size, HP_HUGE_PAGE_SIZE - head);
+
+#ifdef MADV_HUGEPAGE
+    if (E.mem.thp && madvise(aligned, size, MADV_HUGEPAGE) == 0) {
+        *page_size = HP_HUGE_PAGE_SIZE;
+    }
+#endif
+
+    return aligned;
+}
+
+void hp_account(struct hp_region *r, int sign) {
+    if (sign > 0) {
+        E.mem.region_bytes += r->size;
+        E.mem.huge_bytes += r->page_size > E.page_size ? r->size : 0;
+    } else {
+        E.mem.region_bytes -= r->size;
+        E.mem.huge_bytes -= r->page_size > E.page_size ? r->size : 0;
+    }
+}
+
+void hp_region_free(struct hp_region *r) {
+    if (r->base != NULL) {
+        hp_account(r, -1);
+        munmap(r->base, r->size);
+    }
+    r->base = NULL;
+    r->size = 0;
+    r->page_size = 0;
+    r->hugetlb = 0;
+}
+
+/* Grow `r` to hold at least `size` bytes, preserving its contents. Returns -1 if the memory can't be mapped. */
+int hp_region_grow(struct hp_region *r, size_t size) {
+    struct hp_region grown;
+
+    if (size <= r->size) {
+        return 0;
+    }
+    if (size < r->size * 2) {
+        size = r->size * 2;
+    }
+    size = hp_round(size);
+
+#if defined(__linux__) && defined(MREMAP_MAYMOVE)
+    /* Ordinary mappings can be moved by the kernel without copying; only the page advice needs refreshing. */
+    if (r->base != NULL && !r->hugetlb) {
+        char *p = mremap(r->base, r->size, size, MREMAP_MAYMOVE);
+
+        if (p != MAP_FAILED) {
+            hp_account(r, -1);
+            r->base = p;
+            r->size = size;
+#ifdef MADV_HUGEPAGE
+            if (size >= HP_HUGE_PAGE_SIZE && E.mem.thp && madvise(p, size, MADV_HUGEPAGE) == 0) {
+                r->page_size = HP_HUGE_PAGE_SIZE;
+            }
+#endif
+            hp_account(r, 1);
+            return 0;
+        }
+    }
+#endif
+
+    grown.base = hp_map(size, &grown.page_size, &grown.hugetlb);
+    if (grown.base == NULL) {
+        return -1;
+    }
+    grown.size = size;
+    if (r->base != NULL) {
+        memcpy(grown.base, r->base, r->size);
+    }
+    hp_region_free(r);
+    *r = grown;
+    hp_account(r, 1);
+
+    return 0;
+}
+
+/* Human readable byte count for the status line, e.g. "12.5M". */
+void format_size(char *buffer, size_t length, size_t bytes) {
+    const char *units = "BKMGT";
+    double value = (double)bytes;
+
+    while (value >= 1024 && units[1] != '\0') {
+        value /= 1024;
+        units++;
+    }
+    snprintf(buffer, length, *units == 'B' ? "%.0f%c" : "%.1f%c", value, *units);
+}
+
+/* --------------------------------- Hashing -------------------------------- */
+/*
+64-bit content hash in the style of xxHash64: four independent lanes over 32-byte stripes keep the multiplier units
+busy and vectorize well, then a short tail loop and a final avalanche.
+*/
+#define HASH_PRIME1 0x9E3779B185EBCA87ULL
+#define HASH_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define HASH_PRIME3 0x165667B19E3779F9ULL
+#define HASH_PRIME4 0x85EBCA77C2B2AE63ULL
+#define HASH_PRIME5 0x27D4EB2F165667C5ULL
+
+uint64_t hash_rotl(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+uint64_t hash_read64(const unsigned char *p) {
+    uint64_t v;
+
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+uint64_t hash_round(uint64_t acc, uint64_t input) {
+    acc += input * HASH_PRIME2;
+    acc = hash_rotl(acc, 31);
+    return acc * HASH_PRIME1;
+}
+
+uint64_t hash_merge(uint64_t acc, uint64_t lane) {
+    acc ^= hash_round(0, lane);
+    return acc * HASH_PRIME1 + HASH_PRIME4;
+}
+
+uint64_t hash_bytes(const void *data, size_t length, uint64_t seed) {
+    const unsigned char *p = data;
+    const unsigned char *end = p + length;
+    uint64_t h;
+
+    if (length >= 32) {
+        uint64_t v1 = seed + HASH_PRIME1 + HASH_PRIME2;
+        uint64_t v2 = seed + HASH_PRIME2;
+        uint64_t v3 = seed;
+        uint64_t v4 = seed - HASH_PRIME1;
+
+        do {
+            v1 = hash_round(v1, hash_read64(p));
+            v2 = hash_round(v2, hash_read64(p + 8));
+            v3 = hash_round(v3, hash_read64(p + 16));
+            v4 = hash_round(v4, hash_read64(p + 24));
+            p += 32;
+        } while (end - p >= 32);
+
+        h = hash_rotl(v1, 1) + hash_rotl(v2, 7) + hash_rotl(v3, 12) + hash_rotl(v4, 18);
+        h = hash_merge(h, v1);
+        h = hash_merge(h, v2);
+        h = hash_merge(h, v3);
+        h = hash_merge(h, v4);
+    } else {
+        h = seed + HASH_PRIME5;
+    }
+    h += (uint64_t)length;
+
+    while (end - p >= 8) {
+        h ^= hash_round(0, hash_read64(p));
+        h = hash_rotl(h, 27) * HASH_PRIME1 + HASH_PRIME4;
+        p += 8;
+    }
+    while (p < end) {
+        h ^= *p++ * HASH_PRIME5;
+        h = hash_rotl(h, 11) * HASH_PRIME1;
+    }
+
+    h ^= h >> 33;
+    h *= HASH_PRIME2;
+    h ^= h >> 29;
+    h *= HASH_PRIME3;
+    h ^= h >> 32;
+
+    return h;
+}
+
+/*
+Identity hash of a run of lines: each line is hashed with hash_bytes() and the results are folded as the digits of a
+polynomial modulo the Mersenne prime 2^61 - 1. The fold is associative, so the hash of a run can be put together from
+the hashes of its parts in any grouping. Line terminators are not part of it.
+*/
+#define HASH_MOD ((1ULL << 61) - 1)
+#define HASH_BASE 0x0ab5d4e2916c3f7dULL
+
+uint64_t hash_mod(uint64_t x) {
+    x = (x & HASH_MOD) + (x >> 61);
+    return x >= HASH_MOD ? x - HASH_MOD : x;
+}
+
+/* a * b mod 2^61 - 1 for a, b < 2^61, in 32-bit halves so no 128-bit type is needed. */
+uint64_t hash_mul(uint64_t a, uint64_t b) {
+    uint64_t a_lo = a & 0xffffffff;
+    uint64_t a_hi = a >> 32;
+    uint64_t b_lo = b & 0xffffffff;
+    uint64_t b_hi = b >> 32;
+    uint64_t lo = a_lo * b_lo;
+    uint64_t mid = a_lo * b_hi + a_hi * b_lo;
+    uint64_t hi = a_hi * b_hi;
+    uint64_t r = (lo & HASH_MOD) + (lo >> 61) + (hi << 3) + (mid >> 29) + (mid << 35 >> 3) + 1;
+
+    r = (r & HASH_MOD) + (r >> 61);
+    r = (r & HASH_MOD) + (r >> 61);
+    return r - 1;
+}
+
+/* HASH_BASE^n */
+uint64_t hash_pow(size_t n) {
+    uint64_t result = 1;
+    uint64_t base = HASH_BASE;
+
+    while (n > 0) {
+        if (n & 1) {
+            result = hash_mul(result, base);
+        }
+        base = hash_mul(base, base);
+        n >>= 1;
+    }
+
+    return result;
+}
+
+/* Identity hash of run `a` followed by run `b` of `b_lines` lines. */
+uint64_t hash_concat(uint64_t a, uint64_t b, size_t b_lines) {
+    return hash_mod(hash_mul(a, hash_pow(b_lines)) + b);
+}
+
+/* Identity hash of the `count` lines between two prefix hashes: `before` up to the run, `through` up to its end. */
+uint64_t hash_range(uint64_t before, uint64_t through, size_t count) {
+    return hash_mod(through + HASH_MOD - hash_mul(before, hash_pow(count)));
+}
+
+uint64_t hash_line(const char *s, size_t length) {
+    return hash_mod(hash_bytes(s, length, 0));
+}
+
+/* ------------------------------- Chunk Store ------------------------------ */
+/* Fill the gear table from a fixed seed so cut points are stable from run to run. */
+void chunk_store_init(void) {
+    uint64_t x = 0x6b696c6f;
+
+    for (int i = 0; i < 256; i++) {
+        /* splitmix64 */
+        uint64_t z = (x += 0x9E3779B97F4A7C15ULL);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+        E.store.gear[i] = z ^ (z >> 31);
+    }
+}
+
+/*
+Length of the first chunk in `p`: cut where the CHUNK_CUT_MASK bits of the rolling gear hash are all zero. The mask is
+spread across the word rather than taken from the top bits, which stay stuck on text with a small alphabet.
+*/
+size_t chunk_cut(const unsigned char *p, size_t length) {
+    uint64_t h = 0;
+
+    if (length > CHUNK_MAX_SIZE) {
+        length = CHUNK_MAX_SIZE;
+    }
+    for (size_t i = 0; i < length; i++) {
+        h = (h << 1) + E.store.gear[p[i]];
+        if (i + 1 >= CHUNK_MIN_SIZE && (h & CHUNK_CUT_MASK) == 0) {
+            return i + 1;
+        }
+    }
+
+    return length;
+}
+
+void chunk_store_grow(void) {
+    struct chunk_store *store = &E.store;
+    size_t capacity = store->capacity ? store->capacity * 2 : 1024;
+    struct chunk **slots = calloc(capacity, sizeof(*slots));
+
+    if (slots == NULL) {
+        error_handler("calloc");
+    }
+    for (size_t i = 0; i < store->capacity; i++) {
+        struct chunk *chunk = store->slots[i];
+
+        if (chunk != NULL) {
+            size_t j = chunk->hash & (capacity - 1);
+
+            while (slots[j] != NULL) {
+                j = (j + 1) & (capacity - 1);
+            }
+            slots[j] = chunk;
+        }
+    }
+    free(store->slots);
+    store->slots = slots;
+    store->capacity = capacity;
+}
+
+/* Return a chunk holding `data`, sharing an existing identical one when deduplication is on. */
+struct chunk *chunk_store_intern(const char *data, size_t length) {
+    struct chunk_store *store = &E.store;
+    struct chunk *chunk;
+    uint64_t hash = 0;
+    size_t i = 0;
+
+    if (store->dedup) {
+        if ((store->count + 1) * 10 > store->capacity * 7) {
+            chunk_store_grow();
+        }
+        hash = hash_bytes(data, length, 0);
+        for (i = hash & (store->capacity - 1); store->slots[i] != NULL; i = (i + 1) & (store->capacity - 1)) {
+            chunk = store->slots[i];
+            if (chunk->hash == hash && chunk->length == length && memcmp(chunk->data, data, length) == 0) {
+                chunk->refs++;
+                return chunk;
+            }
+        }
+    }
+
+    chunk = malloc(sizeof(*chunk) + length);
+    if (chunk == NULL) {
+        error_handler("malloc");
+    }
+    chunk->hash = hash;
+    chunk->length = length;
+    chunk->refs = 1;
+    memcpy(chunk->data, data, length);
+    store->stored_bytes += length;
+
+    if (store->dedup) {
+        store->slots[i] = chunk;
+        store->count++;
+    }
+
+    return chunk;
+}
+
+/* ------------------------------- Line Index ------------------------------- */
+/* Set bits in `word`. */
+int bit_count(uint64_t word) {
+#if defined(__GNUC__)
+    return __builtin_popcountll(word);
+#else
+    word = word - ((word >> 1) & 0x5555555555555555ULL);
+    word = (word & 0x3333333333333333ULL) + ((word >> 2) & 0x3333333333333333ULL);
+    word = (word + (word >> 4)) & 0x0f0f0f0f0f0f0f0fULL;
+    return (int)((word * 0x0101010101010101ULL) >> 56);
+#endif
+}
+
+/* Position of set bit number `i` (from 0) in `word`, which has more than `i` of them. */
+int bit_select(uint64_t word, int i) {
+    int position = 0;
+
+    while (i-- > 0) {
+        word &= word - 1;
+    }
+#if defined(__GNUC__)
+    position = __builtin_ctzll(word);
+#else
+    while ((word & 1) == 0) {
+        word >>= 1;
+        position++;
+    }
+#endif
+
+    return position;
+}
+
+/* `width` (up to 64) bits of the stream from bit `position`. */
+uint64_t line_index_get_bits(const struct line_index *idx, size_t position, int width) {
+    size_t word = position / 64;
+    int shift = position % 64;
+    uint64_t value;
+
+    if (width == 0) {
+        return 0;
+    }
+    value = idx->bits[word] >> shift;
+    if (shift + width > 64) {
+        value |= idx->bits[word + 1] << (64 - shift);
+    }
+
+    return width == 64 ? value : value & ((1ULL << width) - 1);
+}
+
+/* Overwrite `width` (up to 64) bits of the stream from bit `position` with the low bits of `value`. */
+void line_index_put_bits(struct line_index *idx, size_t position, uint64_t value, int width) {
+    size_t word = position / 64;
+    int shift = position % 64;
+    uint64_t mask = width == 64 ? ~0ULL : (1ULL << width) - 1;
+
+    if (width == 0) {
+        return;
+    }
+    value &= mask;
+    idx->bits[word] = (idx->bits[word] & ~(mask << shift)) | (value << shift);
+    if (shift + width > 64) {
+        idx->bits[word + 1] = (idx->bits[word + 1] & ~(mask >> (64 - shift))) | (value >> (64 - shift));
+    }
+}
+
+/* Compress the full tail into a new block. */
+void line_index_encode(struct line_index *idx) {
+    struct line_index_block *block;
+    size_t base = idx->tail[0];
+    size_t span = idx->tail[LINE_INDEX_BLOCK - 1] - base;
+    size_t position = idx->bit_length;
+    size_t high;
+    size_t end;
+    int width = 0;
+
+    /* Narrow enough low halves that the high parts stay below LINE_INDEX_BLOCK: at most two bits a line. */
+    while ((span >> width) >= LINE_INDEX_BLOCK) {
+        width++;
+    }
+    high = position + (size_t)LINE_INDEX_BLOCK * width;
+    end = high + LINE_INDEX_BLOCK + (span >> width);
+
+    if (hp_region_grow(&idx->block_region, (idx->num_blocks + 1) * sizeof(struct line_index_block)) == -1) {
+        error_handler("mmap");
+    }
+    idx->blocks = (struct line_index_block *)idx->block_region.base;
+    /* A word of slack past the end lets lookups read 64 bits from anywhere inside the block. */
+    if (hp_region_grow(&idx->bit_region, (end / 64 + 2) * sizeof(uint64_t)) == -1) {
+        error_handler("mmap");
+    }
+    idx->bits = (uint64_t *)idx->bit_region.base;
+
+    for (size_t bit = high; bit < end; bit += 64) {
+        line_index_put_bits(idx, bit, 0, end - bit < 64 ? (int)(end - bit) : 64);
+    }
+    for (size_t i = 0; i < LINE_INDEX_BLOCK; i++) {
+        size_t relative = idx->tail[i] - base;
+
+        line_index_put_bits(idx, position + i * width, relative, width);
+        line_index_put_bits(idx, high + (relative >> width) + i, 1, 1);
+    }
+
+    block = &idx->blocks[idx->num_blocks++];
+    block->base = base;
+    block->position = (uint64_t)position << 6 | (uint64_t)width;
+    idx->bit_length = end;
+    idx->tail_count = 0;
+}
+
+size_t line_index_count(const struct line_index *idx) {
+    return idx->num_blocks * LINE_INDEX_BLOCK + idx->tail_count;
+}
+
+/* Offset number `i`. */
+size_t line_index_get(const struct line_index *idx, size_t i) {
+    const struct line_index_block *block;
+    size_t position;
+    size_t high;
+    size_t rank;
+    int width;
+
+    if (i >= idx->num_blocks * LINE_INDEX_BLOCK) {
+        return idx->tail[i - idx->num_blocks * LINE_INDEX_BLOCK];
+    }
+    block = &idx->blocks[i / LINE_INDEX_BLOCK];
+    rank = i % LINE_INDEX_BLOCK;
+    width = (int)(block->position & 63);
+    position = (size_t)(block->position >> 6);
+
+    /* Select the rank-th set bit of the high parts: its distance from the start, less `rank`, is the high part. */
+    high = position + (size_t)LINE_INDEX_BLOCK * width;
+    for (size_t bit = high;; bit += 64) {
+        uint64_t word = line_index_get_bits(idx, bit, 64);
+        int count = bit_count(word);
+
+        if ((size_t)count > rank) {
+            high = bit + bit_select(word, (int)rank) - high - i % LINE_INDEX_BLOCK;
+            break;
+        }
+        rank -= count;
+    }
+
+    return block->base + (high << width | line_index_get_bits(idx, position + (i % LINE_INDEX_BLOCK) * width, width));
+}
+
+/* Set offset number `i`, forgetting any from there on first, so `i` can be at most line_index_count(). */
+void line_index_set(struct line_index *idx, size_t i, size_t offset) {
+    size_t block = i / LINE_INDEX_BLOCK;
+
+    if (block < idx->num_blocks) {
+        /* Cut back into a compressed block: reopen it as the tail. */
+        for (size_t j = 0; j < LINE_INDEX_BLOCK; j++) {
+            idx->tail[j] = line_index_get(idx, block * LINE_INDEX_BLOCK + j);
+        }
+        idx->bit_length = (size_t)(idx->blocks[block].position >> 6);
+        idx->num_blocks = block;
+    }
+    idx->tail_count = i - idx->num_blocks * LINE_INDEX_BLOCK;
+    idx->tail[idx->tail_count++] = offset;
+    if (idx->tail_count == LINE_INDEX_BLOCK) {
+        line_index_encode(idx);
+    }
+}
+
+/* Bytes the index takes, for the status line. */
+size_t line_index_bytes(const struct line_index *idx) {
+    return idx->num_blocks * sizeof(struct line_index_block) + (idx->bit_length + 7) / 8 + sizeof(idx->tail);
+}
+
+/* -------------------------------- Document -------------------------------- */
+/*
+Open `fd` (already opened by main(), possibly a dup of stdin) as the document, naming it `filename`. An `fd` of -1 is
+a file that doesn't exist yet: the document is empty and saving creates it.
+*/
+void editor_open(const char *filename, int fd) {
+    struct document *doc = &E.doc;
+    struct stat st;
+
+    doc->filename = strdup(filename);
+    doc->fd = fd;
+    if (fd == -1) {
+        return;
+    }
+    if (fstat(doc->fd, &st) == -1) {
+        error_handler("fstat");
+    }
+
+    /*
+    Pipes and devices can't be mapped, and files in /proc report a size of zero, so all of those are copied in. An
+    empty regular file takes the same path and simply hits EOF on the first read.
+    */
+    if (S_ISREG(st.st_mode) && st.st_size > 0) {
+        doc->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, doc->fd, 0);
+        if (doc->map != MAP_FAILED) {
+            doc->size = (size_t)st.st_size;
+            doc->map_length = doc->size;
+            return;
+        }
+        doc->map = NULL;
+    }
+    doc_start_copy_in();
+}
+
+/* Switch the document to copy-in storage, reading from the current position of its file descriptor. */
+void doc_start_copy_in(void) {
+    struct document *doc = &E.doc;
+
+    doc->copy_in = 1;
+    doc->pending = malloc(CHUNK_READ_SIZE);
+    if (doc->pending == NULL) {
+        error_handler("malloc");
+    }
+}
+
+/* Cut the first `length` pending bytes into a chunk and append it to the document. */
+void doc_append_chunk(size_t length) {
+    struct document *doc = &E.doc;
+
+    if (doc->num_chunks == doc->chunk_capacity) {
+        if (hp_region_grow(&doc->chunk_region, (doc->num_chunks + 1) * sizeof(struct chunk_ref)) == -1) {
+            error_handler("mmap");
+        }
+        doc->chunks = (struct chunk_ref *)doc->chunk_region.base;
+        doc->chunk_capacity = doc->chunk_region.size / sizeof(struct chunk_ref);
+    }
+    doc->chunks[doc->num_chunks].start = doc->size;
+    doc->chunks[doc->num_chunks].chunk = chunk_store_intern(doc->pending, length);
+    doc->num_chunks++;
+    doc->size += length;
+
+    doc->pending_length -= length;
+    memmove(doc->pending, doc->pending + length, doc->pending_length);
+}
+
+/*
+Copy in at least one more chunk from a non-mmappable source. Reads block, which is what we want: the viewport asked
+for text that isn't there yet. Returns 0 once the source is exhausted (always, for mmapped documents).
+*/
+int doc_load_more(void) {
+    struct document *doc = &E.doc;
+    ssize_t n;
+
+    if (!doc->copy_in || (doc->eof && doc->pending_length == 0)) {
+        return 0;
+    }
+
+    /* Only cut once a full CHUNK_MAX_SIZE is buffered, so a cut point never depends on where a read() ended. */
+    while (!doc->eof && doc->pending_length < CHUNK_MAX_SIZE) {
+        n = read(doc->fd, doc->pending + doc->pending_length, CHUNK_READ_SIZE - doc->pending_length);
+        if (n == -1) {
+            if (errno == EINTR || errno == EAGAIN) {
+                continue;
+            }
+            error_handler("read");
+        }
+        if (n == 0) {
+            doc->eof = 1;
+            close(doc->fd);
+            doc->fd = -1;
+        }
+        doc->pending_length += (size_t)n;
+    }
+    if (doc->pending_length == 0) {
+        return 0;
+    }
+
+    doc_append_chunk(chunk_cut((const unsigned char *)doc->pending, doc->pending_length));
+    if (doc->eof && doc->pending_length == 0) {
+        free(doc->pending);
+        doc->pending = NULL;
+    }
+
+    return 1;
+}
+
+/*
+Reads of the document mapping go between doc_read_begin() and doc_read_end(). Only these may unwind on a fault, so an
+operation is never cut off halfway through anything but reading; elsewhere, and on other threads, a fault is fatal.
+*/
+void doc_read_begin(void) {
+    if (pthread_equal(pthread_self(), E.main_thread)) {
+        E.bus_armed++;
+    }
+}
+
+void doc_read_end(void) {
+    if (pthread_equal(pthread_self(), E.main_thread)) {
+        E.bus_armed--;
+    }
+}
+
+/*
+Contiguous bytes starting at `offset`, which must be inside the document. `*length` is set to how many bytes can be
+read from the returned pointer before the next call is needed.
+*/
+const char *doc_span(size_t offset, size_t *length) {
+    struct document *doc = &E.doc;
+    struct chunk_ref *ref;
+    size_t lo;
+    size_t hi;
+
+    if (doc->map != NULL) {
+        *length = doc->size - offset;
+        return doc->map + offset;
+    }
+
+    ref = &doc->chunks[doc->last_chunk];
+    if (offset < ref->start || offset >= ref->start + ref->chunk->length) {
+        /* Binary search for the last chunk starting at or before `offset`. */
+        lo = 0;
+        hi = doc->num_chunks;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+
+            if (doc->chunks[mid].start <= offset) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        doc->last_chunk = lo;
+        ref = &doc->chunks[lo];
+    }
+
+    *length = ref->chunk->length - (offset - ref->start);
+    return ref->chunk->data + (offset - ref->start);
+}
+
+char doc_byte(size_t offset) {
+    size_t length;
+    char c;
+
+    doc_read_begin();
+    c = *doc_span(offset, &length);
+    doc_read_end();
+
+    return c;
+}
+
+/* Offset just past the newline ending the line that starts at `offset` (or the end of what has been read). */
+size_t doc_next_line(size_t offset) {
+    const char *span;
+    const char *newline;
+    size_t length;
+
+    if (E.doc.record_length > 0) {
+        offset = (offset / E.doc.record_length + 1) * E.doc.record_length;
+        return offset < E.doc.size ? offset : E.doc.size;
+    }
+    while (offset < E.doc.size) {
+        span = doc_span(offset, &length);
+        doc_read_begin();
+        newline = memchr(span, '\n', length);
+        doc_read_end();
+        if (newline != NULL) {
+            return offset + (size_t)(newline - span) + 1;
+        }
+        offset += length;
+    }
+
+    return offset;
+}
+
+/* Start of the line before the one starting at `offset`, or 0 at the top. */
+size_t doc_prev_line(size_t offset) {
+    if (offset == 0) {
+        return 0;
+    }
+    if (E.doc.record_length > 0) {
+        return (offset - 1) / E.doc.record_length * E.doc.record_length;
+    }
+    offset--; /* The newline ending that line. */
+    while (offset > 0 && doc_byte(offset - 1) != '\n') {
+        offset--;
+    }
+
+    return offset;
+}
+
+/*
+doc_index_to() for fixed-length records. Line starts are multiples of the record length, so there is nothing to scan
+for: a full index only has to hash each record, and a sparse one just counts up to `line` at once.
+*/
+int doc_index_records(size_t line) {
+    struct document *doc = &E.doc;
+    size_t n = doc->record_length;
+    size_t want;
+    size_t count;
+
+    while (doc->num_lines <= line && !doc->fully_indexed) {
+        if (doc->index_stride == 1) {
+            want = doc->index_pos + n;
+        } else {
+            want = line < SIZE_MAX / n - 1 ? (line + 1) * n : SIZE_MAX;
+        }
+        while (doc->size < want && doc_load_more()) {
+            continue;
+        }
+        if (doc->index_pos == doc->size) {
+            doc->fully_indexed = 1;
+            break;
+        }
+        count = (doc->size - doc->index_pos + n - 1) / n;
+        if (doc->index_stride == 1) {
+            count = 1;
+        } else if (line - doc->num_lines < count) {
+            count = line - doc->num_lines + 1;
+        }
+        doc->num_lines += count;
+        doc->index_pos = doc->index_pos + count * n < doc->size ? doc->index_pos + count * n : doc->size;
+        if (doc->index_stride == 1) {
+            doc_hash_line(doc->num_lines - 1);
+        }
+        if (doc->index_pos == doc->size && (doc->map != NULL || doc->eof)) {
+            doc->fully_indexed = 1;
+        }
+    }
+
+    return line < doc->num_lines;
+}
+
+/* Extend the line index until `line` is known or the end of the file is reached. Returns 1 if the line exists. */
+int doc_index_to(size_t line) {
+    struct document *doc = &E.doc;
+    size_t pos;
+
+    if (doc->record_length > 0) {
+        return doc_index_records(line);
+    }
+    while (doc->num_lines <= line && !doc->fully_indexed) {
+        if (doc->index_pos == doc->size && !doc_load_more()) {
+            doc->fully_indexed = 1;
+            break;
+        }
+        if (doc->num_lines % doc->index_stride == 0) {
+            line_index_set(&doc->lines, doc->num_lines / doc->index_stride, doc->index_pos);
+        }
+        doc->num_lines++;
+
+        /* Find the end of the line, pulling in more copy-in data if it runs past what has been read so far. */
+        pos = doc_next_line(doc->index_pos);
+        while (doc_byte(pos - 1) != '\n' && doc_load_more()) {
+            pos = doc_next_line(pos);
+        }
+        doc->index_pos = pos;
+        if (doc->index_stride == 1) {
+            doc_hash_line(doc->num_lines - 1);
+        }
+        if (doc->index_pos == doc->size && (doc->map != NULL || doc->eof)) {
+            doc->fully_indexed = 1;
+        }
+    }
+
+    return line < doc->num_lines;
+}
+
+/* Start of an indexed line. */
+size_t doc_line_start(size_t line) {
+    struct document *doc = &E.doc;
+    struct line_block *block;
+    size_t sample;
+    size_t count;
+    size_t offset;
+
+    if (doc->record_length > 0) {
+        return line * doc->record_length;
+    }
+    if (doc->index_stride == 1) {
+        return line_index_get(&doc->lines, line);
+    }
+
+    sample = line / doc->index_stride;
+    for (int i = 0; i < 2; i++) {
+        block = &doc->blocks[i];
+        if (block->block == sample && line % doc->index_stride < block->count) {
+            return block->offsets[line % doc->index_stride];
+        }
+    }
+
+    /* Expand the sample into the older of the two blocks. */
+    block = &doc->blocks[doc->next_block];
+    doc->next_block ^= 1;
+    count = doc->num_lines - sample * doc->index_stride;
+    if (count > doc->index_stride) {
+        count = doc->index_stride;
+    }
+    offset = line_index_get(&doc->lines, sample);
+    for (size_t i = 0; i < count; i++) {
+        block->offsets[i] = offset;
+        if (i + 1 < count) {
+            offset = doc_next_line(offset);
+        }
+    }
+    block->block = sample;
+    block->count = count;
+
+    return block->offsets[line % doc->index_stride];
+}
+
+/* The indexed line containing `offset`, which must be before index_pos. */
+size_t doc_line_at(size_t offset) {
+    struct document *doc = &E.doc;
+    size_t lo = 0;
+    size_t hi;
+    size_t line;
+    size_t start;
+
+    if (doc->num_lines == 0) {
+        return 0;
+    }
+    if (doc->record_length > 0) {
+        return offset / doc->record_length < doc->num_lines ? offset / doc->record_length : doc->num_lines - 1;
+    }
+
+    /* Binary search for the last sample starting at or before `offset`, then walk the lines after it. */
+    hi = (doc->num_lines + doc->index_stride - 1) / doc->index_stride;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (line_index_get(&doc->lines, mid) <= offset) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    line = lo * doc->index_stride;
+    start = line_index_get(&doc->lines, lo);
+    while (line + 1 < doc->num_lines && (start = doc_next_line(start)) <= offset) {
+        line++;
+    }
+
+    return line;
+}
+
+/* Forget expanded sparse index blocks, after the index has been cut back. */
+void doc_invalidate_blocks(void) {
+    E.doc.blocks[0].block = SIZE_MAX;
+    E.doc.blocks[1].block = SIZE_MAX;
+}
+
+/* End of an indexed line, excluding its line terminator. */
+size_t doc_line_end(size_t line) {
+    struct document *doc = &E.doc;
+    size_t start = doc_line_start(line);
+    size_t end = line + 1 < doc->num_lines ? doc_line_start(line + 1) : doc->index_pos;
+
+    if (doc->record_length > 0) {
+        return end; /* Records have no terminator: every byte is data. */
+    }
+    if (end > start && doc_byte(end - 1) == '\n') {
+        end--;
+    }
+    if (end > start && doc_byte(end - 1) == '\r') {
+        end--;
+    }
+
+    return end;
+}
+
+size_t doc_line_length(size_t line) {
+    if (!doc_index_to(line)) {
+        return 0;
+    }
+    return doc_line_end(line) - doc_line_start(line);
+}
+
+/*
+Fold a newly indexed line into the prefix hashes. This is the hash of the file as loaded, built up as the index grows:
+it costs one pass of hash_bytes() over text the index scan has just brought into cache anyway.
+*/
+void doc_hash_line(size_t line) {
+    struct document *doc = &E.doc;
+    size_t start = doc_line_start(line);
+    size_t end = doc_line_end(line);
+    size_t length;
+    const char *s = doc_span(start, &length);
+    char *copy = NULL;
+    uint64_t hash;
+
+    doc_read_begin();
+    if (length < end - start) {
+        /* The line straddles copy-in chunks. */
+        copy = malloc(end - start);
+        if (copy == NULL) {
+            error_handler("malloc");
+        }
+        for (size_t offset = start; offset < end; offset += length) {
+            s = doc_span(offset, &length);
+            if (length > end - offset) {
+                length = end - offset;
+            }
+            memcpy(copy + (offset - start), s, length);
+        }
+        s = copy;
+    }
+    hash = hash_line(s, end - start);
+    doc_read_end();
+    free(copy);
+
+    if (hp_region_grow(&doc->hash_region, (line + 1) * sizeof(uint64_t)) == -1) {
+        error_handler("mmap");
+    }
+    doc->prefix_hashes = (uint64_t *)doc->hash_region.base;
+    doc->prefix_hashes[line] = hash_concat(line > 0 ? doc->prefix_hashes[line - 1] : 0, hash, 1);
+    if (line == 0 && doc->record_length == 0) {
+        doc->crlf = end < doc->index_pos && doc_byte(end) == '\r';
+    }
+}
+
+/* Identity hash of indexed document lines [from, to). */
+uint64_t doc_range_hash(size_t from, size_t to) {
+    uint64_t before = from > 0 ? E.doc.prefix_hashes[from - 1] : 0;
+    uint64_t through = to > 0 ? E.doc.prefix_hashes[to - 1] : 0;
+
+    return hash_range(before, through, to - from);
+}
+
+/* ----------------------------- Fault Recovery ----------------------------- */
+/*
+Touching a page of a MAP_SHARED mapping past the end of a file that has been truncated raises SIGBUS. Faults inside the
+document mapping, taken by the main thread between doc_read_begin() and doc_read_end(), unwind to E.bus_jump: the
+sigsetjmp() in the main loop, or one an operation set to clean up after itself, either way followed by
+doc_recover_truncation(). Any other SIGBUS keeps its default, fatal behaviour.
+*/
+void sigbus_handler(int sig, siginfo_t *info, void *context) {
+    char *addr = info->si_addr;
+
+    (void)context;
+    if (E.bus_armed > 0 && E.bus_jump != NULL && pthread_equal(pthread_self(), E.main_thread) && E.doc.map != NULL &&
+        addr >= E.doc.map && addr < E.doc.map + E.doc.map_length) {
+        E.bus_armed = 0;
+        E.doc.fault = (size_t)(addr - E.doc.map);
+        siglongjmp(*E.bus_jump, 1);
+    }
+    signal(sig, SIG_DFL);
+    raise(sig);
+}
+
+void init_sigbus(void) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = sigbus_handler;
+    sa.sa_flags = SA_SIGINFO;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGBUS, &sa, NULL) == -1) {
+        error_handler("sigaction");
+    }
+}
+
+/*
+Called after a fault on the document mapping. If the faulting offset is still inside the file (it was rewritten, or
+shrank and grew again), the file is mapped afresh and re-indexed, so unedited lines are read again rather than lost.
+If the file now ends before the fault and what is left is small (typically a rotated log truncated to zero), the
+mapping is dropped and the file is re-read through read(), which cannot fault, into a private copy. Otherwise the
+mapping is kept but clamped to the surviving size and the index trimmed to match. A fault that comes back at the same
+offset after a fresh mapping (an I/O error on a network filesystem) takes the copy-in path, where read() reports the
+error properly.
+*/
+void doc_recover_truncation(void) {
+    struct document *doc = &E.doc;
+    struct stat st;
+    size_t size = 0;
+    size_t samples;
+    char *map;
+
+    if (fstat(doc->fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        size = (size_t)st.st_size;
+    }
+    doc->truncated = doc->truncated || size < doc->size;
+    memset(&E.ra, 0, sizeof(E.ra));
+    doc_invalidate_blocks();
+    render_cache_clear();
+
+    /* The fault may have come partway through copying a line into the add buffer: drop what it got of it. */
+    E.buf.add_length = E.buf.num_added > 0 ? E.buf.added[E.buf.num_added - 1].offset +
+                       E.buf.added[E.buf.num_added - 1].length : 0;
+
+    if (doc->fault < size && doc->remapped_fault != doc->fault + 1 &&
+        (map = mmap(NULL, size, PROT_READ, MAP_SHARED, doc->fd, 0)) != MAP_FAILED) {
+        munmap(doc->map, doc->map_length);
+        doc->map = map;
+        doc->map_length = size;
+        doc->size = size;
+        doc->num_lines = 0;
+        doc->index_pos = 0;
+        doc->fully_indexed = 0;
+        doc->remapped_fault = doc->fault + 1;
+        editor_set_status_message("File changed on disk: reading it again");
+    } else if (size < DOC_SNAPSHOT_LIMIT || doc->fault < size) {
+        munmap(doc->map, doc->map_length);
+        doc->map = NULL;
+        doc->map_length = 0;
+        doc->size = 0;
+        doc->num_lines = 0;
+        doc->index_pos = 0;
+        doc->fully_indexed = 0;
+        if (lseek(doc->fd, 0, SEEK_SET) == -1) {
+            error_handler("lseek");
+        }
+        doc_start_copy_in();
+        editor_set_status_message("File truncated on disk: switched to a private copy");
+    } else {
+        /*
+        Drop every sample that starts past the new end and re-index from the last survivor, which may have lost its
+        tail. Only the samples are consulted: scanning the text here could fault again.
+        */
+        samples = doc->record_length > 0 ? 0 : (doc->num_lines + doc->index_stride - 1) / doc->index_stride;
+        while (samples > 0 && line_index_get(&doc->lines, samples - 1) >= size) {
+            samples--;
+        }
+        if (samples > 0) {
+            samples--;
+            doc->index_pos = line_index_get(&doc->lines, samples);
+        } else {
+            doc->index_pos = 0;
+        }
+        doc->num_lines = samples * doc->index_stride;
+        if (doc->record_length > 0) {
+            /* Records are found by arithmetic: keep the whole ones that survived. */
+            doc->num_lines = doc->num_lines < size / doc->record_length ? doc->num_lines : size / doc->record_length;
+            doc->index_pos = doc->num_lines * doc->record_length;
+        }
+        doc->size = size;
+        doc->fully_indexed = 0;
+        editor_set_status_message("File truncated on disk: showing the surviving part");
+    }
+
+    /* Pull the cursor back inside what is left. Edited lines survive; unedited lines that were lost read as empty. */
+    if (!buf_line_exists(E.cy)) {
+        E.cy = buf_num_lines() > 0 ? buf_num_lines() - 1 : 0;
+    }
+    if (E.cx > buf_line_length(E.cy)) {
+        E.cx = buf_line_length(E.cy);
+    }
+}
+
+/* ------------------------------- Read-ahead ------------------------------- */
+/* Apply `advice` to the page-aligned cover of [lo, hi) in the document mapping. */
+void ra_advise(size_t lo, size_t hi, int advice) {
+    if (hi > E.doc.size) {
+        hi = E.doc.size;
+    }
+    if (lo >= hi) {
+        return;
+    }
+    lo -= lo % E.page_size;
+
+    if (madvise(E.doc.map + lo, hi - lo, advice) == -1 && advice == MADV_WILLNEED) {
+#ifdef __linux__
+        /* Some filesystems refuse the hint on the mapping; ask the page cache directly. */
+        readahead(E.doc.fd, (off_t)lo, hi - lo);
+#endif
+    }
+}
+
+/*
+Called whenever the viewport moves to bytes [top, bottom). Tracks how fast and in which direction the user is
+scrolling, prefetches the region the viewport is heading into, switches the mapping to MADV_SEQUENTIAL while the user
+is paging linearly through the file, and releases pages that have fallen far behind.
+*/
+void readahead_update(size_t top, size_t bottom) {
+    struct readahead *ra = &E.ra;
+    struct timespec now;
+    double elapsed;
+    double speed;
+    long long delta;
+    size_t window;
+    size_t lo;
+    size_t hi;
+    size_t old_lo;
+    size_t old_hi;
+    size_t new_lo;
+    size_t new_hi;
+    int release;
+
+    if (E.doc.map == NULL || (top == ra->top && bottom == ra->bottom)) {
+        return;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (double)(now.tv_sec - ra->stamp.tv_sec) + (double)(now.tv_nsec - ra->stamp.tv_nsec) / 1e9;
+    if (elapsed < 0.001) {
+        elapsed = 0.001;
+    }
+    delta = (long long)top - (long long)ra->top;
+    ra->velocity = ra->velocity * 0.5 + ((double)delta / elapsed) * 0.5;
+
+    /* Linear scan: short forward hops in a row. Anything else (jumps, scrolling back) returns to normal paging. */
+    if (delta > 0 && (unsigned long long)delta <= 2 * (bottom - top)) {
+        ra->sequential_runs++;
+    } else {
+        ra->sequential_runs = 0;
+    }
+    if (!ra->sequential && ra->sequential_runs >= RA_SEQUENTIAL_RUNS) {
+        madvise(E.doc.map, E.doc.size, MADV_SEQUENTIAL);
+        ra->sequential = 1;
+    } else if (ra->sequential && ra->sequential_runs == 0) {
+        madvise(E.doc.map, E.doc.size, MADV_NORMAL);
+        ra->sequential = 0;
+    }
+
+    /*
+    Prefetch in the direction of travel. Like the kernel's own async read-ahead, only top the window up once the
+    viewport has eaten into half of what was prefetched last time, so slow scrolling doesn't cost a syscall per frame.
+    */
+    speed = ra->velocity < 0 ? -ra->velocity : ra->velocity;
+    window = (size_t)(speed * RA_HORIZON_MS / 1000);
+    if (window < RA_MIN_WINDOW) {
+        window = RA_MIN_WINDOW;
+    } else if (window > RA_MAX_WINDOW) {
+        window = RA_MAX_WINDOW;
+    }
+    if (ra->velocity >= 0) {
+        lo = bottom;
+        hi = bottom + window;
+        if (lo >= ra->ahead_lo && lo < ra->ahead_hi) {
+            lo = ra->ahead_hi - bottom >= window / 2 ? hi : ra->ahead_hi;
+        }
+    } else {
+        lo = top > window ? top - window : 0;
+        hi = top;
+        if (hi > ra->ahead_lo && hi <= ra->ahead_hi) {
+            hi = top - ra->ahead_lo >= window / 2 ? lo : ra->ahead_lo;
+        }
+    }
+    if (lo < hi) {
+        ra_advise(lo, hi, MADV_WILLNEED);
+        ra->ahead_lo = lo;
+        ra->ahead_hi = hi;
+    }
+
+    /* Release the part of the old neighbourhood of the viewport that is not part of the new one. */
+    old_lo = ra->top > RA_KEEP_AROUND ? ra->top - RA_KEEP_AROUND : 0;
+    old_hi = ra->bottom + RA_KEEP_AROUND;
+    new_lo = top > RA_KEEP_AROUND ? top - RA_KEEP_AROUND : 0;
+    new_hi = bottom + RA_KEEP_AROUND;
+#if defined(MADV_PAGEOUT)
+    /* During a linear scan the pages behind us will not be revisited soon, so reclaim them outright. */
+    release = ra->sequential ? MADV_PAGEOUT : MADV_COLD;
+#elif defined(MADV_COLD)
+    release = MADV_COLD;
+#else
+    release = MADV_DONTNEED; /* Read-only shared mapping: the pages stay in the page cache. */
+#endif
+    ra_advise(old_lo, old_hi < new_lo ? old_hi : new_lo, release);
+    ra_advise(old_lo > new_hi ? old_lo : new_hi, old_hi, release);
+
+    ra->top = top;
+    ra->bottom = bottom;
+    ra->stamp = now;
+}
+
+/* --------------------------------- Buffer --------------------------------- */
+/*
+Every node of the piece tree carries the identity hash of its subtree's text, making it a Merkle tree whose root is
+the hash of everything above the unedited tail. An edit rehashes only the nodes on the path it touched. Because the
+hash fold is associative, the same text hashes the same however it happens to be cut into pieces, so comparing
+against the state saved on disk is a couple of hash compares, and undoing back to it clears the modified flag.
+*/
+size_t piece_lines(size_t n) {
+    return n != 0 ? E.buf.nodes[n].lines : 0;
+}
+
+uint64_t piece_hash(size_t n) {
+    return n != 0 ? E.buf.nodes[n].hash : 0;
+}
+
+/* Identity hash of `count` lines of `source` starting at `first`. */
+uint64_t piece_own_hash(int source, size_t first, size_t count) {
+    struct added_line *added = E.buf.added;
+
+    if (source == PIECE_DOCUMENT) {
+        return doc_range_hash(first, first + count);
+    }
+    return hash_range(first > 0 ? added[first - 1].prefix : 0, added[first + count - 1].prefix, count);
+}
+
+/* Recompute a node's subtree totals from its children. */
+void piece_update(size_t n) {
+    struct piece *p = &E.buf.nodes[n];
+    size_t right_lines = piece_lines(p->right);
+
+    p->lines = piece_lines(p->left) + p->count + right_lines;
+    p->hash = hash_concat(hash_concat(piece_hash(p->left), p->own_hash, p->count), piece_hash(p->right), right_lines);
+}
+
+/* A new single-node tree. Growing the node table can move it, so don't hold piece pointers across this. */
+size_t piece_new(int source, size_t first, size_t count) {
+    struct buffer *buf = &E.buf;
+    struct piece *p;
+    uint32_t x = buf->seed;
+
+    if (buf->num_nodes + 1 >= buf->node_capacity) {
+        if (hp_region_grow(&buf->node_region, (buf->num_nodes + 2) * sizeof(struct piece)) == -1) {
+            error_handler("mmap");
+        }
+        buf->nodes = (struct piece *)buf->node_region.base;
+        buf->node_capacity = buf->node_region.size / sizeof(struct piece);
+    }
+    if (buf->num_nodes == 0) {
+        buf->num_nodes = 1; /* The null node, zeroed by the mapping. */
+    }
+
+    /* xorshift32 */
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    buf->seed = x;
+
+    p = &buf->nodes[buf->num_nodes];
+    memset(p, 0, sizeof(*p));
+    p->source = source;
+    p->first = first;
+    p->count = count;
+    p->own_hash = piece_own_hash(source, first, count);
+    p->priority = x;
+    piece_update(buf->num_nodes);
+
+    return buf->num_nodes++;
+}
+
+/* Join two trees, all of `a`'s lines before `b`'s. */
+size_t piece_merge(size_t a, size_t b) {
+    struct piece *nodes = E.buf.nodes;
+
+    if (a == 0 || b == 0) {
+        return a != 0 ? a : b;
+    }
+    if (nodes[a].priority > nodes[b].priority) {
+        nodes[a].right = piece_merge(nodes[a].right, b);
+        piece_update(a);
+        return a;
+    }
+    nodes[b].left = piece_merge(a, nodes[b].left);
+    piece_update(b);
+    return b;
+}
+
+/* Cut tree `t` into its first `k` lines (`*a`) and the rest (`*b`), splitting a piece if the cut falls inside one. */
+void piece_split(size_t t, size_t k, size_t *a, size_t *b) {
+    struct piece *p;
+    size_t left_lines;
+    size_t rest;
+
+    if (t == 0) {
+        *a = 0;
+        *b = 0;
+        return;
+    }
+    p = &E.buf.nodes[t];
+    left_lines = piece_lines(p->left);
+
+    if (k <= left_lines) {
+        piece_split(p->left, k, a, &rest);
+        E.buf.nodes[t].left = rest;
+        piece_update(t);
+        *b = t;
+    } else if (k >= left_lines + p->count) {
+        piece_split(p->right, k - left_lines - p->count, &rest, b);
+        E.buf.nodes[t].right = rest;
+        piece_update(t);
+        *a = t;
+    } else {
+        /* This node keeps the lines before the cut and a new node takes the others. */
+        size_t cut = k - left_lines;
+        size_t tail = piece_new(p->source, p->first + cut, p->count - cut);
+
+        p = &E.buf.nodes[t];
+        rest = p->right;
+        p->right = 0;
+        p->count = cut;
+        p->own_hash = piece_own_hash(p->source, p->first, cut);
+        piece_update(t);
+        *a = t;
+        *b = piece_merge(tail, rest);
+    }
+}
+
+/* Find where buffer line `line` comes from. Returns 1 if the line exists. */
+int buf_locate(size_t line, int *source, size_t *index) {
+    struct buffer *buf = &E.buf;
+    size_t n = buf->root;
+
+    while (n != 0) {
+        struct piece *p = &buf->nodes[n];
+        size_t left_lines = piece_lines(p->left);
+
+        if (line < left_lines) {
+            n = p->left;
+        } else if (line < left_lines + p->count) {
+            *source = p->source;
+            *index = p->first + (line - left_lines);
+            return 1;
+        } else {
+            line -= left_lines + p->count;
+            n = p->right;
+        }
+    }
+
+    /* Past the tree: the unedited tail of the document. */
+    *source = PIECE_DOCUMENT;
+    *index = buf->tail + line;
+    return doc_index_to(*index);
+}
+
+/* Like buf_locate(), also setting *count to how many lines from `line` on continue in order in the same source. */
+int buf_locate_run(size_t line, int *source, size_t *index, size_t *count) {
+    struct buffer *buf = &E.buf;
+    size_t n = buf->root;
+
+    while (n != 0) {
+        struct piece *p = &buf->nodes[n];
+        size_t left_lines = piece_lines(p->left);
+
+        if (line < left_lines) {
+            n = p->left;
+        } else if (line < left_lines + p->count) {
+            *source = p->source;
+            *index = p->first + (line - left_lines);
+            *count = p->count - (line - left_lines);
+            return 1;
+        } else {
+            line -= left_lines + p->count;
+            n = p->right;
+        }
+    }
+
+    *source = PIECE_DOCUMENT;
+    *index = buf->tail + line;
+    *count = E.doc.num_lines > *index ? E.doc.num_lines - *index : 0;
+    return doc_index_to(*index);
+}
+
+int buf_line_exists(size_t line) {
+    int source;
+    size_t index;
+
+    return buf_locate(line, &source, &index);
+}
+
+/* Lines known so far: all of them once the document is fully indexed. */
+size_t buf_num_lines(void) {
+    size_t tail = E.doc.num_lines > E.buf.tail ? E.doc.num_lines - E.buf.tail : 0;
+
+    return piece_lines(E.buf.root) + tail;
+}
+
+/*
+Contiguous bytes of buffer line `line` from byte `offset` on, without the line terminator. `*length` is how many can be
+read before the next call is needed; NULL at the end of the line.
+*/
+const char *buf_line_span(size_t line, size_t offset, size_t *length) {
+    const char *s;
+    int source;
+    size_t index;
+    size_t start;
+    size_t end;
+
+    *length = 0;
+    if (!buf_locate(line, &source, &index)) {
+        return NULL;
+    }
+    if (source == PIECE_ADDED) {
+        struct added_line *added = &E.buf.added[index];
+
+        if (offset >= added->length) {
+            return NULL;
+        }
+        *length = added->length - offset;
+        return E.buf.add_region.base + added->offset + offset;
+    }
+
+    if (index >= E.doc.num_lines) {
+        return NULL; /* Lost when the file was truncated under us. */
+    }
+    start = doc_line_start(index) + offset;
+    end = doc_line_end(index);
+    if (start >= end) {
+        return NULL;
+    }
+    s = doc_span(start, length);
+    if (*length > end - start) {
+        *length = end - start;
+    }
+    return s;
+}
+
+size_t buf_line_length(size_t line) {
+    int source;
+    size_t index;
+
+    if (!buf_locate(line, &source, &index)) {
+        return 0;
+    }
+    if (source == PIECE_ADDED) {
+        return E.buf.added[index].length;
+    }
+    if (index >= E.doc.num_lines) {
+        return 0;
+    }
+    return doc_line_end(index) - doc_line_start(index);
+}
+
+/* Copy buffer line `line` into `*s`, grown as needed to `*capacity` bytes, NUL-terminated. Returns its length. */
+size_t buf_line_copy(size_t line, char **s, size_t *capacity) {
+    const char *span;
+    size_t length = buf_line_length(line);
+    size_t offset = 0;
+    size_t n;
+
+    if (length + 1 > *capacity) {
+        char *grown = realloc(*s, length + 1);
+
+        if (grown == NULL) {
+            error_handler("realloc");
+        }
+        *s = grown;
+        *capacity = length + 1;
+    }
+    doc_read_begin();
+    while ((span = buf_line_span(line, offset, &n)) != NULL) {
+        memcpy(*s + offset, span, n);
+        offset += n;
+    }
+    doc_read_end();
+    (*s)[offset] = '\0';
+
+    return offset;
+}
+
+/* The document line buffer line `line` shows, if it is an unedited one. */
+int buf_document_line(size_t line, size_t *index) {
+    int source;
+
+    return buf_locate(line, &source, index) && source == PIECE_DOCUMENT && *index < E.doc.num_lines;
+}
+
+/* In-order walk for buf_line_of_document(), adding the lines passed to *line. Returns 1 once the spot is found. */
+int buf_find_document_line(size_t n, size_t index, size_t *line) {
+    struct piece *p;
+
+    if (n == 0) {
+        return 0;
+    }
+    p = &E.buf.nodes[n];
+    if (buf_find_document_line(p->left, index, line)) {
+        return 1;
+    }
+    if (p->source == PIECE_DOCUMENT && index < p->first + p->count) {
+        *line += index > p->first ? index - p->first : 0; /* Before the piece: the line was deleted. */
+        return 1;
+    }
+    *line += p->count;
+
+    return buf_find_document_line(p->right, index, line);
+}
+
+/* The buffer line showing document line `index`, or the line after where it was if it has been deleted. */
+size_t buf_line_of_document(size_t index) {
+    size_t line = 0;
+
+    if (index >= E.buf.tail) {
+        return piece_lines(E.buf.root) + (index - E.buf.tail);
+    }
+    if (!buf_find_document_line(E.buf.root, index, &line)) {
+        line = piece_lines(E.buf.root);
+    }
+
+    return line;
+}
+
+/* Make room for `length` more bytes in the add buffer. Growing can move it, so do this before taking pointers. */
+void buf_add_reserve(size_t length) {
+    struct buffer *buf = &E.buf;
+
+    if (hp_region_grow(&buf->add_region, buf->add_length + length) == -1) {
+        error_handler("mmap");
+    }
+}
+
+void buf_add_bytes(const char *s, size_t length) {
+    buf_add_reserve(length);
+    memcpy(E.buf.add_region.base + E.buf.add_length, s, length);
+    E.buf.add_length += length;
+}
+
+/* Append bytes [from, to) of buffer line `line` to the add buffer. */
+void buf_add_copy(size_t line, size_t from, size_t to) {
+    const char *s;
+    size_t length;
+
+    buf_add_reserve(to - from);
+    doc_read_begin();
+    while (from < to && (s = buf_line_span(line, from, &length)) != NULL) {
+        if (length > to - from) {
+            length = to - from;
+        }
+        memcpy(E.buf.add_region.base + E.buf.add_length, s, length);
+        E.buf.add_length += length;
+        from += length;
+    }
+    doc_read_end();
+}
+
+/*
+End the line being written to the add buffer and return its index in the added line table. Lines ended one after
+another have consecutive indices, so they can go into the buffer as a single piece.
+*/
+size_t buf_add_line(void) {
+    struct buffer *buf = &E.buf;
+    struct added_line *added;
+    uint64_t prefix = 0;
+    size_t offset = 0;
+
+    if (buf->num_added == buf->added_capacity) {
+        if (hp_region_grow(&buf->added_region, (buf->num_added + 1) * sizeof(struct added_line)) == -1) {
+            error_handler("mmap");
+        }
+        buf->added = (struct added_line *)buf->added_region.base;
+        buf->added_capacity = buf->added_region.size / sizeof(struct added_line);
+    }
+    if (buf->num_added > 0) {
+        added = &buf->added[buf->num_added - 1];
+        offset = added->offset + added->length;
+        prefix = added->prefix;
+    }
+
+    added = &buf->added[buf->num_added];
+    added->offset = offset;
+    added->length = buf->add_length - offset;
+    added->prefix = hash_concat(prefix, hash_line(buf->add_region.base + offset, added->length), 1);
+
+    return buf->num_added++;
+}
+
+/*
+Append `count` whole lines to the add buffer at once: `text` holds them back to back, with their lengths and
+hash_line() hashes worked out beforehand (by worker threads, say). Returns the index of the first.
+*/
+size_t buf_add_lines(const char *text, const size_t *lengths, const uint64_t *hashes, size_t count) {
+    struct buffer *buf = &E.buf;
+    uint64_t prefix = buf->num_added > 0 ? buf->added[buf->num_added - 1].prefix : 0;
+    size_t offset = buf->add_length;
+    size_t total = 0;
+    size_t first = buf->num_added;
+
+    for (size_t i = 0; i < count; i++) {
+        total += lengths[i];
+    }
+    if (buf->num_added + count > buf->added_capacity) {
+        if (hp_region_grow(&buf->added_region, (buf->num_added + count) * sizeof(struct added_line)) == -1) {
+            error_handler("mmap");
+        }
+        buf->added = (struct added_line *)buf->added_region.base;
+        buf->added_capacity = buf->added_region.size / sizeof(struct added_line);
+    }
+    buf_add_bytes(text, total);
+    for (size_t i = 0; i < count; i++) {
+        struct added_line *added = &buf->added[buf->num_added++];
+
+        added->offset = offset;
+        added->length = lengths[i];
+        prefix = hash_concat(prefix, hashes[i], 1);
+        added->prefix = prefix;
+        offset += lengths[i];
+    }
+    return first;
+}
+
+/* Move document lines from the unedited tail into the tree until it holds `lines` lines or the document ends. */
+void buf_materialize(size_t lines) {
+    struct buffer *buf = &E.buf;
+    size_t have = piece_lines(buf->root);
+    size_t count;
+
+    if (lines <= have) {
+        return;
+    }
+    doc_index_to(buf->tail + (lines - have) - 1);
+    count = E.doc.num_lines > buf->tail ? E.doc.num_lines - buf->tail : 0;
+    if (count > lines - have) {
+        count = lines - have;
+    }
+    if (count == 0) {
+        return;
+    }
+    buf->root = piece_merge(buf->root, piece_new(PIECE_DOCUMENT, buf->tail, count));
+    buf->tail += count;
+}
+
+/* Append `lines` added lines starting at `first` to the end of the buffer, outside undo: text that arrives by itself. */
+void buf_append(size_t first, size_t lines) {
+    doc_index_to(SIZE_MAX);
+    buf_materialize(buf_num_lines());
+    E.buf.root = piece_merge(E.buf.root, piece_new(PIECE_ADDED, first, lines));
+}
+
+/* Drop all text and history, back to an empty, unedited buffer. Observers stay. */
+void buf_reset(void) {
+    struct buffer *buf = &E.buf;
+    void (*observers[BUF_OBSERVERS_MAX])(size_t at, size_t removed, size_t inserted);
+    int num_observers = buf->num_observers;
+
+    memcpy(observers, buf->observers, sizeof(observers));
+    hp_region_free(&buf->node_region);
+    hp_region_free(&buf->add_region);
+    hp_region_free(&buf->added_region);
+    free(buf->undo);
+    memset(buf, 0, sizeof(*buf));
+    buf->seed = 0x6b696c6f;
+    memcpy(buf->observers, observers, sizeof(observers));
+    buf->num_observers = num_observers;
+    render_cache_clear();
+}
+
+/* Have `fn` told about every change to the buffer's lines, before it is made. */
+void buf_observe(void (*fn)(size_t at, size_t removed, size_t inserted)) {
+    if (E.buf.num_observers == BUF_OBSERVERS_MAX) {
+        error_handler("buf_observe");
+    }
+    E.buf.observers[E.buf.num_observers++] = fn;
+}
+
+void buf_unobserve(void (*fn)(size_t at, size_t removed, size_t inserted)) {
+    struct buffer *buf = &E.buf;
+
+    for (int i = 0; i < buf->num_observers; i++) {
+        if (buf->observers[i] == fn) {
+            buf->observers[i] = buf->observers[--buf->num_observers];
+            return;
+        }
+    }
+}
+
+void buf_notify(size_t at, size_t removed, size_t inserted) {
+    for (int i = 0; i < E.buf.num_observers; i++) {
+        E.buf.observers[i](at, removed, inserted);
+    }
+}
+
+/* Start an edit. A new undo group begins unless this continues a run of typing. */
+void buf_begin_edit(int typing) {
+    if (!typing || !E.buf.typing) {
+        E.buf.group++;
+    }
+    E.buf.typing = typing;
+}
+
+/* Remember where the cursor ended up, for redo. */
+void buf_end_edit(void) {
+    struct buffer *buf = &E.buf;
+
+    if (buf->num_undo > 0) {
+        buf->undo[buf->num_undo - 1].cx_after = E.cx;
+        buf->undo[buf->num_undo - 1].cy_after = E.cy;
+    }
+}
+
+/*
+Replace the `count` lines at `at` with the `lines` lines of the add buffer starting at added line `first`, recording
+the change in the current undo group.
+*/
+void buf_replace(size_t at, size_t count, size_t first, size_t lines) {
+    struct buffer *buf = &E.buf;
+    struct undo_record *record;
+    size_t before;
+    size_t rest;
+    size_t removed;
+    size_t after;
+
+    buf_materialize(at + count);
+    buf_notify(at, count, lines);
+    piece_split(buf->root, at, &before, &rest);
+    piece_split(rest, count, &removed, &after);
+    if (lines > 0) {
+        before = piece_merge(before, piece_new(PIECE_ADDED, first, lines));
+    }
+    buf->root = piece_merge(before, after);
+
+    /* A new change makes everything that was undone unreachable. */
+    buf->num_undo = buf->undo_pos;
+    if (buf->num_undo == buf->undo_capacity) {
+        size_t capacity = buf->undo_capacity ? buf->undo_capacity * 2 : 64;
+        struct undo_record *undo = realloc(buf->undo, capacity * sizeof(*undo));
+
+        if (undo == NULL) {
+            error_handler("realloc");
+        }
+        buf->undo = undo;
+        buf->undo_capacity = capacity;
+    }
+    record = &buf->undo[buf->num_undo++];
+    buf->undo_pos = buf->num_undo;
+    record->at = at;
+    record->lines = lines;
+    record->held = removed;
+    record->group = buf->group;
+    record->cx = E.cx;
+    record->cy = E.cy;
+    record->cx_after = E.cx;
+    record->cy_after = E.cy;
+}
+
+/* Swap the lines a record holds with the ones standing in for them in the buffer. */
+void buf_swap(struct undo_record *record) {
+    struct buffer *buf = &E.buf;
+    size_t before;
+    size_t rest;
+    size_t current;
+    size_t after;
+
+    buf_notify(record->at, record->lines, piece_lines(record->held));
+    piece_split(buf->root, record->at, &before, &rest);
+    piece_split(rest, record->lines, &current, &after);
+    buf->root = piece_merge(piece_merge(before, record->held), after);
+    record->lines = piece_lines(record->held);
+    record->held = current;
+}
+
+void buf_undo(void) {
+    struct buffer *buf = &E.buf;
+    unsigned group;
+
+    if (buf->undo_pos == 0) {
+        editor_set_status_message("Nothing to undo");
+        return;
+    }
+    group = buf->undo[buf->undo_pos - 1].group;
+    while (buf->undo_pos > 0 && buf->undo[buf->undo_pos - 1].group == group) {
+        buf_swap(&buf->undo[--buf->undo_pos]);
+    }
+    E.cx = buf->undo[buf->undo_pos].cx;
+    E.cy = buf->undo[buf->undo_pos].cy;
+    buf->typing = 0;
+}
+
+void buf_redo(void) {
+    struct buffer *buf = &E.buf;
+    unsigned group;
+
+    if (buf->undo_pos == buf->num_undo) {
+        editor_set_status_message("Nothing to redo");
+        return;
+    }
+    group = buf->undo[buf->undo_pos].group;
+    while (buf->undo_pos < buf->num_undo && buf->undo[buf->undo_pos].group == group) {
+        buf_swap(&buf->undo[buf->undo_pos++]);
+    }
+    E.cx = buf->undo[buf->undo_pos - 1].cx_after;
+    E.cy = buf->undo[buf->undo_pos - 1].cy_after;
+    buf->typing = 0;
+}
+
+struct buffer_state buf_state(void) {
+    struct buffer_state state;
+
+    state.hash = piece_hash(E.buf.root);
+    state.lines = piece_lines(E.buf.root);
+    state.tail = E.buf.tail;
+
+    return state;
+}
+
+/* Re-express `state` with its unedited tail starting at document line `tail` (not before the state's own). */
+struct buffer_state buf_state_at(struct buffer_state state, size_t tail) {
+    if (tail > state.tail) {
+        state.hash = hash_concat(state.hash, doc_range_hash(state.tail, tail), tail - state.tail);
+        state.lines += tail - state.tail;
+        state.tail = tail;
+    }
+
+    return state;
+}
+
+/*
+Whether the buffer differs from the file on disk. Both sides are a tree root followed by the document from some line,
+so after moving the earlier tail start up to the later one it comes down to comparing two hashes and two counts,
+however big the file or the edit history.
+*/
+int buf_modified(void) {
+    struct buffer_state now = buf_state();
+    struct buffer_state saved = E.buf.saved;
+    size_t tail = now.tail > saved.tail ? now.tail : saved.tail;
+
+    now = buf_state_at(now, tail);
+    saved = buf_state_at(saved, tail);
+
+    return now.hash != saved.hash || now.lines != saved.lines;
+}
+
+/*
+In-order walk for buf_save_records() over the buffer lines that aren't their own document record. With `fd` -1 it only
+copies the records that moved to other lines into *stage, since patching may write over where they come from. Then,
+with the file open, it writes each such line in place, the moved records from *stage.
+*/
+int buf_patch_records(int fd, size_t n, size_t *line, char **stage, size_t *staged, size_t *written) {
+    struct piece *p;
+    char *text = NULL;
+    size_t capacity = 0;
+    size_t length;
+    size_t start;
+    size_t bytes;
+
+    if (n == 0) {
+        return 0;
+    }
+    p = &E.buf.nodes[n];
+    if (buf_patch_records(fd, p->left, line, stage, staged, written) == -1) {
+        return -1;
+    }
+    if (p->source == PIECE_DOCUMENT && p->first != *line) {
+        /* Records have no terminators, so a run of them is one run of bytes in the file, and in place. */
+        start = doc_line_start(p->first);
+        bytes = doc_line_end(p->first + p->count - 1) - start;
+        if (fd == -1) {
+            char *grown = realloc(*stage, *staged + bytes);
+
+            if (grown == NULL) {
+                error_handler("realloc");
+            }
+            *stage = grown;
+            doc_read_begin();
+            for (size_t offset = 0; offset < bytes; offset += length) {
+                const char *span = doc_span(start + offset, &length);
+
+                if (length > bytes - offset) {
+                    length = bytes - offset;
+                }
+                memcpy(*stage + *staged + offset, span, length);
+            }
+            doc_read_end();
+        } else if (pwrite(fd, *stage + *staged, bytes, (off_t)(*line * E.doc.record_length)) != (ssize_t)bytes) {
+            return -1;
+        } else {
+            *written += p->count;
+        }
+        *staged += bytes;
+    } else if (p->source != PIECE_DOCUMENT && fd != -1) {
+        for (size_t i = 0; i < p->count; i++) {
+            length = buf_line_copy(*line + i, &text, &capacity);
+            if (pwrite(fd, text, length, (off_t)((*line + i) * E.doc.record_length)) != (ssize_t)length) {
+                free(text);
+                return -1;
+            }
+        }
+        *written += p->count;
+    }
+    *line += p->count;
+    free(text);
+
+    return buf_patch_records(fd, p->right, line, stage, staged, written);
+}
+
+/*
+Save fixed-length records by writing only the changed ones over their old selves, so changing a record of a huge
+extract doesn't rewrite all of it. That only works while every record keeps its length. A mapped document now shows
+the patched file, which it wasn't indexed and hashed as, so the buffer starts over from it, without undo history.
+*/
+int buf_save_records(void) {
+    struct document *doc = &E.doc;
+    size_t lines = buf_num_lines();
+    size_t line = 0;
+    size_t written = 0;
+    char *stage = NULL;
+    size_t staged = 0;
+    int fd;
+
+    if (lines != doc->num_lines) {
+        editor_set_status_message("Can't save: %zu records where the file has %zu", lines, doc->num_lines);
+        return -1;
+    }
+    for (size_t i = 0; i < lines; i++) {
+        size_t expected = i + 1 < lines ? doc->record_length : doc->size - i * doc->record_length;
+
+        if (buf_line_length(i) != expected) {
+            editor_set_status_message("Can't save: record %zu is no longer %zu bytes", i + 1, expected);
+            return -1;
+        }
+    }
+
+    buf_patch_records(-1, E.buf.root, &line, &stage, &staged, &written);
+    line = 0;
+    staged = 0;
+
+    /* The document's own descriptor is read-only (and gone, for copy-ins). */
+    if ((fd = open(doc->filename, O_WRONLY)) == -1) {
+        editor_set_status_message("Can't save: %s", strerror(errno));
+        free(stage);
+        return -1;
+    }
+    if (buf_patch_records(fd, E.buf.root, &line, &stage, &staged, &written) == -1 || fsync(fd) == -1) {
+        editor_set_status_message("Can't save: %s", strerror(errno));
+        close(fd);
+        free(stage);
+        return -1;
+    }
+    close(fd);
+    free(stage);
+
+    /* A copy-in document holds its own copy of the old text, which undo can still go back to. */
+    if (doc->map != NULL) {
+        buf_reset();
+        doc->num_lines = 0;
+        doc->index_pos = 0;
+        doc->fully_indexed = 0;
+        doc_invalidate_blocks();
+    }
+    E.buf.saved = buf_state();
+    editor_set_status_message("%zu records written in place to %s", written, doc->filename);
+    return 0;
+}
+
+/*
+Write the buffer out to a temporary file next to the original and rename() it into place. The document mapping keeps
+reading the old copy, so unedited lines stay valid after the save. Returns 0 if the file was written.
+*/
+int buf_save(void) {
+    struct document *doc = &E.doc;
+    const char *newline = doc->crlf ? "\r\n" : "\n";
+    sigjmp_buf jump;
+    sigjmp_buf *outer = E.bus_jump;
+    struct stat st;
+    char *path;
+    FILE *fp;
+    size_t lines;
+    int trailing;
+
+    if (doc->filename == NULL || doc->unnamed) {
+        editor_set_status_message("No file name to save to");
+        return -1;
+    }
+    if (!buf_modified()) {
+        editor_set_status_message("No changes to save");
+        return -1;
+    }
+    if (E.session.replaying) {
+        editor_set_status_message("Replaying: not saved");
+        return -1;
+    }
+
+    doc_index_to(SIZE_MAX);
+    if (doc->record_length > 0) {
+        return buf_save_records();
+    }
+
+    /* The last line ends in a newline only if the file's did (or the file was empty). */
+    lines = buf_num_lines();
+    trailing = doc->size == 0 || doc_byte(doc->size - 1) == '\n';
+
+    path = malloc(strlen(doc->filename) + sizeof(".kilo-save"));
+    if (path == NULL) {
+        error_handler("malloc");
+    }
+    sprintf(path, "%s.kilo-save", doc->filename);
+    if ((fp = fopen(path, "w")) == NULL) {
+        goto fail;
+    }
+    if (stat(doc->filename, &st) == 0) {
+        fchmod(fileno(fp), st.st_mode & 07777);
+    }
+    /* If the file is truncated while we copy from it, don't leave the temporary file behind. */
+    if (sigsetjmp(jump, 1) != 0) {
+        E.bus_jump = outer;
+        fclose(fp);
+        unlink(path);
+        free(path);
+        doc_recover_truncation();
+        return -1;
+    }
+    E.bus_jump = &jump;
+    doc_read_begin();
+    for (size_t line = 0; line < lines; line++) {
+        const char *s;
+        size_t offset = 0;
+        size_t length;
+
+        while ((s = buf_line_span(line, offset, &length)) != NULL) {
+            fwrite(s, 1, length, fp);
+            offset += length;
+        }
+        if (line + 1 < lines || trailing) {
+            fputs(newline, fp);
+        }
+    }
+    doc_read_end();
+    E.bus_jump = outer;
+    if (fflush(fp) != 0 || ferror(fp) || fsync(fileno(fp)) == -1) {
+        fclose(fp);
+        goto fail;
+    }
+    if (fclose(fp) != 0 || rename(path, doc->filename) == -1) {
+        goto fail;
+    }
+    free(path);
+
+    E.buf.saved = buf_state();
+    editor_set_status_message("%zu lines written to %s", lines, doc->filename);
+    return 0;
+
+fail:
+    editor_set_status_message("Can't save: %s", strerror(errno));
+    unlink(path);
+    free(path);
+    return -1;
+}
+
+/* ---------------------------- Editor Operations --------------------------- */
+int is_identifier_char(int c) {
+    return isalnum(c) || c == '_';
+}
+
+int editor_can_edit(void) {
+    if (E.read_only) {
+        editor_set_status_message("Read-only");
+        return 0;
+    }
+    return 1;
+}
+
+/* Records have a fixed length: their bytes can be typed over, but not inserted, deleted or split. */
+int editor_can_resize(void) {
+    if (E.doc.record_length > 0) {
+        editor_set_status_message("%zu-byte records: type over them instead", E.doc.record_length);
+        return 0;
+    }
+    return editor_can_edit();
+}
+
+void editor_insert_char(int c) {
+    char ch = (char)c;
+    size_t length;
+
+    if (!editor_can_edit()) {
+        return;
+    }
+    if (E.doc.record_length > 0) {
+        /* Overwrite the byte under the cursor. */
+        if (!buf_line_exists(E.cy) || E.cx >= buf_line_length(E.cy)) {
+            editor_set_status_message("End of the record");
+            return;
+        }
+        buf_begin_edit(1);
+        length = buf_line_length(E.cy);
+        buf_add_copy(E.cy, 0, E.cx);
+        buf_add_bytes(&ch, 1);
+        buf_add_copy(E.cy, E.cx + 1, length);
+        buf_replace(E.cy, 1, buf_add_line(), 1);
+        E.cx++;
+        buf_end_edit();
+        return;
+    }
+    buf_begin_edit(1);
+    if (buf_line_exists(E.cy)) {
+        length = buf_line_length(E.cy);
+        buf_add_copy(E.cy, 0, E.cx);
+        buf_add_bytes(&ch, 1);
+        buf_add_copy(E.cy, E.cx, length);
+        buf_replace(E.cy, 1, buf_add_line(), 1);
+    } else {
+        /* First character of an empty file. */
+        buf_add_bytes(&ch, 1);
+        buf_replace(E.cy, 0, buf_add_line(), 1);
+    }
+    E.cx++;
+    buf_end_edit();
+}
+
+/* Split the line at the cursor. */
+void editor_insert_newline(void) {
+    size_t length;
+    size_t first;
+
+    if (!editor_can_resize()) {
+        return;
+    }
+    buf_begin_edit(0);
+    if (buf_line_exists(E.cy)) {
+        length = buf_line_length(E.cy);
+        buf_add_copy(E.cy, 0, E.cx);
+        first = buf_add_line();
+        buf_add_copy(E.cy, E.cx, length);
+        buf_add_line();
+        buf_replace(E.cy, 1, first, 2);
+    } else {
+        first = buf_add_line();
+        buf_add_line();
+        buf_replace(E.cy, 0, first, 2);
+    }
+    E.cy++;
+    E.cx = 0;
+    buf_end_edit();
+}
+
+/* Delete the character left of the cursor, joining the line onto the one above at the start of a line. */
+void editor_delete_char(void) {
+    size_t length;
+    size_t previous;
+
+    if (!editor_can_resize() || (E.cx == 0 && E.cy == 0) || !buf_line_exists(E.cy)) {
+        return;
+    }
+    buf_begin_edit(0);
+    length = buf_line_length(E.cy);
+    if (E.cx > 0) {
+        buf_add_copy(E.cy, 0, E.cx - 1);
+        buf_add_copy(E.cy, E.cx, length);
+        buf_replace(E.cy, 1, buf_add_line(), 1);
+        E.cx--;
+    } else {
+        previous = buf_line_length(E.cy - 1);
+        buf_add_copy(E.cy - 1, 0, previous);
+        buf_add_copy(E.cy, 0, length);
+        buf_replace(E.cy - 1, 2, buf_add_line(), 1);
+        E.cy--;
+        E.cx = previous;
+    }
+    buf_end_edit();
+}
+
+/*
+Open `path` at `line` by replacing this process with a fresh kilo on it: there is one document per process. Refuses if
+that would throw away unsaved changes. A running job carries on: exec() keeps the pid, so it stays our child, and its
+descriptors are passed on.
+*/
+void editor_switch_file(const char *path, size_t line) {
+    char number[24];
+    int read_only = E.dir.active ? E.dir.read_only : E.read_only;
+
+    if (buf_modified()) {
+        editor_set_status_message("Unsaved changes: save them first");
+        return;
+    }
+    snprintf(number, sizeof(number), "+%zu", line + 1);
+    restore_term();
+    lsp_stop(NULL); /* The new kilo starts its own. */
+    job_handoff(1);
+    if (read_only) {
+        execl("/proc/self/exe", "kilo", "-R", number, path, (char *)NULL);
+    } else {
+        execl("/proc/self/exe", "kilo", number, path, (char *)NULL);
+    }
+    job_handoff(0);
+    init_term();
+    editor_set_status_message("Can't open %s: %s", path, strerror(errno));
+}
+
+/* Is `path` the file being edited? Compares resolved paths, so any spelling of it counts. */
+int editor_is_open_file(const char *path) {
+    char *real;
+    char *current;
+    int same;
+
+    if (E.doc.filename == NULL || E.doc.unnamed || E.dir.active) {
+        return 0;
+    }
+    real = realpath(path, NULL);
+    current = realpath(E.doc.filename, NULL);
+    same = real != NULL && current != NULL && strcmp(real, current) == 0;
+    free(real);
+    free(current);
+
+    return same;
+}
+
+/* Go to `line` (and byte `col`) of `path`: move the cursor if it is the open file, otherwise switch to it. */
+void editor_goto_location(const char *path, size_t line, size_t col) {
+    if (!editor_is_open_file(path)) {
+        editor_switch_file(path, line);
+        return;
+    }
+    E.cy = buf_line_exists(line) ? line : (buf_num_lines() > 0 ? buf_num_lines() - 1 : 0);
+    E.cx = col < buf_line_length(E.cy) ? col : buf_line_length(E.cy);
+}
+
+/* The lines a command works on: those the selection touches, or else all of them. The selection is used up. */
+void editor_selected_lines(size_t *from, size_t *to) {
+    doc_index_to(SIZE_MAX);
+    *from = 0;
+    *to = buf_num_lines();
+    if (E.sel_active) {
+        *from = E.sel_line < E.cy ? E.sel_line : E.cy;
+        *to = (E.sel_line > E.cy ? E.sel_line : E.cy) + 1;
+        E.sel_active = 0;
+    }
+}
+
+/* Bring the cursor back inside the text after lines have gone. */
+void editor_clamp_cursor(void) {
+    if (E.cy >= buf_num_lines()) {
+        E.cy = buf_num_lines() > 0 ? buf_num_lines() - 1 : 0;
+    }
+    if (E.cx > buf_line_length(E.cy)) {
+        E.cx = buf_line_length(E.cy);
+    }
+}
+
+/* --------------------------------- Prompt --------------------------------- */
+void prompt_open(const char *label, void (*done)(const char *text), void (*complete)(int apply)) {
+    struct prompt *p = &E.prompt;
+
+    p->active = 1;
+    p->label = label;
+    p->length = 0;
+    p->text[0] = '\0';
+    p->hint[0] = '\0';
+    p->done = done;
+    p->complete = complete;
+}
+
+/* Start the prompt with `text` already typed, to be edited or accepted as it is. */
+void prompt_set(const char *text) {
+    struct prompt *p = &E.prompt;
+
+    p->length = snprintf(p->text, sizeof(p->text), "%s", text);
+    if (p->length >= sizeof(p->text)) {
+        p->length = sizeof(p->text) - 1;
+    }
+}
+
+/* Keys go here instead of the keymap while the prompt is open. */
+void prompt_key(int c) {
+    struct prompt *p = &E.prompt;
+    char text[PROMPT_MAX];
+
+    if (c == '\r') {
+        memcpy(text, p->text, p->length + 1); /* done() may open another prompt. */
+        p->active = 0;
+        p->done(text);
+        return;
+    }
+    if (c == '\x1b' || c == CTRL_KEY('g')) {
+        p->active = 0;
+        return;
+    }
+
+    if ((c == 127 || c == CTRL_KEY('h')) && p->length > 0) {
+        p->length--;
+    } else if (c == '\t' && p->complete != NULL) {
+        p->complete(1);
+        return;
+    } else if (c >= ' ' && c < 256 && c != 127 && p->length < PROMPT_MAX - 1) {
+        p->text[p->length++] = (char)c;
+    }
+    p->text[p->length] = '\0';
+    if (p->complete != NULL) {
+        p->complete(0);
+    }
+}
+
+/* -------------------------------- Directory ------------------------------- */
+/*
+`kilo dir/` browses a directory. A worker thread reads it with getdents64 in DIR_BATCH_SIZE batches and hands the
+names over through the shared dir_listing, writing a byte to a pipe the event loop watches; each batch is appended to
+the buffer as lines, so a huge directory fills in while it can already be scrolled. stat() is only done for the rows
+on screen, by the worker, ahead of reading further: on NFS that is what takes the time.
+*/
+void dir_notify(struct dir_listing *listing) {
+    if (write(listing->notify, "", 1) == -1) {
+        /* Pipe full (a wakeup is pending anyway) or the browser has gone. */
+    }
+}
+
+void dir_listing_release(struct dir_listing *listing) {
+    int refs;
+
+    pthread_mutex_lock(&listing->lock);
+    refs = --listing->refs;
+    pthread_mutex_unlock(&listing->lock);
+    if (refs == 0) {
+        pthread_mutex_destroy(&listing->lock);
+        pthread_cond_destroy(&listing->wake);
+        free(listing->names);
+        free(listing->stats);
+        free(listing);
+    }
+}
+
+/* Grow `*p` (of `*capacity` elements of `size` bytes) to hold at least `count`. Returns -1 if out of memory. */
+int dir_reserve(void **p, size_t *capacity, size_t count, size_t size) {
+    size_t grown = *capacity ? *capacity : 1024;
+    void *q;
+
+    if (count <= *capacity) {
+        return 0;
+    }
+    while (grown < count) {
+        grown *= 2;
+    }
+    if ((q = realloc(*p, grown * size)) == NULL) {
+        return -1;
+    }
+    *p = q;
+    *capacity = grown;
+    return 0;
+}
+
+void *dir_worker(void *arg) {
+    struct dir_listing *listing = arg;
+    char *batch = malloc(DIR_BATCH_SIZE);
+    char *arena = NULL; /* Our own copy of every name, for stat(). */
+    size_t arena_length = 0;
+    size_t arena_capacity = 0;
+    size_t *offsets = NULL;
+    unsigned char *statted = NULL;
+    size_t offsets_capacity = 0;
+    size_t statted_capacity = 0;
+    size_t count = 0;
+    int listed = 0;
+    int quit = 0;
+
+    while (!quit && batch != NULL) {
+        size_t lo;
+        size_t hi;
+        size_t i;
+        long n;
+
+        /* Wait for work once everything has been read and every row on screen has been stat()ed. */
+        pthread_mutex_lock(&listing->lock);
+        for (;;) {
+            lo = listing->want_lo;
+            hi = listing->want_hi < count ? listing->want_hi : count;
+            for (i = lo; i < hi && statted[i]; i++) {
+            }
+            if (listing->quit || !listed || i < hi) {
+                break;
+            }
+            pthread_cond_wait(&listing->wake, &listing->lock);
+        }
+        quit = listing->quit;
+        pthread_mutex_unlock(&listing->lock);
+        if (quit) {
+            break;
+        }
+
+        if (i < hi) {
+            for (; i < hi; i++) {
+                struct stat st;
+                struct dir_stat result;
+
+                if (statted[i]) {
+                    continue;
+                }
+                statted[i] = 1;
+                memset(&result, 0, sizeof(result));
+                result.index = i;
+                result.ok = fstatat(listing->fd, arena + offsets[i], &st, AT_SYMLINK_NOFOLLOW) == 0;
+                if (result.ok) {
+                    result.mode = st.st_mode;
+                    result.size = st.st_size;
+                    result.mtime = st.st_mtime;
+                }
+                pthread_mutex_lock(&listing->lock);
+                if (dir_reserve((void **)&listing->stats, &listing->stats_capacity, listing->num_stats + 1,
+                                sizeof(struct dir_stat)) == 0) {
+                    listing->stats[listing->num_stats++] = result;
+                }
+                pthread_mutex_unlock(&listing->lock);
+            }
+            dir_notify(listing);
+        }
+        if (listed) {
+            continue;
+        }
+
+        n = syscall(SYS_getdents64, listing->fd, batch, DIR_BATCH_SIZE);
+        if (n <= 0) {
+            listed = 1;
+            pthread_mutex_lock(&listing->lock);
+            listing->done = 1;
+            listing->error = n < 0 ? errno : 0;
+            pthread_mutex_unlock(&listing->lock);
+            dir_notify(listing);
+            continue;
+        }
+
+        /* struct linux_dirent64: u64 d_ino, s64 d_off, u16 d_reclen, u8 d_type, char d_name[]. */
+        pthread_mutex_lock(&listing->lock);
+        for (long pos = 0; pos < n;) {
+            unsigned short reclen;
+            const char *name = batch + pos + 19;
+            size_t length = strlen(name);
+
+            memcpy(&reclen, batch + pos + 16, sizeof(reclen));
+            if (strcmp(name, ".") != 0 &&
+                dir_reserve((void **)&arena, &arena_capacity, arena_length + length + 1, 1) == 0 &&
+                dir_reserve((void **)&offsets, &offsets_capacity, count + 1, sizeof(size_t)) == 0 &&
+                dir_reserve((void **)&statted, &statted_capacity, count + 1, 1) == 0 &&
+                dir_reserve((void **)&listing->names, &listing->names_capacity, listing->names_length + length + 2,
+                            1) == 0) {
+                memcpy(arena + arena_length, name, length + 1);
+                offsets[count] = arena_length;
+                statted[count] = 0;
+                arena_length += length + 1;
+                count++;
+
+                listing->names[listing->names_length] = batch[pos + 18];
+                memcpy(listing->names + listing->names_length + 1, name, length + 1);
+                listing->names_length += length + 2;
+            }
+            pos += reclen;
+        }
+        pthread_mutex_unlock(&listing->lock);
+        dir_notify(listing);
+    }
+
+    free(batch);
+    free(arena);
+    free(offsets);
+    free(statted);
+    close(listing->fd);
+    close(listing->notify);
+    dir_listing_release(listing);
+    return NULL;
+}
+
+/* The worker has news: append new entries to the buffer and file away stat() results. */
+void dir_wakeup(void) {
+    struct directory *dir = &E.dir;
+    struct dir_listing *listing = dir->listing;
+    char drain[256];
+    char *names;
+    size_t length;
+    struct dir_stat *stats;
+    size_t num_stats;
+    size_t first = E.buf.num_added;
+    size_t count = 0;
+    int done;
+    int error;
+
+    while (read(dir->wakeup, drain, sizeof(drain)) > 0) {
+    }
+
+    /* Take the queues as they are and leave the worker empty ones, so it is never held up while we append. */
+    pthread_mutex_lock(&listing->lock);
+    names = listing->names;
+    length = listing->names_length;
+    listing->names = NULL;
+    listing->names_length = 0;
+    listing->names_capacity = 0;
+    stats = listing->stats;
+    num_stats = listing->num_stats;
+    listing->stats = NULL;
+    listing->num_stats = 0;
+    listing->stats_capacity = 0;
+    done = listing->done;
+    error = listing->error;
+    pthread_mutex_unlock(&listing->lock);
+
+    for (size_t pos = 0; pos < length; pos += strlen(names + pos + 1) + 2) {
+        unsigned char type = (unsigned char)names[pos];
+        const char *name = names + pos + 1;
+
+        if (dir->count == dir->capacity) {
+            if (hp_region_grow(&dir->info_region, (dir->count + 1) * sizeof(struct dir_info)) == -1) {
+                error_handler("mmap");
+            }
+            dir->info = (struct dir_info *)dir->info_region.base;
+            dir->capacity = dir->info_region.size / sizeof(struct dir_info);
+        }
+        memset(&dir->info[dir->count], 0, sizeof(struct dir_info));
+        dir->info[dir->count].type = type;
+        dir->count++;
+
+        buf_add_bytes(name, strlen(name));
+        if (type == DT_DIR) {
+            buf_add_bytes("/", 1);
+        }
+        buf_add_line();
+        count++;
+    }
+    if (count > 0) {
+        buf_append(first, count);
+        E.buf.saved = buf_state(); /* A listing is never "modified". */
+    }
+
+    for (size_t i = 0; i < num_stats; i++) {
+        struct dir_info *info = &dir->info[stats[i].index];
+
+        info->statted = stats[i].ok ? 1 : 2;
+        info->mode = stats[i].mode;
+        info->size = stats[i].size;
+        info->mtime = stats[i].mtime;
+    }
+    free(names);
+    free(stats);
+
+    if (done && !dir->done) {
+        dir->done = 1;
+        if (error != 0) {
+            editor_set_status_message("%s: %s", dir->path, strerror(error));
+        } else {
+            editor_set_status_message("%zu entries", dir->count);
+        }
+    }
+}
+
+/* Ask the worker to stat() rows [lo, hi), the ones on screen. */
+void dir_request_stats(size_t lo, size_t hi) {
+    struct directory *dir = &E.dir;
+
+    if (lo == dir->want_lo && hi == dir->want_hi) {
+        return;
+    }
+    dir->want_lo = lo;
+    dir->want_hi = hi;
+    pthread_mutex_lock(&dir->listing->lock);
+    dir->listing->want_lo = lo;
+    dir->listing->want_hi = hi;
+    pthread_cond_signal(&dir->listing->wake);
+    pthread_mutex_unlock(&dir->listing->lock);
+}
+
+/* Leave the current directory. The worker finishes whatever call it is in and cleans up after itself. */
+void dir_close(void) {
+    struct directory *dir = &E.dir;
+
+    pthread_mutex_lock(&dir->listing->lock);
+    dir->listing->quit = 1;
+    pthread_cond_signal(&dir->listing->wake);
+    pthread_mutex_unlock(&dir->listing->lock);
+    dir_listing_release(dir->listing);
+    dir->listing = NULL;
+
+    watch_remove(dir->wakeup);
+    close(dir->wakeup);
+    free(dir->path);
+    dir->path = NULL;
+    dir->count = 0;
+    dir->active = 0;
+    buf_reset();
+}
+
+/* Start browsing `path`. Returns -1 (with errno set) if it can't be opened as a directory. */
+int dir_open(const char *path) {
+    struct directory *dir = &E.dir;
+    struct dir_listing *listing;
+    pthread_t worker;
+    char *real = realpath(path, NULL);
+    int fds[2];
+    int fd;
+
+    if (real == NULL || (fd = open(real, O_RDONLY | O_DIRECTORY)) == -1) {
+        free(real);
+        return -1;
+    }
+    if (pipe(fds) == -1) {
+        error_handler("pipe");
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+
+    listing = calloc(1, sizeof(*listing));
+    if (listing == NULL) {
+        error_handler("calloc");
+    }
+    pthread_mutex_init(&listing->lock, NULL);
+    pthread_cond_init(&listing->wake, NULL);
+    listing->refs = 2;
+    listing->fd = fd;
+    listing->notify = fds[1];
+
+    dir->active = 1;
+    dir->path = real;
+    dir->listing = listing;
+    dir->wakeup = fds[0];
+    dir->done = 0;
+    dir->count = 0;
+    dir->want_lo = 0;
+    dir->want_hi = 0;
+    watch_add(fds[0], dir_wakeup);
+
+    free(E.doc.filename);
+    E.doc.filename = strdup(real);
+    E.doc.unnamed = 1;
+    E.cx = 0;
+    E.cy = 0;
+    E.rowoff = 0;
+    E.coloff = 0;
+    E.sel_active = 0;
+
+    if (pthread_create(&worker, NULL, dir_worker, listing) != 0) {
+        error_handler("pthread_create");
+    }
+    pthread_detach(worker);
+    return 0;
+}
+
+/* Open the entry on row `line`: descend into a directory, or switch to editing the file. */
+void dir_open_entry(size_t line) {
+    struct directory *dir = &E.dir;
+    struct stat st;
+    const char *s;
+    char *path;
+    size_t length = buf_line_length(line);
+    size_t base = strlen(dir->path);
+    size_t offset = 0;
+    size_t n;
+
+    if (line >= dir->count) {
+        return;
+    }
+    path = malloc(base + length + 2);
+    if (path == NULL) {
+        error_handler("malloc");
+    }
+    memcpy(path, dir->path, base);
+    path[base++] = '/';
+    while ((s = buf_line_span(line, offset, &n)) != NULL) {
+        memcpy(path + base + offset, s, n);
+        offset += n;
+    }
+    if (dir->info[line].type == DT_DIR) {
+        offset--; /* The "/" we added to the name. */
+    }
+    path[base + offset] = '\0';
+
+    if (stat(path, &st) == 0 && S_ISDIR(st.st_mode)) {
+        char *previous = strdup(dir->path);
+
+        dir_close();
+        if (dir_open(path) == -1) {
+            editor_set_status_message("%s: %s", path, strerror(errno));
+            dir_open(previous);
+        }
+        free(previous);
+        free(path);
+        return;
+    }
+
+    editor_switch_file(path, 0);
+    free(path);
+}
+
+/* The columns left of an entry's name: type and permissions, size, and modification time once it has been stat()ed. */
+int dir_format_row(size_t line, char *s, size_t size) {
+    struct dir_info *info = &E.dir.info[line];
+    const char *types = "?pc?d?b?-?l?s???"; /* Indexed by the S_IFMT bits. */
+    const char *rwx = "rwxrwxrwx";
+    char mode[11];
+    char length[16];
+    char date[20];
+
+    if (line >= E.dir.count || info->statted != 1) {
+        return snprintf(s, size, "%*s", DIR_GUTTER_WIDTH, "");
+    }
+    mode[0] = types[(info->mode & S_IFMT) >> 12];
+    for (int i = 0; i < 9; i++) {
+        mode[i + 1] = info->mode & (0400 >> i) ? rwx[i] : '-';
+    }
+    mode[10] = '\0';
+    format_size(length, sizeof(length), (size_t)info->size);
+    strftime(date, sizeof(date), "%Y-%m-%d %H:%M", localtime(&info->mtime));
+
+    return snprintf(s, size, "%s %7s %s ", mode, length, date);
+}
+
+/* ---------------------------------- Tags ---------------------------------- */
+/* Cut the last component off a path, keeping "/" itself. */
+void path_parent(char *path) {
+    char *slash = strrchr(path, '/');
+
+    if (slash == path) {
+        slash[1] = '\0';
+    } else if (slash != NULL) {
+        *slash = '\0';
+    }
+}
+
+/* "dir/name", allocated. */
+char *path_join(const char *dir, const char *name) {
+    char *path = malloc(strlen(dir) + strlen(name) + 2);
+
+    if (path == NULL) {
+        error_handler("malloc");
+    }
+    sprintf(path, "%s%s%s", dir, dir[strlen(dir) - 1] == '/' ? "" : "/", name);
+    return path;
+}
+
+/* The directory of the nearest tags file at or above the document's directory (or the working directory), or NULL. */
+char *tags_locate(void) {
+    char *dir = NULL;
+    struct stat st;
+
+    if (E.dir.active) {
+        dir = strdup(E.dir.path);
+    } else if (E.doc.filename != NULL && !E.doc.unnamed && (dir = realpath(E.doc.filename, NULL)) != NULL) {
+        path_parent(dir);
+    } else {
+        dir = getcwd(NULL, 0);
+    }
+
+    while (dir != NULL) {
+        char *path = path_join(dir, TAGS_FILE);
+        int found = stat(path, &st) == 0 && S_ISREG(st.st_mode);
+
+        free(path);
+        if (found) {
+            return dir;
+        }
+        if (strcmp(dir, "/") == 0) {
+            break;
+        }
+        path_parent(dir);
+    }
+    free(dir);
+    return NULL;
+}
+
+void tags_unload(void) {
+    struct tags *tags = &E.tags;
+
+    if (tags->map != NULL) {
+        munmap(tags->map, tags->size);
+    }
+    free(tags->path);
+    free(tags->dir);
+    tags->map = NULL;
+    tags->size = 0;
+    tags->path = NULL;
+    tags->dir = NULL;
+}
+
+/* Start of the line containing `offset`. */
+size_t tags_line_start(size_t offset) {
+    while (offset > 0 && E.tags.map[offset - 1] != '\n') {
+        offset--;
+    }
+    return offset;
+}
+
+size_t tags_next_line(size_t offset) {
+    const char *newline = memchr(E.tags.map + offset, '\n', E.tags.size - offset);
+
+    return newline != NULL ? (size_t)(newline - E.tags.map) + 1 : E.tags.size;
+}
+
+/* Length of the tag name on the line starting at `offset`. */
+size_t tags_name_length(size_t offset) {
+    size_t n = 0;
+
+    while (offset + n < E.tags.size && E.tags.map[offset + n] != '\t' && E.tags.map[offset + n] != '\n') {
+        n++;
+    }
+    return n;
+}
+
+/*
+Map the nearest tags file, or remap it if ctags has replaced it since. Only the header is read; the kernel is told to
+expect random access so a lookup faults in just the pages the binary search touches. Returns -1 if there is none.
+*/
+int tags_load(void) {
+    struct tags *tags = &E.tags;
+    char *dir = tags_locate();
+    char *path;
+    struct stat st;
+    size_t offset;
+    int fd;
+
+    if (dir == NULL) {
+        editor_set_status_message("No %s file", TAGS_FILE);
+        return -1;
+    }
+    path = path_join(dir, TAGS_FILE);
+    if (stat(path, &st) == 0 && tags->map != NULL && strcmp(path, tags->path) == 0 && st.st_ino == tags->ino &&
+        st.st_mtime == tags->mtime) {
+        free(dir);
+        free(path);
+        return 0;
+    }
+
+    tags_unload();
+    if ((fd = open(path, O_RDONLY)) == -1 || fstat(fd, &st) == -1) {
+        editor_set_status_message("%s: %s", path, strerror(errno));
+        if (fd != -1) {
+            close(fd);
+        }
+        free(dir);
+        free(path);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        editor_set_status_message("%s: empty", path);
+        close(fd);
+        free(dir);
+        free(path);
+        return -1;
+    }
+    tags->map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (tags->map == MAP_FAILED) {
+        tags->map = NULL;
+        editor_set_status_message("%s: %s", path, strerror(errno));
+        free(dir);
+        free(path);
+        return -1;
+    }
+    madvise(tags->map, (size_t)st.st_size, MADV_RANDOM);
+    tags->size = (size_t)st.st_size;
+    tags->path = path;
+    tags->dir = dir;
+    tags->ino = st.st_ino;
+    tags->mtime = st.st_mtime;
+
+    /* Pseudo-tags come first. Without a sort header we can't trust the order and fall back to scanning. */
+    tags->sorted = 0;
+    for (offset = 0; offset < tags->size && tags->map[offset] == '!'; offset = tags_next_line(offset)) {
+        if (tags->size - offset > 19 && memcmp(tags->map + offset, "!_TAG_FILE_SORTED\t", 18) == 0) {
+            tags->sorted = tags->map[offset + 18] - '0';
+        }
+    }
+    if (tags->sorted < 0 || tags->sorted > 2) {
+        tags->sorted = 0;
+    }
+
+    return 0;
+}
+
+/* Compare the tag name on the line at `offset`, cut to `length` bytes, with `key`, in the file's sort order. */
+int tags_compare(size_t offset, const char *key, size_t length) {
+    size_t n = tags_name_length(offset);
+
+    for (size_t i = 0; i < length; i++) {
+        int a;
+        int b = (unsigned char)key[i];
+
+        if (i == n) {
+            return -1;
+        }
+        a = (unsigned char)E.tags.map[offset + i];
+        if (E.tags.sorted == 2) {
+            a = toupper(a);
+            b = toupper(b);
+        }
+        if (a != b) {
+            return a - b;
+        }
+    }
+
+    return 0;
+}
+
+/*
+Offset of the first line whose name, cut to `length` bytes, sorts at or after `key` (with `upper`: after it). Bisects
+byte offsets and backs up to the start of the line each probe lands in. Unsorted files are searched linearly.
+*/
+size_t tags_search(const char *key, size_t length, int upper) {
+    size_t lo = 0;
+    size_t hi = E.tags.size;
+
+    if (E.tags.sorted == 0) {
+        while (lo < hi && (tags_compare(lo, key, length) != 0) != upper) {
+            lo = tags_next_line(lo);
+        }
+        return lo;
+    }
+    while (lo < hi) {
+        size_t line = tags_line_start(lo + (hi - lo) / 2);
+        int c = tags_compare(line, key, length);
+
+        if (c < 0 || (upper && c == 0)) {
+            lo = tags_next_line(line);
+        } else {
+            hi = line;
+        }
+    }
+
+    return lo;
+}
+
+/* Does `key` occur in the name on the line at `offset` as a subsequence? */
+int tags_fuzzy_match(size_t offset, const char *key, size_t length) {
+    size_t n = tags_name_length(offset);
+    size_t k = 0;
+
+    for (size_t i = 0; i < n && k < length; i++) {
+        if (E.tags.map[offset + i] == key[k] ||
+            (E.tags.sorted == 2 && toupper((unsigned char)E.tags.map[offset + i]) == toupper((unsigned char)key[k]))) {
+            k++;
+        }
+    }
+    return k == length;
+}
+
+/* Does a line of text match a tags search pattern (already unescaped, anchors removed)? */
+int tags_pattern_match(const char *line, size_t length, const char *pattern, size_t plength, int start, int end) {
+    if (plength > length) {
+        return 0;
+    }
+    if (start && end) {
+        return plength == length && memcmp(line, pattern, length) == 0;
+    }
+    if (start) {
+        return memcmp(line, pattern, plength) == 0;
+    }
+    if (end) {
+        return memcmp(line + length - plength, pattern, plength) == 0;
+    }
+    return memmem(line, length, pattern, plength) != NULL;
+}
+
+/* First line of `path` (0-based) matching a pattern, searching the buffer if it is the open document. */
+size_t tags_find_line(const char *path, const char *pattern, size_t plength, int start, int end) {
+    size_t found = 0;
+
+    if (editor_is_open_file(path)) {
+        char *text = NULL;
+        size_t capacity = 0;
+
+        doc_index_to(SIZE_MAX);
+        for (size_t line = 0; line < buf_num_lines(); line++) {
+            size_t length = buf_line_copy(line, &text, &capacity);
+
+            if (tags_pattern_match(text, length, pattern, plength, start, end)) {
+                found = line;
+                break;
+            }
+        }
+        free(text);
+    } else {
+        struct stat st;
+        int fd = open(path, O_RDONLY);
+        char *map = MAP_FAILED;
+
+        if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > 0) {
+            map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+        if (map != MAP_FAILED) {
+            size_t size = (size_t)st.st_size;
+            size_t line = 0;
+
+            for (size_t offset = 0; offset < size; line++) {
+                const char *newline = memchr(map + offset, '\n', size - offset);
+                size_t next = newline != NULL ? (size_t)(newline - map) + 1 : size;
+                size_t length = next - offset - (newline != NULL);
+
+                if (length > 0 && map[offset + length - 1] == '\r') {
+                    length--;
+                }
+                if (tags_pattern_match(map + offset, length, pattern, plength, start, end)) {
+                    found = line;
+                    break;
+                }
+                offset = next;
+            }
+            munmap(map, size);
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+
+    return found;
+}
+
+/* Follow the tag on the line at `offset`: `name<TAB>file<TAB>address;"...`, the address a line number or a pattern. */
+void tags_jump(size_t offset) {
+    const char *map = E.tags.map;
+    size_t end = tags_next_line(offset);
+    size_t file = offset + tags_name_length(offset) + 1;
+    size_t address;
+    size_t line = 0;
+    char *name;
+    char *path;
+
+    for (address = file; address < end && map[address] != '\t'; address++) {
+    }
+    if (address + 1 >= end) { /* No tab after the file, or nothing after it: the last line of a cut-off file. */
+        editor_set_status_message("Malformed tag");
+        return;
+    }
+    name = malloc(address - file + 1);
+    if (name == NULL) {
+        error_handler("malloc");
+    }
+    memcpy(name, map + file, address - file);
+    name[address - file] = '\0';
+    path = name[0] == '/' ? strdup(name) : path_join(E.tags.dir, name);
+    free(name);
+    address++;
+
+    if (map[address] >= '0' && map[address] <= '9') {
+        while (address < end && map[address] >= '0' && map[address] <= '9') {
+            line = line * 10 + (map[address++] - '0');
+        }
+        line = line > 0 ? line - 1 : 0;
+    } else if (map[address] == '/' || map[address] == '?') {
+        /* An ex search: /^text$/ with \/ and \\ escaped. */
+        char delimiter = map[address++];
+        char *pattern = malloc(end - address + 1);
+        size_t length = 0;
+        int start = 0;
+        int anchored_end = 0;
+
+        if (pattern == NULL) {
+            error_handler("malloc");
+        }
+        if (address < end && map[address] == '^') {
+            start = 1;
+            address++;
+        }
+        while (address < end && map[address] != delimiter && map[address] != '\n') {
+            if (map[address] == '\\' && address + 1 < end &&
+                (map[address + 1] == delimiter || map[address + 1] == '\\')) {
+                address++;
+            }
+            pattern[length++] = map[address++];
+        }
+        if (length > 0 && pattern[length - 1] == '$') {
+            anchored_end = 1;
+            length--;
+        }
+        line = tags_find_line(path, pattern, length, start, anchored_end);
+        free(pattern);
+    }
+
+    editor_goto_location(path, line, 0);
+    free(path);
+}
+
+/* Jump to the definition of tag `name`. */
+void tags_goto(const char *name) {
+    size_t length = strlen(name);
+    size_t offset;
+    size_t count = 0;
+
+    if (length == 0 || tags_load() == -1) {
+        return;
+    }
+    offset = tags_search(name, length, 0);
+    for (size_t o = offset; o < E.tags.size && tags_compare(o, name, length) == 0; o = tags_next_line(o)) {
+        if (tags_name_length(o) == length) {
+            if (count++ == 0) {
+                offset = o;
+            }
+        } else if (E.tags.sorted != 0) {
+            break;
+        }
+    }
+    if (count == 0) {
+        editor_set_status_message("Tag not found: %s", name);
+        return;
+    }
+    if (count > 1) {
+        editor_set_status_message("%s: first of %zu definitions", name, count);
+    }
+    tags_jump(offset);
+}
+
+/* Is the name on the line at `offset` already among the candidates? Tags with several definitions repeat. */
+int tags_listed(const size_t *candidates, size_t count, size_t offset) {
+    size_t length = tags_name_length(offset);
+
+    for (size_t i = 0; i < count; i++) {
+        if (tags_name_length(candidates[i]) == length &&
+            memcmp(E.tags.map + candidates[i], E.tags.map + offset, length) == 0) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+Completion for the tag prompt. Names starting with what has been typed are found with two binary searches (first and
+last match), and Tab extends the text to their longest common prefix. If nothing starts with it, names that contain
+the typed characters in order and start with the same one are offered instead, scanning at most TAGS_FUZZY_BUDGET
+bytes of the file.
+*/
+void tags_complete(int apply) {
+    struct prompt *p = &E.prompt;
+    size_t candidates[TAGS_MAX_CANDIDATES];
+    size_t count = 0;
+    size_t from;
+    size_t to;
+    size_t last = 0;
+    int more = 0;
+    int fuzzy = 0;
+    int n;
+
+    p->hint[0] = '\0';
+    if (p->length == 0 || tags_load() == -1) {
+        return;
+    }
+
+    from = tags_search(p->text, p->length, 0);
+    to = E.tags.sorted != 0 ? tags_search(p->text, p->length, 1) : E.tags.size;
+    for (size_t o = from; o < to; o = tags_next_line(o)) {
+        if (E.tags.map[o] == '!' || tags_compare(o, p->text, p->length) != 0) {
+            continue;
+        }
+        last = o;
+        if (tags_listed(candidates, count, o)) {
+            continue;
+        }
+        if (count == TAGS_MAX_CANDIDATES) {
+            more = 1;
+            if (E.tags.sorted != 0) {
+                last = tags_line_start(to - 1);
+                break;
+            }
+            continue;
+        }
+        candidates[count++] = o;
+    }
+
+    if (count == 0) {
+        size_t budget = TAGS_FUZZY_BUDGET;
+
+        fuzzy = 1;
+        from = tags_search(p->text, 1, 0);
+        to = E.tags.sorted != 0 ? tags_search(p->text, 1, 1) : E.tags.size;
+        for (size_t o = from; o < to && budget > 0; o = tags_next_line(o)) {
+            size_t length = tags_next_line(o) - o;
+
+            budget = budget > length ? budget - length : 0;
+            if (E.tags.map[o] == '!' || tags_compare(o, p->text, 1) != 0 || !tags_fuzzy_match(o, p->text, p->length)) {
+                continue;
+            }
+            if (tags_listed(candidates, count, o)) {
+                continue;
+            }
+            if (count == TAGS_MAX_CANDIDATES) {
+                more = 1;
+                break;
+            }
+            candidates[count++] = o;
+        }
+    }
+
+    if (apply && count > 0) {
+        size_t a = candidates[0];
+        size_t b = fuzzy ? candidates[0] : last;
+        size_t length = 0;
+
+        /* Sorted order puts the longest common prefix of all matches in common between the first and the last. */
+        if (!fuzzy && E.tags.sorted == 0) {
+            b = candidates[count - 1];
+        }
+        if (!fuzzy || count == 1) {
+            while (length < tags_name_length(a) && length < tags_name_length(b) && length < PROMPT_MAX - 1 &&
+                   E.tags.map[a + length] == E.tags.map[b + length]) {
+                length++;
+            }
+            if (length >= p->length || fuzzy) {
+                memcpy(p->text, E.tags.map + a, length);
+                p->length = length;
+                p->text[length] = '\0';
+            }
+        }
+    }
+
+    n = snprintf(p->hint, sizeof(p->hint), count == 0 ? "  [no match]" : fuzzy ? "  {" : "  [");
+    for (size_t i = 0; i < count && n < (int)sizeof(p->hint); i++) {
+        n += snprintf(p->hint + n, sizeof(p->hint) - n, "%s%.*s", i > 0 ? " " : "",
+                      (int)tags_name_length(candidates[i]), E.tags.map + candidates[i]);
+    }
+    if (count > 0 && n < (int)sizeof(p->hint)) {
+        snprintf(p->hint + n, sizeof(p->hint) - n, "%s%s", more ? " ..." : "", fuzzy ? "}" : "]");
+    }
+}
+
+void tags_regenerate(void);
+
+/* ctags has finished (or written something, which we don't show). */
+void tags_regenerated(void) {
+    struct tags *tags = &E.tags;
+    char drain[4096];
+    ssize_t n;
+    int status;
+
+    while ((n = read(tags->regenerate_fd, drain, sizeof(drain))) > 0) {
+    }
+    if (n == -1 && (errno == EAGAIN || errno == EINTR)) {
+        return;
+    }
+    watch_remove(tags->regenerate_fd);
+    close(tags->regenerate_fd);
+    waitpid(tags->regenerate_pid, &status, 0);
+    tags->regenerate_pid = 0;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        editor_set_status_message("Regenerating %s failed", TAGS_FILE);
+    } else if (tags->regenerate_again) {
+        tags_regenerate();
+    }
+}
+
+/* Sources have been saved: if the project has a tags file, rebuild it in the background. The next lookup remaps it. */
+void tags_regenerate(void) {
+    struct tags *tags = &E.tags;
+    char *dir;
+
+    if (tags->regenerate_pid != 0) {
+        tags->regenerate_again = 1;
+        return;
+    }
+    tags->regenerate_again = 0;
+    if ((dir = tags_locate()) == NULL) {
+        return;
+    }
+    tags->regenerate_pid = spawn_shell(dir, TAGS_REGENERATE, NULL, &tags->regenerate_fd);
+    free(dir);
+    if (tags->regenerate_pid == -1) {
+        tags->regenerate_pid = 0;
+        return;
+    }
+    watch_add(tags->regenerate_fd, tags_regenerated);
+}
+
+/* ---------------------------------- Jobs ---------------------------------- */
+void job_show_panel(int show) {
+    int rows = E.rows / 3 < JOB_PANEL_ROWS ? E.rows / 3 : JOB_PANEL_ROWS;
+
+    E.job.show_panel = show && rows > 1;
+    E.screen_rows = E.rows - 1 - (E.job.show_panel ? rows : 0);
+    if (E.cy >= E.rowoff + E.screen_rows) {
+        E.rowoff = E.cy - E.screen_rows + 1;
+    }
+}
+
+/* Keep the last JOB_TAIL_SIZE bytes of output for the panel. */
+void job_keep_tail(const char *data, size_t length) {
+    struct job *job = &E.job;
+
+    if (length >= JOB_TAIL_SIZE) {
+        memcpy(job->tail, data + length - JOB_TAIL_SIZE, JOB_TAIL_SIZE);
+        job->tail_length = JOB_TAIL_SIZE;
+        return;
+    }
+    if (job->tail_length + length > JOB_TAIL_SIZE) {
+        size_t drop = job->tail_length + length - JOB_TAIL_SIZE;
+
+        memmove(job->tail, job->tail + drop, job->tail_length - drop);
+        job->tail_length -= drop;
+    }
+    memcpy(job->tail + job->tail_length, data, length);
+    job->tail_length += length;
+}
+
+/* Record the line at `offset` in the log if it starts `path:line:` or `path:line:col:` (or ends after the numbers). */
+void job_parse_line(const char *text, size_t length, off_t offset) {
+    struct job *job = &E.job;
+    struct diagnostic *d;
+    unsigned long line = 0;
+    unsigned long col = 0;
+    size_t i = 0;
+    size_t path_length;
+
+    if (length > 0 && text[length - 1] == '\r') {
+        length--;
+    }
+    while (i < length && text[i] != ':' && text[i] != ' ' && text[i] != '\t') {
+        i++;
+    }
+    if (i == 0 || i + 1 >= length || text[i] != ':' || !isdigit((unsigned char)text[i + 1])) {
+        return;
+    }
+    path_length = i++;
+    while (i < length && isdigit((unsigned char)text[i])) {
+        line = line < 100000000 ? line * 10 + (text[i] - '0') : line;
+        i++;
+    }
+    if (i + 1 < length && text[i] == ':' && isdigit((unsigned char)text[i + 1])) {
+        for (i++; i < length && isdigit((unsigned char)text[i]); i++) {
+            col = col < 100000000 ? col * 10 + (text[i] - '0') : col;
+        }
+    }
+    if ((i < length && text[i] != ':') || line == 0) {
+        return;
+    }
+
+    if (job->count == JOB_DIAGNOSTICS_MAX) {
+        job->dropped++;
+        return;
+    }
+    if (job->count == job->capacity) {
+        job->capacity = job->capacity ? job->capacity * 2 : 64;
+        if (job->capacity > JOB_DIAGNOSTICS_MAX) {
+            job->capacity = JOB_DIAGNOSTICS_MAX;
+        }
+        job->diagnostics = realloc(job->diagnostics, job->capacity * sizeof(*job->diagnostics));
+        if (job->diagnostics == NULL) {
+            error_handler("realloc");
+        }
+    }
+    d = &job->diagnostics[job->count++];
+    d->offset = offset;
+    d->path_length = path_length;
+    d->line = line;
+    d->col = col;
+}
+
+/* Take the next `length` bytes of output: split them into lines and parse each one as it completes. */
+void job_feed(const char *data, size_t length) {
+    struct job *job = &E.job;
+    size_t i = 0;
+
+    job_keep_tail(data, length);
+    while (i < length) {
+        const char *newline = memchr(data + i, '\n', length - i);
+        size_t end = newline != NULL ? (size_t)(newline - data) : length;
+        size_t n = end - i;
+
+        /* Past JOB_LINE_MAX a line is only counted: whatever a diagnostic says about itself is at the start. */
+        if (n > JOB_LINE_MAX - job->partial_length) {
+            n = JOB_LINE_MAX - job->partial_length;
+        }
+        memcpy(job->partial + job->partial_length, data + i, n);
+        job->partial_length += n;
+        if (newline == NULL) {
+            break;
+        }
+        job_parse_line(job->partial, job->partial_length, job->partial_offset);
+        job->partial_length = 0;
+        job->partial_offset = job->log_size + end + 1;
+        i = end + 1;
+    }
+    job->log_size += length;
+}
+
+/* The output has ended: an unterminated last line still counts. */
+void job_flush(void) {
+    struct job *job = &E.job;
+
+    if (job->partial_length > 0) {
+        job_parse_line(job->partial, job->partial_length, job->partial_offset);
+        job->partial_length = 0;
+        job->partial_offset = job->log_size;
+    }
+}
+
+/* Forget the last job's output and diagnostics. */
+void job_reset(void) {
+    struct job *job = &E.job;
+
+    if (job->log != -1) {
+        close(job->log);
+        job->log = -1;
+    }
+    free(job->dir);
+    free(job->diagnostics);
+    job->dir = NULL;
+    job->diagnostics = NULL;
+    job->count = job->capacity = job->dropped = 0;
+    job->current = SIZE_MAX;
+    job->log_size = job->partial_offset = 0;
+    job->reload_offset = -1;
+    job->partial_length = job->tail_length = 0;
+    job->status = 0;
+}
+
+void job_finished(void) {
+    struct job *job = &E.job;
+    const char *name = job->command;
+
+    watch_remove(job->fd);
+    timer_stop(&job->poll_timer);
+    close(job->fd);
+    job->fd = -1;
+    job_flush();
+    while (waitpid(job->pid, &job->status, 0) == -1 && errno == EINTR) {
+    }
+    job->pid = 0;
+
+    if (WIFSIGNALED(job->status)) {
+        editor_set_status_message("%.40s: killed by signal %d", name, WTERMSIG(job->status));
+    } else {
+        editor_set_status_message("%.40s: exit %d, %zu diagnostics", name, WEXITSTATUS(job->status),
+                                  job->count + job->dropped);
+    }
+}
+
+void job_output(void);
+
+void job_rearm(void) {
+    if (E.job.fd != -1) {
+        watch_add(E.job.fd, job_output);
+    }
+}
+
+/*
+The job's pipe is readable. Drain it into the log, JOB_READ_BUDGET bytes per wakeup at most so keys still get their
+turn while it floods. Once it is empty it is left alone for JOB_POLL_INTERVAL ms (the enlarged pipe buffers the job in
+the meantime), so output arriving a line at a time redraws the screen a bounded number of times a second.
+*/
+void job_output(void) {
+    struct job *job = &E.job;
+    char buffer[JOB_READ_SIZE];
+    size_t total = 0;
+    ssize_t n;
+
+    while (total < JOB_READ_BUDGET) {
+        n = read(job->fd, buffer, sizeof(buffer));
+        if (n > 0) {
+            for (ssize_t written = 0, w; written < n; written += w) {
+                if ((w = pwrite(job->log, buffer + written, n - written, job->log_size + written)) <= 0) {
+                    break; /* Disk full: the panel and diagnostics keep going, jumps past here won't read back. */
+                }
+            }
+            job_feed(buffer, (size_t)n);
+            total += (size_t)n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && errno == EAGAIN) {
+            watch_remove(job->fd);
+            timer_start(&job->poll_timer, JOB_POLL_INTERVAL, job_rearm);
+            return;
+        } else {
+            job_finished();
+            return;
+        }
+    }
+}
+
+/*
+Replace the last job's output with a new, empty log for `command`. Returns -1, with the status line saying why, if the
+log couldn't be created.
+*/
+int job_open_log(const char *command) {
+    struct job *job = &E.job;
+    const char *tmp = getenv("TMPDIR");
+    char *path;
+    int log;
+
+    path = path_join(tmp != NULL && tmp[0] != '\0' ? tmp : "/tmp", "kilo-job-XXXXXX");
+    if ((log = mkostemp(path, O_CLOEXEC)) == -1) {
+        editor_set_status_message("Can't create a job log: %s", strerror(errno));
+        free(path);
+        return -1;
+    }
+    unlink(path);
+    free(path);
+
+    job_reset();
+    job->log = log;
+    job->dir = getcwd(NULL, 0);
+    snprintf(job->command, sizeof(job->command), "%s", command);
+    return 0;
+}
+
+/*
+Show `text` in the output panel as if a finished job called `title` had printed it, so M-n steps through the
+`file:line:` locations in it.
+*/
+void job_show_text(const char *title, const char *text, size_t length) {
+    struct job *job = &E.job;
+
+    if (job->pid != 0 || job_open_log(title) == -1) {
+        return;
+    }
+    for (size_t written = 0; written < length;) {
+        ssize_t n = pwrite(job->log, text + written, length - written, written);
+
+        if (n <= 0) {
+            break; /* As in job_output(): the panel and diagnostics still work. */
+        }
+        written += n;
+    }
+    job_feed(text, length);
+    job_flush();
+    job_show_panel(1);
+}
+
+/*
+Start `command` through the shell in the working directory, replacing the last job. Only one runs at a time. Its
+output goes to a log in $TMPDIR that is unlinked at once, so nothing is left behind however kilo ends.
+*/
+void job_start(const char *command) {
+    struct job *job = &E.job;
+
+    if (job->pid != 0) {
+        editor_set_status_message("A job is already running (C-x k kills it)");
+        return;
+    }
+    if (command[0] == '\0' || job_open_log(command) == -1) {
+        return;
+    }
+    job->pid = spawn_shell(NULL, command, NULL, &job->fd);
+    if (job->pid == -1) {
+        job->pid = 0;
+        job->fd = -1;
+        editor_set_status_message("Can't start %s: %s", command, strerror(errno));
+        return;
+    }
+    fcntl(job->fd, F_SETPIPE_SZ, JOB_PIPE_SIZE);
+    job->started = time(NULL);
+    watch_add(job->fd, job_output);
+    job_show_panel(1);
+}
+
+/* Stop the running job, and anything it started: it leads its own process group. */
+void job_kill(void) {
+    if (E.job.pid == 0) {
+        editor_set_status_message("No job running");
+        return;
+    }
+    kill(-E.job.pid, SIGTERM);
+}
+
+void job_exit(void) {
+    if (E.job.pid != 0) {
+        kill(-E.job.pid, SIGTERM);
+    }
+}
+
+/*
+Called with 1 just before editor_switch_file() exec()s, and with 0 if that failed. The new kilo inherits the pipe and
+the log (their close-on-exec flags are cleared for the exec) and finds them through JOB_HANDOFF.
+*/
+void job_handoff(int handing_off) {
+    struct job *job = &E.job;
+    char *value;
+    size_t size;
+
+    if (job->log == -1) {
+        return;
+    }
+    if (!handing_off) {
+        unsetenv(JOB_HANDOFF);
+        fcntl(job->log, F_SETFD, FD_CLOEXEC);
+        if (job->fd != -1) {
+            fcntl(job->fd, F_SETFD, FD_CLOEXEC);
+        }
+        return;
+    }
+
+    size = strlen(job->dir != NULL ? job->dir : ".") + strlen(job->command) + 64;
+    value = malloc(size);
+    if (value == NULL) {
+        error_handler("malloc");
+    }
+    snprintf(value, size, "%ld %d %d %zu %d\t%s\t%s", (long)job->pid, job->fd, job->log,
+             job->current == SIZE_MAX ? 0 : job->current + 1, job->status, job->dir != NULL ? job->dir : ".",
+             job->command);
+    setenv(JOB_HANDOFF, value, 1);
+    free(value);
+    fcntl(job->log, F_SETFD, 0);
+    if (job->fd != -1) {
+        fcntl(job->fd, F_SETFD, 0);
+    }
+}
+
+/*
+Read the log back in after a handoff, a budget's worth per wakeup (a regular file always polls readable). The job's
+pipe isn't watched until this catches up, so nothing is appended to the log behind the reader's back.
+*/
+void job_reload(void) {
+    struct job *job = &E.job;
+    char buffer[JOB_READ_SIZE];
+    size_t total = 0;
+    ssize_t n = 0;
+
+    while (total < JOB_READ_BUDGET && (n = pread(job->log, buffer, sizeof(buffer), job->reload_offset)) > 0) {
+        job_feed(buffer, (size_t)n);
+        job->reload_offset += n;
+        total += (size_t)n;
+    }
+    if (n > 0 || (n == -1 && errno == EINTR)) {
+        return;
+    }
+    watch_remove(job->log);
+    job->reload_offset = -1;
+    if (job->fd != -1) {
+        job_rearm();
+    } else {
+        job_flush();
+    }
+}
+
+/* Pick up a job handed over by the kilo that exec()ed us. */
+void job_resume(void) {
+    struct job *job = &E.job;
+    const char *value = getenv(JOB_HANDOFF);
+    const char *dir;
+    const char *command;
+    long pid;
+    size_t current;
+
+    if (value == NULL) {
+        return;
+    }
+    if (sscanf(value, "%ld %d %d %zu %d", &pid, &job->fd, &job->log, &current, &job->status) != 5 ||
+        (dir = strchr(value, '\t')) == NULL || (command = strchr(dir + 1, '\t')) == NULL) {
+        job->fd = job->log = -1;
+        unsetenv(JOB_HANDOFF);
+        return;
+    }
+    job->pid = (pid_t)pid;
+    job->dir = strndup(dir + 1, command - dir - 1);
+    snprintf(job->command, sizeof(job->command), "%s", command + 1);
+    job->current = current > 0 ? current - 1 : SIZE_MAX;
+    unsetenv(JOB_HANDOFF);
+
+    fcntl(job->log, F_SETFD, FD_CLOEXEC);
+    if (job->fd != -1) {
+        fcntl(job->fd, F_SETFD, FD_CLOEXEC);
+    }
+    job->reload_offset = 0;
+    watch_add(job->log, job_reload);
+}
+
+/* Go `step` diagnostics forward or back. Each one's text is read back from the log. */
+void job_next_diagnostic(int step) {
+    struct job *job = &E.job;
+    struct diagnostic *d;
+    char text[JOB_LINE_MAX + 1];
+    char *newline;
+    char *path;
+    ssize_t n;
+
+    if (job->count == 0) {
+        editor_set_status_message(job->log == -1 ? "No job has run" : "No diagnostics");
+        return;
+    }
+    if (job->current == SIZE_MAX || job->current >= job->count) {
+        job->current = step > 0 ? 0 : job->count - 1;
+    } else if ((step > 0 && job->current + 1 >= job->count) || (step < 0 && job->current == 0)) {
+        editor_set_status_message("No more diagnostics%s", job->pid != 0 ? " yet" : "");
+        return;
+    } else {
+        job->current += step;
+    }
+
+    d = &job->diagnostics[job->current];
+    n = pread(job->log, text, JOB_LINE_MAX, d->offset);
+    if (n < (ssize_t)d->path_length) {
+        editor_set_status_message("Can't read the job log");
+        return;
+    }
+    text[n] = '\0';
+    if ((newline = strchr(text, '\n')) != NULL) {
+        *newline = '\0';
+    }
+    editor_set_status_message("[%zu/%zu] %s", job->current + 1, job->count, text);
+    text[d->path_length] = '\0';
+    path = text[0] == '/' ? strdup(text) : path_join(job->dir != NULL ? job->dir : ".", text);
+    editor_goto_location(path, d->line - 1, d->col > 0 ? d->col - 1 : 0);
+    free(path);
+}
+
+/* The panel's header, then the last lines of output. Control characters are shown as '?'. */
+int job_format_panel_row(int row, int rows, char *out, int width) {
+    struct job *job = &E.job;
+    size_t end = job->tail_length;
+    size_t start;
+    int length = 0;
+
+    if (width <= 0) {
+        return 0;
+    }
+    if (row == 0) {
+        length = snprintf(out, width, "-- %.60s: %s, %zu diagnostics%s --", job->command[0] ? job->command : "job",
+                          job->pid != 0 ? "running" : WIFSIGNALED(job->status) ? "killed" :
+                          WEXITSTATUS(job->status) == 0 ? "done" : "failed", job->count + job->dropped,
+                          job->reload_offset != -1 ? " (loading)" : "");
+        return length < width ? length : width - 1;
+    }
+
+    /* Walk back from the end of the tail to the start of output line `row` of the rows - 1 shown. */
+    if (end > 0 && job->tail[end - 1] == '\n') {
+        end--;
+    }
+    for (int back = rows - 1 - row; ; back--) {
+        start = end;
+        while (start > 0 && job->tail[start - 1] != '\n') {
+            start--;
+        }
+        if (back == 0) {
+            break;
+        }
+        if (start == 0) {
+            return 0;
+        }
+        end = start - 1;
+    }
+    for (size_t i = start; i < end && length < width; i++) {
+        unsigned char c = job->tail[i];
+
+        if (c == '\r' && i + 1 == end) {
+            break;
+        }
+        out[length++] = c == '\t' ? ' ' : iscntrl(c) ? '?' : (char)c;
+    }
+
+    return length;
+}
+
+/* -------------------------------- Sessions -------------------------------- */
+/*
+`--record file` logs every read from the terminal with the ms since the start, and every change of window size, after
+a header naming the file that was open: its path, size, and a hash of its first and last SESSION_SAMPLE bytes. Someone
+who hit something slow can send that along. `--replay file` feeds the log back in as though it were being typed, at
+the pace it was recorded or, with --fast, skipping the time kilo sat waiting for the next key (time a timer is waiting
+for still passes, so background work lands where it did). Meanwhile the bottom line shows how long each input took to
+reach the screen, and a summary is printed when the log runs out or a key is pressed. Saving is skipped in a replay.
+*/
+
+/* Milliseconds, finer than now_ms(), for timing frames. */
+double session_clock(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* A hash of the size and the first and last SESSION_SAMPLE bytes of `fd`: enough to tell the file has changed. */
+uint64_t session_sample_hash(int fd, off_t size) {
+    char *sample = malloc(SESSION_SAMPLE);
+    uint64_t hash = hash_line((const char *)&size, sizeof(size));
+    off_t offsets[2] = {0, size > SESSION_SAMPLE ? size - SESSION_SAMPLE : 0};
+
+    if (sample == NULL) {
+        error_handler("malloc");
+    }
+    for (int i = 0; i < 2; i++) {
+        ssize_t n = pread(fd, sample, SESSION_SAMPLE, offsets[i]);
+
+        hash = hash_concat(hash, hash_line(sample, n > 0 ? (size_t)n : 0), 1);
+    }
+    free(sample);
+    return hash;
+}
+
+/* Append a record to the log being written. A failed write ends the recording rather than the session. */
+void session_write(int type, const void *data, size_t length) {
+    struct session *s = &E.session;
+    struct session_record record;
+    struct iovec iov[2];
+
+    if (s->record_fd == -1) {
+        return;
+    }
+    record.ms = (uint32_t)(now_ms() - s->start);
+    record.type = (uint16_t)type;
+    record.length = (uint16_t)length;
+    iov[0].iov_base = &record;
+    iov[0].iov_len = sizeof(record);
+    iov[1].iov_base = (void *)data;
+    iov[1].iov_len = length;
+    if (writev(s->record_fd, iov, 2) != (ssize_t)(sizeof(record) + length)) {
+        close(s->record_fd);
+        s->record_fd = -1;
+        editor_set_status_message("Recording stopped: %s", strerror(errno));
+    }
+}
+
+/* The record at s->pos, or NULL once the log has run out (a record cut short counts as the end). */
+const struct session_record *session_next(void) {
+    struct session *s = &E.session;
+    struct session_record *record = (struct session_record *)(s->log + s->pos);
+
+    if (s->pos + sizeof(*record) > s->length || s->pos + sizeof(*record) + record->length > s->length) {
+        return NULL;
+    }
+    return record;
+}
+
+/* At exit, after restore_term() (registered later, so run earlier): how the replay went. */
+void session_report(void) {
+    struct session *s = &E.session;
+
+    fprintf(stderr, "kilo: replayed %zu inputs in %.0fms%s: input to screen avg %.2fms, max %.2fms, %zu over %dms\n",
+            s->inputs, session_clock() - s->replay_started, session_next() != NULL ? " (stopped early)" : "",
+            s->frames ? s->total_ms / s->frames : 0.0, s->max_ms, s->slow, SESSION_SLOW_MS);
+}
+
+/* Start `--record path`, for the file `filename` (NULL if none) open on `fd` (-1 if none). Exits if it can't. */
+void session_record(const char *path, const char *filename, int fd) {
+    struct session *s = &E.session;
+    struct session_header header;
+    char *real = filename != NULL ? realpath(filename, NULL) : NULL;
+    const char *name = real != NULL ? real : filename != NULL ? filename : "";
+    uint16_t size[2] = {(uint16_t)E.rows, (uint16_t)E.cols};
+    struct stat st;
+
+    s->record_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (s->record_fd == -1) {
+        perror(path);
+        exit(1);
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SESSION_MAGIC, sizeof(header.magic));
+    header.version = SESSION_VERSION;
+    header.read_only = E.read_only;
+    if (fd != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        header.size = st.st_size;
+        header.sample_hash = session_sample_hash(fd, st.st_size);
+    }
+    header.path_length = strlen(name);
+    if (write(s->record_fd, &header, sizeof(header)) != sizeof(header) ||
+        write(s->record_fd, name, header.path_length) != (ssize_t)header.path_length) {
+        perror(path);
+        exit(1);
+    }
+    free(real);
+    s->start = now_ms();
+    session_write(SESSION_RESIZE, size, sizeof(size));
+}
+
+/*
+Load `--replay path`. Returns the file the session had open (allocated; "" for none), with the header in `*header`.
+Exits if the log can't be read.
+*/
+char *session_load(const char *path, struct session_header *header) {
+    struct session *s = &E.session;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    char *name;
+
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        perror(path);
+        exit(1);
+    }
+    s->log = malloc(st.st_size > 0 ? st.st_size : 1);
+    if (s->log == NULL) {
+        error_handler("malloc");
+    }
+    for (s->length = 0; s->length < (size_t)st.st_size;) {
+        ssize_t n = read(fd, s->log + s->length, st.st_size - s->length);
+
+        if (n <= 0) {
+            perror(path);
+            exit(1);
+        }
+        s->length += n;
+    }
+    close(fd);
+    memcpy(header, s->log, s->length >= sizeof(*header) ? sizeof(*header) : 0);
+    if (s->length < sizeof(*header) || memcmp(header->magic, SESSION_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != SESSION_VERSION || s->length - sizeof(*header) < header->path_length) {
+        fprintf(stderr, "%s: not a kilo session (or from another version)\n", path);
+        exit(1);
+    }
+    name = strndup(s->log + sizeof(*header), header->path_length);
+    if (name == NULL) {
+        error_handler("strndup");
+    }
+    s->pos = sizeof(*header) + header->path_length;
+    s->replaying = 1;
+    atexit(session_report);
+    return name;
+}
+
+/* Apply the window size a resize record (or the terminal) gives. */
+void session_resize(int rows, int cols) {
+    if (rows < 3 || cols < 1) {
+        return;
+    }
+    E.rows = rows;
+    E.cols = cols;
+    job_show_panel(E.job.show_panel); /* Works out screen_rows again. */
+    editor_clamp_cursor();
+}
+
+/*
+Replaying: how long a wait of up to `timeout_ms` (-1: no limit) should really take, given when the next input is due.
+--fast skips a wait that would only have ended with that input.
+*/
+int session_timeout(int timeout_ms) {
+    struct session *s = &E.session;
+    const struct session_record *record = session_next();
+    long long left;
+
+    if (record == NULL) {
+        return timeout_ms;
+    }
+    left = s->start + record->ms - now_ms();
+    if (left <= 0) {
+        return 0;
+    }
+    if (s->fast && (timeout_ms == -1 || timeout_ms >= left)) {
+        s->start -= left;
+        return 0;
+    }
+    return timeout_ms == -1 || left < timeout_ms ? (int)left : timeout_ms;
+}
+
+/* Begin the replay: the window takes the size it had when the recording started. */
+void session_replay_start(void) {
+    struct session *s = &E.session;
+    const struct session_record *record;
+
+    s->start = now_ms();
+    s->replay_started = session_clock();
+    while ((record = session_next()) != NULL && record->type == SESSION_RESIZE && record->ms == 0) {
+        uint16_t size[2];
+
+        if (record->length == sizeof(size)) {
+            memcpy(size, record + 1, sizeof(size));
+            session_resize(size[0], size[1]);
+        }
+        s->pos += sizeof(*record) + record->length;
+    }
+}
+
+/* Replaying: is the next record due? */
+int session_due(void) {
+    const struct session_record *record = session_next();
+
+    return record != NULL && now_ms() >= E.session.start + record->ms;
+}
+
+/* Take up to `size` bytes of recorded input that are due, applying resizes on the way. Returns 0 if none are. */
+ssize_t session_replay_read(char *buf, size_t size) {
+    struct session *s = &E.session;
+    const struct session_record *record;
+
+    while (session_due() && (record = session_next()) != NULL) {
+        const char *data = (const char *)(record + 1);
+        size_t n = record->length - s->offset;
+
+        if (record->type == SESSION_RESIZE && record->length == 2 * sizeof(uint16_t)) {
+            uint16_t size[2];
+
+            memcpy(size, data, sizeof(size));
+            session_resize(size[0], size[1]);
+        } else if (record->type == SESSION_INPUT) {
+            n = n < size ? n : size;
+            memcpy(buf, data + s->offset, n);
+            if ((s->offset += n) < record->length) {
+                return (ssize_t)n; /* The rest next time, when there is room. */
+            }
+            s->offset = 0;
+            s->pos += sizeof(*record) + record->length;
+            if (s->input_at == 0) {
+                s->input_at = session_clock();
+            }
+            s->inputs++;
+            return (ssize_t)n;
+        }
+        s->pos += sizeof(*record) + record->length;
+    }
+    return 0;
+}
+
+/*
+Read what the terminal has sent (it has been polled readable), or while replaying whatever the log has due; record it
+if recording. Every read of keys goes through here, so a session holds the C-g that stopped a filter too.
+*/
+ssize_t session_read(char *buf, size_t size) {
+    ssize_t n;
+
+    if (E.session.replaying) {
+        return session_replay_read(buf, size);
+    }
+    n = read(STDIN_FILENO, buf, size);
+    if (n > 0) {
+        session_write(SESSION_INPUT, buf, n < 65535 ? (size_t)n : 65535);
+    }
+    return n;
+}
+
+/* The screen has been drawn: if replayed input was waiting for that, note how long it took. */
+void session_frame_done(void) {
+    struct session *s = &E.session;
+    double latency;
+
+    if (!s->replaying || s->input_at == 0) {
+        return;
+    }
+    latency = session_clock() - s->input_at;
+    s->input_at = 0;
+    s->frames++;
+    s->last_ms = latency;
+    s->total_ms += latency;
+    s->max_ms = latency > s->max_ms ? latency : s->max_ms;
+    s->slow += latency > SESSION_SLOW_MS;
+    if (session_next() == NULL) {
+        exit(0);
+    }
+}
+
+/* The replay's part of the bottom line. */
+int session_hud(char *out, size_t size) {
+    struct session *s = &E.session;
+
+    if (!s->replaying) {
+        return 0;
+    }
+    return snprintf(out, size, "replay %zu%% | %.1fms, avg %.1fms, max %.1fms, %zu slow | ",
+                    s->length > 0 ? s->pos * 100 / s->length : 100, s->last_ms,
+                    s->frames ? s->total_ms / s->frames : 0.0, s->max_ms, s->slow);
+}
+
+/* Between frames: pick up a new window size, and end a replay whose log has run out. */
+void session_check(void) {
+    struct session *s = &E.session;
+
+    if (E.resized) {
+        int rows;
+        int cols;
+
+        E.resized = 0;
+        if (!s->replaying && get_window_size(&rows, &cols) == 0 && (rows != E.rows || cols != E.cols)) {
+            uint16_t size[2] = {(uint16_t)rows, (uint16_t)cols};
+
+            session_resize(rows, cols);
+            session_write(SESSION_RESIZE, size, sizeof(size));
+        }
+    }
+    if (s->replaying && session_next() == NULL && s->input_at == 0) {
+        exit(0);
+    }
+}
+
+void sigwinch_handler(int sig) {
+    (void)sig;
+    E.resized = 1;
+}
+
+void init_sigwinch(void) {
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = sigwinch_handler;
+    sa.sa_flags = SA_RESTART; /* poll() is never restarted, so the main loop still wakes up to redraw. */
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGWINCH, &sa, NULL) == -1) {
+        error_handler("sigaction");
+    }
+}
+
+/* ------------------------------ Append Buffer ----------------------------- */
+#define ABUF_INIT {NULL, 0, 0} // constructor for append buffer
+
+void ab_append(struct abuf *ab, const char *s, int length) {
+    /* Grow geometrically so a buffer that is reused every frame stops allocating after the first few. */
+    if (ab->length + length > ab->capacity) {
+        uint capacity = ab->capacity ? ab->capacity : 1024;
+        char *new_buff;
+
+        while (capacity < ab->length + length) {
+            capacity *= 2;
+        }
+        new_buff = realloc(ab->str, capacity);
+        if (new_buff == NULL) {
+            return;
+        }
+        ab->str = new_buff;
+        ab->capacity = capacity;
     }
 
     /* make sure we don't have a memory leak here */
-    memcpy(&new_buff[ab->length], s, length);
-    ab->str = new_buff;
+    memcpy(&ab->str[ab->length], s, length);
     ab->length += length;
 }
 
-/* Destructor */
-void ab_free(struct abuf *ab) {
-    free(ab->str);
+/* Empty the buffer but keep its memory for the next frame. */
+void ab_reset(struct abuf *ab) {
+    ab->length = 0;
+}
+
+/* Destructor */
+void ab_free(struct abuf *ab) {
+    free(ab->str);
+}
+
+/* ---------------------------------- JSON ---------------------------------- */
+void json_space(struct json *j) {
+    while (j->pos < j->length && (j->text[j->pos] == ' ' || j->text[j->pos] == '\t' || j->text[j->pos] == '\n' ||
+                                  j->text[j->pos] == '\r')) {
+        j->pos++;
+    }
+}
+
+/* Tokenize the value at j->pos and everything in it. Returns its token's index, or -1 if the text isn't JSON. */
+long json_value(struct json *j, int depth) {
+    long index;
+    char c;
+
+    json_space(j);
+    if (j->pos >= j->length || depth > JSON_MAX_DEPTH) {
+        return -1;
+    }
+    if (j->count == j->capacity) {
+        j->capacity = j->capacity ? j->capacity * 2 : 256;
+        j->tokens = realloc(j->tokens, j->capacity * sizeof(*j->tokens));
+        if (j->tokens == NULL) {
+            error_handler("realloc");
+        }
+    }
+    index = j->count++;
+    j->tokens[index].start = j->pos;
+    j->tokens[index].size = 0;
+    c = j->text[j->pos];
+
+    if (c == '{' || c == '[') {
+        char close = c == '{' ? '}' : ']';
+
+        j->tokens[index].type = c == '{' ? JSON_OBJECT : JSON_ARRAY;
+        j->pos++;
+        json_space(j);
+        if (j->pos < j->length && j->text[j->pos] == close) {
+            j->pos++;
+        } else {
+            for (;;) {
+                if (c == '{') {
+                    long key = json_value(j, depth + 1);
+
+                    if (key == -1 || j->tokens[key].type != JSON_STRING) {
+                        return -1;
+                    }
+                    json_space(j);
+                    if (j->pos >= j->length || j->text[j->pos] != ':') {
+                        return -1;
+                    }
+                    j->pos++;
+                }
+                if (json_value(j, depth + 1) == -1) {
+                    return -1;
+                }
+                j->tokens[index].size++;
+                json_space(j);
+                if (j->pos < j->length && j->text[j->pos] == ',') {
+                    j->pos++;
+                } else if (j->pos < j->length && j->text[j->pos] == close) {
+                    j->pos++;
+                    break;
+                } else {
+                    return -1;
+                }
+            }
+        }
+        j->tokens[index].end = j->pos;
+    } else if (c == '"') {
+        j->tokens[index].type = JSON_STRING;
+        j->tokens[index].start = ++j->pos;
+        while (j->pos < j->length && j->text[j->pos] != '"') {
+            j->pos += j->text[j->pos] == '\\' ? 2 : 1;
+        }
+        if (j->pos >= j->length) {
+            return -1;
+        }
+        j->tokens[index].end = j->pos++;
+    } else {
+        j->tokens[index].type = JSON_PRIMITIVE;
+        while (j->pos < j->length && strchr(",:]} \t\r\n", j->text[j->pos]) == NULL) {
+            j->pos++;
+        }
+        if (j->pos == j->tokens[index].start) {
+            return -1;
+        }
+        j->tokens[index].end = j->pos;
+    }
+    j->tokens[index].next = j->count;
+
+    return index;
+}
+
+/* Tokenize a whole message; its top-level value is token 0. */
+int json_parse(struct json *j, const char *text, size_t length) {
+    j->text = text;
+    j->length = length;
+    j->pos = 0;
+    j->count = 0;
+    return json_value(j, 0) == 0 ? 0 : -1;
+}
+
+/* The value of member `key` of the object at `object`, or -1. Either may be -1, so lookups chain. */
+long json_get(const struct json *j, long object, const char *key) {
+    size_t length = strlen(key);
+    long i;
+
+    if (object < 0 || j->tokens[object].type != JSON_OBJECT) {
+        return -1;
+    }
+    i = object + 1;
+    for (size_t n = 0; n < j->tokens[object].size; n++) {
+        if (j->tokens[i].end - j->tokens[i].start == length && memcmp(j->text + j->tokens[i].start, key, length) == 0) {
+            return i + 1;
+        }
+        i = j->tokens[i + 1].next;
+    }
+
+    return -1;
+}
+
+long json_number(const struct json *j, long token, long fallback) {
+    char number[32];
+    size_t length;
+
+    if (token < 0 || j->tokens[token].type != JSON_PRIMITIVE) {
+        return fallback;
+    }
+    length = j->tokens[token].end - j->tokens[token].start;
+    if (length >= sizeof(number)) {
+        return fallback;
+    }
+    memcpy(number, j->text + j->tokens[token].start, length);
+    number[length] = '\0';
+    return strtol(number, NULL, 10);
+}
+
+/* Unescape the string at `token` into `out` (cut to fit, always terminated). Returns its length; "" if it isn't one. */
+size_t json_string(const struct json *j, long token, char *out, size_t capacity) {
+    size_t n = 0;
+
+    if (token >= 0 && j->tokens[token].type == JSON_STRING) {
+        const char *s = j->text + j->tokens[token].start;
+        const char *end = j->text + j->tokens[token].end;
+
+        while (s < end && n + 4 < capacity) {
+            unsigned long c = (unsigned char)*s++;
+
+            if (c == '\\' && s < end) {
+                c = (unsigned char)*s++;
+                if (c == 'n') {
+                    c = '\n';
+                } else if (c == 't') {
+                    c = '\t';
+                } else if (c == 'r') {
+                    c = '\r';
+                } else if (c == 'b' || c == 'f') {
+                    c = ' ';
+                } else if (c == 'u' && end - s >= 4) {
+                    char hex[5] = {s[0], s[1], s[2], s[3], '\0'};
+
+                    c = strtoul(hex, NULL, 16);
+                    s += 4;
+                    if (c >= 0xd800 && c < 0xdc00 && end - s >= 6 && s[0] == '\\' && s[1] == 'u') {
+                        char low[5] = {s[2], s[3], s[4], s[5], '\0'};
+
+                        c = 0x10000 + ((c - 0xd800) << 10) + (strtoul(low, NULL, 16) - 0xdc00);
+                        s += 6;
+                    }
+                    /* UTF-8 encode. */
+                    if (c >= 0x80) {
+                        if (c < 0x800) {
+                            out[n++] = (char)(0xc0 | (c >> 6));
+                        } else {
+                            if (c < 0x10000) {
+                                out[n++] = (char)(0xe0 | (c >> 12));
+                            } else {
+                                out[n++] = (char)(0xf0 | (c >> 18));
+                                out[n++] = (char)(0x80 | ((c >> 12) & 0x3f));
+                            }
+                            out[n++] = (char)(0x80 | ((c >> 6) & 0x3f));
+                        }
+                        c = 0x80 | (c & 0x3f);
+                    }
+                }
+            }
+            out[n++] = (char)c;
+        }
+    }
+    if (capacity > 0) {
+        out[n < capacity ? n : capacity - 1] = '\0';
+    }
+
+    return n;
+}
+
+/* Append `s` escaped for the inside of a JSON string. */
+void json_write_escaped(struct abuf *ab, const char *s, size_t length) {
+    size_t run = 0;
+
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = s[i];
+        char escape[8];
+        int n;
+
+        if (c != '"' && c != '\\' && c >= 0x20) {
+            continue;
+        }
+        ab_append(ab, s + run, i - run);
+        if (c == '"' || c == '\\') {
+            n = snprintf(escape, sizeof(escape), "\\%c", c);
+        } else if (c == '\n') {
+            n = snprintf(escape, sizeof(escape), "\\n");
+        } else if (c == '\t') {
+            n = snprintf(escape, sizeof(escape), "\\t");
+        } else {
+            n = snprintf(escape, sizeof(escape), "\\u%04x", c);
+        }
+        ab_append(ab, escape, n);
+        run = i + 1;
+    }
+    ab_append(ab, s + run, length - run);
+}
+
+void json_write_string(struct abuf *ab, const char *s) {
+    ab_append(ab, "\"", 1);
+    json_write_escaped(ab, s, strlen(s));
+    ab_append(ab, "\"", 1);
+}
+
+/* ----------------------------- Language Server ---------------------------- */
+/* `lsp .ext command...` in ~/.kilorc: start `command` for files ending in `.ext`. */
+int lsp_parse_line(const char *line) {
+    struct lsp_server *server = &E.lsp.servers[E.lsp.num_servers];
+    const char *p = line + 3;
+    size_t n;
+
+    p += strspn(p, " \t");
+    n = strcspn(p, " \t\r\n");
+    if (n == 0 || n >= sizeof(server->extension) || E.lsp.num_servers == LSP_SERVERS_MAX) {
+        return -1;
+    }
+    memcpy(server->extension, p, n);
+    server->extension[n] = '\0';
+    p += n;
+    p += strspn(p, " \t");
+    n = strcspn(p, "\r\n");
+    if (n == 0 || n >= sizeof(server->command)) {
+        return -1;
+    }
+    memcpy(server->command, p, n);
+    server->command[n] = '\0';
+    E.lsp.num_servers++;
+
+    return 0;
+}
+
+/* The LSP languageId for a file extension. */
+const char *lsp_language(const char *extension) {
+    static const char *languages[][2] = {
+        {".c", "c"}, {".h", "c"}, {".cc", "cpp"}, {".cpp", "cpp"}, {".cxx", "cpp"}, {".hh", "cpp"}, {".hpp", "cpp"},
+        {".py", "python"}, {".rs", "rust"}, {".go", "go"}, {".js", "javascript"}, {".ts", "typescript"},
+        {".java", "java"}, {".rb", "ruby"}, {".sh", "shellscript"}, {".lua", "lua"}, {".zig", "zig"},
+    };
+
+    for (size_t i = 0; i < sizeof(languages) / sizeof(languages[0]); i++) {
+        if (strcmp(extension, languages[i][0]) == 0) {
+            return languages[i][1];
+        }
+    }
+    return extension[0] == '.' ? extension + 1 : extension;
+}
+
+/* file:// URI for an absolute path, percent-encoding all but unreserved characters and '/'. Caller frees. */
+char *lsp_uri(const char *path) {
+    char *uri = malloc(strlen(path) * 3 + 8);
+    char *p = uri;
+
+    if (uri == NULL) {
+        error_handler("malloc");
+    }
+    p += sprintf(p, "file://");
+    for (; *path != '\0'; path++) {
+        unsigned char c = *path;
+
+        if (isalnum(c) || strchr("-._~/", c) != NULL) {
+            *p++ = (char)c;
+        } else {
+            p += sprintf(p, "%%%02X", c);
+        }
+    }
+    *p = '\0';
+
+    return uri;
+}
+
+void lsp_printf(const char *fmt, ...) {
+    char text[512];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(text, sizeof(text), fmt, ap);
+    va_end(ap);
+    ab_append(&E.lsp.message, text, n < (int)sizeof(text) ? n : (int)sizeof(text) - 1);
+}
+
+void lsp_write(void);
+
+void lsp_writable(void) {
+    watch_remove(E.lsp.in);
+    E.lsp.writable_watch = 0;
+    lsp_write();
+}
+
+/* Write out what the server will take without blocking; the rest waits for the pipe to drain. */
+void lsp_write(void) {
+    struct lsp *lsp = &E.lsp;
+
+    while (lsp->sent < lsp->output.length) {
+        ssize_t n = write(lsp->in, lsp->output.str + lsp->sent, lsp->output.length - lsp->sent);
+
+        if (n > 0) {
+            lsp->sent += n;
+        } else if (n == -1 && errno == EAGAIN) {
+            if (!lsp->writable_watch) {
+                watch_add_writable(lsp->in, lsp_writable);
+                lsp->writable_watch = 1;
+            }
+            return;
+        } else if (n == -1 && errno != EINTR) {
+            lsp_stop("Language server stopped reading");
+            return;
+        }
+    }
+    ab_reset(&lsp->output);
+    lsp->sent = 0;
+}
+
+/* Frame the message built with lsp_printf() and queue it. */
+void lsp_send(void) {
+    struct lsp *lsp = &E.lsp;
+    char header[48];
+    int n = snprintf(header, sizeof(header), "Content-Length: %u\r\n\r\n", lsp->message.length);
+
+    ab_append(&lsp->output, header, n);
+    ab_append(&lsp->output, lsp->message.str, lsp->message.length);
+    ab_reset(&lsp->message);
+    lsp_write();
+}
+
+/* Append lines [from, to) as one JSON string, each line ending in a newline. */
+void lsp_write_lines(size_t from, size_t to) {
+    struct lsp *lsp = &E.lsp;
+
+    ab_append(&lsp->message, "\"", 1);
+    for (size_t line = from; line < to && buf_line_exists(line); line++) {
+        size_t length = buf_line_copy(line, &lsp->line, &lsp->line_capacity);
+
+        json_write_escaped(&lsp->message, lsp->line, length);
+        ab_append(&lsp->message, "\\n", 2);
+    }
+    ab_append(&lsp->message, "\"", 1);
+}
+
+/* Server columns for byte `cx` of `line`: bytes if it took UTF-8, otherwise UTF-16 code units. */
+size_t lsp_to_character(size_t line, size_t cx) {
+    size_t length;
+    size_t units = 0;
+
+    if (E.lsp.utf8 || !buf_line_exists(line)) {
+        return cx;
+    }
+    length = buf_line_copy(line, &E.lsp.line, &E.lsp.line_capacity);
+    for (size_t i = 0; i < cx && i < length; i++) {
+        unsigned char c = E.lsp.line[i];
+
+        if ((c & 0xc0) != 0x80) {
+            units += c >= 0xf0 ? 2 : 1; /* Four-byte sequences are surrogate pairs in UTF-16. */
+        }
+    }
+    return units;
+}
+
+/* The byte of `line` at server column `character`. */
+size_t lsp_to_byte(size_t line, size_t character) {
+    size_t length;
+    size_t units = 0;
+    size_t i = 0;
+
+    if (!buf_line_exists(line)) {
+        return 0;
+    }
+    length = buf_line_copy(line, &E.lsp.line, &E.lsp.line_capacity);
+    if (E.lsp.utf8) {
+        return character < length ? character : length;
+    }
+    while (i < length && units < character) {
+        units += (unsigned char)E.lsp.line[i] >= 0xf0 ? 2 : 1;
+        i++;
+        while (i < length && ((unsigned char)E.lsp.line[i] & 0xc0) == 0x80) {
+            i++;
+        }
+    }
+    return i;
+}
+
+/* Send the edits gathered since the last change as one didChange. */
+void lsp_sync(void) {
+    struct lsp *lsp = &E.lsp;
+
+    timer_stop(&lsp->sync_timer);
+    if (!lsp->dirty || lsp->state != LSP_READY) {
+        return;
+    }
+    lsp->dirty = 0;
+    lsp->version++;
+    lsp_printf("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didChange\",\"params\":{\"textDocument\":{\"uri\":");
+    json_write_string(&lsp->message, lsp->uri);
+    lsp_printf(",\"version\":%ld},\"contentChanges\":[{\"range\":{\"start\":{\"line\":%zu,\"character\":0},"
+               "\"end\":{\"line\":%zu,\"character\":0}},\"text\":", lsp->version, lsp->from, lsp->old_end);
+    lsp_write_lines(lsp->from, lsp->new_end);
+    lsp_printf("}]}}");
+    lsp_send();
+}
+
+void lsp_request_completion(void);
+
+/*
+The buffer is about to replace `removed` lines at `at` with `inserted` lines. Grow the window of unsent changes to
+cover it, first sending what is pending if the two are too far apart to be worth one message.
+*/
+void lsp_buffer_changed(size_t at, size_t removed, size_t inserted) {
+    struct lsp *lsp = &E.lsp;
+
+    for (size_t i = 0; i < lsp->num_diagnostics; i++) {
+        struct lsp_diagnostic *d = &lsp->diagnostics[i];
+
+        if (d->line >= at + removed) {
+            d->line = d->line + inserted - removed;
+        } else if (d->line >= at && d->line >= at + inserted) {
+            d->line = at + inserted > 0 ? at + inserted - 1 : 0;
+        }
+    }
+    if (lsp->state != LSP_READY) {
+        return; /* didOpen hasn't gone out yet, and will carry the edit. */
+    }
+
+    if (lsp->dirty && (at > lsp->new_end + LSP_MERGE_GAP || at + removed + LSP_MERGE_GAP < lsp->from)) {
+        lsp_sync();
+    }
+    if (!lsp->dirty) {
+        lsp->dirty = 1;
+        lsp->from = at;
+        lsp->old_end = lsp->new_end = at + removed;
+    } else {
+        if (at < lsp->from) {
+            lsp->from = at;
+        }
+        if (at + removed > lsp->new_end) {
+            lsp->old_end += at + removed - lsp->new_end;
+            lsp->new_end = at + removed;
+        }
+    }
+    lsp->new_end = lsp->new_end + inserted - removed;
+
+    timer_start(&lsp->sync_timer, LSP_SYNC_DELAY, lsp_sync);
+    if (lsp->popup) {
+        timer_start(&lsp->complete_timer, LSP_COMPLETE_DELAY, lsp_request_completion);
+    }
+}
+
+/* The reply to initialize: note what the server can do, then open the document. */
+void lsp_initialized(long result) {
+    struct lsp *lsp = &E.lsp;
+    struct json *j = &lsp->json;
+    long capabilities = json_get(j, result, "capabilities");
+    long sync = json_get(j, capabilities, "textDocumentSync");
+    char encoding[16];
+    const char *extension = strrchr(E.doc.filename, '.');
+
+    if (sync >= 0 && j->tokens[sync].type == JSON_OBJECT) {
+        sync = json_get(j, sync, "change");
+    }
+    if (json_number(j, sync, 0) != 2) {
+        lsp_stop("Language server can't take incremental changes");
+        return;
+    }
+    json_string(j, json_get(j, capabilities, "positionEncoding"), encoding, sizeof(encoding));
+    lsp->utf8 = strcmp(encoding, "utf-8") == 0;
+
+    lsp_printf("{\"jsonrpc\":\"2.0\",\"method\":\"initialized\",\"params\":{}}");
+    lsp_send();
+    lsp->version = 1;
+    lsp_printf("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didOpen\",\"params\":{\"textDocument\":{\"uri\":");
+    json_write_string(&lsp->message, lsp->uri);
+    lsp_printf(",\"languageId\":\"%s\",\"version\":%ld,\"text\":", lsp_language(extension ? extension : ""),
+               lsp->version);
+    doc_index_to(SIZE_MAX);
+    lsp_write_lines(0, buf_num_lines());
+    lsp_printf("}}}");
+    lsp_send();
+    lsp->state = LSP_READY;
+    lsp->dirty = 0;
+}
+
+int lsp_diagnostic_compare(const void *a, const void *b) {
+    const struct lsp_diagnostic *x = a;
+    const struct lsp_diagnostic *y = b;
+
+    return x->line < y->line ? -1 : x->line > y->line ? 1 : x->severity - y->severity;
+}
+
+/* publishDiagnostics replaces everything known about the document. */
+void lsp_diagnostics(long params) {
+    struct lsp *lsp = &E.lsp;
+    struct json *j = &lsp->json;
+    long list = json_get(j, params, "diagnostics");
+    char uri[4096];
+    long item;
+
+    json_string(j, json_get(j, params, "uri"), uri, sizeof(uri));
+    if (strcmp(uri, lsp->uri) != 0) {
+        return;
+    }
+    if (lsp->diagnostics == NULL) {
+        lsp->diagnostics = malloc(LSP_DIAGNOSTICS_MAX * sizeof(*lsp->diagnostics));
+        if (lsp->diagnostics == NULL) {
+            error_handler("malloc");
+        }
+    }
+    lsp->num_diagnostics = 0;
+    if (list < 0 || j->tokens[list].type != JSON_ARRAY) {
+        return;
+    }
+
+    item = list + 1;
+    for (size_t n = 0; n < j->tokens[list].size && lsp->num_diagnostics < LSP_DIAGNOSTICS_MAX; n++) {
+        struct lsp_diagnostic *d = &lsp->diagnostics[lsp->num_diagnostics++];
+        long range = json_get(j, item, "range");
+        long start = json_get(j, range, "start");
+        long end = json_get(j, range, "end");
+        char *newline;
+
+        d->line = (size_t)json_number(j, json_get(j, start, "line"), 0);
+        d->start = lsp_to_byte(d->line, (size_t)json_number(j, json_get(j, start, "character"), 0));
+        d->end = (size_t)json_number(j, json_get(j, end, "line"), 0) == d->line ?
+                 lsp_to_byte(d->line, (size_t)json_number(j, json_get(j, end, "character"), 0)) :
+                 buf_line_length(d->line);
+        d->severity = (int)json_number(j, json_get(j, item, "severity"), 1);
+        json_string(j, json_get(j, item, "message"), d->message, sizeof(d->message));
+        if ((newline = strchr(d->message, '\n')) != NULL) {
+            *newline = '\0';
+        }
+        item = j->tokens[item].next;
+    }
+    qsort(lsp->diagnostics, lsp->num_diagnostics, sizeof(*lsp->diagnostics), lsp_diagnostic_compare);
+}
+
+/* The most severe diagnostic on `line`, or NULL. */
+const struct lsp_diagnostic *lsp_diagnostic_at(size_t line) {
+    struct lsp *lsp = &E.lsp;
+    size_t lo = 0;
+    size_t hi = lsp->num_diagnostics;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        if (lsp->diagnostics[mid].line < line) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo < lsp->num_diagnostics && lsp->diagnostics[lo].line == line ? &lsp->diagnostics[lo] : NULL;
+}
+
+/* Copy a completion string, without the leading spaces some servers pad labels with. */
+void lsp_copy_item_text(long token, char *out, size_t capacity) {
+    char text[256];
+    const char *p;
+
+    json_string(&E.lsp.json, token, text, sizeof(text));
+    p = text + strspn(text, " ");
+    snprintf(out, capacity, "%.*s", (int)strcspn(p, "\n"), p);
+}
+
+void lsp_completions(long result) {
+    struct lsp *lsp = &E.lsp;
+    struct json *j = &lsp->json;
+    long list = result >= 0 && j->tokens[result].type == JSON_ARRAY ? result : json_get(j, result, "items");
+    long item;
+
+    /* Stale: the text has moved on since, and a fresh request is on its way. */
+    if (lsp->completion_version != lsp->version || !lsp->popup || list < 0 || j->tokens[list].type != JSON_ARRAY) {
+        return;
+    }
+    if (lsp->items == NULL) {
+        lsp->items = malloc(LSP_COMPLETIONS_MAX * sizeof(*lsp->items));
+        if (lsp->items == NULL) {
+            error_handler("malloc");
+        }
+    }
+    lsp->num_items = 0;
+    lsp->selected = 0;
+    item = list + 1;
+    for (size_t n = 0; n < j->tokens[list].size && lsp->num_items < LSP_COMPLETIONS_MAX; n++) {
+        struct lsp_completion *c = &lsp->items[lsp->num_items++];
+        long label = json_get(j, item, "label");
+        long insert = json_get(j, json_get(j, item, "textEdit"), "newText");
+        long filter = json_get(j, item, "filterText");
+
+        if (insert < 0) {
+            insert = json_get(j, item, "insertText");
+        }
+        lsp_copy_item_text(label, c->label, sizeof(c->label));
+        lsp_copy_item_text(insert >= 0 ? insert : label, c->insert, sizeof(c->insert));
+        lsp_copy_item_text(filter >= 0 ? filter : label, c->filter, sizeof(c->filter));
+        item = j->tokens[item].next;
+    }
+}
+
+/* Answer a request from the server. None need doing anything: null, or a null per item asked about. */
+void lsp_reply(long id, const char *method) {
+    struct lsp *lsp = &E.lsp;
+    struct json *j = &lsp->json;
+    const struct json_token *t = &j->tokens[id];
+    long items = json_get(j, json_get(j, 0, "params"), "items");
+
+    lsp_printf("{\"jsonrpc\":\"2.0\",\"id\":%s%.*s%s,\"result\":", t->type == JSON_STRING ? "\"" : "",
+               (int)(t->end - t->start), j->text + t->start, t->type == JSON_STRING ? "\"" : "");
+    if (strcmp(method, "workspace/configuration") == 0 && items >= 0) {
+        lsp_printf("[");
+        for (size_t i = 0; i < j->tokens[items].size; i++) {
+            lsp_printf(i > 0 ? ",null" : "null");
+        }
+        lsp_printf("]}");
+    } else {
+        lsp_printf("null}");
+    }
+    lsp_send();
+}
+
+void lsp_dispatch(const char *text, size_t length) {
+    struct lsp *lsp = &E.lsp;
+    struct json *j = &lsp->json;
+    long id;
+    long method;
+    long number;
+    char name[64];
+
+    if (json_parse(j, text, length) == -1) {
+        return;
+    }
+    id = json_get(j, 0, "id");
+    method = json_get(j, 0, "method");
+    if (method >= 0) {
+        json_string(j, method, name, sizeof(name));
+        if (id >= 0) {
+            lsp_reply(id, name);
+        } else if (strcmp(name, "textDocument/publishDiagnostics") == 0) {
+            lsp_diagnostics(json_get(j, 0, "params"));
+        }
+        return;
+    }
+
+    number = json_number(j, id, -1);
+    if (number == lsp->initialize_id && lsp->state == LSP_STARTING) {
+        if (json_get(j, 0, "result") < 0) {
+            lsp_stop("Language server failed to initialize");
+        } else {
+            lsp_initialized(json_get(j, 0, "result"));
+        }
+    } else if (number == lsp->completion_id && number > 0) {
+        lsp->completion_id = 0;
+        lsp_completions(json_get(j, 0, "result"));
+    }
+}
+
+/* Content-Length from a message header, or SIZE_MAX if it has none. */
+size_t lsp_content_length(const char *header, size_t length) {
+    static const char name[] = "content-length:";
+    size_t i = 0;
+
+    while (i + sizeof(name) - 1 <= length) {
+        const char *newline;
+        size_t k = 0;
+
+        while (k < sizeof(name) - 1 && tolower((unsigned char)header[i + k]) == name[k]) {
+            k++;
+        }
+        if (k == sizeof(name) - 1) {
+            return strtoul(header + i + k, NULL, 10);
+        }
+        if ((newline = memchr(header + i, '\n', length - i)) == NULL) {
+            break;
+        }
+        i = newline - header + 1;
+    }
+
+    return SIZE_MAX;
+}
+
+/* Read what the server has written, JSON-RPC message by message, a budget's worth per wakeup. */
+void lsp_readable(void) {
+    struct lsp *lsp = &E.lsp;
+    size_t total = 0;
+    size_t start = 0;
+    ssize_t n;
+
+    while (total < LSP_READ_BUDGET) {
+        if (lsp->input_capacity - lsp->input_length < LSP_READ_SIZE) {
+            lsp->input_capacity = lsp->input_capacity ? lsp->input_capacity * 2 : LSP_READ_SIZE * 2;
+            lsp->input = realloc(lsp->input, lsp->input_capacity);
+            if (lsp->input == NULL) {
+                error_handler("realloc");
+            }
+        }
+        n = read(lsp->out, lsp->input + lsp->input_length, LSP_READ_SIZE);
+        if (n > 0) {
+            lsp->input_length += n;
+            total += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && errno == EAGAIN) {
+            break;
+        } else {
+            lsp_stop("Language server exited");
+            return;
+        }
+    }
+
+    for (;;) {
+        char *end = memmem(lsp->input + start, lsp->input_length - start, "\r\n\r\n", 4);
+        size_t header;
+        size_t body;
+
+        if (end == NULL) {
+            if (lsp->input_length - start > LSP_READ_SIZE) {
+                lsp_stop("Language server sent a bad message");
+                return;
+            }
+            break;
+        }
+        header = end + 4 - (lsp->input + start);
+        body = lsp_content_length(lsp->input + start, header);
+        if (body > LSP_MESSAGE_MAX) {
+            lsp_stop("Language server sent a bad message");
+            return;
+        }
+        if (lsp->input_length - start < header + body) {
+            break;
+        }
+        lsp_dispatch(lsp->input + start + header, body);
+        if (lsp->state == LSP_OFF) {
+            return;
+        }
+        start += header + body;
+    }
+    memmove(lsp->input, lsp->input + start, lsp->input_length - start);
+    lsp->input_length -= start;
+}
+
+/* Start the server configured for the open file, if there is one. Nothing waits on it. */
+void lsp_start(void) {
+    struct lsp *lsp = &E.lsp;
+    const char *name = E.doc.filename;
+    const struct lsp_server *server = NULL;
+    char *path;
+    char *root;
+    char *root_uri;
+
+    if (name == NULL || E.read_only || E.doc.unnamed || E.dir.active) {
+        return;
+    }
+    for (int i = 0; i < lsp->num_servers; i++) {
+        size_t length = strlen(lsp->servers[i].extension);
+
+        if (strlen(name) >= length && strcmp(name + strlen(name) - length, lsp->servers[i].extension) == 0) {
+            server = &lsp->servers[i];
+        }
+    }
+    if (server == NULL) {
+        return;
+    }
+    if (E.doc.size > LSP_DOCUMENT_MAX) {
+        editor_set_status_message("Too big to give the language server");
+        return;
+    }
+    lsp->pid = spawn_shell(NULL, server->command, &lsp->in, &lsp->out);
+    if (lsp->pid == -1) {
+        editor_set_status_message("Can't start %s: %s", server->command, strerror(errno));
+        return;
+    }
+
+    root = getcwd(NULL, 0);
+    if ((path = realpath(name, NULL)) == NULL) {
+        path = name[0] == '/' || root == NULL ? strdup(name) : path_join(root, name); /* A new file. */
+    }
+    lsp->uri = lsp_uri(path);
+    root_uri = lsp_uri(root != NULL ? root : "/");
+    free(path);
+    free(root);
+
+    lsp->state = LSP_STARTING;
+    lsp->next_id = 1;
+    lsp->initialize_id = lsp->next_id++;
+    buf_observe(lsp_buffer_changed);
+    watch_add(lsp->out, lsp_readable);
+    lsp_printf("{\"jsonrpc\":\"2.0\",\"id\":%ld,\"method\":\"initialize\",\"params\":{\"processId\":%ld,\"rootUri\":",
+               lsp->initialize_id, (long)getpid());
+    json_write_string(&lsp->message, root_uri);
+    lsp_printf(",\"capabilities\":{\"general\":{\"positionEncodings\":[\"utf-8\",\"utf-16\"]},\"textDocument\":"
+               "{\"synchronization\":{\"didSave\":true},\"completion\":{\"completionItem\":{\"snippetSupport\":false}},"
+               "\"publishDiagnostics\":{}}}}}");
+    lsp_send();
+    free(root_uri);
+}
+
+void lsp_popup_close(void) {
+    struct lsp *lsp = &E.lsp;
+
+    lsp->popup = 0;
+    lsp->num_items = 0;
+    timer_stop(&lsp->complete_timer);
+}
+
+/* Shut the server down (it is killed: it has nothing of ours to save), saying why if `reason` isn't NULL. */
+void lsp_stop(const char *reason) {
+    struct lsp *lsp = &E.lsp;
+
+    if (lsp->state == LSP_OFF) {
+        return;
+    }
+    watch_remove(lsp->out);
+    if (lsp->writable_watch) {
+        watch_remove(lsp->in);
+        lsp->writable_watch = 0;
+    }
+    close(lsp->in);
+    close(lsp->out);
+    kill(-lsp->pid, SIGKILL);
+    while (waitpid(lsp->pid, NULL, 0) == -1 && errno == EINTR) {
+    }
+    timer_stop(&lsp->sync_timer);
+    lsp_popup_close();
+    lsp->state = LSP_OFF;
+    lsp->pid = 0;
+    lsp->num_diagnostics = 0;
+    lsp->completion_id = 0;
+    lsp->dirty = 0;
+    free(lsp->uri);
+    lsp->uri = NULL;
+    ab_reset(&lsp->output);
+    lsp->sent = 0;
+    lsp->input_length = 0;
+    buf_unobserve(lsp_buffer_changed);
+    if (reason != NULL) {
+        editor_set_status_message("%s", reason);
+    }
+}
+
+void lsp_exit(void) {
+    if (E.lsp.state != LSP_OFF) {
+        kill(-E.lsp.pid, SIGTERM);
+    }
+}
+
+void lsp_saved(void) {
+    if (E.lsp.state != LSP_READY) {
+        return;
+    }
+    lsp_sync();
+    lsp_printf("{\"jsonrpc\":\"2.0\",\"method\":\"textDocument/didSave\",\"params\":{\"textDocument\":{\"uri\":");
+    json_write_string(&E.lsp.message, E.lsp.uri);
+    lsp_printf("}}}");
+    lsp_send();
+}
+
+/* Ask for completions at the cursor, first withdrawing a request still in flight: its answer would be stale. */
+void lsp_request_completion(void) {
+    struct lsp *lsp = &E.lsp;
+
+    timer_stop(&lsp->complete_timer);
+    if (lsp->state != LSP_READY) {
+        return;
+    }
+    lsp_sync();
+    if (lsp->completion_id != 0) {
+        lsp_printf("{\"jsonrpc\":\"2.0\",\"method\":\"$/cancelRequest\",\"params\":{\"id\":%ld}}", lsp->completion_id);
+        lsp_send();
+    }
+    lsp->completion_id = lsp->next_id++;
+    lsp->completion_version = lsp->version;
+    lsp_printf("{\"jsonrpc\":\"2.0\",\"id\":%ld,\"method\":\"textDocument/completion\",\"params\":{\"textDocument\":"
+               "{\"uri\":", lsp->completion_id);
+    json_write_string(&lsp->message, lsp->uri);
+    lsp_printf("},\"position\":{\"line\":%zu,\"character\":%zu}}}", E.cy, lsp_to_character(E.cy, E.cx));
+    lsp_send();
+}
+
+/* Open the completion popup for the word before the cursor. It stays open, and asks again, while the word is typed. */
+void lsp_complete(void) {
+    struct lsp *lsp = &E.lsp;
+    size_t start = E.cx;
+
+    if (lsp->state != LSP_READY) {
+        editor_set_status_message(lsp->state == LSP_OFF ? "No language server" : "Language server is starting");
+        return;
+    }
+    if (buf_line_exists(E.cy)) {
+        buf_line_copy(E.cy, &lsp->line, &lsp->line_capacity);
+        while (start > 0 && is_identifier_char((unsigned char)lsp->line[start - 1])) {
+            start--;
+        }
+    }
+    lsp->popup = 1;
+    lsp->popup_line = E.cy;
+    lsp->popup_start = start;
+    lsp->num_items = 0;
+    lsp->selected = 0;
+    lsp_request_completion();
+}
+
+/* Indices of the items that still match what has been typed of the word, up to `max`. */
+int lsp_visible_items(int *visible, int max) {
+    struct lsp *lsp = &E.lsp;
+    size_t length;
+    size_t typed;
+    int count = 0;
+
+    if (!lsp->popup || E.cy != lsp->popup_line || E.cx < lsp->popup_start) {
+        return 0;
+    }
+    length = buf_line_copy(E.cy, &lsp->line, &lsp->line_capacity);
+    typed = (E.cx < length ? E.cx : length) - lsp->popup_start;
+    for (int i = 0; i < lsp->num_items && count < max; i++) {
+        if (strncmp(lsp->items[i].filter, lsp->line + lsp->popup_start, typed) == 0) {
+            visible[count++] = i;
+        }
+    }
+    return count;
+}
+
+/* Replace the word being completed with the selected item. */
+void lsp_accept(const struct lsp_completion *item) {
+    struct lsp *lsp = &E.lsp;
+    size_t line = lsp->popup_line;
+    size_t start = lsp->popup_start;
+    size_t length = buf_line_length(line);
+
+    lsp_popup_close();
+    if (!editor_can_edit()) {
+        return;
+    }
+    buf_begin_edit(0);
+    buf_add_copy(line, 0, start);
+    buf_add_bytes(item->insert, strlen(item->insert));
+    buf_add_copy(line, E.cx < length ? E.cx : length, length);
+    buf_replace(line, 1, buf_add_line(), 1);
+    E.cx = start + strlen(item->insert);
+    buf_end_edit();
+}
+
+/*
+Keys the open popup takes: Tab or Enter accepts, up and down (or C-p and C-n) choose, Esc or C-g closes. Anything else
+goes on to the keymap, closing the popup unless it continues (or backspaces through) the word. Returns 1 if taken.
+*/
+int lsp_popup_key(int c) {
+    struct lsp *lsp = &E.lsp;
+    int visible[LSP_COMPLETIONS_MAX];
+    int count;
+
+    if (!lsp->popup) {
+        return 0;
+    }
+    count = lsp_visible_items(visible, LSP_COMPLETIONS_MAX);
+    if (c == '\x1b' || c == CTRL_KEY('g')) {
+        lsp_popup_close();
+        return 1;
+    }
+    if (count > 0 && (c == '\t' || c == '\r')) {
+        lsp_accept(&lsp->items[visible[lsp->selected < count ? lsp->selected : 0]]);
+        return 1;
+    }
+    if (count > 0 && (c == ARROW_DOWN || c == CTRL_KEY('n'))) {
+        lsp->selected = (lsp->selected + 1) % count;
+        return 1;
+    }
+    if (count > 0 && (c == ARROW_UP || c == CTRL_KEY('p'))) {
+        lsp->selected = (lsp->selected + count - 1) % count;
+        return 1;
+    }
+    if (!is_identifier_char(c) && c != 127 && c != CTRL_KEY('h')) {
+        lsp_popup_close();
+    }
+    return 0;
+}
+
+/* Draw the popup over the text, below the word (or above it, near the bottom). Closes it once the cursor leaves. */
+void lsp_draw_popup(struct abuf *ab) {
+    struct lsp *lsp = &E.lsp;
+    int visible[LSP_COMPLETIONS_MAX];
+    int count;
+    int rows;
+    int first;
+    int width = 8;
+    int row;
+    int col;
+    int top;
+    char cell[96];
+
+    if (!lsp->popup) {
+        return;
+    }
+    if (E.cy != lsp->popup_line || E.cx < lsp->popup_start) {
+        lsp_popup_close();
+        return;
+    }
+    if ((count = lsp_visible_items(visible, LSP_COMPLETIONS_MAX)) == 0) {
+        return;
+    }
+    if (lsp->selected >= count) {
+        lsp->selected = count - 1;
+    }
+    rows = count < LSP_POPUP_ROWS ? count : LSP_POPUP_ROWS;
+    first = lsp->selected >= rows ? lsp->selected - rows + 1 : 0;
+    for (int i = first; i < first + rows; i++) {
+        int length = (int)strlen(lsp->items[visible[i]].label);
+
+        width = length > width ? length : width;
+    }
+    width = width < 40 ? width : 40;
+
+    row = (int)(E.cy - E.rowoff);
+    top = row + 1 + rows <= E.screen_rows ? row + 1 : row - rows;
+    if (top < 0) {
+        top = row + 1;
+        rows = E.screen_rows - top < rows ? E.screen_rows - top : rows;
+    }
+    col = editor_gutter_width() + (int)(editor_cx_to_rx(E.cy, lsp->popup_start) - E.coloff);
+    if (col + width + 2 > E.cols) {
+        col = E.cols - width - 2;
+    }
+    col = col > 0 ? col : 0;
+
+    for (int r = 0; r < rows; r++) {
+        int n = snprintf(cell, sizeof(cell), CURSOR_REPOSITION_COORDS "%s %-*.*s " RESET_COLORS, top + r + 1, col + 1,
+                         first + r == lsp->selected ? "\x1b[1;7m" : INVERT_COLORS, width, width,
+                         lsp->items[visible[first + r]].label);
+
+        ab_append(ab, cell, n < (int)sizeof(cell) ? n : (int)sizeof(cell) - 1);
+    }
+}
+
+/* ----------------------------------- Git ---------------------------------- */
+/* Grow the line arrays to hold `n` lines. */
+void git_reserve(size_t n) {
+    struct git *git = &E.git;
+    size_t capacity = git->capacity ? git->capacity : 1024;
+    uint64_t *lines;
+    unsigned char *marks;
+
+    if (n <= git->capacity) {
+        return;
+    }
+    while (capacity < n) {
+        capacity *= 2;
+    }
+    lines = realloc(git->lines, capacity * sizeof(*lines));
+    marks = lines != NULL ? realloc(git->marks, capacity) : NULL;
+    if (lines == NULL || marks == NULL) {
+        error_handler("realloc");
+    }
+    git->lines = lines;
+    git->marks = marks;
+    git->capacity = capacity;
+}
+
+/* Forget every line's hash, as when the buffer changed in a way we weren't told about. */
+void git_unhash_all(void) {
+    struct git *git = &E.git;
+
+    git->num_lines = buf_num_lines();
+    git_reserve(git->num_lines + 1);
+    for (size_t i = 0; i < git->num_lines; i++) {
+        git->lines[i] = GIT_UNHASHED;
+    }
+    memset(git->marks, GIT_UNCHANGED, git->num_lines);
+    git->unhashed_from = 0;
+    git->unhashed_to = git->num_lines;
+}
+
+/* Hash the lines edited since the last diff: a piece lookup each, as the document and add buffer keep prefix hashes. */
+void git_rehash(void) {
+    struct git *git = &E.git;
+    int source;
+    size_t index;
+
+    for (size_t i = git->unhashed_from; i < git->unhashed_to; i++) {
+        if (git->lines[i] == GIT_UNHASHED) {
+            git->lines[i] = buf_locate(i, &source, &index) ? piece_own_hash(source, index, 1) : 0;
+        }
+    }
+    git->unhashed_from = 0;
+    git->unhashed_to = 0;
+}
+
+int git_diff_cancelled(struct git_diff *diff) {
+    int cancelled;
+
+    pthread_mutex_lock(&E.git.lock);
+    cancelled = diff->cancelled;
+    pthread_mutex_unlock(&E.git.lock);
+    return cancelled;
+}
+
+/*
+Myers' greedy diff of a[0..n) against b[0..m): marks the lines of b that were inserted, and counts the lines of a
+deleted just before each line of b (deleted[m] for the end). The furthest x reached on each diagonal is kept for every
+d so the path can be walked back. Returns -1 if cancelled, or if it would take more than GIT_DIFF_MAX_EDITS edits.
+`diff` is only looked at for cancellation, and may be NULL: the formatter diffs on the main thread.
+*/
+int git_diff_script(struct git_diff *diff, const uint64_t *a, long n, const uint64_t *b, long m, unsigned char *marks,
+                    size_t *deleted) {
+    long max = n + m < GIT_DIFF_MAX_EDITS ? n + m : GIT_DIFF_MAX_EDITS;
+    long *v = malloc((2 * max + 1) * sizeof(long));
+    long *trace = NULL; /* v[-d..d] after each d, back to back: d starts at d * d. */
+    size_t trace_capacity = 0;
+    long x;
+    long y;
+    long d;
+    long k;
+
+    if (v == NULL) {
+        return -1;
+    }
+    v[max + 1] = 0;
+    for (d = 0; d <= max; d++) {
+        if (diff != NULL && git_diff_cancelled(diff)) {
+            break;
+        }
+        if ((size_t)((d + 1) * (d + 1)) > trace_capacity) {
+            size_t capacity = trace_capacity ? trace_capacity * 2 : 4096;
+            long *grown = realloc(trace, capacity * sizeof(long));
+
+            if (grown == NULL) {
+                break;
+            }
+            trace = grown;
+            trace_capacity = capacity;
+        }
+        for (k = -d; k <= d; k += 2) {
+            x = k == -d || (k != d && v[max + k - 1] < v[max + k + 1]) ? v[max + k + 1] : v[max + k - 1] + 1;
+            y = x - k;
+            while (x < n && y < m && a[x] == b[y]) {
+                x++;
+                y++;
+            }
+            v[max + k] = x;
+            if (x >= n && y >= m) {
+                goto found;
+            }
+        }
+        memcpy(trace + d * d, v + max - d, (2 * d + 1) * sizeof(long));
+    }
+    free(trace);
+    free(v);
+    return -1;
+
+found:
+    for (x = n, y = m; d > 0; d--) {
+        long *prev = trace + (d - 1) * (d - 1) + (d - 1); /* prev[k] for k in [-(d - 1), d - 1]. */
+
+        k = x - y;
+        if (k == -d || (k != d && prev[k - 1] < prev[k + 1])) {
+            x = prev[k + 1];
+            y = x - (k + 1);
+            marks[y] = GIT_ADDED;
+        } else {
+            x = prev[k - 1];
+            y = x - (k - 1);
+            deleted[y]++;
+        }
+    }
+    free(trace);
+    free(v);
+    return 0;
+}
+
+/* Fill in diff->marks. Lines alike at both ends are skipped first, so an edit in a huge file diffs only around it. */
+void git_diff_run(struct git_diff *diff) {
+    const uint64_t *a = diff->head;
+    const uint64_t *b = diff->lines;
+    size_t n = diff->num_head;
+    size_t m = diff->num_lines;
+    size_t prefix = 0;
+    size_t suffix = 0;
+    unsigned char *marks;
+    size_t *deleted;
+
+    while (prefix < n && prefix < m && a[prefix] == b[prefix]) {
+        prefix++;
+    }
+    while (suffix < n - prefix && suffix < m - prefix && a[n - 1 - suffix] == b[m - 1 - suffix]) {
+        suffix++;
+    }
+    n -= prefix + suffix;
+    m -= prefix + suffix;
+    if (n == 0 && m == 0) {
+        return;
+    }
+    marks = diff->marks + prefix;
+    if ((deleted = calloc(m + 1, sizeof(*deleted))) == NULL) {
+        return;
+    }
+    if (git_diff_script(diff, a + prefix, n, b + prefix, m, marks, deleted) == -1) {
+        if (git_diff_cancelled(diff)) {
+            free(deleted);
+            return;
+        }
+        /* Too different to be worth the time. Edits that kept the line count are matched up line for line. */
+        if (n == m) {
+            for (size_t i = 0; i < m; i++) {
+                marks[i] = a[prefix + i] == b[prefix + i] ? GIT_UNCHANGED : GIT_MODIFIED;
+            }
+        } else {
+            memset(marks, GIT_ADDED, m);
+            deleted[0] = n;
+        }
+    }
+
+    /* Each run of inserted lines, with the deletions in and around it, is a hunk: replaced lines count as modified. */
+    for (size_t y = 0; y <= m;) {
+        size_t run = 0;
+        size_t removed = deleted[y];
+
+        while (y + run < m && marks[y + run] == GIT_ADDED) {
+            run++;
+            removed += deleted[y + run];
+        }
+        for (size_t i = 0; i < run && i < removed; i++) {
+            marks[y + i] = GIT_MODIFIED;
+        }
+        if (run == 0 && removed > 0 && diff->num_lines > 0) {
+            size_t line = prefix + y > 0 ? prefix + y - 1 : 0;
+
+            if (diff->marks[line] == GIT_UNCHANGED) {
+                diff->marks[line] = GIT_DELETED;
+            }
+        }
+        y += run + 1;
+    }
+    free(deleted);
+}
+
+void *git_diff_worker(void *arg) {
+    struct git_diff *diff = arg;
+
+    git_diff_run(diff);
+    /* Hand the diff back; the main loop frees it. */
+    while (write(E.git.wakeup[1], &diff, sizeof(diff)) == -1 && errno == EINTR) {
+    }
+    return NULL;
+}
+
+/* Snapshot the line hashes and diff them in the background. */
+void git_diff_start(void) {
+    struct git *git = &E.git;
+    struct git_diff *diff;
+    pthread_t worker;
+
+    if (git->num_lines != buf_num_lines()) {
+        git_unhash_all();
+    }
+    git_rehash();
+    diff = calloc(1, sizeof(*diff));
+    if (diff == NULL || (diff->lines = malloc((git->num_lines + 1) * sizeof(uint64_t))) == NULL ||
+        (diff->marks = calloc(git->num_lines + 1, 1)) == NULL) {
+        error_handler("malloc");
+    }
+    memcpy(diff->lines, git->lines, git->num_lines * sizeof(uint64_t));
+    diff->num_lines = git->num_lines;
+    diff->head = git->head;
+    diff->num_head = git->num_head;
+    diff->generation = git->generation;
+    if (pthread_create(&worker, NULL, git_diff_worker, diff) != 0) {
+        error_handler("pthread_create");
+    }
+    pthread_detach(worker);
+    git->running = diff;
+}
+
+/* The buffer has been quiet for GIT_DIFF_DELAY ms. */
+void git_diff_due(void) {
+    if (E.git.running != NULL) {
+        E.git.rerun = 1; /* Cancelled; it will be back soon. */
+    } else {
+        git_diff_start();
+    }
+}
+
+/* A diff has come back from the worker. The gutter takes it only if the buffer hasn't changed since. */
+void git_diff_done(void) {
+    struct git *git = &E.git;
+    struct git_diff *diff;
+
+    while (read(git->wakeup[0], &diff, sizeof(diff)) == sizeof(diff)) {
+        if (diff == git->running) {
+            git->running = NULL;
+        }
+        if (!diff->cancelled && diff->generation == git->generation && diff->num_lines == git->num_lines) {
+            memcpy(git->marks, diff->marks, diff->num_lines);
+        }
+        free(diff->lines);
+        free(diff->marks);
+        free(diff);
+    }
+    if (git->running == NULL && git->rerun) {
+        git->rerun = 0;
+        git_diff_start();
+    }
+}
+
+/* Where line `p` ends up after `removed` lines at `at` are replaced by `inserted`. */
+size_t git_shift(size_t p, size_t at, size_t removed, size_t inserted) {
+    if (p <= at) {
+        return p;
+    }
+    return p >= at + removed ? p - removed + inserted : at + inserted;
+}
+
+/*
+Buffer observer. Hashes and marks move along with the lines they belong to and the new lines wait to be hashed, so the
+gutter stays lined up (showing the new lines as changed) until the next diff puts it right.
+*/
+void git_buffer_changed(size_t at, size_t removed, size_t inserted) {
+    struct git *git = &E.git;
+    size_t tail;
+
+    if (at + removed > git->num_lines) {
+        return; /* Out of step; git_diff_start() starts over. */
+    }
+    tail = git->num_lines - at - removed;
+    git_reserve(git->num_lines - removed + inserted);
+    memmove(git->lines + at + inserted, git->lines + at + removed, tail * sizeof(uint64_t));
+    memmove(git->marks + at + inserted, git->marks + at + removed, tail);
+    for (size_t i = at; i < at + inserted; i++) {
+        git->lines[i] = GIT_UNHASHED;
+        git->marks[i] = i - at < removed ? GIT_MODIFIED : GIT_ADDED;
+    }
+    git->num_lines = git->num_lines - removed + inserted;
+
+    if (git->unhashed_from < git->unhashed_to) {
+        size_t from = git_shift(git->unhashed_from, at, removed, inserted);
+        size_t to = git_shift(git->unhashed_to, at, removed, inserted);
+
+        git->unhashed_from = from < at ? from : at;
+        git->unhashed_to = to > at + inserted ? to : at + inserted;
+    } else {
+        git->unhashed_from = at;
+        git->unhashed_to = at + inserted;
+    }
+
+    git->generation++;
+    if (git->running != NULL) {
+        pthread_mutex_lock(&git->lock);
+        git->running->cancelled = 1;
+        pthread_mutex_unlock(&git->lock);
+    }
+    timer_start(&git->diff_timer, GIT_DIFF_DELAY, git_diff_due);
+}
+
+/* HEAD's copy has been read: hash its lines (split as the document splits them) and show the gutter. */
+void git_head_loaded(void) {
+    struct git *git = &E.git;
+    const char *p = git->blob;
+    const char *end = git->blob + git->blob_length;
+    size_t count = 0;
+
+    for (const char *q = p; q < end; count++) {
+        const char *newline = memchr(q, '\n', end - q);
+
+        q = newline != NULL ? newline + 1 : end;
+    }
+    git->head = malloc((count + 1) * sizeof(uint64_t));
+    if (git->head == NULL) {
+        error_handler("malloc");
+    }
+    while (p < end) {
+        const char *newline = memchr(p, '\n', end - p);
+        size_t length = (newline != NULL ? newline : end) - p;
+
+        if (length > 0 && p[length - 1] == '\r') {
+            length--;
+        }
+        git->head[git->num_head++] = hash_line(p, length);
+        p = newline != NULL ? newline + 1 : end;
+    }
+
+    doc_index_to(SIZE_MAX);
+    git_unhash_all();
+    git->ready = 1;
+    buf_observe(git_buffer_changed);
+    git_diff_start();
+}
+
+/* More of HEAD's copy of the file from `git show`. */
+void git_readable(void) {
+    struct git *git = &E.git;
+    size_t total = 0;
+    int status = -1;
+    int ok = 0;
+    ssize_t n;
+
+    while (total < GIT_READ_BUDGET) {
+        if (git->blob_capacity - git->blob_length < GIT_READ_SIZE) {
+            size_t capacity = git->blob_capacity ? git->blob_capacity * 2 : GIT_READ_SIZE * 4;
+            char *grown;
+
+            if (git->blob_length > GIT_BLOB_MAX) {
+                kill(-git->pid, SIGKILL);
+                break;
+            }
+            if ((grown = realloc(git->blob, capacity)) == NULL) {
+                error_handler("realloc");
+            }
+            git->blob = grown;
+            git->blob_capacity = capacity;
+        }
+        n = read(git->fd, git->blob + git->blob_length, git->blob_capacity - git->blob_length);
+        if (n > 0) {
+            git->blob_length += n;
+            total += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && errno == EAGAIN) {
+            return;
+        } else {
+            ok = n == 0;
+            break;
+        }
+    }
+    if (total >= GIT_READ_BUDGET) {
+        return;
+    }
+
+    watch_remove(git->fd);
+    close(git->fd);
+    while (waitpid(git->pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    git->loading = 0;
+    git->pid = 0;
+    /* Not in a repository, or not committed: no gutter. */
+    if (ok && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        git_head_loaded();
+    }
+    free(git->blob);
+    git->blob = NULL;
+    git->blob_length = 0;
+    git->blob_capacity = 0;
+}
+
+/* Ask git for HEAD's copy of the open file. Nothing waits on it; outside a repository it quietly comes to nothing. */
+void git_start(void) {
+    struct git *git = &E.git;
+    const char *name = E.doc.filename;
+    char *dir;
+    char *base;
+    char *quoted;
+    char *command;
+
+    if (name == NULL || E.read_only || E.doc.unnamed || E.dir.active || E.doc.size > GIT_BLOB_MAX) {
+        return;
+    }
+    if (pipe(git->wakeup) == -1) {
+        error_handler("pipe");
+    }
+    fcntl(git->wakeup[0], F_SETFL, O_NONBLOCK);
+    fcntl(git->wakeup[0], F_SETFD, FD_CLOEXEC);
+    fcntl(git->wakeup[1], F_SETFD, FD_CLOEXEC);
+    pthread_mutex_init(&git->lock, NULL);
+    watch_add(git->wakeup[0], git_diff_done);
+
+    dir = strdup(name);
+    if (dir == NULL) {
+        error_handler("strdup");
+    }
+    base = strrchr(name, '/') != NULL ? strrchr(name, '/') + 1 : (char *)name;
+    if (strchr(dir, '/') != NULL) {
+        path_parent(dir);
+    } else {
+        strcpy(dir, ".");
+    }
+    quoted = shell_quote(base);
+    command = malloc(strlen(quoted) + 64);
+    if (command == NULL) {
+        error_handler("malloc");
+    }
+    /* "HEAD:./name" is relative to the working directory, which spares us finding the top of the repository. */
+    sprintf(command, "git --no-pager show HEAD:./%s 2>/dev/null", quoted);
+    git->pid = spawn_shell(dir, command, NULL, &git->fd);
+    if (git->pid != -1) {
+        fcntl(git->fd, F_SETPIPE_SZ, JOB_PIPE_SIZE); /* Fewer wakeups, each with more of the file. */
+        git->loading = 1;
+        watch_add(git->fd, git_readable);
+    }
+    free(command);
+    free(quoted);
+    free(dir);
+}
+
+/* The gutter mark for buffer line `line`. */
+int git_mark_at(size_t line) {
+    struct git *git = &E.git;
+
+    return git->ready && line < git->num_lines ? git->marks[line] : GIT_UNCHANGED;
+}
+
+/* --------------------------------- Scripts -------------------------------- */
+/*
+Line edits, typed at the M-x prompt or run over a stream with --batch. A script has one command per line:
+
+    [address[,address]][!] command
+
+An address is a line number or /text/, the lines containing text; two make a range, from a line the first selects
+through the next one the second does. ! selects the lines the address doesn't. The commands are `replace /old/new/`
+(any delimiter; \ escapes it), `delete`, `upcase`, `downcase` and `trim` (trailing blanks). Every line goes through the
+commands in turn and they see only that line, so a script runs over a stream in one pass, holding one line at a time.
+*/
+const char *script_op_names[] = {"replace", "delete", "upcase", "downcase", "trim"};
+
+/*
+Text from *p up to an unescaped `delim`, with \ before the delimiter or \ itself taking it literally and \t a tab.
+Allocated; *p is left past the closing delimiter. NULL if there is none.
+*/
+char *script_parse_text(const char **p, char delim, size_t *length) {
+    const char *s = *p;
+    char *text = malloc(strlen(s) + 1);
+    size_t n = 0;
+
+    if (text == NULL) {
+        error_handler("malloc");
+    }
+    for (; *s != delim; s++) {
+        if (*s == '\0' || *s == '\r' || *s == '\n') {
+            free(text);
+            return NULL;
+        }
+        if (*s == '\\' && (s[1] == delim || s[1] == '\\' || s[1] == 't')) {
+            s++;
+            text[n++] = *s == 't' && delim != 't' ? '\t' : *s;
+        } else {
+            text[n++] = *s;
+        }
+    }
+    text[n] = '\0';
+    *p = s + 1;
+    *length = n;
+    return text;
+}
+
+/* A line number or /text/ at *p. Returns 1 if there was one, 0 if not, -1 if it is malformed. */
+int script_parse_address(const char **p, struct script_address *address) {
+    if (isdigit((unsigned char)**p)) {
+        address->line = strtoul(*p, (char **)p, 10);
+        return address->line > 0 ? 1 : -1;
+    }
+    if (**p == '/') {
+        (*p)++;
+        address->text = script_parse_text(p, '/', &address->length);
+        return address->text != NULL && address->length > 0 ? 1 : -1;
+    }
+    return 0;
+}
+
+void script_free_command(struct script_command *c) {
+    free(c->from.text);
+    free(c->to.text);
+    free(c->old);
+    free(c->new);
+}
+
+/* Add a line of script. Blank lines and # comments are skipped. Returns -1 if it isn't a command. */
+int script_parse_line(struct script *script, const char *line) {
+    struct script_command c;
+    const char *p = line + strspn(line, " \t");
+    size_t length;
+    int n;
+
+    memset(&c, 0, sizeof(c));
+    c.op = -1;
+    if (*p == '\0' || *p == '#' || *p == '\r' || *p == '\n') {
+        return 0;
+    }
+    if ((n = script_parse_address(&p, &c.from)) == -1) {
+        goto bad;
+    }
+    c.addresses = n;
+    if (n == 1 && *p == ',') {
+        p++;
+        if (script_parse_address(&p, &c.to) != 1) {
+            goto bad;
+        }
+        c.addresses = 2;
+    }
+    p += strspn(p, " \t");
+    if (*p == '!' && c.addresses > 0) {
+        c.invert = 1;
+        p++;
+        p += strspn(p, " \t");
+    }
+    length = strcspn(p, " \t\r\n");
+    for (int i = 0; i < (int)(sizeof(script_op_names) / sizeof(script_op_names[0])); i++) {
+        if (strlen(script_op_names[i]) == length && strncmp(p, script_op_names[i], length) == 0) {
+            c.op = i;
+        }
+    }
+    p += length;
+    p += strspn(p, " \t");
+    if (c.op == SCRIPT_REPLACE) {
+        char delim = *p;
+
+        if (delim == '\0' || delim == '\\' || isspace((unsigned char)delim)) {
+            goto bad;
+        }
+        p++;
+        if ((c.old = script_parse_text(&p, delim, &c.old_length)) == NULL || c.old_length == 0 ||
+            (c.new = script_parse_text(&p, delim, &c.new_length)) == NULL) {
+            goto bad;
+        }
+        p += strspn(p, " \t");
+    }
+    if (c.op == -1 || (*p != '\0' && *p != '\r' && *p != '\n')) {
+        goto bad;
+    }
+
+    if (script->count == script->capacity) {
+        int capacity = script->capacity ? script->capacity * 2 : 8;
+        struct script_command *commands = realloc(script->commands, capacity * sizeof(*commands));
+
+        if (commands == NULL) {
+            error_handler("realloc");
+        }
+        script->commands = commands;
+        script->capacity = capacity;
+    }
+    script->commands[script->count++] = c;
+    return 0;
+
+bad:
+    script_free_command(&c);
+    return -1;
+}
+
+void script_free(struct script *script) {
+    for (int i = 0; i < script->count; i++) {
+        script_free_command(&script->commands[i]);
+    }
+    free(script->commands);
+    ab_free(&script->text[0]);
+    ab_free(&script->text[1]);
+    memset(script, 0, sizeof(*script));
+}
+
+/* Does line `number` (1-based) match `address`? The last address of a range matches every line from its number on. */
+int script_address_matches(const struct script_address *address, size_t number, const char *s, size_t length) {
+    if (address->text == NULL) {
+        return number == address->line;
+    }
+    return length >= address->length && memmem(s, length, address->text, address->length) != NULL;
+}
+
+/* Is line `number` one `c` applies to? Ranges keep their state from line to line, so lines must come in order. */
+int script_selects(struct script_command *c, size_t number, const char *s, size_t length) {
+    int selected;
+
+    if (c->addresses == 0) {
+        return 1;
+    }
+    if (c->addresses == 1) {
+        selected = script_address_matches(&c->from, number, s, length);
+    } else if (!c->in_range) {
+        selected = script_address_matches(&c->from, number, s, length);
+        /* A range ending at a line number already passed is just the one line. */
+        c->in_range = selected && (c->to.text != NULL || c->to.line > number);
+    } else {
+        selected = 1;
+        c->in_range = c->to.text != NULL ? !script_address_matches(&c->to, number, s, length) : c->to.line > number;
+    }
+    return selected != c->invert;
+}
+
+/*
+Run line `number` (1-based) through the script. Returns 0 if it was deleted; otherwise *out and *out_length are the
+result, which is `s` itself if nothing changed it and otherwise lasts until the next call.
+*/
+int script_edit(struct script *script, size_t number, const char *s, size_t length, const char **out,
+                size_t *out_length) {
+    int next = 0; /* The text buffer the next change is written to: not the one `s` may be in. */
+
+    for (int i = 0; i < script->count; i++) {
+        struct script_command *c = &script->commands[i];
+        struct abuf *ab = &script->text[next];
+        const char *p;
+        const char *hit;
+
+        if (!script_selects(c, number, s, length)) {
+            continue;
+        }
+        switch (c->op) {
+        case SCRIPT_DELETE:
+            return 0;
+        case SCRIPT_TRIM:
+            while (length > 0 && (s[length - 1] == ' ' || s[length - 1] == '\t')) {
+                length--;
+            }
+            continue;
+        case SCRIPT_REPLACE:
+            if (length < c->old_length || (hit = memmem(s, length, c->old, c->old_length)) == NULL) {
+                continue;
+            }
+            ab_reset(ab);
+            for (p = s; hit != NULL; p = hit + c->old_length, hit = memmem(p, s + length - p, c->old, c->old_length)) {
+                ab_append(ab, p, hit - p);
+                ab_append(ab, c->new, c->new_length);
+            }
+            ab_append(ab, p, s + length - p);
+            break;
+        default:
+            ab_reset(ab);
+            ab_append(ab, s, length);
+            for (uint j = 0; j < ab->length; j++) {
+                ab->str[j] = c->op == SCRIPT_UPCASE ? toupper((unsigned char)ab->str[j]) :
+                                                      tolower((unsigned char)ab->str[j]);
+            }
+            break;
+        }
+        s = ab->str != NULL ? ab->str : "";
+        length = ab->length;
+        next ^= 1;
+    }
+
+    *out = s;
+    *out_length = length;
+    return 1;
+}
+
+/* Read a script file. Returns -1, having said where, if a line of it isn't a command. */
+int script_load(struct script *script, const char *path) {
+    FILE *fp = fopen(path, "r");
+    char *line = NULL;
+    size_t capacity = 0;
+    int number = 0;
+    int result = 0;
+
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+    while (result == 0 && getline(&line, &capacity, fp) != -1) {
+        number++;
+        if (script_parse_line(script, line) == -1) {
+            fprintf(stderr, "%s:%d: bad command\n", path, number);
+            result = -1;
+        }
+    }
+    free(line);
+    fclose(fp);
+    return result;
+}
+
+/* Write out and empty `ab`. */
+int script_write(struct abuf *ab) {
+    size_t written = 0;
+    ssize_t n;
+
+    while (written < (size_t)ab->length) {
+        n = write(STDOUT_FILENO, ab->str + written, ab->length - written);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            perror("write");
+            return -1;
+        }
+        written += n;
+    }
+    ab_reset(ab);
+    return 0;
+}
+
+/*
+kilo --batch: run the script at `path` over `in`, writing to stdout. Input is read into a window of SCRIPT_WINDOW bytes
+that slides along it, lines are edited in place in the window and output goes out in SCRIPT_WRITE_SIZE writes, so
+memory stays the same however long the stream is (the window only grows for a line longer than it). Line endings are
+kept as they were. Returns the exit status.
+*/
+int script_batch(const char *path, int in) {
+    struct script script;
+    struct abuf output = ABUF_INIT;
+    size_t capacity = SCRIPT_WINDOW;
+    char *window = malloc(capacity);
+    size_t have = 0;
+    size_t number = 0;
+    int eof = 0;
+
+    memset(&script, 0, sizeof(script));
+    if (window == NULL) {
+        error_handler("malloc");
+    }
+    if (script_load(&script, path) == -1) {
+        return 2;
+    }
+    posix_fadvise(in, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    for (;;) {
+        size_t start = 0;
+        char *newline;
+        const char *s;
+        size_t length;
+        ssize_t n;
+
+        while ((newline = memchr(window + start, '\n', have - start)) != NULL || (eof && start < have)) {
+            size_t end = newline != NULL ? (size_t)(newline - window) : have;
+            int crlf = newline != NULL && end > start && window[end - 1] == '\r';
+
+            if (script_edit(&script, ++number, window + start, end - start - crlf, &s, &length)) {
+                ab_append(&output, s, length);
+                if (newline != NULL) {
+                    ab_append(&output, "\r\n" + !crlf, 1 + crlf);
+                }
+            }
+            start = newline != NULL ? end + 1 : have;
+            if (output.length >= SCRIPT_WRITE_SIZE && script_write(&output) == -1) {
+                return 1;
+            }
+        }
+        if (eof) {
+            break;
+        }
+
+        memmove(window, window + start, have - start);
+        have -= start;
+        if (have == capacity) {
+            char *grown = realloc(window, capacity * 2);
+
+            if (grown == NULL) {
+                error_handler("realloc");
+            }
+            window = grown;
+            capacity *= 2;
+        }
+        n = read(in, window + have, capacity - have);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            perror("read");
+            return 1;
+        }
+        have += n;
+        eof = n == 0;
+    }
+
+    if (script_write(&output) == -1) {
+        return 1;
+    }
+    free(window);
+    ab_free(&output);
+    script_free(&script);
+    return 0;
+}
+
+/*
+Run a script over buffer lines [from, to), inside the caller's edit. Each run of changed lines becomes a single
+replacement, so a script touching every line costs one piece per run rather than one per line. Returns the lines
+changed.
+*/
+size_t script_run_buffer(struct script *script, size_t from, size_t to) {
+    char *line = NULL;
+    size_t capacity = 0;
+    size_t at = from; /* Where the next line to read is now. */
+    size_t run_at = 0; /* The changed lines not yet replaced: `run_removed` lines at `run_at`... */
+    size_t run_removed = 0;
+    size_t run_first = 0; /* ...to become `run_lines` added lines from `run_first`. */
+    size_t run_lines = 0;
+    size_t changed = 0;
+
+    for (size_t number = from; number < to; number++) {
+        size_t length = buf_line_copy(at, &line, &capacity);
+        const char *s;
+        size_t n;
+        int kept = script_edit(script, number + 1, line, length, &s, &n);
+
+        if (kept && n == length && memcmp(s, line, n) == 0) {
+            if (run_removed > 0) {
+                buf_replace(run_at, run_removed, run_first, run_lines);
+                at = at - run_removed + run_lines;
+                run_removed = 0;
+            }
+            at++;
+            continue;
+        }
+        if (run_removed == 0) {
+            run_at = at;
+            run_lines = 0;
+        }
+        run_removed++;
+        if (kept) {
+            buf_add_bytes(s, n);
+            if (run_lines++ == 0) {
+                run_first = buf_add_line();
+            } else {
+                buf_add_line();
+            }
+        }
+        changed++;
+        at++;
+    }
+    if (run_removed > 0) {
+        buf_replace(run_at, run_removed, run_first, run_lines);
+    }
+    free(line);
+    return changed;
+}
+
+/* --------------------------------- Filters -------------------------------- */
+/*
+`!command` at the script prompt pipes the selected lines (or all of them) through a shell command and puts its output
+in their place. Runs of lines still in the mapped file go into the pipe with vmsplice(), which passes the kernel the
+mapped pages rather than copying them out; only edited lines are copied, from the add buffer. Output is read in the
+same poll loop as input is written, so a command that writes before it has read everything can't deadlock on a full
+pipe, and it goes straight into the add buffer as lines. Nothing changes until the command has succeeded; then the
+region is replaced in one edit, undone in one step.
+*/
+
+/* Point f->pending at the next bytes of the region. Returns 0 once it has all been sent. */
+int filter_fill(struct filter *f) {
+    int source;
+    size_t index;
+    size_t count;
+    size_t length;
+
+    while (f->pending_length == 0) {
+        if (f->offset < f->end) {
+            f->pending = doc_span(f->offset, &length);
+            f->pending_length = length < f->end - f->offset ? length : f->end - f->offset;
+            f->splice = E.doc.map != NULL;
+            f->offset += f->pending_length;
+            /* The last line of a file may have no newline, but the command should see a whole line. */
+            f->newline = f->offset == f->end && doc_byte(f->end - 1) != '\n';
+            return 1;
+        }
+        if (f->newline) {
+            f->pending = "\n";
+            f->pending_length = 1;
+            f->splice = 0;
+            f->newline = 0;
+            return 1;
+        }
+        if (f->line >= f->to || !buf_locate_run(f->line, &source, &index, &count)) {
+            return 0;
+        }
+        if (count > f->to - f->line) {
+            count = f->to - f->line;
+        }
+        if (source == PIECE_DOCUMENT) {
+            f->offset = doc_line_start(index);
+            f->end = index + count < E.doc.num_lines ? doc_line_start(index + count) : E.doc.index_pos;
+            f->line += count;
+            continue;
+        }
+        /* Edited lines have no newlines between them in the add buffer: copy them out with newlines added. */
+        ab_reset(&f->staging);
+        for (size_t i = 0; i < count && f->staging.length < FILTER_IO_SIZE; i++, f->line++) {
+            struct added_line *added = &E.buf.added[index + i];
+
+            ab_append(&f->staging, E.buf.add_region.base + added->offset, added->length);
+            ab_append(&f->staging, "\n", 1);
+        }
+        f->pending = f->staging.str;
+        f->pending_length = f->staging.length;
+        f->splice = 0;
+    }
+    return 1;
+}
+
+/* Send what the pipe will take. Returns 0 when done: the region has all been sent, or the command stopped reading. */
+int filter_write(struct filter *f) {
+    ssize_t n;
+
+    for (;;) {
+        if (f->pending_length == 0 && !filter_fill(f)) {
+            return 0;
+        }
+        if (f->splice) {
+            struct iovec iov = {(void *)f->pending, f->pending_length};
+
+            n = vmsplice(f->in, &iov, 1, SPLICE_F_NONBLOCK);
+        } else {
+            n = write(f->in, f->pending, f->pending_length);
+        }
+        if (n > 0) {
+            f->pending += n;
+            f->pending_length -= n;
+            f->sent += n;
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && errno == EAGAIN) {
+            return 1;
+        } else {
+            return 0; /* EPIPE: it has read all it wants, like `head`. */
+        }
+    }
+}
+
+/* Add whole lines of output to the add buffer. */
+void filter_add_lines(struct filter *f, size_t length, int eof) {
+    size_t start = 0;
+    char *newline;
+
+    while ((newline = memchr(f->output + start, '\n', length - start)) != NULL || (eof && start < length)) {
+        size_t end = newline != NULL ? (size_t)(newline - f->output) : length;
+        size_t index;
+
+        buf_add_bytes(f->output + start, end - start - (end > start && f->output[end - 1] == '\r'));
+        index = buf_add_line();
+        if (f->lines++ == 0) {
+            f->first = index;
+        }
+        start = newline != NULL ? end + 1 : length;
+    }
+    memmove(f->output, f->output + start, length - start);
+    f->partial = length - start;
+}
+
+/* Read what the command has written. Returns 0 at the end of its output. */
+int filter_read(struct filter *f) {
+    ssize_t n;
+
+    for (;;) {
+        if (f->output_capacity - f->partial < FILTER_IO_SIZE) {
+            size_t capacity = f->output_capacity ? f->output_capacity * 2 : FILTER_IO_SIZE * 2;
+            char *grown = realloc(f->output, capacity);
+
+            if (grown == NULL) {
+                error_handler("realloc");
+            }
+            f->output = grown;
+            f->output_capacity = capacity;
+        }
+        n = read(f->out, f->output + f->partial, f->output_capacity - f->partial);
+        if (n > 0) {
+            filter_add_lines(f, f->partial + n, 0);
+        } else if (n == -1 && errno == EINTR) {
+            continue;
+        } else if (n == -1 && errno == EAGAIN) {
+            return 1;
+        } else {
+            filter_add_lines(f, f->partial, 1);
+            return 0;
+        }
+    }
+}
+
+/* Identity hash of buffer line `line`, as the piece tree has it. */
+uint64_t filter_line_hash(size_t line) {
+    int source;
+    size_t index;
+
+    return buf_locate(line, &source, &index) ? piece_own_hash(source, index, 1) : 0;
+}
+
+/*
+Make buffer lines [from, from + n) into the `m` added lines from `first` by replacing only the runs that differ, found
+with the gutter's line-hash diff. Lines the edit leaves alone keep their pieces (and the document's, if they had them),
+so nothing that follows lines around has to start over. Hunks are applied last first, so line numbers ahead of each
+are still right. Returns the number of hunks.
+*/
+size_t filter_apply_diff(size_t from, size_t n, size_t first, size_t m) {
+    uint64_t *a = malloc((n + 1) * sizeof(uint64_t));
+    uint64_t *b = malloc((m + 1) * sizeof(uint64_t));
+    unsigned char *marks;
+    size_t *deleted;
+    size_t prefix = 0;
+    size_t suffix = 0;
+    size_t (*hunks)[4] = NULL; /* Lines at, lines removed, added line, lines added: all from the prefix on. */
+    size_t num_hunks = 0;
+    size_t x = 0;
+    size_t y = 0;
+
+    if (a == NULL || b == NULL) {
+        error_handler("malloc");
+    }
+    for (size_t i = 0; i < n; i++) {
+        a[i] = filter_line_hash(from + i);
+    }
+    for (size_t i = 0; i < m; i++) {
+        b[i] = piece_own_hash(PIECE_ADDED, first + i, 1);
+    }
+    while (prefix < n && prefix < m && a[prefix] == b[prefix]) {
+        prefix++;
+    }
+    while (suffix < n - prefix && suffix < m - prefix && a[n - 1 - suffix] == b[m - 1 - suffix]) {
+        suffix++;
+    }
+    n -= prefix + suffix;
+    m -= prefix + suffix;
+    marks = calloc(m + 1, 1);
+    deleted = calloc(m + 1, sizeof(*deleted));
+    hunks = malloc((m + 2) * sizeof(*hunks));
+    if (marks == NULL || deleted == NULL || hunks == NULL) {
+        error_handler("malloc");
+    }
+
+    if ((n > 0 || m > 0) && git_diff_script(NULL, a + prefix, n, b + prefix, m, marks, deleted) == -1) {
+        /* Too different to be worth it: the middle goes in one piece. */
+        memset(marks, GIT_ADDED, m);
+        memset(deleted, 0, (m + 1) * sizeof(*deleted));
+        deleted[0] = n;
+    }
+    /* Walk the script: deletions and insertions between matched lines make a hunk. */
+    while (n > 0 || m > 0) {
+        size_t x_at = x;
+        size_t y_at = y;
+
+        for (;;) {
+            x += deleted[y];
+            if (y < m && marks[y] == GIT_ADDED) {
+                y++;
+            } else {
+                break;
+            }
+        }
+        if (x > x_at || y > y_at) {
+            hunks[num_hunks][0] = x_at;
+            hunks[num_hunks][1] = x - x_at;
+            hunks[num_hunks][2] = y_at;
+            hunks[num_hunks][3] = y - y_at;
+            num_hunks++;
+        }
+        if (y == m) {
+            break;
+        }
+        x++;
+        y++;
+    }
+    for (size_t i = num_hunks; i > 0; i--) {
+        size_t *h = hunks[i - 1];
+
+        buf_replace(from + prefix + h[0], h[1], first + prefix + h[2], h[3]);
+    }
+
+    free(hunks);
+    free(deleted);
+    free(marks);
+    free(b);
+    free(a);
+    return num_hunks;
+}
+
+/*
+Replace buffer lines [from, to) with their output through `command`, inside the caller's edit: wholesale, or if
+`minimal` hunk by hunk where they differ. Keys other than C-g (which kills the command) are ignored until it
+finishes. Returns the lines of output (hunks applied, if `minimal`), or -1 if it didn't succeed.
+*/
+long filter_region(const char *command, size_t from, size_t to, int minimal) {
+    struct filter *f = calloc(1, sizeof(*f)); /* Not a local: it changes after the sigsetjmp() below. */
+    sigjmp_buf jump;
+    sigjmp_buf *outer = E.bus_jump;
+    pid_t pid;
+    int status = -1;
+    volatile int cancelled = 0; /* Both change after the sigsetjmp() below, and are read after it returns again. */
+    volatile long long shown = now_ms();
+    char size[16];
+    long lines;
+
+    if (f == NULL) {
+        error_handler("calloc");
+    }
+    f->line = from;
+    f->to = to;
+    if ((pid = spawn_shell(NULL, command, &f->in, &f->out)) == -1) {
+        editor_set_status_message("Can't run %s: %s", command, strerror(errno));
+        free(f);
+        return -1;
+    }
+    fcntl(f->in, F_SETPIPE_SZ, FILTER_PIPE_SIZE);
+    fcntl(f->out, F_SETPIPE_SZ, FILTER_PIPE_SIZE);
+    editor_set_status_message("Filtering through %s (C-g to stop)", command);
+
+    /* If the file is truncated while we send it, stop the command and tidy up before recovering. */
+    if (sigsetjmp(jump, 1) != 0) {
+        E.bus_jump = outer;
+        kill(-pid, SIGKILL);
+        cancelled = -1;
+    } else {
+        E.bus_jump = &jump;
+        editor_refresh_screen();
+    }
+
+    while (f->out != -1 && !cancelled) {
+        struct pollfd pfds[3] = {{STDIN_FILENO, POLLIN, 0}, {f->out, POLLIN, 0}, {f->in, POLLOUT, 0}};
+        char keys[64];
+        ssize_t n;
+
+        if (poll(pfds, f->in != -1 ? 3 : 2, 250) == -1 && errno != EINTR) {
+            error_handler("poll");
+        }
+        if ((pfds[0].revents & POLLIN || E.session.replaying) && (n = session_read(keys, sizeof(keys))) > 0) {
+            cancelled = memchr(keys, CTRL_KEY('g'), n) != NULL;
+        }
+        if (f->in != -1 && pfds[2].revents != 0 && !filter_write(f)) {
+            close(f->in); /* End of input for the command. */
+            f->in = -1;
+        }
+        if (pfds[1].revents != 0 && !filter_read(f)) {
+            close(f->out);
+            f->out = -1;
+        }
+        if (now_ms() - shown >= 250) {
+            format_size(size, sizeof(size), f->sent);
+            editor_set_status_message("Filtering through %s: %s sent, %zu lines back (C-g to stop)", command, size,
+                                      f->lines);
+            editor_refresh_screen();
+            shown = now_ms();
+        }
+    }
+
+    E.bus_jump = outer;
+
+    if (cancelled == 1) {
+        kill(-pid, SIGKILL);
+    }
+    if (f->in != -1) {
+        close(f->in);
+    }
+    if (f->out != -1) {
+        close(f->out);
+    }
+    while (waitpid(pid, &status, 0) == -1 && errno == EINTR) {
+    }
+    ab_free(&f->staging);
+    free(f->output);
+
+    if (cancelled == -1) {
+        free(f);
+        doc_recover_truncation();
+        return -1;
+    }
+    if (cancelled) {
+        free(f);
+        editor_set_status_message("Filter stopped; nothing changed");
+        return -1;
+    }
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        editor_set_status_message("%s failed (status %d); nothing changed", command,
+                                  WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+        free(f);
+        return -1;
+    }
+    if (minimal) {
+        lines = (long)filter_apply_diff(from, to - from, f->first, f->lines);
+    } else {
+        buf_replace(from, to - from, f->first, f->lines);
+        lines = (long)f->lines;
+    }
+    free(f);
+    return lines;
+}
+
+/* `format .ext command` or `format-on-save .ext command` in ~/.kilorc. */
+int format_parse_line(const char *line) {
+    struct formatter *formatter = &E.formatters[E.num_formatters];
+    const char *p = line + strcspn(line, " \t");
+    size_t n;
+
+    if (E.num_formatters == FORMATTERS_MAX) {
+        return -1;
+    }
+    formatter->on_save = strncmp(line, "format-on-save", p - line) == 0 && p - line == 14;
+    if (!formatter->on_save && p - line != 6) {
+        return -1;
+    }
+    p += strspn(p, " \t");
+    n = strcspn(p, " \t\r\n");
+    if (n == 0 || n >= sizeof(formatter->extension)) {
+        return -1;
+    }
+    memcpy(formatter->extension, p, n);
+    formatter->extension[n] = '\0';
+    p += n;
+    p += strspn(p, " \t");
+    n = strcspn(p, "\r\n");
+    if (n == 0 || n >= sizeof(formatter->command)) {
+        return -1;
+    }
+    memcpy(formatter->command, p, n);
+    formatter->command[n] = '\0';
+    E.num_formatters++;
+
+    return 0;
+}
+
+/* The formatter for the open file, or NULL. */
+const struct formatter *format_find(void) {
+    const char *name = E.doc.filename;
+    const struct formatter *found = NULL;
+
+    if (name == NULL || E.doc.unnamed || E.dir.active) {
+        return NULL;
+    }
+    for (int i = 0; i < E.num_formatters; i++) {
+        size_t length = strlen(E.formatters[i].extension);
+
+        if (strlen(name) >= length && strcmp(name + strlen(name) - length, E.formatters[i].extension) == 0) {
+            found = &E.formatters[i];
+        }
+    }
+    return found;
+}
+
+/*
+Format lines [from, to) with the file's formatter, as one undo group. Only the hunks that differ are edited, so
+formatting an already tidy file changes nothing and leaves it unmodified. Returns -1 if the formatter failed.
+*/
+int format_region(const struct formatter *formatter, size_t from, size_t to) {
+    long hunks;
+
+    buf_begin_edit(0);
+    hunks = filter_region(formatter->command, from, to, 1);
+    editor_clamp_cursor();
+    buf_end_edit();
+    if (hunks >= 0) {
+        editor_set_status_message(hunks > 0 ? "Formatted: %ld hunk%s changed" : "Already formatted", hunks,
+                                  hunks == 1 ? "" : "s");
+    }
+    return hunks >= 0 ? 0 : -1;
+}
+
+/* --------------------------------- Reflow --------------------------------- */
+/*
+Hard-wrapping paragraphs to E.fill_column. A paragraph is a run of non-blank lines with the same comment marker
+(//, #, ;, --, > or the * of a block comment), broken before each list item (-, *, + or 1. / 1)). Its words are refilled
+greedily; the first line keeps its prefix and later lines take the second line's, or for a list item the first line's
+padded past the bullet. Paragraphs don't depend on each other, so the region is cut into slices at kept lines, each
+reflowed by its own thread into its own memory, text and line hashes both; the main thread only appends the slices to
+the add buffer and lets filter_apply_diff() edit the lines that came out different, as one undo group.
+*/
+
+/* Leading blanks of `s`. */
+size_t reflow_indent(const char *s, size_t length) {
+    size_t i = 0;
+
+    while (i < length && (s[i] == ' ' || s[i] == '\t')) {
+        i++;
+    }
+    return i;
+}
+
+/* Columns `s` takes starting at column `col`: tabs go to the next stop, UTF-8 continuation bytes take none. */
+size_t reflow_width(const char *s, size_t length, size_t col) {
+    for (size_t i = 0; i < length; i++) {
+        if (s[i] == '\t') {
+            col += KILO_TAB_STOP - col % KILO_TAB_STOP;
+        } else if (((unsigned char)s[i] & 0xc0) != 0x80) {
+            col++;
+        }
+    }
+    return col;
+}
+
+/*
+The part of a line every line of its paragraph repeats: indentation, then any comment marker and the blanks after it.
+The marker is *marker bytes (0 if there is none) from the end of the indentation.
+*/
+size_t reflow_prefix(const char *s, size_t length, size_t *marker) {
+    static const char *markers[] = {"//", "#", ";", "--", ">", NULL};
+    size_t start = reflow_indent(s, length);
+    size_t i = start;
+
+    for (int m = 0; markers[m] != NULL; m++) {
+        size_t n = strlen(markers[m]);
+
+        if (length - i >= n && memcmp(s + i, markers[m], n) == 0) {
+            i += n;
+            while (i < length && s[i] == s[start]) {
+                i++; /* ///, ;;, > > */
+            }
+            break;
+        }
+    }
+    /* A block comment's continuation: " * text", which an indented list item can't be told apart from anyway. */
+    if (i == start && start > 0 && i < length && s[i] == '*' && (i + 1 == length || s[i + 1] == ' ')) {
+        i++;
+    }
+    *marker = i - start;
+    while (i < length && (s[i] == ' ' || s[i] == '\t')) {
+        i++;
+    }
+    return i;
+}
+
+/* Length of a list item's bullet and the blanks after it at the start of `s`, or 0. */
+size_t reflow_bullet(const char *s, size_t length) {
+    size_t i = 0;
+
+    if (length >= 2 && (s[0] == '-' || s[0] == '*' || s[0] == '+') && s[1] == ' ') {
+        i = 1;
+    } else {
+        while (i < length && i < 9 && isdigit((unsigned char)s[i])) {
+            i++;
+        }
+        if (i == 0 || i + 1 >= length || (s[i] != '.' && s[i] != ')') || s[i + 1] != ' ') {
+            return 0;
+        }
+        i++;
+    }
+    while (i < length && s[i] == ' ') {
+        i++;
+    }
+    return i;
+}
+
+/* End a line of a slice's output. */
+void reflow_emit(struct reflow_slice *slice, size_t start) {
+    if (slice->num_out == slice->out_capacity) {
+        size_t capacity = slice->out_capacity ? slice->out_capacity * 2 : 256;
+        size_t *lengths = realloc(slice->lengths, capacity * sizeof(size_t));
+        uint64_t *hashes = lengths != NULL ? realloc(slice->hashes, capacity * sizeof(uint64_t)) : NULL;
+
+        if (lengths == NULL || hashes == NULL) {
+            error_handler("realloc");
+        }
+        slice->lengths = lengths;
+        slice->hashes = hashes;
+        slice->out_capacity = capacity;
+    }
+    slice->lengths[slice->num_out] = slice->text.length - start;
+    slice->hashes[slice->num_out] = hash_line(slice->text.str + start, slice->text.length - start);
+    slice->num_out++;
+}
+
+/* Refill lines [first, end) of a slice, which make one paragraph. */
+void reflow_paragraph(struct reflow_slice *slice, size_t first, size_t end) {
+    const struct reflow_line *lines = slice->lines;
+    size_t marker;
+    size_t prefix = reflow_prefix(lines[first].s, lines[first].length, &marker);
+    size_t bullet = reflow_bullet(lines[first].s + prefix, lines[first].length - prefix);
+    const char *next_prefix = lines[first].s;
+    size_t next_length = prefix;
+    size_t next_pad = bullet; /* Blanks after the next prefix, to hang under a list item's text. */
+    size_t start = slice->text.length;
+    size_t col;
+    int fresh = 1; /* No word on the output line yet. */
+
+    if (bullet == 0 && end - first > 1) {
+        next_length = reflow_prefix(lines[first + 1].s, lines[first + 1].length, &marker);
+        next_prefix = lines[first + 1].s;
+    }
+    ab_append(&slice->text, lines[first].s, prefix + bullet);
+    col = reflow_width(lines[first].s, prefix + bullet, 0);
+
+    for (size_t i = first; i < end; i++) {
+        size_t skip = reflow_prefix(lines[i].s, lines[i].length, &marker);
+        const char *s = lines[i].s + skip + (i == first ? bullet : 0);
+        const char *line_end = lines[i].s + lines[i].length;
+
+        while (s < line_end) {
+            const char *word;
+            size_t width;
+
+            while (s < line_end && (*s == ' ' || *s == '\t')) {
+                s++;
+            }
+            word = s;
+            while (s < line_end && *s != ' ' && *s != '\t') {
+                s++;
+            }
+            if (s == word) {
+                break;
+            }
+            width = reflow_width(word, s - word, 0);
+            if (!fresh && col + 1 + width > (size_t)slice->width) {
+                reflow_emit(slice, start);
+                start = slice->text.length;
+                ab_append(&slice->text, next_prefix, next_length);
+                for (size_t pad = 0; pad < next_pad; pad++) {
+                    ab_append(&slice->text, " ", 1);
+                }
+                col = reflow_width(next_prefix, next_length, 0) + next_pad;
+                fresh = 1;
+            }
+            if (!fresh) {
+                ab_append(&slice->text, " ", 1);
+                col++;
+            }
+            ab_append(&slice->text, word, s - word);
+            col += width;
+            fresh = 0;
+        }
+    }
+    reflow_emit(slice, start);
+}
+
+/*
+Lines kept as they are, which separate paragraphs: those blank once their prefix is taken off, and those opening or
+closing a block comment.
+*/
+int reflow_is_kept(const struct reflow_line *line) {
+    size_t marker;
+    size_t indent = reflow_indent(line->s, line->length);
+    const char *s = line->s + indent;
+
+    if (line->length - indent >= 2 && (memcmp(s, "/*", 2) == 0 || memcmp(s, "*/", 2) == 0)) {
+        return 1;
+    }
+    return reflow_prefix(line->s, line->length, &marker) == line->length;
+}
+
+/* Do two lines have the same comment marker, or both none? Indentation may differ, as under a list item. */
+int reflow_same_marker(const struct reflow_line *a, const struct reflow_line *b) {
+    size_t a_marker;
+    size_t b_marker;
+    size_t a_at = reflow_indent(a->s, a->length);
+    size_t b_at = reflow_indent(b->s, b->length);
+
+    reflow_prefix(a->s, a->length, &a_marker);
+    reflow_prefix(b->s, b->length, &b_marker);
+    return a_marker == b_marker && memcmp(a->s + a_at, b->s + b_at, a_marker) == 0;
+}
+
+/* Reflow one slice. */
+void reflow_slice(struct reflow_slice *slice) {
+    const struct reflow_line *lines = slice->lines;
+    size_t i = 0;
+
+    while (i < slice->count) {
+        size_t end;
+
+        if (reflow_is_kept(&lines[i])) {
+            size_t start = slice->text.length;
+
+            ab_append(&slice->text, lines[i].s, lines[i].length);
+            reflow_emit(slice, start);
+            i++;
+            continue;
+        }
+        /* The paragraph goes on while the comment marker stays the same and no list item starts. */
+        for (end = i + 1; end < slice->count; end++) {
+            size_t marker;
+            size_t prefix = reflow_prefix(lines[end].s, lines[end].length, &marker);
+
+            if (reflow_is_kept(&lines[end]) || !reflow_same_marker(&lines[i], &lines[end]) ||
+                reflow_bullet(lines[end].s + prefix, lines[end].length - prefix) > 0) {
+                break;
+            }
+        }
+        reflow_paragraph(slice, i, end);
+        i = end;
+    }
+}
+
+/* Worker thread: reflow a run of slices. */
+void *reflow_worker(void *arg) {
+    struct reflow_job *job = arg;
+
+    for (size_t i = 0; i < job->count; i++) {
+        reflow_slice(&job->slices[i]);
+    }
+    return NULL;
+}
+
+/* Reflow buffer lines [from, to) inside the caller's edit. Returns the number of hunks that changed. */
+size_t reflow_region(size_t from, size_t to) {
+    size_t n = to - from;
+    struct reflow_line *lines = malloc((n + 1) * sizeof(*lines));
+    size_t *offsets = malloc((n + 1) * sizeof(*offsets)); /* Where each document line starts in the document. */
+    char *copy; /* The document lines, copied out so the workers never touch the mapping (a truncation faults). */
+    size_t copied = 0;
+    struct reflow_slice *slices;
+    size_t num_slices;
+    struct reflow_job jobs[REFLOW_THREADS_MAX];
+    pthread_t workers[REFLOW_THREADS_MAX];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : cpus > REFLOW_THREADS_MAX ? REFLOW_THREADS_MAX : (int)cpus;
+    size_t first = 0;
+    size_t total = 0;
+    size_t hunks;
+    size_t at = 0;
+
+    if (lines == NULL || offsets == NULL) {
+        error_handler("malloc");
+    }
+    /*
+    Find every line a run at a time: edited ones in the add buffer, document lines by the line index. The document lines
+    are measured first and copied once the total is known.
+    */
+    for (size_t line = from; line < to;) {
+        int source;
+        size_t index;
+        size_t count;
+
+        if (!buf_locate_run(line, &source, &index, &count)) {
+            break;
+        }
+        for (size_t k = 0; k < count && line < to; k++, line++, at++) {
+            if (source == PIECE_ADDED) {
+                lines[at].s = E.buf.add_region.base + E.buf.added[index + k].offset;
+                lines[at].length = E.buf.added[index + k].length;
+            } else {
+                offsets[at] = doc_line_start(index + k);
+                lines[at].s = NULL;
+                lines[at].length = doc_line_end(index + k) - offsets[at];
+                copied += lines[at].length;
+            }
+        }
+    }
+    n = at;
+    copy = malloc(copied + 1);
+    if (copy == NULL) {
+        error_handler("malloc");
+    }
+    copied = 0;
+    doc_read_begin();
+    for (at = 0; at < n; at++) {
+        if (lines[at].s == NULL) {
+            for (size_t offset = 0, length; offset < lines[at].length; offset += length) {
+                const char *span = doc_span(offsets[at] + offset, &length);
+
+                if (length > lines[at].length - offset) {
+                    length = lines[at].length - offset;
+                }
+                memcpy(copy + copied + offset, span, length);
+            }
+            lines[at].s = copy + copied;
+            copied += lines[at].length;
+        }
+    }
+    doc_read_end();
+
+    /*
+    Slices of about REFLOW_SLICE_LINES, so no one's output outgrows an abuf, each starting at a kept line so no
+    paragraph is cut in two; each thread then takes a run of them.
+    */
+    num_slices = n / REFLOW_SLICE_LINES + 1;
+    slices = calloc(num_slices, sizeof(*slices));
+    if (slices == NULL) {
+        error_handler("calloc");
+    }
+    at = 0;
+    for (size_t i = 0; i < num_slices; i++) {
+        size_t end = i + 1 < num_slices ? (i + 1) * REFLOW_SLICE_LINES : n;
+
+        if (end < at) {
+            end = at;
+        }
+        while (end < n && !reflow_is_kept(&lines[end])) {
+            end++;
+        }
+        slices[i].lines = lines + at;
+        slices[i].count = end - at;
+        slices[i].width = E.fill_column;
+        at = end;
+    }
+    if ((size_t)threads > num_slices) {
+        threads = (int)num_slices;
+    }
+    for (int t = 0; t < threads; t++) {
+        size_t start = t * num_slices / threads;
+
+        jobs[t].slices = slices + start;
+        jobs[t].count = (t + 1) * num_slices / threads - start;
+    }
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&workers[t], NULL, reflow_worker, &jobs[t]) != 0) {
+            error_handler("pthread_create");
+        }
+    }
+    reflow_worker(&jobs[0]);
+    for (int t = 1; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+
+    /* Lines added one after another have consecutive indices, so the slices line up as one run. */
+    for (size_t i = 0; i < num_slices; i++) {
+        if (slices[i].num_out > 0) {
+            size_t index = buf_add_lines(slices[i].text.str, slices[i].lengths, slices[i].hashes, slices[i].num_out);
+
+            if (total == 0) {
+                first = index;
+            }
+            total += slices[i].num_out;
+        }
+        ab_free(&slices[i].text);
+        free(slices[i].lengths);
+        free(slices[i].hashes);
+    }
+    free(slices);
+    hunks = filter_apply_diff(from, n, first, total);
+
+    free(copy);
+    free(offsets);
+    free(lines);
+    return hunks;
+}
+
+/* ----------------------------- Project Replace ---------------------------- */
+/*
+M-% replaces text in every file under the working directory. Worker threads share the walk: each takes a directory or
+a file off a common stack, pushing what a directory holds and streaming a file through in blocks of whole lines, so
+no file is ever held whole. Hidden entries, symlinks and binary files are passed over. The matches are previewed in
+the output panel, where M-n steps through them, and nothing changes until the prompt that follows is answered.
+Then the workers rewrite each file into a copy next to it; only once every copy is written are the originals
+hard-linked into a journal in REPLACE_JOURNAL and the copies renamed over them, so a failure anywhere changes
+nothing, and replace-rollback (C-x M-%) puts the journal's files back. The open file is edited in the buffer instead,
+in one undo group, and left for the user to save.
+*/
+
+/* Write out s->out and empty it. Returns -1 if the write failed. */
+int replace_flush(struct replace_stream *s, int out) {
+    for (size_t written = 0; written < s->out.length;) {
+        ssize_t n = write(out, s->out.str + written, s->out.length - written);
+
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return -1;
+        }
+        written += n;
+    }
+    ab_reset(&s->out);
+    return 0;
+}
+
+/*
+Search `length` bytes of whole lines starting at line *line of `path`. Scanning (`out` is -1), each match adds a
+`path:line:col: text` line to s->preview; rewriting, the block goes to `out` with every match replaced. Returns the
+matches, or -1 if a write failed.
+*/
+long replace_block(struct replace *r, struct replace_stream *s, const char *block, size_t length, size_t *line, int out,
+                   const char *path) {
+    const char *end = block + length;
+    const char *p = block;
+    const char *counted = block; /* Newlines before here are in *line. */
+    const char *hit;
+    const char *newline;
+    long matches = 0;
+
+    while (p < end && (hit = memmem(p, end - p, r->old, r->old_length)) != NULL) {
+        matches++;
+        if (out == -1) {
+            const char *start = memrchr(block, '\n', hit - block);
+            const char *stop = memchr(hit, '\n', end - hit);
+            char where[64];
+            int n;
+
+            start = start != NULL ? start + 1 : block;
+            stop = stop != NULL ? stop : end;
+            if (stop > start && stop[-1] == '\r') {
+                stop--;
+            }
+            if (stop - start > REPLACE_PREVIEW_MAX) {
+                stop = start + REPLACE_PREVIEW_MAX;
+            }
+            while ((newline = memchr(counted, '\n', hit - counted)) != NULL) {
+                (*line)++;
+                counted = newline + 1;
+            }
+            n = snprintf(where, sizeof(where), ":%zu:%zu: ", *line, (size_t)(hit - start) + 1);
+            ab_append(&s->preview, path, strlen(path));
+            ab_append(&s->preview, where, n);
+            ab_append(&s->preview, start, stop - start);
+            ab_append(&s->preview, "\n", 1);
+        } else {
+            ab_append(&s->out, p, hit - p);
+            ab_append(&s->out, r->new, r->new_length);
+            if (s->out.length >= REPLACE_BLOCK_SIZE && replace_flush(s, out) == -1) {
+                return -1;
+            }
+        }
+        p = hit + r->old_length;
+    }
+    if (out == -1) {
+        while ((newline = memchr(counted, '\n', end - counted)) != NULL) {
+            (*line)++;
+            counted = newline + 1;
+        }
+    } else {
+        ab_append(&s->out, p, end - p);
+        if (s->out.length >= REPLACE_BLOCK_SIZE && replace_flush(s, out) == -1) {
+            return -1;
+        }
+    }
+    return matches;
+}
+
+/*
+Stream the file open on `fd` through replace_block() a block of whole lines at a time; the block only grows past
+REPLACE_BLOCK_SIZE for a line longer than that. Returns the matches, -1 if reading or writing failed, or -2 for a binary
+file (a NUL near the start), which is left alone.
+*/
+long replace_stream(struct replace *r, struct replace_stream *s, int fd, int out, const char *path) {
+    size_t have = 0;
+    size_t line = 1;
+    long matches = 0;
+    int first = 1;
+
+    for (;;) {
+        ssize_t n;
+        size_t end;
+        long found;
+
+        if (have == s->capacity) {
+            size_t capacity = s->capacity ? s->capacity * 2 : REPLACE_BLOCK_SIZE;
+            char *block = realloc(s->block, capacity);
+
+            if (block == NULL) {
+                return -1;
+            }
+            s->block = block;
+            s->capacity = capacity;
+        }
+        n = read(fd, s->block + have, s->capacity - have);
+        if (n == -1 && errno == EINTR) {
+            continue;
+        }
+        if (n == -1) {
+            return -1;
+        }
+        if (first && memchr(s->block + have, '\0', n < 8192 ? n : 8192) != NULL) {
+            return -2;
+        }
+        first = 0;
+        have += n;
+        if (n > 0) {
+            const char *newline = memrchr(s->block, '\n', have);
+
+            if (newline == NULL) {
+                continue;
+            }
+            end = newline - s->block + 1;
+        } else {
+            end = have;
+        }
+        if ((found = replace_block(r, s, s->block, end, &line, out, path)) == -1) {
+            return -1;
+        }
+        matches += found;
+        if (n == 0) {
+            break;
+        }
+        memmove(s->block, s->block + end, have - end);
+        have -= end;
+    }
+    if (out != -1 && replace_flush(s, out) == -1) {
+        return -1;
+    }
+    return matches;
+}
+
+/* Add `type` (DT_DIR or DT_REG) and `path` to the stack. Under r->lock. */
+void replace_push(struct replace *r, unsigned char type, char *path) {
+    if (dir_reserve((void **)&r->stack, &r->stack_capacity, r->stack_length + 1, sizeof(*r->stack)) == -1) {
+        error_handler("realloc");
+    }
+    r->stack[r->stack_length].type = type;
+    r->stack[r->stack_length].path = path;
+    r->stack_length++;
+}
+
+/* Push the entries of directory `path` worth looking into. */
+void replace_read_dir(struct replace *r, const char *path) {
+    char *full = path[0] ? path_join(r->root, path) : strdup(r->root);
+    DIR *d = full != NULL ? opendir(full) : NULL;
+    struct dirent *entry;
+
+    while (d != NULL && (entry = readdir(d)) != NULL) {
+        unsigned char type = entry->d_type;
+
+        if (entry->d_name[0] == '.') {
+            continue; /* ., .., and hidden files and directories: .git, REPLACE_JOURNAL. */
+        }
+        if (type == DT_UNKNOWN) {
+            struct stat st;
+
+            if (fstatat(dirfd(d), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+                continue;
+            }
+            type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+        }
+        if (type == DT_DIR || type == DT_REG) {
+            char *child = path[0] ? path_join(path, entry->d_name) : strdup(entry->d_name);
+
+            if (child == NULL) {
+                error_handler("strdup");
+            }
+            pthread_mutex_lock(&r->lock);
+            replace_push(r, type, child);
+            pthread_cond_signal(&r->wake);
+            pthread_mutex_unlock(&r->lock);
+        }
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+    free(full);
+}
+
+/* Scan file `path` and file it away if it has matches. */
+void replace_scan_file(struct replace *r, struct replace_stream *s, char *path) {
+    char *full = path_join(r->root, path);
+    int fd = open(full, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    long matches = 0;
+
+    free(full);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        if (fd != -1) {
+            close(fd);
+        }
+        free(path);
+        return;
+    }
+    if (!(r->open_known && st.st_dev == r->open_dev && st.st_ino == r->open_ino)) {
+        matches = replace_stream(r, s, fd, -1, path);
+    }
+    close(fd);
+    pthread_mutex_lock(&r->lock);
+    r->scanned++;
+    r->bytes += st.st_size;
+    if (matches > 0 &&
+        dir_reserve((void **)&r->files, &r->files_capacity, r->num_files + 1, sizeof(*r->files)) == 0) {
+        struct replace_file *file = &r->files[r->num_files++];
+
+        memset(file, 0, sizeof(*file));
+        file->path = path;
+        file->size = st.st_size;
+        file->matches = matches;
+        file->preview = malloc(s->preview.length);
+        file->preview_length = file->preview != NULL ? s->preview.length : 0;
+        if (file->preview != NULL) {
+            memcpy(file->preview, s->preview.str, s->preview.length);
+        }
+        r->matches += matches;
+        path = NULL;
+    }
+    pthread_mutex_unlock(&r->lock);
+    ab_reset(&s->preview);
+    free(path);
+}
+
+/*
+Write file `i`'s replacement next to it as "name.kilo-replace", with the original's permissions. Returns -1, with
+file->error set, if it couldn't be.
+*/
+int replace_rewrite_file(struct replace *r, struct replace_stream *s, struct replace_file *file) {
+    char *full = path_join(r->root, file->path);
+    int fd = open(full, O_RDONLY | O_CLOEXEC);
+    int out = -1;
+    struct stat st;
+    long matches = -1;
+
+    file->temp = malloc(strlen(full) + sizeof(".kilo-replace"));
+    if (file->temp == NULL) {
+        error_handler("malloc");
+    }
+    sprintf(file->temp, "%s.kilo-replace", full);
+    free(full);
+    if (fd != -1 && fstat(fd, &st) == 0 &&
+        (out = open(file->temp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, st.st_mode & 07777)) != -1) {
+        fchmod(out, st.st_mode & 07777);
+        matches = replace_stream(r, s, fd, out, file->path);
+        if (matches >= 0 && fsync(out) == -1) {
+            matches = -1;
+        }
+    }
+    file->error = matches < 0 ? (errno != 0 ? errno : EIO) : 0;
+    if (fd != -1) {
+        close(fd);
+    }
+    if (out != -1) {
+        close(out);
+    }
+    if (file->error != 0) {
+        unlink(file->temp);
+        free(file->temp);
+        file->temp = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/* Worker thread: take work off the stack while scanning, or the next file to rewrite while applying. */
+void *replace_worker(void *arg) {
+    struct replace *r = arg;
+    struct replace_stream s;
+
+    memset(&s, 0, sizeof(s));
+    pthread_mutex_lock(&r->lock);
+    while (!r->cancelled) {
+        if (r->applying) {
+            struct replace_file *file;
+            int failed;
+
+            if (r->next == r->num_files) {
+                break;
+            }
+            file = &r->files[r->next++];
+            pthread_mutex_unlock(&r->lock);
+            errno = 0;
+            failed = replace_rewrite_file(r, &s, file) == -1;
+            pthread_mutex_lock(&r->lock);
+            if (failed) {
+                r->cancelled = 1; /* One failure and none of it goes ahead. */
+            }
+            r->scanned++;
+            r->bytes += file->size;
+        } else if (r->stack_length > 0) {
+            struct replace_item item = r->stack[--r->stack_length];
+
+            r->busy++;
+            pthread_mutex_unlock(&r->lock);
+            if (item.type == DT_DIR) {
+                replace_read_dir(r, item.path);
+                free(item.path);
+            } else {
+                replace_scan_file(r, &s, item.path);
+            }
+            pthread_mutex_lock(&r->lock);
+            if (--r->busy == 0 && r->stack_length == 0) {
+                pthread_cond_broadcast(&r->wake); /* Nothing more is coming: the waiting threads can finish. */
+            }
+        } else if (r->busy > 0) {
+            pthread_cond_wait(&r->wake, &r->lock); /* Others may yet push more. */
+        } else {
+            break;
+        }
+    }
+    r->running--;
+    pthread_cond_broadcast(&r->wake);
+    pthread_mutex_unlock(&r->lock);
+    free(s.block);
+    ab_free(&s.out);
+    ab_free(&s.preview);
+    return NULL;
+}
+
+/*
+Run the workers to the end of the scan or the rewrite, while the screen shows how far they've got. C-g stops them.
+Returns 0 if they got to the end, -1 if stopped.
+*/
+int replace_run(struct replace *r, const char *doing) {
+    pthread_t workers[REPLACE_THREADS_MAX];
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cpus < 1 ? 1 : cpus > REPLACE_THREADS_MAX ? REPLACE_THREADS_MAX : (int)cpus;
+    long long shown = 0;
+    int running = 1;
+    int error = 0;
+
+    r->scanned = 0;
+    r->bytes = 0;
+    r->running = 0;
+    for (int t = 0; t < threads; t++) {
+        /* Counted before it starts, under the lock the workers count themselves out under. */
+        pthread_mutex_lock(&r->lock);
+        r->running++;
+        pthread_mutex_unlock(&r->lock);
+        if ((error = pthread_create(&workers[t], NULL, replace_worker, r)) != 0) {
+            pthread_mutex_lock(&r->lock);
+            r->running--;
+            pthread_mutex_unlock(&r->lock);
+            threads = t;
+            break;
+        }
+    }
+    if (threads == 0) {
+        editor_set_status_message("Can't start a thread: %s", strerror(error));
+        return -1;
+    }
+
+    while (running) {
+        struct pollfd pfd = {STDIN_FILENO, POLLIN, 0};
+        char keys[64];
+        ssize_t n;
+
+        if (poll(&pfd, 1, 50) == -1 && errno != EINTR) {
+            error_handler("poll");
+        }
+        if ((pfd.revents & POLLIN || E.session.replaying) && (n = session_read(keys, sizeof(keys))) > 0 &&
+            memchr(keys, CTRL_KEY('g'), n) != NULL) {
+            pthread_mutex_lock(&r->lock);
+            r->cancelled = -1;
+            pthread_cond_broadcast(&r->wake);
+            pthread_mutex_unlock(&r->lock);
+        }
+        pthread_mutex_lock(&r->lock);
+        running = r->running > 0;
+        if (now_ms() - shown >= 250) {
+            char size[16];
+
+            format_size(size, sizeof(size), r->bytes);
+            editor_set_status_message("%s: %zu files (%s), %zu matches (C-g to stop)", doing, r->scanned, size,
+                                      r->matches);
+            shown = now_ms();
+            pthread_mutex_unlock(&r->lock);
+            editor_refresh_screen();
+            continue;
+        }
+        pthread_mutex_unlock(&r->lock);
+    }
+    for (int t = 0; t < threads; t++) {
+        pthread_join(workers[t], NULL);
+    }
+    return r->cancelled ? -1 : 0;
+}
+
+int replace_file_compare(const void *a, const void *b) {
+    return strcmp(((const struct replace_file *)a)->path, ((const struct replace_file *)b)->path);
+}
+
+/* Forget the last replace's matches and the copies of any files not renamed into place. */
+void replace_reset(struct replace *r) {
+    for (size_t i = 0; i < r->num_files; i++) {
+        if (r->files[i].temp != NULL) {
+            unlink(r->files[i].temp);
+        }
+        free(r->files[i].path);
+        free(r->files[i].preview);
+        free(r->files[i].temp);
+    }
+    for (size_t i = 0; i < r->stack_length; i++) {
+        free(r->stack[i].path);
+    }
+    free(r->files);
+    free(r->stack);
+    free(r->root);
+    free(r->old);
+    free(r->new);
+    r->files = NULL;
+    r->stack = NULL;
+    r->root = r->old = r->new = NULL;
+    r->num_files = r->files_capacity = r->stack_length = r->stack_capacity = 0;
+    r->matches = r->buffer_matches = r->bytes = 0;
+    r->cancelled = r->applying = 0;
+    r->next = 0;
+}
+
+/* Can the open file be changed in the buffer? Then the copy on disk is left out of the scan. */
+int replace_uses_buffer(void) {
+    return !E.read_only && !E.dir.active && E.doc.filename != NULL && !E.doc.unnamed;
+}
+
+/* Preview matches in the open file's buffer, which is what will be changed. */
+void replace_scan_buffer(struct replace *r, struct abuf *preview) {
+    char *line = NULL;
+    size_t capacity = 0;
+    size_t lines;
+
+    doc_index_to(SIZE_MAX);
+    lines = buf_num_lines();
+    for (size_t i = 0; i < lines; i++) {
+        size_t length = buf_line_copy(i, &line, &capacity);
+        const char *hit;
+
+        for (const char *p = line; (hit = memmem(p, line + length - p, r->old, r->old_length)) != NULL;
+             p = hit + r->old_length) {
+            char where[64];
+            int n = snprintf(where, sizeof(where), ":%zu:%zu: ", i + 1, (size_t)(hit - line) + 1);
+
+            ab_append(preview, E.doc.filename, strlen(E.doc.filename));
+            ab_append(preview, where, n);
+            ab_append(preview, line, length < REPLACE_PREVIEW_MAX ? length : REPLACE_PREVIEW_MAX);
+            ab_append(preview, "\n", 1);
+            r->buffer_matches++;
+        }
+    }
+    free(line);
+}
+
+/* Unlink the journal, after a rollback or before a new replace starts one. */
+void replace_journal_remove(const char *root) {
+    char *dir = path_join(root, REPLACE_JOURNAL);
+    DIR *d = opendir(dir);
+    struct dirent *entry;
+
+    while (d != NULL && (entry = readdir(d)) != NULL) {
+        if (entry->d_name[0] != '.') {
+            unlinkat(dirfd(d), entry->d_name, 0);
+        }
+    }
+    if (d != NULL) {
+        closedir(d);
+    }
+    rmdir(dir);
+    free(dir);
+}
+
+/*
+Put back every file the journal in `root` holds, renaming each saved original over its replacement. Returns the files
+restored, or -1 if there is no journal.
+*/
+long replace_rollback(const char *root) {
+    char *dir = path_join(root, REPLACE_JOURNAL);
+    char *index = path_join(dir, "index");
+    FILE *fp = fopen(index, "r");
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    long restored = 0;
+
+    free(index);
+    if (fp == NULL) {
+        free(dir);
+        return -1;
+    }
+    /* Each line is "number<TAB>path": the original of `path` is linked in the journal as `number`. */
+    while ((length = getline(&line, &capacity, fp)) > 0) {
+        char *tab = strchr(line, '\t');
+        char *saved;
+
+        if (line[length - 1] == '\n') {
+            line[length - 1] = '\0';
+        }
+        if (tab == NULL) {
+            continue;
+        }
+        *tab = '\0';
+        saved = path_join(dir, line);
+        if (rename(saved, tab + 1) == 0) {
+            restored++;
+        }
+        free(saved);
+    }
+    free(line);
+    fclose(fp);
+    free(dir);
+    replace_journal_remove(root);
+    return restored;
+}
+
+/*
+Every copy has been written: journal the originals, then rename the copies over them. Returns the files replaced, or
+-1 with nothing changed.
+*/
+long replace_commit(struct replace *r) {
+    char *dir = path_join(r->root, REPLACE_JOURNAL);
+    char *index = path_join(dir, "index");
+    FILE *fp = NULL;
+    long done = 0;
+    int error = 0;
+
+    replace_journal_remove(r->root);
+    if (mkdir(dir, 0700) == -1 || (fp = fopen(index, "w")) == NULL) {
+        error = errno;
+    }
+    for (size_t i = 0; i < r->num_files && !error; i++) {
+        char number[24];
+        char *full = path_join(r->root, r->files[i].path);
+        char *saved;
+
+        snprintf(number, sizeof(number), "%zu", i);
+        saved = path_join(dir, number);
+        if (link(full, saved) == -1) {
+            error = errno;
+        }
+        fprintf(fp, "%s\t%s\n", number, full);
+        free(saved);
+        free(full);
+    }
+    if (fp != NULL && (fflush(fp) != 0 || fsync(fileno(fp)) == -1) && !error) {
+        error = errno;
+    }
+    if (fp != NULL) {
+        fclose(fp);
+    }
+    /* The journal is complete before the first file changes; the renames themselves are each atomic. */
+    for (size_t i = 0; i < r->num_files && !error; i++) {
+        char *full = path_join(r->root, r->files[i].path);
+
+        if (rename(r->files[i].temp, full) == -1) {
+            error = errno;
+        } else {
+            free(r->files[i].temp);
+            r->files[i].temp = NULL;
+            done++;
+        }
+        free(full);
+    }
+    free(index);
+    free(dir);
+    if (error) {
+        if (done > 0) {
+            replace_rollback(r->root);
+        } else {
+            replace_journal_remove(r->root);
+        }
+        editor_set_status_message("Can't replace: %s; nothing changed", strerror(error));
+        return -1;
+    }
+    return done;
+}
+
+/* The answer to "Replace N matches?". */
+void replace_confirmed(const char *answer) {
+    struct replace *r = &E.replace;
+    struct script_command command;
+    struct script script;
+    long files = 0;
+
+    if (answer[0] != 'y' && answer[0] != 'Y') {
+        editor_set_status_message("Nothing replaced");
+        replace_reset(r);
+        return;
+    }
+    if (r->buffer_matches > 0 && !editor_can_resize()) {
+        replace_reset(r);
+        return;
+    }
+    if (r->num_files > 0) {
+        r->applying = 1;
+        r->next = 0;
+        if (replace_run(r, "Rewriting") == -1) {
+            struct replace_file *failed = NULL;
+
+            for (size_t i = 0; i < r->num_files && failed == NULL; i++) {
+                failed = r->files[i].error != 0 ? &r->files[i] : NULL;
+            }
+            if (failed != NULL) {
+                editor_set_status_message("Can't rewrite %s: %s; nothing changed", failed->path,
+                                          strerror(failed->error));
+            } else {
+                editor_set_status_message("Replace stopped; nothing changed");
+            }
+            replace_reset(r);
+            return;
+        }
+        if ((files = replace_commit(r)) == -1) {
+            replace_reset(r);
+            return;
+        }
+    }
+
+    /* The open file: one replace command run as a script, in one undo group. */
+    if (r->buffer_matches > 0) {
+        memset(&command, 0, sizeof(command));
+        memset(&script, 0, sizeof(script));
+        command.op = SCRIPT_REPLACE;
+        command.old = r->old;
+        command.old_length = r->old_length;
+        command.new = r->new;
+        command.new_length = r->new_length;
+        script.commands = &command;
+        script.count = 1;
+        buf_begin_edit(0);
+        script_run_buffer(&script, 0, buf_num_lines());
+        editor_clamp_cursor();
+        buf_end_edit();
+        ab_free(&script.text[0]);
+        ab_free(&script.text[1]);
+    }
+    if (files > 0) {
+        editor_set_status_message("Replaced %zu matches in %ld files%s; C-x M-%% rolls the files back",
+                                  r->matches + r->buffer_matches, files,
+                                  r->buffer_matches > 0 ? " and the buffer" : "");
+    } else {
+        editor_set_status_message("Replaced %zu matches in the buffer", r->buffer_matches);
+    }
+    replace_reset(r);
+}
+
+/* "/old/new/" at the replace prompt: scan, preview, and ask. */
+void replace_entered(const char *text) {
+    struct replace *r = &E.replace;
+    struct abuf preview = ABUF_INIT;
+    struct stat st;
+    char title[PROMPT_MAX];
+    char *top;
+    const char *p = text + (text[0] != '\0');
+    char delim = text[0];
+
+    replace_reset(r);
+    if (delim == '\0' || (r->old = script_parse_text(&p, delim, &r->old_length)) == NULL ||
+        (r->new = script_parse_text(&p, delim, &r->new_length)) == NULL || r->old_length == 0) {
+        editor_set_status_message("Replace what? Type /old/new/");
+        replace_reset(r);
+        return;
+    }
+    if (E.job.pid != 0) {
+        editor_set_status_message("A job is running: the preview needs the output panel (C-x k kills it)");
+        replace_reset(r);
+        return;
+    }
+    if ((r->root = getcwd(NULL, 0)) == NULL) {
+        editor_set_status_message("Can't find the working directory: %s", strerror(errno));
+        replace_reset(r);
+        return;
+    }
+    r->open_known = replace_uses_buffer() && stat(E.doc.filename, &st) == 0;
+    if (r->open_known) {
+        r->open_dev = st.st_dev;
+        r->open_ino = st.st_ino;
+    }
+    if (replace_uses_buffer()) {
+        replace_scan_buffer(r, &preview);
+    }
+    if ((top = strdup("")) == NULL) {
+        error_handler("strdup");
+    }
+    pthread_mutex_lock(&r->lock);
+    replace_push(r, DT_DIR, top); /* The walk's paths are relative to the root: "" is the root itself. */
+    pthread_mutex_unlock(&r->lock);
+    if (replace_run(r, "Searching") == -1) {
+        editor_set_status_message("Search stopped; nothing changed");
+        ab_free(&preview);
+        replace_reset(r);
+        return;
+    }
+
+    /* Files in name order, so the preview reads the same however the threads took them. */
+    qsort(r->files, r->num_files, sizeof(*r->files), replace_file_compare);
+    for (size_t i = 0; i < r->num_files; i++) {
+        ab_append(&preview, r->files[i].preview, r->files[i].preview_length);
+        free(r->files[i].preview);
+        r->files[i].preview = NULL;
+    }
+    snprintf(title, sizeof(title), "replace %s", text);
+    job_show_text(title, preview.str, preview.length);
+    ab_free(&preview);
+
+    if (r->matches + r->buffer_matches == 0) {
+        editor_set_status_message("No matches in %zu files", r->scanned);
+        replace_reset(r);
+        return;
+    }
+    snprintf(r->question, sizeof(r->question), "Replace %zu matches in %zu files%s? (y/n) ",
+             r->matches + r->buffer_matches, r->num_files, r->buffer_matches > 0 ? " and the buffer" : "");
+    prompt_open(r->question, replace_confirmed, NULL);
+}
+
+void cmd_replace_project(void) {
+    prompt_open("Replace in project (/old/new/): ", replace_entered, NULL);
+}
+
+void rollback_confirmed(const char *answer) {
+    char *root;
+    long restored;
+
+    if (answer[0] != 'y' && answer[0] != 'Y') {
+        return;
+    }
+    if ((root = getcwd(NULL, 0)) == NULL) {
+        editor_set_status_message("Can't find the working directory: %s", strerror(errno));
+        return;
+    }
+    restored = replace_rollback(root);
+    free(root);
+    if (restored == -1) {
+        editor_set_status_message("No project replace to roll back");
+    } else {
+        editor_set_status_message("Rolled back %ld files%s", restored,
+                                  buf_modified() ? " (undo the buffer's replace with C-z)" : "");
+    }
+}
+
+void cmd_replace_rollback(void) {
+    prompt_open("Roll back the last project replace? (y/n) ", rollback_confirmed, NULL);
+}
+
+/* ---------------------------------- Seek ---------------------------------- */
+/*
+Jumps by byte offset (goto-percent, goto-byte, the scrollbar, the end of the file) don't wait for the line index. The
+view detaches from line numbers: it shows the lines from the first line start at or after the target, labelled with
+numbers extrapolated from the part indexed so far, while a timer keeps indexing in slices between keys. Once the index
+passes the top of the view the estimate gives way to the real line number and the view attaches again.
+*/
+
+/* Only a mapped document can be read at any offset without reading everything before it. */
+int seek_available(void) {
+    return E.doc.map != NULL && !E.dir.active;
+}
+
+/* Whether the line starting at the top of the view has been indexed. */
+int seek_indexed(void) {
+    return E.seek.offset < E.doc.index_pos || E.doc.fully_indexed;
+}
+
+/* Buffer line of the line starting at `offset` past the index, at the lines per byte indexed so far. */
+size_t seek_estimate(size_t offset) {
+    struct document *doc = &E.doc;
+    size_t line = doc->num_lines;
+
+    if (doc->index_pos > 0 && offset > doc->index_pos) {
+        line += (size_t)((double)(offset - doc->index_pos) * doc->num_lines / doc->index_pos);
+    }
+
+    return buf_line_of_document(line);
+}
+
+/* How far the index has got towards the top of the view, in percent. */
+int seek_progress(void) {
+    return E.seek.offset > 0 ? (int)((double)E.doc.index_pos * 100 / E.seek.offset) : 100;
+}
+
+/* End of the last line on screen, for the read-ahead predictor. */
+size_t seek_view_end(void) {
+    size_t offset = E.seek.offset;
+
+    for (int y = 0; y < E.screen_rows && offset < E.doc.size; y++) {
+        offset = doc_next_line(offset);
+    }
+
+    return offset;
+}
+
+/* The top of the view has been indexed: put the cursor on it, at its real line number. */
+void seek_attach(void) {
+    struct seek *s = &E.seek;
+    size_t line = buf_line_of_document(doc_line_at(s->offset));
+
+    if (s->active) {
+        editor_set_status_message("Line %zu (estimated %zu)", line + 1, s->estimate + 1);
+        E.rowoff = line; /* Keep the view where it is. */
+    }
+    s->active = 0;
+    timer_stop(&s->timer);
+    E.cy = line;
+    E.cx = 0;
+    E.sel_active = 0;
+}
+
+/* Back to the cursor, which stayed where it was while the view was detached. */
+void seek_leave(void) {
+    E.seek.active = 0;
+    timer_stop(&E.seek.timer);
+}
+
+/* Index a slice, then attach if the index has reached the view or come back for another slice. */
+void seek_catch_up(void) {
+    long long start = now_ms();
+
+    while (!seek_indexed() && now_ms() - start < SEEK_INDEX_SLICE_MS) {
+        doc_index_to(E.doc.num_lines + SEEK_INDEX_LINES);
+    }
+    if (seek_indexed()) {
+        seek_attach();
+    } else {
+        E.seek.estimate = seek_estimate(E.seek.offset);
+        timer_start(&E.seek.timer, 0, seek_catch_up);
+    }
+}
+
+/* Show the document from byte `offset` on, resynced forward to the next line start. */
+void seek_to(size_t offset) {
+    struct document *doc = &E.doc;
+    struct seek *s = &E.seek;
+
+    while (doc->size < offset && doc_load_more()) {
+        continue;
+    }
+    if (offset > doc->size) {
+        offset = doc->size;
+    }
+    if (offset > 0 && doc_byte(offset - 1) != '\n') {
+        offset = doc_next_line(offset);
+    }
+    if (offset == doc->size) {
+        offset = doc_prev_line(offset); /* Past the last newline: show the last line. */
+    }
+    s->offset = offset;
+
+    /* Near the index, or in a document that has to be read in order anyway: index up to the target now. */
+    if (!seek_available() || offset < doc->index_pos + SEEK_SYNC_BYTES) {
+        while (!seek_indexed()) {
+            doc_index_to(doc->num_lines + SEEK_INDEX_LINES);
+        }
+        seek_attach();
+        return;
+    }
+    s->active = 1;
+    s->estimate = seek_estimate(offset);
+    timer_start(&s->timer, 0, seek_catch_up);
+}
+
+/* Move a detached view by `lines`, attaching if that lands it on indexed lines. */
+void seek_scroll(long lines) {
+    struct seek *s = &E.seek;
+
+    for (; lines > 0 && doc_next_line(s->offset) < E.doc.size; lines--) {
+        s->offset = doc_next_line(s->offset);
+        s->estimate++;
+    }
+    for (; lines < 0 && s->offset > 0; lines++) {
+        s->offset = doc_prev_line(s->offset);
+        s->estimate -= s->estimate > 0;
+    }
+    if (seek_indexed()) {
+        seek_attach();
+    }
+}
+
+/* A scrollbar takes the last column of mapped documents, where the view can jump anywhere. */
+int seek_scrollbar_width(void) {
+    return seek_available() && E.doc.size > 0;
+}
+
+/* Screen row of the scrollbar thumb: how far into the document the top of the view is. */
+int seek_thumb_row(void) {
+    double fraction = 0;
+    size_t top;
+
+    if (E.seek.active) {
+        fraction = (double)E.seek.offset / E.doc.size;
+    } else if (buf_document_line(E.rowoff, &top)) {
+        fraction = (double)doc_line_start(top) / E.doc.size;
+    } else if (buf_num_lines() > 0) {
+        fraction = (double)E.rowoff / buf_num_lines();
+    }
+
+    return (int)(fraction * (E.screen_rows - 1) + 0.5);
+}
+
+/* Pressing or dragging on the scrollbar jumps to the same fraction of the document. */
+void seek_scrollbar(const struct input_event *ev) {
+    int y = ev->y < 1 ? 1 : ev->y > E.screen_rows ? E.screen_rows : ev->y;
+
+    if (ev->release) {
+        E.seek.dragging = 0;
+        return;
+    }
+    E.seek.dragging = 1;
+    seek_to(E.screen_rows > 1 ? (size_t)((double)E.doc.size * (y - 1) / (E.screen_rows - 1)) : 0);
+}
+
+void goto_percent(const char *text) {
+    char *end;
+    double percent = strtod(text, &end);
+
+    if (end == text || (*end != '\0' && strcmp(end, "%") != 0) || percent < 0 || percent > 100) {
+        editor_set_status_message("Not a percentage: %s", text);
+        return;
+    }
+    if (E.dir.active) {
+        E.cy = (size_t)(percent / 100 * (buf_num_lines() > 0 ? buf_num_lines() - 1 : 0));
+        E.cx = 0;
+        return;
+    }
+    if (!seek_available()) {
+        doc_index_to(SIZE_MAX); /* Like less, this reads to the end of a pipe to know where the percent is. */
+    }
+    seek_to((size_t)(percent / 100 * E.doc.size));
+}
+
+/* A byte offset, in decimal or 0x hex, optionally in K, M or G. */
+void goto_byte(const char *text) {
+    char *end;
+    unsigned long long offset;
+    int shift = 0;
+
+    errno = 0;
+    offset = strtoull(text, &end, 0);
+    if (*end != '\0' && end[1] == '\0') {
+        shift = strchr("Kk", *end) ? 10 : strchr("Mm", *end) ? 20 : strchr("Gg", *end) ? 30 : 0;
+        end += shift > 0;
+    }
+    if (end == text || *end != '\0' || errno != 0 || text[0] == '-' || offset > (SIZE_MAX >> shift) || E.dir.active) {
+        editor_set_status_message("Not a byte offset: %s", text);
+        return;
+    }
+    seek_to((size_t)offset << shift);
+}
+
+/* ---------------------------------- Logs ---------------------------------- */
+/* Days from 1970-01-01 to a date of the proleptic Gregorian calendar. */
+int64_t log_days(int64_t year, int month, int day) {
+    int64_t era;
+    int64_t year_of_era;
+    int64_t day_of_year;
+
+    year -= month <= 2;
+    era = (year >= 0 ? year : year - 399) / 400;
+    year_of_era = year - era * 400;
+    day_of_year = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5 + day - 1;
+
+    return era * 146097 + year_of_era * 365 + year_of_era / 4 - year_of_era / 100 + day_of_year - 719468;
+}
+
+/* The `count` digits at `s` as a number, or -1 if they aren't all digits. */
+int log_digits(const char *s, int count) {
+    int value = 0;
+
+    for (int i = 0; i < count; i++) {
+        if (!isdigit((unsigned char)s[i])) {
+            return -1;
+        }
+        value = value * 10 + (s[i] - '0');
+    }
+
+    return value;
+}
+
+/* 1 to 12 for an English month abbreviation at `s`, or 0. */
+int log_month(const char *s) {
+    static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+
+    for (int i = 0; i < 12; i++) {
+        if (memcmp(s, months + i * 3, 3) == 0) {
+            return i + 1;
+        }
+    }
+
+    return 0;
+}
+
+/* HH:MM:SS at `s` as seconds into the day, or -1. */
+int64_t log_clock(const char *s) {
+    int hours = log_digits(s, 2);
+    int minutes = log_digits(s + 3, 2);
+    int seconds = log_digits(s + 6, 2);
+
+    if (hours < 0 || minutes < 0 || seconds < 0 || s[2] != ':' || s[5] != ':' || hours > 23 || minutes > 59) {
+        return -1;
+    }
+
+    return hours * 3600 + minutes * 60 + seconds;
+}
+
+/* The timestamp in the first `length` bytes of a line, in `format`. Returns 0 if the line doesn't have one. */
+int log_parse(const char *s, size_t length, int format, int64_t *time) {
+    const char *bracket;
+    int64_t clock;
+    int year;
+    int month;
+    int day;
+
+    if ((format == LOG_ISO || format == LOG_CLOCK) && length > 0 && s[0] == '[') {
+        s++;
+        length--;
+    }
+    switch (format) {
+        case LOG_ISO:
+            if (length < 19 || s[4] != '-' || s[7] != '-' || (s[10] != ' ' && s[10] != 'T')) {
+                return 0;
+            }
+            year = log_digits(s, 4);
+            month = log_digits(s + 5, 2);
+            day = log_digits(s + 8, 2);
+            clock = log_clock(s + 11);
+            break;
+        case LOG_CLF:
+            bracket = memchr(s, '[', length < LOG_STAMP_SEARCH ? length : LOG_STAMP_SEARCH);
+            if (bracket == NULL || (size_t)(s + length - bracket) < 21 || bracket[3] != '/' || bracket[7] != '/' ||
+                bracket[12] != ':') {
+                return 0;
+            }
+            day = log_digits(bracket + 1, 2);
+            month = log_month(bracket + 4);
+            year = log_digits(bracket + 8, 4);
+            clock = log_clock(bracket + 13);
+            break;
+        case LOG_SYSLOG:
+            if (length < 15 || s[3] != ' ' || s[6] != ' ') {
+                return 0;
+            }
+            year = 1970; /* Syslog doesn't say. */
+            month = log_month(s);
+            day = s[4] == ' ' ? log_digits(s + 5, 1) : log_digits(s + 4, 2);
+            clock = log_clock(s + 7);
+            break;
+        case LOG_CLOCK:
+            if (length < 8) {
+                return 0;
+            }
+            year = 1970;
+            month = 1;
+            day = 1;
+            clock = log_clock(s);
+            break;
+        default:
+            return 0;
+    }
+    if (year < 0 || month < 1 || month > 12 || day < 1 || day > 31 || clock < 0) {
+        return 0;
+    }
+    *time = log_days(year, month, day) * 86400 + clock;
+
+    return 1;
+}
+
+/* The timestamp of the line starting at `offset`, in `format`. */
+int log_line_time(size_t offset, int format, int64_t *time) {
+    size_t length;
+    const char *s = doc_span(offset, &length);
+    const char *newline;
+    int found;
+
+    if (length > LOG_STAMP_SEARCH + 32) {
+        length = LOG_STAMP_SEARCH + 32;
+    }
+    doc_read_begin();
+    if ((newline = memchr(s, '\n', length)) != NULL) {
+        length = (size_t)(newline - s);
+    }
+    found = log_parse(s, length, format, time);
+    doc_read_end();
+
+    return found;
+}
+
+/* The first stamped line among LOG_PROBE_LINES from `offset` on, stopping at `end`. Sets *at to its start. */
+int log_probe(size_t offset, size_t end, int64_t *time, size_t *at) {
+    for (int i = 0; i < LOG_PROBE_LINES && offset < end; i++) {
+        if (log_line_time(offset, E.log.format, time)) {
+            *at = offset;
+            return 1;
+        }
+        offset = doc_next_line(offset);
+    }
+
+    return 0;
+}
+
+/* Count a line stamped `time` in its minute of the timeline. */
+void log_count(int64_t time) {
+    struct log_index *log = &E.log;
+    int64_t minute = time / 60 - log->first_time / 60;
+    size_t index = minute > 0 ? (size_t)minute : 0; /* Out of order before the first line: count it there. */
+
+    if (index >= LOG_MINUTES_MAX) {
+        return;
+    }
+    if (index >= log->num_minutes) {
+        if (dir_reserve((void **)&log->minutes, &log->minute_capacity, index + 1, sizeof(uint32_t)) == -1) {
+            return;
+        }
+        memset(log->minutes + log->num_minutes, 0, (index + 1 - log->num_minutes) * sizeof(uint32_t));
+        log->num_minutes = index + 1;
+    }
+    log->minutes[index]++;
+}
+
+/* Scan a slice of the file: sample the time index and count lines for the timeline, then come back for more. */
+void log_scan(void) {
+    struct log_index *log = &E.log;
+    long long start = now_ms();
+    size_t offset = log->scan_pos;
+    size_t next;
+    int64_t time;
+
+    if (E.doc.map == NULL) {
+        return; /* Switched to a private copy after the file was truncated. */
+    }
+    while (offset < E.doc.size && now_ms() - start < LOG_SCAN_SLICE_MS) {
+        for (int i = 0; i < 1024 && offset < E.doc.size; i++) {
+            next = doc_next_line(offset);
+            if (log_line_time(offset, log->format, &time)) {
+                if (log->num_samples == 0 || offset / LOG_SAMPLE_BYTES > log->samples[log->num_samples - 1].offset /
+                                                                         LOG_SAMPLE_BYTES) {
+                    if (dir_reserve((void **)&log->samples, &log->sample_capacity, log->num_samples + 1,
+                                    sizeof(struct log_sample)) == 0) {
+                        log->samples[log->num_samples].time = time;
+                        log->samples[log->num_samples].offset = offset;
+                        log->num_samples++;
+                    }
+                }
+                log_count(time);
+            }
+            offset = next;
+        }
+    }
+    log->scan_pos = offset;
+    if (offset < E.doc.size) {
+        timer_start(&log->timer, 0, log_scan);
+    }
+}
+
+/* Recognise a log by the timestamps on its first lines, and if it is one start indexing them in the background. */
+void log_start(void) {
+    struct log_index *log = &E.log;
+    size_t offset;
+    int best = 0;
+    int lines = 0;
+    int64_t time;
+
+    if (E.doc.map == NULL) {
+        return;
+    }
+    for (int format = LOG_ISO; format <= LOG_CLOCK; format++) {
+        int hits = 0;
+
+        lines = 0;
+        for (offset = 0; offset < E.doc.size && lines < LOG_DETECT_LINES; offset = doc_next_line(offset)) {
+            hits += log_line_time(offset, format, &time);
+            lines++;
+        }
+        if (hits > best) {
+            best = hits;
+            log->format = format;
+        }
+    }
+    if (best * 2 < lines || !log_probe(0, E.doc.size, &log->first_time, &offset)) {
+        log->format = LOG_NONE;
+        return;
+    }
+    timer_start(&log->timer, 0, log_scan);
+}
+
+/*
+Start of the first line stamped `target` or later, or the end of the file. The time index narrows the search to a
+stretch between two samples where it has got that far; the rest is bisected by bytes, each step resyncing to a line
+start and reading the first timestamp after it, so a time in a 30 GB log is a few dozen page reads away.
+*/
+size_t log_find(int64_t target) {
+    struct log_index *log = &E.log;
+    size_t lo = 0;
+    size_t hi = E.doc.size;
+    size_t found = E.doc.size;
+    size_t first = 0;
+    size_t count = log->num_samples;
+    size_t offset;
+    size_t at;
+    int64_t time;
+
+    /* The last sample before the target, and the one after it if the scan has got that far. */
+    while (count > 0) {
+        size_t half = count / 2;
+
+        if (log->samples[first + half].time < target) {
+            first += half + 1;
+            count -= half + 1;
+        } else {
+            count = half;
+        }
+    }
+    if (first > 0) {
+        lo = log->samples[first - 1].offset;
+    }
+    if (first < log->num_samples && log->samples[first].offset < hi) {
+        hi = found = log->samples[first].offset;
+    }
+
+    /* Bisect what is left: everything before lo is earlier than the target, found is a line at or after it. */
+    while (hi - lo > LOG_BISECT_BYTES) {
+        offset = doc_next_line(lo + (hi - lo) / 2);
+        if (!log_probe(offset, hi, &time, &at)) {
+            hi = lo + (hi - lo) / 2; /* No stamps to go by: look in the first half. */
+        } else if (time < target) {
+            lo = at;
+        } else {
+            hi = found = at;
+        }
+    }
+    for (offset = lo; offset < hi; offset = doc_next_line(offset)) {
+        if (log_line_time(offset, log->format, &time) && time >= target) {
+            return offset;
+        }
+    }
+
+    return found;
+}
+
+/* Seconds since 1970 for "[YYYY-MM-DD ]HH:MM[:SS]"; a bare time of day is its first occurrence in the log. */
+int log_parse_target(const char *text, int64_t *target) {
+    int64_t day = -1;
+    int hours;
+    int minutes;
+    int seconds = 0;
+    size_t length = strlen(text);
+
+    if (length >= 11 && text[4] == '-' && text[7] == '-' && (text[10] == ' ' || text[10] == 'T')) {
+        int year = log_digits(text, 4);
+        int month = log_digits(text + 5, 2);
+        int date = log_digits(text + 8, 2);
+
+        if (year < 0 || month < 1 || month > 12 || date < 1 || date > 31) {
+            return 0;
+        }
+        /* Syslog lines have no year, and bare clocks no date. */
+        day = E.log.format == LOG_CLOCK ? 0 : log_days(E.log.format == LOG_SYSLOG ? 1970 : year, month, date);
+        text += 11;
+        length -= 11;
+    }
+    if ((length != 5 && length != 8) || text[2] != ':' || (length == 8 && text[5] != ':')) {
+        return 0;
+    }
+    hours = log_digits(text, 2);
+    minutes = log_digits(text + 3, 2);
+    if (length == 8) {
+        seconds = log_digits(text + 6, 2);
+    }
+    if (hours < 0 || hours > 23 || minutes < 0 || minutes > 59 || seconds < 0 || seconds > 60) {
+        return 0;
+    }
+
+    if (day >= 0) {
+        *target = day * 86400 + hours * 3600 + minutes * 60 + seconds;
+    } else {
+        *target = E.log.first_time - E.log.first_time % 86400 + hours * 3600 + minutes * 60 + seconds;
+        if (*target < E.log.first_time) {
+            *target += 86400;
+        }
+    }
+
+    return 1;
+}
+
+void goto_time(const char *text) {
+    int64_t target;
+    size_t offset;
+
+    if (!log_parse_target(text, &target)) {
+        editor_set_status_message("Not a time: %s (HH:MM[:SS], optionally after YYYY-MM-DD)", text);
+        return;
+    }
+    offset = log_find(target);
+    if (offset == E.doc.size) {
+        editor_set_status_message("Nothing logged at %s or later", text);
+        return;
+    }
+    seek_to(offset);
+}
+
+/* Minute of the timeline the top of the view is in, or -1. */
+long log_view_minute(void) {
+    size_t top;
+    size_t offset;
+    size_t at;
+    int64_t time;
+
+    if (E.seek.active) {
+        offset = E.seek.offset;
+    } else if (buf_document_line(E.rowoff, &top)) {
+        offset = doc_line_start(top);
+    } else {
+        return -1;
+    }
+    if (!log_probe(offset, E.doc.size, &time, &at)) {
+        return -1;
+    }
+
+    return (long)(time / 60 - E.log.first_time / 60);
+}
+
+/* "HH:MM", or "MM-DD HH:MM" when the log spans days, for the timeline's ends. */
+int log_format_minute(char *out, size_t size, size_t minute) {
+    time_t time = (time_t)((E.log.first_time / 60 + (int64_t)minute) * 60);
+    struct tm *tm = gmtime(&time);
+
+    if (tm == NULL) {
+        return 0;
+    }
+    return (int)strftime(out, size, E.log.num_minutes > 1440 && E.log.format != LOG_CLOCK ? "%m-%d %H:%M" : "%H:%M",
+                         tm);
+}
+
+/*
+Lines per minute as a sparkline across the bottom row, from the first minute of the log to the last one scanned so far,
+with the top of the view marked. While the scan is still going its progress follows.
+*/
+void log_draw_timeline(struct abuf *ab, int cols) {
+    struct log_index *log = &E.log;
+    char first[16];
+    char last[16];
+    char progress[8] = "";
+    int first_length = log_format_minute(first, sizeof(first), 0);
+    int last_length = log_format_minute(last, sizeof(last), log->num_minutes > 0 ? log->num_minutes - 1 : 0);
+    int progress_length = 0;
+    int width;
+    size_t per;
+    size_t columns;
+    long view = log_view_minute();
+    uint32_t peak = 1;
+
+    if (log->scan_pos < E.doc.size) {
+        progress_length = snprintf(progress, sizeof(progress), " %d%%",
+                                   (int)((double)log->scan_pos * 100 / E.doc.size));
+    }
+    width = cols - first_length - last_length - 2 - progress_length;
+    if (width < 10 || log->num_minutes == 0) {
+        return;
+    }
+    per = (log->num_minutes + width - 1) / width;
+    columns = (log->num_minutes + per - 1) / per;
+    for (size_t i = 0; i < log->num_minutes; i += per) {
+        uint32_t sum = 0;
+
+        for (size_t j = i; j < i + per && j < log->num_minutes; j++) {
+            sum += log->minutes[j];
+        }
+        peak = sum > peak ? sum : peak;
+    }
+
+    ab_append(ab, first, first_length);
+    ab_append(ab, " ", 1);
+    for (size_t column = 0; column < columns; column++) {
+        uint32_t sum = 0;
+        char glyph[3] = {'\xe2', '\x96', '\x81'}; /* U+2581 to U+2588: eight heights of bar. */
+
+        for (size_t j = column * per; j < (column + 1) * per && j < log->num_minutes; j++) {
+            sum += log->minutes[j];
+        }
+        glyph[2] += (char)((uint64_t)sum * 7 / peak);
+        if (view >= 0 && (size_t)view / per == column) {
+            ab_append(ab, INVERT_COLORS, strlen(INVERT_COLORS));
+        }
+        if (sum == 0) {
+            ab_append(ab, " ", 1);
+        } else {
+            ab_append(ab, glyph, 3);
+        }
+        if (view >= 0 && (size_t)view / per == column) {
+            ab_append(ab, RESET_COLORS, strlen(RESET_COLORS));
+        }
+    }
+    ab_append(ab, " ", 1);
+    ab_append(ab, last, last_length);
+    ab_append(ab, progress, progress_length);
+}
+
+/* ---------------------------------- Input --------------------------------- */
+
+void editor_move_cursor(int key) {
+    // idea: H = top, M = middle, L = bottom of screen
+    switch (key) {
+        case ARROW_LEFT:
+            if (E.cx == 0) { /* Wrap to end of above row if we hit left boundary. */
+                if (E.cy > 0) {
+                    E.cy--;
+                    E.cx = buf_line_length(E.cy);
+                }
+            } else {
+                E.cx--; // left
+            }
+            break;
+        case ARROW_DOWN:
+            if (buf_line_exists(E.cy + 1)) { /* Stop at the last line of the document. */
+                E.cy++; // down
+            }
+            break;
+        case ARROW_UP:
+            if (E.cy > 0) { /* Stop at the first line of the document. */
+                E.cy--; // up
+            }
+            break;
+        case ARROW_RIGHT:
+            if (E.cx >= buf_line_length(E.cy)) { /* Wrap to start of below row if we hit right boundary. */
+                if (buf_line_exists(E.cy + 1)) {
+                    E.cx = 0;
+                    E.cy++;
+                }
+            } else {
+                E.cx++; // right
+            }
+    }
+
+    /* Snap to the end of the new line if it is shorter than the old one. */
+    if (E.cx > buf_line_length(E.cy)) {
+        E.cx = buf_line_length(E.cy);
+    }
+}
+
+void editor_move_page(int key) {
+    int times = E.screen_rows;
+
+    while (times--) {
+        editor_move_cursor(key == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+    }
+}
+
+/* Commands: everything a key can be bound to. */
+void cmd_quit(void) {
+    static long long warned;
+
+    /* Unsaved changes: the first press only warns, a second one within a few seconds quits anyway. */
+    if (buf_modified() && now_ms() - warned > STATUS_MESSAGE_TIMEOUT * 1000) {
+        warned = now_ms();
+        editor_set_status_message("Unsaved changes: quit again to discard them");
+        return;
+    }
+    /* Clear screen and resposition cursor to top-left on exit. */
+    write(STDOUT_FILENO, CLEAR_SCREEN, 4);
+    write(STDOUT_FILENO, CURSOR_REPOSITION, 3);
+    exit(0);
+}
+
+void cmd_move_left(void) {
+    editor_move_cursor(ARROW_LEFT);
+}
+
+void cmd_move_right(void) {
+    editor_move_cursor(ARROW_RIGHT);
+}
+
+void cmd_move_up(void) {
+    editor_move_cursor(ARROW_UP);
+}
+
+void cmd_move_down(void) {
+    editor_move_cursor(ARROW_DOWN);
+}
+
+void cmd_page_up(void) {
+    editor_move_page(PAGE_UP);
+}
+
+void cmd_page_down(void) {
+    editor_move_page(PAGE_DOWN);
+}
+
+void cmd_line_start(void) {
+    E.cx = 0; /* Move to start of line */
+}
+
+void cmd_line_end(void) {
+    E.cx = buf_line_length(E.cy); /* Move to end of line */
+}
+
+void cmd_top(void) {
+    E.cy = 0;
+    E.cx = 0;
+}
+
+void cmd_bottom(void) {
+    if (seek_available() && !E.doc.fully_indexed) {
+        seek_to(E.doc.size); /* Show the end now; its line number follows once the index gets there. */
+        return;
+    }
+    doc_index_to(SIZE_MAX); /* Like less, this reads to the end of a pipe. */
+    E.cy = buf_num_lines() > 0 ? buf_num_lines() - 1 : 0;
+    E.cx = 0;
+}
+
+void cmd_clear_selection(void) {
+    E.sel_active = 0;
+}
+
+void cmd_newline(void) {
+    editor_insert_newline();
+}
+
+void cmd_backspace(void) {
+    editor_delete_char();
+}
+
+void cmd_delete_char(void) {
+    if ((E.cx < buf_line_length(E.cy) || buf_line_exists(E.cy + 1)) && editor_can_resize()) {
+        editor_move_cursor(ARROW_RIGHT);
+        editor_delete_char();
+    }
+}
+
+void cmd_undo(void) {
+    buf_undo();
+}
+
+void cmd_redo(void) {
+    buf_redo();
+}
+
+void cmd_open(void) {
+    if (E.dir.active) {
+        dir_open_entry(E.cy);
+    }
+}
+
+void cmd_save(void) {
+    const struct formatter *formatter = format_find();
+    int unformatted = 0;
+
+    if (!editor_can_edit()) {
+        return;
+    }
+    if (formatter != NULL && formatter->on_save && E.doc.record_length == 0) { /* Formatters would resize records. */
+        doc_index_to(SIZE_MAX);
+        unformatted = format_region(formatter, 0, buf_num_lines()) == -1; /* Then it is saved as it is. */
+    }
+    if (buf_save() == 0) {
+        tags_regenerate();
+        lsp_saved();
+        if (unformatted) {
+            editor_set_status_message("Saved, but %s failed", formatter->command);
+        }
+    }
+}
+
+/* Jump to the definition of the identifier under the cursor. */
+void cmd_goto_tag(void) {
+    char *text = NULL;
+    size_t capacity = 0;
+    size_t length;
+    size_t start;
+    size_t end;
+
+    if (!editor_text_visible()) {
+        return;
+    }
+    length = buf_line_copy(E.cy, &text, &capacity);
+    start = end = E.cx < length ? E.cx : length;
+    while (start > 0 && is_identifier_char((unsigned char)text[start - 1])) {
+        start--;
+    }
+    while (end < length && is_identifier_char((unsigned char)text[end])) {
+        end++;
+    }
+    if (start == end) {
+        editor_set_status_message("No identifier under the cursor");
+    } else {
+        text[end] = '\0';
+        tags_goto(text + start);
+    }
+    free(text);
+}
+
+void cmd_find_tag(void) {
+    prompt_open("Tag: ", tags_goto, tags_complete);
+}
+
+void cmd_goto_percent(void) {
+    prompt_open("Go to percent: ", goto_percent, NULL);
+}
+
+void cmd_goto_byte(void) {
+    prompt_open("Go to byte: ", goto_byte, NULL);
+}
+
+void cmd_goto_time(void) {
+    if (E.log.format == LOG_NONE) {
+        editor_set_status_message("No log timestamps recognised in this file");
+        return;
+    }
+    prompt_open("Go to time: ", goto_time, NULL);
+}
+
+void cmd_log_timeline(void) {
+    if (E.log.format == LOG_NONE) {
+        editor_set_status_message("No log timestamps recognised in this file");
+        return;
+    }
+    E.log.timeline = !E.log.timeline;
+}
+
+/* Run a line of script, or a !filter, over the selected lines or all of them, as one undo group. */
+void script_entered(const char *text) {
+    struct script script;
+    size_t from;
+    size_t to;
+    size_t changed;
+
+    memset(&script, 0, sizeof(script));
+    if (text[0] != '!' && (script_parse_line(&script, text) == -1 || script.count == 0)) {
+        editor_set_status_message("Not a command: %s", text);
+        script_free(&script);
+        return;
+    }
+    editor_selected_lines(&from, &to);
+
+    buf_begin_edit(0);
+    if (text[0] == '!') {
+        long lines = filter_region(text + 1, from, to, 0);
+
+        if (lines >= 0) {
+            editor_set_status_message("%zu lines filtered into %ld", to - from, lines);
+        }
+    } else {
+        changed = script_run_buffer(&script, from, to);
+        editor_set_status_message("%zu line%s changed", changed, changed == 1 ? "" : "s");
+    }
+    editor_clamp_cursor();
+    buf_end_edit();
+    script_free(&script);
+}
+
+void make_entered(const char *command) {
+    snprintf(E.job.make_command, sizeof(E.job.make_command), "%s", command);
+    job_start(command);
+}
+
+void run_entered(const char *command) {
+    snprintf(E.job.run_command, sizeof(E.job.run_command), "%s", command);
+    job_start(command);
+}
+
+void cmd_script(void) {
+    if (editor_can_resize()) {
+        prompt_open("Script: ", script_entered, NULL);
+    }
+}
+
+void cmd_filter(void) {
+    if (editor_can_resize()) {
+        prompt_open("Script: ", script_entered, NULL);
+        prompt_set("!");
+    }
+}
+
+void cmd_format(void) {
+    const struct formatter *formatter = format_find();
+    size_t from;
+    size_t to;
+
+    if (!editor_can_resize()) {
+        return;
+    }
+    if (formatter == NULL) {
+        editor_set_status_message("No formatter for this file");
+        return;
+    }
+    editor_selected_lines(&from, &to);
+    format_region(formatter, from, to);
+}
+
+void cmd_reflow(void) {
+    size_t from;
+    size_t to;
+    size_t hunks;
+
+    if (!editor_can_resize()) {
+        return;
+    }
+    editor_selected_lines(&from, &to);
+    buf_begin_edit(0);
+    hunks = reflow_region(from, to);
+    editor_clamp_cursor();
+    buf_end_edit();
+    editor_set_status_message(hunks > 0 ? "Reflowed: %zu hunk%s changed" : "Nothing to reflow", hunks,
+                              hunks == 1 ? "" : "s");
+}
+
+void cmd_make(void) {
+    prompt_open("Make: ", make_entered, NULL);
+    prompt_set(E.job.make_command[0] != '\0' ? E.job.make_command : "make");
+}
+
+void cmd_run(void) {
+    prompt_open("Run: ", run_entered, NULL);
+    prompt_set(E.job.run_command);
+}
+
+void cmd_next_error(void) {
+    job_next_diagnostic(1);
+}
+
+void cmd_previous_error(void) {
+    job_next_diagnostic(-1);
+}
+
+void cmd_toggle_output(void) {
+    job_show_panel(!E.job.show_panel);
+}
+
+void cmd_kill_job(void) {
+    job_kill();
+}
+
+void cmd_complete(void) {
+    lsp_complete();
+}
+
+struct command commands[] = {
+    {"quit", cmd_quit},
+    {"move-left", cmd_move_left},
+    {"move-right", cmd_move_right},
+    {"move-up", cmd_move_up},
+    {"move-down", cmd_move_down},
+    {"page-up", cmd_page_up},
+    {"page-down", cmd_page_down},
+    {"line-start", cmd_line_start},
+    {"line-end", cmd_line_end},
+    {"top", cmd_top},
+    {"bottom", cmd_bottom},
+    {"clear-selection", cmd_clear_selection},
+    {"newline", cmd_newline},
+    {"backspace", cmd_backspace},
+    {"delete-char", cmd_delete_char},
+    {"undo", cmd_undo},
+    {"redo", cmd_redo},
+    {"save", cmd_save},
+    {"open", cmd_open},
+    {"goto-tag", cmd_goto_tag},
+    {"find-tag", cmd_find_tag},
+    {"script", cmd_script},
+    {"filter", cmd_filter},
+    {"format", cmd_format},
+    {"reflow", cmd_reflow},
+    {"replace-project", cmd_replace_project},
+    {"replace-rollback", cmd_replace_rollback},
+    {"make", cmd_make},
+    {"run", cmd_run},
+    {"next-error", cmd_next_error},
+    {"previous-error", cmd_previous_error},
+    {"toggle-output", cmd_toggle_output},
+    {"kill-job", cmd_kill_job},
+    {"complete", cmd_complete},
+    {"goto-percent", cmd_goto_percent},
+    {"goto-byte", cmd_goto_byte},
+    {"goto-time", cmd_goto_time},
+    {"log-timeline", cmd_log_timeline},
+    {NULL, NULL}
+};
+
+/*
+While the view is detached from the line index only commands that need no line number run: scrolling and jumps move
+the view, Esc goes back to the cursor, anything else waits for the index. Returns 1 if the command was dealt with here.
+*/
+int seek_command(void (*fn)(void)) {
+    if (fn == cmd_move_down || fn == cmd_move_up) {
+        seek_scroll(fn == cmd_move_down ? 1 : -1);
+    } else if (fn == cmd_page_down || fn == cmd_page_up) {
+        seek_scroll(fn == cmd_page_down ? E.screen_rows : -E.screen_rows);
+    } else if (fn == cmd_clear_selection) {
+        seek_leave();
+    } else if (fn == cmd_top) {
+        seek_leave();
+        return 0;
+    } else if (fn == cmd_quit || fn == cmd_bottom || fn == cmd_goto_percent || fn == cmd_goto_byte ||
+               fn == cmd_goto_time || fn == cmd_log_timeline || fn == cmd_toggle_output) {
+        return 0;
+    } else {
+        editor_set_status_message("Indexed %d%% of the way here: scroll, jump, or Esc to go back", seek_progress());
+    }
+
+    return 1;
+}
+
+/* Scroll the view by `lines` without moving the cursor unless it would leave the screen. */
+void editor_scroll_view(long lines) {
+    size_t last;
+
+    if (E.seek.active) {
+        seek_scroll(lines);
+        return;
+    }
+    if (lines < 0) {
+        E.rowoff = E.rowoff > (size_t)-lines ? E.rowoff - (size_t)-lines : 0;
+    } else if (lines > 0) {
+        buf_line_exists(E.rowoff + lines);
+        last = buf_num_lines() > 0 ? buf_num_lines() - 1 : 0;
+        E.rowoff = E.rowoff + lines < last ? E.rowoff + lines : last;
+    }
+
+    if (E.cy < E.rowoff) {
+        E.cy = E.rowoff;
+    } else if (E.cy >= E.rowoff + E.screen_rows) {
+        E.cy = E.rowoff + E.screen_rows - 1;
+    }
+    if (!buf_line_exists(E.cy)) {
+        E.cy = buf_num_lines() > 0 ? buf_num_lines() - 1 : 0;
+    }
+    if (E.cx > buf_line_length(E.cy)) {
+        E.cx = buf_line_length(E.cy);
+    }
+}
+
+/*
+Left click places the cursor and drops the selection anchor; dragging extends the selection to the pointer. Pressing
+on the scrollbar in the last column jumps there, and the drag that follows belongs to the scrollbar.
+*/
+void editor_process_mouse(const struct input_event *ev) {
+    size_t line;
+    int x;
+
+    if (E.seek.dragging || (ev->button == 0 && !ev->release && !ev->motion && ev->x == E.cols &&
+                            ev->y >= 1 && ev->y <= E.screen_rows && seek_scrollbar_width() > 0)) {
+        seek_scrollbar(ev);
+        return;
+    }
+    if (ev->button != 0 || ev->release || ev->y < 1 || ev->y > E.screen_rows || E.seek.active) {
+        return;
+    }
+
+    line = E.rowoff + (ev->y - 1);
+    if (!buf_line_exists(line)) {
+        line = buf_num_lines() > 0 ? buf_num_lines() - 1 : 0;
+    }
+    x = ev->x - 1 - (editor_text_visible() ? editor_gutter_width() : 0);
+    E.cy = line;
+    E.cx = editor_rx_to_cx(line, E.coloff + (x > 0 ? x : 0));
+
+    if (ev->motion) {
+        E.sel_active = 1;
+    } else {
+        E.sel_active = 0;
+        E.sel_line = E.cy;
+        E.sel_cx = E.cx;
+    }
+}
+
+/*
+Handle everything the terminal has sent since the last frame. Wheel ticks are summed into a single scroll and only the
+last drag position is kept, so a trackpad flinging hundreds of events a second still costs one redraw per frame. Any
+other event first applies what has been coalesced so far, so ordering is preserved.
+*/
+void editor_process_input(void) {
+    struct input_event ev;
+    struct input_event drag;
+    long scroll = 0;
+    int dragging = 0;
+    int events = 0;
+
+    /* Don't sleep on input left over from a frame that hit INPUT_MAX_EVENTS. */
+    if (loop_wait(E.input.length > 0 ? 0 : timers_next_timeout())) {
+        input_fill(0);
+    }
+    while (events++ < INPUT_MAX_EVENTS) {
+        if (!input_next_event(&ev) && (input_fill(0) == 0 || !input_next_event(&ev))) {
+            break;
+        }
+
+        if (ev.type == EVENT_MOUSE && ev.wheel != 0) {
+            scroll += ev.wheel * MOUSE_WHEEL_LINES;
+            continue;
+        }
+        if (ev.type == EVENT_MOUSE && ev.motion) {
+            drag = ev;
+            dragging = 1;
+            continue;
+        }
+
+        if (scroll != 0) {
+            editor_scroll_view(scroll);
+            scroll = 0;
+        }
+        if (dragging) {
+            editor_process_mouse(&drag);
+            dragging = 0;
+        }
+        if (ev.type == EVENT_KEY) {
+            editor_process_keypress(ev.key);
+        } else {
+            editor_process_mouse(&ev);
+        }
+    }
+
+    if (scroll != 0) {
+        editor_scroll_view(scroll);
+    }
+    if (dragging) {
+        editor_process_mouse(&drag);
+    }
+
+    timers_run();
+}
+
+/* --------------------------------- Keymap --------------------------------- */
+/*
+Built-in bindings, in the same syntax as ~/.kilorc: `bind KEYS... COMMAND` applies to every mode, `bind-pager` to
+pager mode and the directory browser (which is read-only too), `bind-directory` to the directory browser alone. Keys
+are single characters, C-x for control, M-x for esc followed by x, or <Name> for special keys.
+*/
+const char *default_bindings[] = {
+    "bind C-q quit",
+    "bind C-x C-c quit",
+    "bind <Left> move-left",
+    "bind <Right> move-right",
+    "bind <Up> move-up",
+    "bind <Down> move-down",
+    "bind <PageUp> page-up",
+    "bind <PageDown> page-down",
+    "bind <Home> line-start",
+    "bind <End> line-end",
+    "bind <Esc> clear-selection",
+    "bind <Enter> newline",
+    "bind <BS> backspace",
+    "bind C-h backspace",
+    "bind <Del> delete-char",
+    "bind C-s save",
+    "bind C-z undo",
+    "bind C-_ undo",
+    "bind C-y redo",
+    "bind C-] goto-tag",
+    "bind M-. goto-tag",
+    "bind C-x t find-tag",
+    "bind M-x script",
+    "bind M-| filter",
+    "bind C-x f format",
+    "bind M-q reflow",
+    "bind M-% replace-project",
+    "bind C-x M-% replace-rollback",
+    "bind C-x m make",
+    "bind C-x r run",
+    "bind M-n next-error",
+    "bind M-p previous-error",
+    "bind C-x ` next-error",
+    "bind C-x o toggle-output",
+    "bind C-x k kill-job",
+    "bind M-/ complete",
+    "bind M-g % goto-percent",
+    "bind M-g c goto-byte",
+    "bind M-g t goto-time",
+    "bind C-x l log-timeline",
+    "bind-pager q quit",
+    "bind-pager <Space> page-down",
+    "bind-pager f page-down",
+    "bind-pager b page-up",
+    "bind-pager j move-down",
+    "bind-pager <Enter> move-down",
+    "bind-pager k move-up",
+    "bind-pager g top",
+    "bind-pager G bottom",
+    "bind-pager % goto-percent",
+    "bind-pager p goto-percent",
+    "bind-pager P goto-byte",
+    "bind-pager t goto-time",
+    "bind-directory <Enter> open",
+    NULL
+};
+
+struct key_name {
+    const char *name;
+    int key;
+};
+
+struct key_name key_names[] = {
+    {"<Left>", ARROW_LEFT}, {"<Right>", ARROW_RIGHT}, {"<Up>", ARROW_UP}, {"<Down>", ARROW_DOWN},
+    {"<PageUp>", PAGE_UP}, {"<PageDown>", PAGE_DOWN}, {"<Home>", HOME}, {"<End>", END}, {"<Del>", DELETE},
+    {"<Esc>", '\x1b'}, {"<Enter>", '\r'}, {"<Tab>", '\t'}, {"<Space>", ' '}, {"<BS>", 127},
+    {NULL, 0}
+};
+
+/* Table slot for a key: bytes map to themselves, special keys follow them. */
+int keymap_slot(int key) {
+    return key < 256 ? key : 256 + (key - ARROW_LEFT);
+}
+
+/* Parse one key token into `keys`. Returns how many keys it stands for (M-x is two), or 0 if it is invalid. */
+int keymap_parse_key(const char *token, int *keys) {
+    if (token[0] != '\0' && token[1] == '\0') {
+        keys[0] = (unsigned char)token[0];
+        return 1;
+    }
+    if (token[0] == 'C' && token[1] == '-' && token[2] != '\0' && token[3] == '\0') {
+        keys[0] = CTRL_KEY(token[2]);
+        return 1;
+    }
+    if (token[0] == 'M' && token[1] == '-' && token[2] != '\0') {
+        keys[0] = '\x1b';
+        return keymap_parse_key(token + 2, keys + 1) == 1 ? 2 : 0;
+    }
+    for (int i = 0; key_names[i].name != NULL; i++) {
+        if (strcmp(token, key_names[i].name) == 0) {
+            keys[0] = key_names[i].key;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+int keymap_new_node(struct keymap *km) {
+    if (km->count == km->capacity) {
+        int capacity = km->capacity ? km->capacity * 2 : 16;
+        struct keymap_node *nodes = realloc(km->nodes, capacity * sizeof(*nodes));
+
+        if (nodes == NULL) {
+            error_handler("realloc");
+        }
+        km->nodes = nodes;
+        km->capacity = capacity;
+    }
+    memset(&km->nodes[km->count], 0, sizeof(km->nodes[0]));
+
+    return km->count++;
+}
+
+/* Insert `keys` into the trie, creating nodes along the way. A later binding for the same keys replaces the earlier. */
+void keymap_bind(struct keymap *km, const int *keys, int length, int command) {
+    int node = 0;
+
+    if (km->count == 0) {
+        keymap_new_node(km);
+    }
+    for (int i = 0; i < length; i++) {
+        int slot = keymap_slot(keys[i]);
+        int next = km->nodes[node].next[slot];
+
+        if (next == 0) {
+            next = keymap_new_node(km);
+            km->nodes[node].next[slot] = next;
+            km->nodes[node].children++;
+        }
+        node = next;
+    }
+    km->nodes[node].command = command + 1;
+}
+
+/* Compile one `bind` line. Returns 0 on success, -1 if the line is malformed. Blank lines and comments are fine. */
+int keymap_parse_line(const char *line) {
+    char buffer[256];
+    char *tokens[KEYMAP_MAX_KEYS + 2];
+    int count = 0;
+    int keys[KEYMAP_MAX_KEYS * 2];
+    int length = 0;
+    int command = -1;
+    int n;
+
+    snprintf(buffer, sizeof(buffer), "%s", line);
+    for (char *token = strtok(buffer, " \t\r\n"); token != NULL; token = strtok(NULL, " \t\r\n")) {
+        if (count == KEYMAP_MAX_KEYS + 2) {
+            return -1;
+        }
+        tokens[count++] = token;
+    }
+    if (count == 0 || tokens[0][0] == '#') {
+        return 0;
+    }
+    if (count < 3 || (strcmp(tokens[0], "bind") != 0 && strcmp(tokens[0], "bind-pager") != 0 &&
+                      strcmp(tokens[0], "bind-directory") != 0)) {
+        return -1;
+    }
+
+    for (int i = 0; commands[i].name != NULL; i++) {
+        if (strcmp(tokens[count - 1], commands[i].name) == 0) {
+            command = i;
+        }
+    }
+    for (int i = 1; i < count - 1; i++) {
+        if ((n = keymap_parse_key(tokens[i], keys + length)) == 0) {
+            return -1;
+        }
+        length += n;
+    }
+    if (command == -1) {
+        return -1;
+    }
+
+    if (strcmp(tokens[0], "bind") == 0) {
+        keymap_bind(&E.keymaps[KEYMAP_NORMAL], keys, length, command);
+    }
+    if (strcmp(tokens[0], "bind-directory") != 0) {
+        keymap_bind(&E.keymaps[KEYMAP_PAGER], keys, length, command);
+    }
+    keymap_bind(&E.keymaps[KEYMAP_DIRECTORY], keys, length, command);
+
+    return 0;
+}
+
+/*
+What init_keymaps() makes of the built-in bindings and ~/.kilorc, kept as an image in ~/.cache/kilo/config: a
+header holding the settings, then each keymap's trie nodes. Startup maps the image and points the keymaps into it, so
+nothing is parsed, which matters since opening another file execs a fresh kilo. The header names the ~/.kilorc it was
+made from by inode, size and mtime, and the build by a hash of everything the layout and the bindings depend on; if
+either differs the config is parsed again and the image rewritten.
+*/
+
+/* The build's side of the image: what it was compiled with and the bindings and commands it knows. */
+uint64_t config_build_hash(void) {
+    size_t sizes[] = {sizeof(struct config_image), sizeof(struct keymap_node), KEYMAP_SLOTS, KEYMAP_MODES};
+    uint64_t hash = hash_line((const char *)sizes, sizeof(sizes));
+
+    for (int i = 0; default_bindings[i] != NULL; i++) {
+        hash = hash_concat(hash, hash_line(default_bindings[i], strlen(default_bindings[i])), 1);
+    }
+    for (int i = 0; commands[i].name != NULL; i++) {
+        hash = hash_concat(hash, hash_line(commands[i].name, strlen(commands[i].name)), 1);
+    }
+    return hash;
+}
+
+/* $XDG_CACHE_HOME/kilo/config, or ~/.cache/kilo/config. Allocated; NULL with neither variable set. */
+char *config_cache_path(void) {
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    char *dir;
+    char *path;
+
+    if (xdg != NULL && xdg[0] == '/') {
+        dir = path_join(xdg, "kilo");
+    } else if (home != NULL) {
+        dir = path_join(home, ".cache/kilo");
+    } else {
+        return NULL;
+    }
+    path = path_join(dir, CONFIG_CACHE_FILE);
+    free(dir);
+    return path;
+}
+
+/* Fill in what identifies ~/.kilorc (`rc`, or nothing if there is none) and this build. */
+void config_image_identify(struct config_image *image, const struct stat *rc) {
+    memset(image, 0, sizeof(*image));
+    memcpy(image->magic, CONFIG_CACHE_MAGIC, sizeof(image->magic));
+    image->version = CONFIG_CACHE_VERSION;
+    image->build = config_build_hash();
+    if (rc != NULL) {
+        image->rc_dev = rc->st_dev;
+        image->rc_ino = rc->st_ino;
+        image->rc_size = rc->st_size;
+        image->rc_mtime = rc->st_mtim.tv_sec;
+        image->rc_mtime_nsec = rc->st_mtim.tv_nsec;
+    }
+}
+
+/* Take the settings and keymaps from the cached image if it is still good. Returns -1 if it isn't. */
+int config_cache_load(const struct stat *rc) {
+    char *path = config_cache_path();
+    int fd = path != NULL ? open(path, O_RDONLY | O_CLOEXEC) : -1;
+    struct config_image expected;
+    const struct config_image *image;
+    struct stat st;
+    char *map;
+    size_t end = sizeof(*image);
+
+    free(path);
+    if (fd == -1) {
+        return -1;
+    }
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*image) ||
+        (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    close(fd);
+    image = (const struct config_image *)map;
+    config_image_identify(&expected, rc);
+    for (int m = 0; m < KEYMAP_MODES; m++) {
+        end += (size_t)image->keymap_count[m] * sizeof(struct keymap_node);
+    }
+    if (memcmp(image, &expected, offsetof(struct config_image, fill_column)) != 0 || end != (size_t)st.st_size ||
+        image->num_servers > LSP_SERVERS_MAX || image->num_formatters > FORMATTERS_MAX) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+
+    /* Nothing binds keys after startup, so the keymaps can stay in the read-only mapping for good. */
+    end = sizeof(*image);
+    for (int m = 0; m < KEYMAP_MODES; m++) {
+        E.keymaps[m].nodes = (struct keymap_node *)(map + end);
+        E.keymaps[m].count = E.keymaps[m].capacity = image->keymap_count[m];
+        end += (size_t)image->keymap_count[m] * sizeof(struct keymap_node);
+    }
+    E.fill_column = image->fill_column;
+    memcpy(E.lsp.servers, image->servers, sizeof(E.lsp.servers));
+    E.lsp.num_servers = image->num_servers;
+    memcpy(E.formatters, image->formatters, sizeof(E.formatters));
+    E.num_formatters = image->num_formatters;
+    if (image->status[0] != '\0') {
+        editor_set_status_message("%s", image->status); /* The config's complaint, as if it had been parsed. */
+    }
+    return 0;
+}
+
+/* Write the image of what was just parsed, to a temporary file renamed into place. Failing is harmless. */
+void config_cache_store(const struct stat *rc) {
+    char *path = config_cache_path();
+    char *temp;
+    struct config_image image;
+    FILE *fp;
+    int ok;
+
+    if (path == NULL) {
+        return;
+    }
+    config_image_identify(&image, rc);
+    for (int m = 0; m < KEYMAP_MODES; m++) {
+        image.keymap_count[m] = E.keymaps[m].count;
+    }
+    image.fill_column = E.fill_column;
+    memcpy(image.servers, E.lsp.servers, sizeof(image.servers));
+    image.num_servers = E.lsp.num_servers;
+    memcpy(image.formatters, E.formatters, sizeof(image.formatters));
+    image.num_formatters = E.num_formatters;
+    memcpy(image.status, E.statusmsg, sizeof(image.status));
+
+    /* Make ~/.cache/kilo, and ~/.cache before it if need be. */
+    path_parent(path);
+    if (mkdir(path, 0700) == -1 && errno == ENOENT) {
+        char *parent = strdup(path);
+
+        if (parent != NULL) {
+            path_parent(parent);
+            mkdir(parent, 0700);
+            free(parent);
+        }
+        mkdir(path, 0700);
+    }
+    free(path);
+    path = config_cache_path();
+    temp = malloc(strlen(path) + sizeof(".kilo-save"));
+    if (temp == NULL) {
+        error_handler("malloc");
+    }
+    sprintf(temp, "%s.kilo-save", path);
+    if ((fp = fopen(temp, "w")) != NULL) {
+        ok = fwrite(&image, sizeof(image), 1, fp) == 1;
+        for (int m = 0; m < KEYMAP_MODES && ok; m++) {
+            ok = (size_t)E.keymaps[m].count ==
+                 fwrite(E.keymaps[m].nodes, sizeof(struct keymap_node), E.keymaps[m].count, fp);
+        }
+        if (fclose(fp) != 0 || !ok || rename(temp, path) == -1) {
+            unlink(temp);
+        }
+    }
+    free(temp);
+    free(path);
+}
+
+/* Compile the built-in bindings, then the user's ~/.kilorc on top of them, unless the cached image is still good. */
+void init_keymaps(void) {
+    char path[1024];
+    char line[256];
+    const char *home = getenv("HOME");
+    struct stat rc;
+    int have_rc;
+    FILE *fp;
+    int number = 0;
+
+    if (home != NULL) {
+        snprintf(path, sizeof(path), "%s/%s", home, KILO_CONFIG);
+        have_rc = stat(path, &rc) == 0;
+        if (config_cache_load(have_rc ? &rc : NULL) == 0) {
+            return;
+        }
+    }
+    for (int i = 0; default_bindings[i] != NULL; i++) {
+        keymap_parse_line(default_bindings[i]);
+    }
+
+    if (home == NULL) {
+        return;
+    }
+    if ((fp = fopen(path, "r")) == NULL) {
+        config_cache_store(NULL);
+        return;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        number++;
+        if (strncmp(line, "lsp", 3) == 0 && (line[3] == ' ' || line[3] == '\t')) {
+            if (lsp_parse_line(line) == -1) {
+                editor_set_status_message("%s:%d: bad lsp line", KILO_CONFIG, number);
+            }
+        } else if (strncmp(line, "fill-column", 11) == 0) {
+            if (sscanf(line, "fill-column %d", &E.fill_column) != 1 || E.fill_column < 1) {
+                E.fill_column = REFLOW_WIDTH;
+                editor_set_status_message("%s:%d: bad fill-column", KILO_CONFIG, number);
+            }
+        } else if (strncmp(line, "format", 6) == 0 && line[6] != '\0' && strchr(" \t-", line[6]) != NULL) {
+            if (format_parse_line(line) == -1) {
+                editor_set_status_message("%s:%d: bad format line", KILO_CONFIG, number);
+            }
+        } else if (keymap_parse_line(line) == -1) {
+            editor_set_status_message("%s:%d: bad binding", KILO_CONFIG, number);
+        }
+    }
+    fclose(fp);
+    config_cache_store(have_rc ? &rc : NULL);
 }
 
-/* ---------------------------------- Input --------------------------------- */
+/* The keymap for the current mode. */
+struct keymap *keymap_active(void) {
+    return &E.keymaps[E.dir.active ? KEYMAP_DIRECTORY : E.read_only ? KEYMAP_PAGER : KEYMAP_NORMAL];
+}
 
-void editor_move_cursor(int key) {
-    // idea: H = top, M = middle, L = bottom of screen
-    switch (key) {
-        case ARROW_LEFT:
-            if (E.cx <= 0) { /* Wrap to end of above row if we hit left boundary. */
-                E.cx = E.cols - 1;
-                E.cy--;
-                if (E.cy < 0) {
-                    E.cy = 0;
-                }
-            } else {
-                E.cx--; // left
+void keymap_run(int node) {
+    struct keymap *km = keymap_active();
+
+    if (km->nodes[node].command != 0) {
+        E.buf.typing = 0;
+        if (E.seek.active && seek_command(commands[km->nodes[node].command - 1].fn)) {
+            return;
+        }
+        commands[km->nodes[node].command - 1].fn();
+    }
+}
+
+/* A bound prefix waited long enough without the rest of a longer binding: run the prefix's own command. */
+void keymap_timeout(void) {
+    int node = E.key_node;
+
+    E.key_node = 0;
+    keymap_run(node);
+}
+
+/*
+Step through the active keymap. Keys that complete a binding with nothing longer behind it run at once, so single
+keys never wait. A key that is a prefix of a longer binding waits for the next key, with a timer on the event loop to
+give up after KEYMAP_TIMEOUT ms. A key that doesn't continue the chord ends it: the prefix's own binding runs (if it
+has one) and the key is looked up again from the root.
+*/
+void editor_process_keypress(int c) {
+    struct keymap *km = keymap_active();
+    int next;
+
+    if (E.prompt.active) {
+        prompt_key(c);
+        return;
+    }
+    if (E.key_node == 0 && lsp_popup_key(c)) {
+        return;
+    }
+    if (km->count == 0 || c < 0 || keymap_slot(c) >= KEYMAP_SLOTS) {
+        return;
+    }
+
+    next = km->nodes[E.key_node].next[keymap_slot(c)];
+    if (next == 0) {
+        if (E.key_node != 0) {
+            timer_stop(&E.key_timer);
+            keymap_timeout();
+            editor_process_keypress(c);
+        } else if (!E.read_only && (c == '\t' || (c >= ' ' && c < 256 && c != 127))) {
+            if (E.seek.active && seek_command(NULL)) {
+                return; /* Typing waits for the index like any other edit. */
             }
-            break;
-        case ARROW_DOWN:
-            if (E.cy >= E.rows - 1) { /* Wrap to first row if we hit bottom boundary. */
-                E.cy = 0;
-            } else {
-                E.cy++; // down
+            editor_insert_char(c); /* Unbound printable keys insert themselves. */
+        }
+        return;
+    }
+
+    if (km->nodes[next].children == 0) {
+        timer_stop(&E.key_timer);
+        E.key_node = 0;
+        keymap_run(next);
+        return;
+    }
+
+    E.key_node = next;
+    timer_start(&E.key_timer, KEYMAP_TIMEOUT, keymap_timeout);
+}
+
+/* --------------------------------- Output --------------------------------- */
+/* Convert a byte column on `line` into a screen column by expanding tabs. */
+size_t editor_cx_to_rx(size_t line, size_t cx) {
+    const char *s;
+    size_t offset = 0;
+    size_t length;
+    size_t rx = 0;
+
+    doc_read_begin();
+    while (offset < cx && (s = buf_line_span(line, offset, &length)) != NULL) {
+        if (length > cx - offset) {
+            length = cx - offset;
+        }
+        for (size_t i = 0; i < length; i++) {
+            if (s[i] == '\t') {
+                rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
             }
-            break;
-        case ARROW_UP:
-            if (E.cy <= 0) { /* Wrap to bottom row if we hit top boundary. */
-                E.cy = E.rows - 1;
-            } else {
-                E.cy--; // up
+            rx++;
+        }
+        offset += length;
+    }
+    doc_read_end();
+
+    return rx;
+}
+
+/* Convert a screen column on `line` back into a byte column, landing on the character that covers it. */
+size_t editor_rx_to_cx(size_t line, size_t rx) {
+    const char *s;
+    size_t offset = 0;
+    size_t length;
+    size_t cur_rx = 0;
+
+    doc_read_begin();
+    while ((s = buf_line_span(line, offset, &length)) != NULL) {
+        for (size_t i = 0; i < length; i++) {
+            if (s[i] == '\t') {
+                cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
             }
-            break;
-        case ARROW_RIGHT:
-            if (E.cx >= E.cols - 1) { /* Wrap to top of below row if we hit right boundary. */
-                E.cx = 0;
-                E.cy++;
-                if (E.cy > E.rows - 1) {
-                    E.cy = E.rows - 1;
-                }
-            } else {
-                E.cx++; // right
+            cur_rx++;
+            if (cur_rx > rx) {
+                doc_read_end();
+                return offset + i;
             }
+        }
+        offset += length;
     }
+    doc_read_end();
 
+    return offset;
 }
 
-void editor_process_keypress(void) {
-    int c = editor_read_key();
-    /* CTRL key combination mapping */
-    switch(c) {
-        case CTRL_KEY('q'):
-            /* Clear screen and resposition cursor to top-left on exit. */
-            write(STDOUT_FILENO, CLEAR_SCREEN, 4);
-            write(STDOUT_FILENO, CURSOR_REPOSITION, 3);
-            exit(0);
-            break;
+/* Whether there is text to show (with a gutter) rather than the welcome screen. */
+int editor_text_visible(void) {
+    return E.doc.filename != NULL || buf_num_lines() > 0;
+}
 
-        case HOME:
-            E.cx = 0; /* Move to start of line */
-            break;
-        case END:
-            E.cx = E.cols - 1; /* Move to end of line */
-            break;
+/* Number of columns taken by the line number gutter, with a column in front for git marks once HEAD is known. */
+int editor_gutter_width(void) {
+    char number[24];
+
+    if (E.dir.active) {
+        return DIR_GUTTER_WIDTH;
+    }
+    if (E.seek.active) {
+        /* Estimated line numbers carry a ~. */
+        return snprintf(number, sizeof(number), "%zu", E.seek.estimate + E.screen_rows) + 2 + E.git.ready;
+    }
+    return snprintf(number, sizeof(number), "%zu", E.rowoff + E.screen_rows) + 1 + E.git.ready;
+}
+
+/* Keep the cursor inside the visible window, then tell the read-ahead predictor where the viewport landed. */
+void editor_scroll(void) {
+    size_t text_cols = E.cols - editor_gutter_width() - seek_scrollbar_width();
+    size_t last;
+    size_t top;
+    size_t bottom;
+
+    if (E.seek.active) {
+        readahead_update(E.seek.offset, seek_view_end());
+        return;
+    }
+    E.rx = editor_cx_to_rx(E.cy, E.cx);
+
+    if (E.cy < E.rowoff) {
+        E.rowoff = E.cy;
+    }
+    if (E.cy >= E.rowoff + E.screen_rows) {
+        E.rowoff = E.cy - E.screen_rows + 1;
+    }
+    if (E.rx < E.coloff) {
+        E.coloff = E.rx;
+    }
+    if (E.rx >= E.coloff + text_cols) {
+        E.coloff = E.rx - text_cols + 1;
+    }
+
+    /* The predictor works on file offsets, so it follows the unedited lines at the edges of the viewport. */
+    if (E.doc.map != NULL && buf_document_line(E.rowoff, &top)) {
+        last = E.rowoff + E.screen_rows - 1;
+        if (!buf_line_exists(last)) {
+            last = buf_num_lines() - 1;
+        }
+        if (!buf_document_line(last, &bottom) || bottom < top) {
+            bottom = top;
+        }
+        readahead_update(doc_line_start(top), doc_line_end(bottom));
+    }
+    if (E.dir.active) {
+        dir_request_stats(E.rowoff, E.rowoff + E.screen_rows);
+    }
+}
+
+/*
+Render `length` bytes of a line whose screen column so far is *rx, appending to `render` at *n what falls inside the
+horizontal scroll window up to screen column `end`.
+*/
+void editor_render_text(const char *s, size_t length, size_t *rx, size_t end, char *render, int *n) {
+    for (size_t i = 0; i < length && *rx < end; i++) {
+        unsigned char c = s[i];
 
-        case PAGE_UP:
-        case PAGE_DOWN:
-        {
-            uint16_t times = E.rows;
-            while (times--) {
-                editor_move_cursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
+        if (c == '\t') {
+            do {
+                if (*rx >= E.coloff && *rx < end) {
+                    render[(*n)++] = ' ';
+                }
+                (*rx)++;
+            } while (*rx % KILO_TAB_STOP != 0);
+        } else {
+            if (*rx >= E.coloff) {
+                render[(*n)++] = iscntrl(c) ? '?' : (char)c;
             }
+            (*rx)++;
         }
-            break;
+    }
+}
 
-        case ARROW_UP:
-        case ARROW_LEFT:
-        case ARROW_DOWN:
-        case ARROW_RIGHT: editor_move_cursor(c);
+/* Render one buffer line into `render`, clipped to the horizontal scroll window. Returns the rendered length. */
+int editor_render_line(size_t line, char *render, int width) {
+    const char *s;
+    size_t offset = 0;
+    size_t length;
+    size_t end = E.coloff + width;
+    size_t rx = 0;
+    int n = 0;
+
+    if (width <= 0) {
+        return 0; /* The gutter takes the whole window. */
+    }
+    doc_read_begin();
+    while (rx < end && (s = buf_line_span(line, offset, &length)) != NULL) {
+        editor_render_text(s, length, &rx, end, render, &n);
+        offset += length;
     }
+    doc_read_end();
+
+    return n;
+}
+
+/* Render the document line in bytes [start, next) for a detached view, like editor_render_line(). */
+int editor_render_bytes(size_t start, size_t next, char *render, int width) {
+    const char *s;
+    size_t length;
+    size_t end = E.coloff + width;
+    size_t rx = 0;
+    int n = 0;
+
+    if (width <= 0) {
+        return 0;
+    }
+    if (next > start && doc_byte(next - 1) == '\n') {
+        next--;
+    }
+    if (next > start && doc_byte(next - 1) == '\r') {
+        next--;
+    }
+    doc_read_begin();
+    while (rx < end && start < next) {
+        s = doc_span(start, &length);
+        if (length > next - start) {
+            length = next - start;
+        }
+        editor_render_text(s, length, &rx, end, render, &n);
+        start += length;
+    }
+    doc_read_end();
+
+    return n;
+}
+
+/* Forget every rendered row, for when the text may have changed under the buffer. */
+void render_cache_clear(void) {
+    for (int i = 0; i < E.cache.slots; i++) {
+        E.cache.lines[i] = SIZE_MAX;
+    }
+}
+
+/* Buffer observer: drop the rows an edit changes, and the ones after it if it moves them to other lines. */
+void render_cache_changed(size_t at, size_t removed, size_t inserted) {
+    struct render_cache *c = &E.cache;
+
+    for (int i = 0; i < c->slots; i++) {
+        if (c->lines[i] != SIZE_MAX && c->lines[i] >= at && (c->lines[i] < at + removed || removed != inserted)) {
+            c->lines[i] = SIZE_MAX;
+        }
+    }
+}
+
+/* Size the cache for three pages of `width` columns at the current horizontal scroll. */
+void render_cache_fit(int width) {
+    struct render_cache *c = &E.cache;
+    int slots = 3 * (E.screen_rows > 0 ? E.screen_rows : 1);
+
+    if (c->slots != slots || c->width != width) {
+        free(c->rows);
+        free(c->lengths);
+        free(c->lines);
+        c->rows = malloc((size_t)slots * (width > 0 ? width : 1));
+        c->lengths = malloc(slots * sizeof(*c->lengths));
+        c->lines = malloc(slots * sizeof(*c->lines));
+        if (c->rows == NULL || c->lengths == NULL || c->lines == NULL) {
+            error_handler("malloc");
+        }
+        c->slots = slots;
+        c->width = width;
+        render_cache_clear();
+    }
+    if (c->coloff != E.coloff) {
+        c->coloff = E.coloff;
+        render_cache_clear();
+    }
+}
+
+/* Is buffer line `line` rendered for the current view? */
+int render_cache_has(size_t line) {
+    return E.cache.slots > 0 && E.cache.lines[line % E.cache.slots] == line;
+}
+
+/* The rendered text of buffer line `line`, rendering it now if the cache doesn't have it. */
+const char *render_cache_row(size_t line, int width, int *length) {
+    struct render_cache *c = &E.cache;
+    int slot;
+
+    if (width <= 0) {
+        *length = 0;
+        return "";
+    }
+    render_cache_fit(width);
+    slot = line % c->slots;
+    if (c->lines[slot] != line) {
+        c->lines[slot] = SIZE_MAX; /* Not valid until it has been rendered in full; rendering may fault. */
+        c->lengths[slot] = editor_render_line(line, c->rows + (size_t)slot * width, width);
+        c->lines[slot] = line;
+    }
+    *length = c->lengths[slot];
+
+    return c->rows + (size_t)slot * width;
+}
+
+/* Row `i` to render ahead: the page below the screen from the top down, then the page above it from the bottom up. */
+int render_ahead_line(int i, size_t *line) {
+    if (i < E.screen_rows) {
+        *line = E.rowoff + E.screen_rows + i;
+    } else if (E.rowoff >= (size_t)(i - E.screen_rows + 1)) {
+        *line = E.rowoff - (i - E.screen_rows + 1);
+    } else {
+        return 0;
+    }
+
+    return buf_line_exists(*line);
+}
+
+/* Timer: render the pages around the screen in idle time, stopping as soon as a key comes. */
+void render_ahead(void) {
+    size_t line;
+    int length;
+
+    if (E.seek.active || !editor_text_visible() || E.cache.slots == 0) {
+        return;
+    }
+    for (int i = 0; i < 2 * E.screen_rows; i++) {
+        if (i % RENDER_AHEAD_CHECK == 0 && input_pending()) {
+            return; /* The next frame schedules what is left. */
+        }
+        if (render_ahead_line(i, &line)) {
+            render_cache_row(line, E.cache.width, &length);
+        }
+    }
+}
+
+/* After a frame: if the pages around it aren't all rendered, render them once input goes quiet. */
+void render_ahead_schedule(void) {
+    size_t line;
+
+    if (E.seek.active || !editor_text_visible() || E.cache.slots == 0) {
+        return;
+    }
+    for (int i = 0; i < 2 * E.screen_rows; i++) {
+        if (render_ahead_line(i, &line) && !render_cache_has(line)) {
+            timer_start(&E.cache.timer, RENDER_AHEAD_DELAY, render_ahead);
+            return;
+        }
+    }
+}
+
+/* Append a rendered line, inverting the part of it covered by the selection. */
+void editor_draw_selection(struct abuf *ab, size_t line, const char *render, int length) {
+    size_t from_line = E.sel_line;
+    size_t from_cx = E.sel_cx;
+    size_t to_line = E.cy;
+    size_t to_cx = E.cx;
+    size_t from_rx;
+    size_t to_rx;
+    int a;
+    int b;
+
+    if (E.sel_active && (to_line < from_line || (to_line == from_line && to_cx < from_cx))) {
+        from_line = E.cy;
+        from_cx = E.cx;
+        to_line = E.sel_line;
+        to_cx = E.sel_cx;
+    }
+    if (!E.sel_active || line < from_line || line > to_line) {
+        ab_append(ab, render, length);
+        return;
+    }
+
+    from_rx = line == from_line ? editor_cx_to_rx(line, from_cx) : 0;
+    to_rx = line == to_line ? editor_cx_to_rx(line, to_cx) : E.coloff + length + 1; /* Past the end: whole line. */
+    a = from_rx > E.coloff ? (int)(from_rx - E.coloff) : 0;
+    b = to_rx > E.coloff ? (int)(to_rx - E.coloff) : 0;
+    a = a < length ? a : length;
+    b = b < length ? b : length;
+
+    ab_append(ab, render, a);
+    ab_append(ab, INVERT_COLORS, strlen(INVERT_COLORS));
+    ab_append(ab, render + a, b - a);
+    ab_append(ab, RESET_COLORS, strlen(RESET_COLORS));
+    ab_append(ab, render + b, length - b);
 }
 
-/* --------------------------------- Output --------------------------------- */
 void editor_draw_rows(struct abuf *ab) {
-    char col[8] = "";
-    char debug[120] = "";
+    char col[DIR_GUTTER_WIDTH + 1] = "";
+    char debug[320] = "";
     char welcome[80] = "";
+    char mem[16] = "";
+    char page[16] = "";
+    char stored[16] = "";
+    char loaded[16] = "";
+    char index[16] = "";
+    char bar[32];
+    int gutter = editor_gutter_width();
+    int text_width = E.cols - gutter - seek_scrollbar_width();
+    int thumb = seek_scrollbar_width() ? seek_thumb_row() : -1;
+    size_t seek_pos = E.seek.offset;
+    size_t seek_next;
+    const char *render;
     int col_length;
     int welcome_length;
     int debug_length;
+    int render_length;
     int padding;
 
-    for (uint8_t y = 0; y < E.rows; y++) {
+    if (text_width < 0) {
+        text_width = 0; /* A window narrower than the gutter (the directory browser's is wide) shows no text. */
+    }
+    if (E.render_capacity < E.cols) {
+        free(E.render);
+        E.render = malloc(E.cols);
+        if (E.render == NULL) {
+            error_handler("malloc");
+        }
+        E.render_capacity = E.cols;
+    }
+
+    for (int y = 0; y < E.rows; y++) {
+        size_t line = E.rowoff + y;
+
         /* Clear each row as we write to them */
         ab_append(ab, "\x1b[K", 3);
 
-        col_length = snprintf(col, sizeof(col), "%d ", y);
-        ab_append(ab, col, col_length);
+        if (y >= E.screen_rows && y < E.rows - 1) {
+            col_length = job_format_panel_row(y - E.screen_rows, E.rows - 1 - E.screen_rows, E.render, E.cols);
+            if (y == E.screen_rows) {
+                ab_append(ab, INVERT_COLORS, 3);
+                ab_append(ab, E.render, col_length);
+                ab_append(ab, RESET_COLORS, 3);
+            } else {
+                ab_append(ab, E.render, col_length);
+            }
+            ab_append(ab, "\r\n", 2);
+            continue;
+        }
+        if (y == E.rows - 1 && E.prompt.active) {
+            debug_length = snprintf(debug, sizeof(debug), "%s%s%s", E.prompt.label, E.prompt.text, E.prompt.hint);
+            if (debug_length > (int)sizeof(debug) - 1) {
+                debug_length = sizeof(debug) - 1;
+            }
+            ab_append(ab, debug, debug_length > E.cols ? E.cols : debug_length);
+            break;
+        }
+        if (y == E.rows - 1 && E.statusmsg[0] != '\0' && time(NULL) - E.statusmsg_time < STATUS_MESSAGE_TIMEOUT) {
+            debug_length = strlen(E.statusmsg);
+            ab_append(ab, E.statusmsg, debug_length > E.cols ? E.cols : debug_length);
+            break;
+        }
+        if (y == E.rows - 1 && lsp_diagnostic_at(E.cy) != NULL) {
+            const struct lsp_diagnostic *d = lsp_diagnostic_at(E.cy);
+
+            debug_length = snprintf(debug, sizeof(debug), "%c: %s", "EWIH"[d->severity >= 1 && d->severity <= 4 ?
+                                    d->severity - 1 : 0], d->message);
+            if (debug_length > (int)sizeof(debug) - 1) {
+                debug_length = sizeof(debug) - 1;
+            }
+            ab_append(ab, debug, debug_length > E.cols ? E.cols : debug_length);
+            break;
+        }
+        if (y == E.rows - 1 && E.log.timeline) {
+            log_draw_timeline(ab, E.cols);
+            break;
+        }
+        if (y == E.rows - 1) { // print debug info on last line
+            format_size(mem, sizeof(mem), E.mem.region_bytes);
+            format_size(index, sizeof(index), line_index_bytes(&E.doc.lines));
+            format_size(page, sizeof(page), E.doc.lines.bit_region.page_size ? E.doc.lines.bit_region.page_size :
+                        E.page_size);
+            debug_length = session_hud(debug, sizeof(debug));
+            debug_length += snprintf(debug + debug_length, sizeof(debug) - debug_length,
+                                    "%.40s%s%s - %zu lines%s | E.rows = %d, E.cols = %d, CURSOR COORDS = (%zu, %zu)"
+                                    " | mem %s (line index %s), %s pages%s",
+                                    E.doc.filename ? E.doc.filename : "[No Name]",
+                                    E.doc.truncated ? " [truncated]" : "", buf_modified() ? " (modified)" : "",
+                                    buf_num_lines(),
+                                    E.doc.fully_indexed ? "" : "+", E.rows, E.cols, E.cx, E.cy, mem, index, page,
+                                    E.doc.lines.bit_region.hugetlb ? " (hugetlb)" : "");
+            if (E.seek.active && debug_length < (int)sizeof(debug)) {
+                debug_length += snprintf(debug + debug_length, sizeof(debug) - debug_length,
+                                         " | ~line %zu, indexed %d%% of the way", E.seek.estimate + 1, seek_progress());
+            }
+            if (E.doc.copy_in && debug_length < (int)sizeof(debug)) {
+                format_size(stored, sizeof(stored), E.store.stored_bytes);
+                format_size(loaded, sizeof(loaded), E.doc.size);
+                debug_length += snprintf(debug + debug_length, sizeof(debug) - debug_length, " | copy-in %s of %s%s",
+                                         stored, loaded, E.store.dedup ? " (dedup)" : "");
+            }
+            if (debug_length > (int)sizeof(debug) - 1) {
+                debug_length = sizeof(debug) - 1;
+            }
+            if (debug_length > E.cols) {
+                debug_length = E.cols;
+            }
+            ab_append(ab, debug, debug_length);
+            break;
+        }
 
-        if (y == 0) { // y == E.rows / 3)
+        if (E.seek.active) {
+            if (seek_pos < E.doc.size) {
+                col_length = snprintf(col, sizeof(col), "%s~%*zu ", E.git.ready ? " " : "", gutter - 2 - E.git.ready,
+                                      E.seek.estimate + y + 1);
+                ab_append(ab, col, col_length);
+                seek_next = doc_next_line(seek_pos);
+                render_length = editor_render_bytes(seek_pos, seek_next, E.render, text_width);
+                ab_append(ab, E.render, render_length);
+                seek_pos = seek_next;
+            }
+        } else if (editor_text_visible()) {
+            if (buf_line_exists(line)) {
+                if (E.dir.active) {
+                    col_length = dir_format_row(line, col, sizeof(col));
+                } else {
+                    const struct lsp_diagnostic *d = lsp_diagnostic_at(line);
+                    int mark = git_mark_at(line);
+
+                    /* The first gutter column marks lines added, modified, or with lines deleted below since HEAD. */
+                    col_length = 0;
+                    if (mark != GIT_UNCHANGED) {
+                        col_length = snprintf(col, sizeof(col), "\x1b[%dm%c" RESET_COLORS,
+                                              mark == GIT_ADDED ? 32 : mark == GIT_MODIFIED ? 33 : 31,
+                                              mark == GIT_ADDED ? '+' : mark == GIT_MODIFIED ? '~' : '_');
+                    } else if (E.git.ready) {
+                        col[col_length++] = ' ';
+                    }
+                    if (d != NULL) {
+                        /* The last gutter column marks lines the language server has something to say about. */
+                        col_length += snprintf(col + col_length, sizeof(col) - col_length,
+                                               "%*zu\x1b[%dm%c" RESET_COLORS, gutter - 1 - E.git.ready, line + 1,
+                                               d->severity <= 1 ? 31 : d->severity == 2 ? 33 : 36,
+                                               "EWIH"[d->severity >= 1 && d->severity <= 4 ? d->severity - 1 : 0]);
+                    } else {
+                        col_length += snprintf(col + col_length, sizeof(col) - col_length, "%*zu ",
+                                               gutter - 1 - E.git.ready, line + 1);
+                    }
+                }
+                ab_append(ab, col, col_length);
+                render = render_cache_row(line, text_width, &render_length);
+                editor_draw_selection(ab, line, render, render_length);
+            }
+        } else if (y == 0) { // y == E.rows / 3)
             welcome_length = snprintf(welcome, sizeof(welcome), "Kilo editor -- Version %s", KILO_VERSION);
             /* Truncate welcome message if window width too thin. */
             if (welcome_length > E.cols) {
@@ -367,47 +11424,69 @@ void editor_draw_rows(struct abuf *ab) {
             }
             /* Divide window length by 2, then subtract half of message's length (from that half-length). */
             padding = (E.cols - welcome_length) / 2;
-  
+
             while (padding) {
                 ab_append(ab, " ", 1);
                 padding--;
             }
             ab_append(ab, welcome, welcome_length);
-        } else {
-            // ab_append(ab, "~", 1);
         }
 
-        if (y < E.rows - 1) {
-            ab_append(ab, "\r\n", 2);
-       } else { // print debug info on last line 
-            debug_length = snprintf(debug, sizeof(debug), "E.rows = %d, E.cols = %d, CURSOR COORDS = (%d, %d)", E.rows,
-                                    E.cols, E.cx, E.cy);
-            ab_append(ab, debug, debug_length);
-       }
+        if (thumb != -1) {
+            col_length = snprintf(bar, sizeof(bar), CURSOR_REPOSITION_COORDS, y + 1, E.cols);
+            ab_append(ab, bar, col_length);
+            ab_append(ab, y == thumb ? INVERT_COLORS " " RESET_COLORS : " ",
+                      y == thumb ? (int)strlen(INVERT_COLORS " " RESET_COLORS) : 1);
+        }
+        ab_append(ab, "\r\n", 2);
     }
 }
 
+void editor_set_status_message(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+    va_end(ap);
+    E.statusmsg_time = time(NULL);
+}
+
 void editor_refresh_screen(void) {
     char buff_cursor_position[32] = "";
-    struct abuf ab = ABUF_INIT;
+    int length;
+    struct abuf *ab = &E.frame; /* Reused across frames, so a steady screen allocates nothing. */
+
+    editor_scroll();
+    ab_reset(ab);
 
     /* Hide cursor */
-    ab_append(&ab, CURSOR_HIDE, 6);
+    ab_append(ab, CURSOR_HIDE, 6);
 
     /* Reposition curser to top-left corner of terminal. */
-    ab_append(&ab, CURSOR_REPOSITION, 3);
+    ab_append(ab, CURSOR_REPOSITION, 3);
 
     /* Draw rows and display current cursor coordinates. */
-    editor_draw_rows(&ab);
+    editor_draw_rows(ab);
+    lsp_draw_popup(ab);
     /* Terminal uses 1-indexed values. */
-    snprintf(buff_cursor_position, sizeof(buff_cursor_position), CURSOR_REPOSITION_COORDS, E.cy + 1, E.cx + 1);
-    ab_append(&ab, buff_cursor_position, sizeof(buff_cursor_position));
+    if (E.prompt.active) {
+        length = snprintf(buff_cursor_position, sizeof(buff_cursor_position), CURSOR_REPOSITION_COORDS, E.rows,
+                          (int)(strlen(E.prompt.label) + E.prompt.length) + 1);
+    } else if (E.seek.active) {
+        length = snprintf(buff_cursor_position, sizeof(buff_cursor_position), CURSOR_REPOSITION_COORDS, 1,
+                          editor_gutter_width() + 1);
+    } else {
+        length = snprintf(buff_cursor_position, sizeof(buff_cursor_position), CURSOR_REPOSITION_COORDS,
+                          (int)(E.cy - E.rowoff) + 1,
+                          (int)(E.rx - E.coloff) + (editor_text_visible() ? editor_gutter_width() : 0) + 1);
+    }
+    ab_append(ab, buff_cursor_position, length);
 
     /* Show cursor */
-    ab_append(&ab, CURSOR_SHOW, 6);
+    ab_append(ab, CURSOR_SHOW, 6);
 
-    write(STDOUT_FILENO, ab.str, ab.length);
-    ab_free(&ab);
+    write(STDOUT_FILENO, ab->str, ab->length);
+    render_ahead_schedule();
 }
 
 /* ---------------------------------- Init ---------------------------------- */
@@ -416,18 +11495,204 @@ void init_editor(void) {
     /* Cursor starts at top-left corner. */
     E.cx = 0;
     E.cy = 0;
+    E.rx = 0;
+    E.rowoff = 0;
+    E.coloff = 0;
+    E.page_size = (size_t)sysconf(_SC_PAGESIZE);
+    memset(&E.mem, 0, sizeof(E.mem));
+    hp_init();
+    chunk_store_init();
+
+    memset(&E.doc, 0, sizeof(E.doc));
+    E.doc.fd = -1;
+    memset(&E.buf, 0, sizeof(E.buf));
+    E.buf.seed = 0x6b696c6f;
+    memset(&E.ra, 0, sizeof(E.ra));
+    E.main_thread = pthread_self();
+    E.bus_armed = 0;
+    E.statusmsg[0] = '\0';
+    E.statusmsg_time = 0;
+    init_sigbus();
+    init_sigwinch();
+    /* Writing to a pipe whose reader has gone (a worker's wakeup pipe) should fail with EPIPE, not kill us. */
+    signal(SIGPIPE, SIG_IGN);
+    E.fill_column = REFLOW_WIDTH;
+    pthread_mutex_init(&E.replace.lock, NULL);
+    pthread_cond_init(&E.replace.wake, NULL);
+    init_keymaps();
+    buf_observe(render_cache_changed);
 
     if (get_window_size(&E.rows, &E.cols) == -1) {
         error_handler("get_window_size");
     }
+    E.screen_rows = E.rows - 1;
+
+    memset(&E.job, 0, sizeof(E.job));
+    E.job.fd = -1;
+    E.job.log = -1;
+    E.job.current = SIZE_MAX;
+    E.job.reload_offset = -1;
+    atexit(job_exit);
+    atexit(lsp_exit);
+    job_resume();
+    if (E.job.pid != 0) {
+        job_show_panel(1);
+    }
+
+    E.doc.index_stride = E.read_only ? DOC_SPARSE_STRIDE : 1;
+    doc_invalidate_blocks();
+}
+
+/* Pager mode with output that isn't a terminal: behave like `cat`, as less does. */
+void pager_passthrough(int fd) {
+    char buffer[CHUNK_READ_SIZE];
+    ssize_t n;
+
+    while ((n = read(fd, buffer, sizeof(buffer))) > 0 || (n == -1 && errno == EINTR)) {
+        if (n > 0 && write(STDOUT_FILENO, buffer, n) != n) {
+            exit(1);
+        }
+    }
+    exit(n == 0 ? 0 : 1);
 }
 
-int main(void) {
+int main(int argc, char *argv[]) {
+    const char *filename = NULL;
+    const char *batch = NULL;
+    const char *record = NULL;
+    const char *replay = NULL;
+    const char *program = strrchr(argv[0], '/') ? strrchr(argv[0], '/') + 1 : argv[0];
+    int fd = -1;
+    int from_stdin = 0;
+    int directory = 0;
+    size_t start_line = 0;
+    size_t record_length = 0;
+    sigjmp_buf bus_jump;
+    struct stat st;
+
+    E.read_only = strcmp(program, "view") == 0;
+    E.session.record_fd = -1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--dedup") == 0) {
+            E.store.dedup = 1;
+        } else if (strcmp(argv[i], "-R") == 0) {
+            E.read_only = 1;
+        } else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc) {
+            batch = argv[++i];
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record = argv[++i];
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay = argv[++i];
+        } else if (strcmp(argv[i], "--fast") == 0) {
+            E.session.fast = 1;
+        } else if (strcmp(argv[i], "--fixed") == 0 && i + 1 < argc && atol(argv[i + 1]) > 0) {
+            record_length = (size_t)atol(argv[++i]);
+        } else if (argv[i][0] == '+' && argv[i][1] >= '0' && argv[i][1] <= '9') {
+            start_line = strtoul(argv[i] + 1, NULL, 10);
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            fprintf(stderr, "Usage: kilo [-R] [--dedup] [--fixed length] [+line] [file | directory | -]\n"
+                            "       kilo --batch script [file]\n"
+                            "       kilo --record session [-R] [file]\n"
+                            "       kilo --replay session [--fast] [file]\n");
+            exit(1);
+        } else {
+            filename = argv[i];
+        }
+    }
+
+    /* Edit a stream with a script, in place of the editor: no terminal is involved. */
+    if (batch != NULL) {
+        if (filename != NULL && strcmp(filename, "-") != 0 && (fd = open(filename, O_RDONLY)) == -1) {
+            perror(filename);
+            exit(1);
+        }
+        exit(script_batch(batch, fd != -1 ? fd : STDIN_FILENO));
+    }
+
+    /* A replay opens the file the session had open, as it had it, unless told another. */
+    if (replay != NULL) {
+        struct session_header header;
+        char *recorded = session_load(replay, &header);
+
+        if (filename == NULL && recorded[0] != '\0') {
+            filename = recorded;
+        }
+        E.read_only = header.read_only;
+        if (filename != NULL && (fd = open(filename, O_RDONLY)) != -1 &&
+            (fstat(fd, &st) == -1 || st.st_size != header.size ||
+             session_sample_hash(fd, st.st_size) != header.sample_hash)) {
+            fprintf(stderr, "kilo: %s isn't the file that was recorded; replaying anyway\n", filename);
+            sleep(1);
+        }
+        if (fd != -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+
+    /* `-`, or no file with input piped in (kilo as $PAGER), reads the document from stdin. */
+    if ((filename == NULL && !isatty(STDIN_FILENO)) || (filename != NULL && strcmp(filename, "-") == 0)) {
+        filename = "[stdin]";
+        from_stdin = 1;
+        fd = dup(STDIN_FILENO);
+        if (fd == -1) {
+            perror("dup");
+            exit(1);
+        }
+    } else if (filename != NULL && (fd = open(filename, O_RDONLY)) == -1 && (errno != ENOENT || E.read_only)) {
+        perror(filename);
+        exit(1);
+    }
+    if (fd != -1 && !from_stdin && fstat(fd, &st) == 0 && S_ISDIR(st.st_mode)) {
+        /* The browser reads the directory itself; it is read-only, and remembers -R for the files it opens. */
+        directory = 1;
+        close(fd);
+        fd = -1;
+        E.dir.read_only = E.read_only;
+        E.read_only = 1;
+    }
+    if (E.read_only && fd != -1 && !isatty(STDOUT_FILENO)) {
+        pager_passthrough(fd);
+    }
+    if (!isatty(STDIN_FILENO)) {
+        reopen_tty();
+    }
+
     init_term();
     init_editor();
+    if (directory) {
+        if (dir_open(filename) == -1) {
+            error_handler(filename);
+        }
+    } else if (filename != NULL) {
+        E.doc.record_length = record_length;
+        editor_open(filename, fd);
+        E.doc.unnamed = from_stdin;
+        /* +N starts on line N (1-based), or the last line if there are fewer. */
+        if (start_line > 1) {
+            E.cy = buf_line_exists(start_line - 1) ? start_line - 1 : (buf_num_lines() > 0 ? buf_num_lines() - 1 : 0);
+        }
+        lsp_start();
+        git_start();
+        log_start();
+    }
+    if (record != NULL) {
+        session_record(record, E.doc.unnamed ? NULL : filename, E.doc.fd);
+    }
+    if (replay != NULL) {
+        session_replay_start();
+    }
+    E.bus_jump = &bus_jump;
     while(1) { // loops with each keypress
+        /* A SIGBUS on the document mapping unwinds to here; a fault during recovery comes back and retries it. */
+        if (sigsetjmp(bus_jump, 1) != 0) {
+            E.bus_jump = &bus_jump;
+            doc_recover_truncation();
+        }
+        session_check();
         editor_refresh_screen();
-        editor_process_keypress();
+        session_frame_done();
+        editor_process_input();
     }
 
     return 0;